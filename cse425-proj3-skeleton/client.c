@@ -34,9 +34,13 @@
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
 #endif
 
-static char usage[] = "usage: client [-q] [-f <filename>] server:port\n";
+static char usage[] = "usage: client [-q] [-f <filename>] [-F <block>] [-E] "
+                      "[-t <trace>] server:port\n";
 static char *filename;
 static int quiet_opt = 0;
+static int fec_block = 0;
+static int ecn = 0;
+static char *trace;
 
 static int parse_address(char *address, struct sockaddr_in *sin);
 static int get_nvt_line(int sd, char *line);
@@ -57,16 +61,28 @@ main(int argc, char *argv[])
 
     filename = NULL;
     /* Parse command line options */
-    while ((opt = getopt(argc, argv, "f:q")) != EOF)
+    while ((opt = getopt(argc, argv, "f:qF:Et:")) != EOF)
     {
         switch (opt)
         {
         case 'f':
             filename = optarg;
             break;
+        case 'F':
+            fec_block = atoi(optarg);
+            break;
         case 'q':
             ++quiet_opt;
             break;
+        case 'E':
+            ecn = 1;
+            break;
+        case 't':
+            /* send at the times the given (uplink) trace has the link
+             * delivering packets
+             */
+            trace = optarg;
+            break;
         case '?':
             ++errflg;
             break;
@@ -99,6 +115,32 @@ main(int argc, char *argv[])
         exit(1);
     }
 
+    if (fec_block > 0 &&
+        mysetsockopt(sd, MYSO_FEC_BLOCK, &fec_block, sizeof(fec_block)) < 0)
+    {
+        perror("mysetsockopt");
+        exit(1);
+    }
+
+    if (ecn && mysetsockopt(sd, MYSO_ECN, &ecn, sizeof(ecn)) < 0)
+    {
+        perror("mysetsockopt");
+        exit(1);
+    }
+
+    if (trace)
+    {
+        mysock_emulation_t link;
+
+        memset(&link, 0, sizeof(link));
+        link.trace = trace;
+        if (mysetsockopt(sd, MYSO_EMULATION, &link, sizeof(link)) < 0)
+        {
+            perror("mysetsockopt");
+            exit(1);
+        }
+    }
+
     sd = myconnect(sd, (struct sockaddr *) &sin, sizeof(struct sockaddr_in));
     if (sd < 0)
     {
@@ -107,6 +149,18 @@ main(int argc, char *argv[])
     }
     printf("myconnect\n");
     loop_until_end(sd);
+
+    if (fec_block > 0)
+    {
+        mysock_stats_t stats;
+        socklen_t stats_len = sizeof(stats);
+
+        if (mygetsockopt(sd, MYSO_STATS, &stats, &stats_len) == 0)
+        {
+            fprintf(stderr, "FEC: %lu segments recovered, %lu retransmitted\n",
+                    stats.fec_recovered, stats.fec_retransmitted);
+        }
+    }
     
     if (myclose(sd) < 0)
     {
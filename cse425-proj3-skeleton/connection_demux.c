@@ -88,8 +88,7 @@ void _mysock_dequeue_connection(mysock_context_t  *accept_ctx,
     PTHREAD_CALL(pthread_mutex_lock(&q->connection_lock));
     while (!q->completed_queue)
     {
-        PTHREAD_CALL(pthread_cond_wait(&q->connection_cond,
-                                       &q->connection_lock));
+        _mysock_engine_wait(NULL, &q->connection_cond, &q->connection_lock);
     }
 
     r = q->completed_queue;
@@ -220,6 +219,7 @@ bool_t _mysock_enqueue_connection(mysock_context_t      *ctx,
 
         new_ctx = _mysock_get_context(queue_entry->sd);
         new_ctx->listen_sd = ctx->my_sd;
+        new_ctx->options   = ctx->options;
 
         new_ctx->network_state.peer_addr       = *peer_addr;
         new_ctx->network_state.peer_addr_len   = peer_addr_len;
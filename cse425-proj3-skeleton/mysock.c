@@ -10,6 +10,8 @@
 #include "mysock.h"
 #include "mysock_impl.h"
 #include "network_io.h"
+#include "network.h"
+#include "network_emul.h"
 #include "stcp_api.h"
 #include "transport.h"
 
@@ -22,9 +24,6 @@
 #endif  /*NDEBUG*/
 
 
-/* helper functions to start transport layer and network receive threads */
-static void *transport_thread_func(void *arg);
-
 static void verify_mysocket_descriptor(mysock_context_t *comp_ctx,
                                        mysocket_t        my_sd);
 static mysock_context_t *_mysock_allocate_context(void);
@@ -81,8 +80,8 @@ void _mysock_transport_init(mysocket_t sd, bool_t is_active)
     assert(!connection_context->listening);
     connection_context->is_active = is_active;
 
-    /* start a new network thread; this handles incoming data, passing it
-     * up to the transport layer.  (the network input is threaded so we can
+    /* start receiving network input; this handles incoming data, passing
+     * it up to the transport layer.  (the network input is threaded so we can
      * keep track of timeouts/when data arrives, in a portable manner
      * independent of the underlying network I/O functionality).
      */
@@ -92,12 +91,8 @@ void _mysock_transport_init(mysocket_t sd, bool_t is_active)
         abort();
     }
 
-    /* start a new transport layer thread */
-    connection_context->transport_thread = _mysock_create_thread(
-        transport_thread_func,
-        connection_context,
-        FALSE);
-    connection_context->transport_thread_started = TRUE;
+    /* start running the transport layer (see mysock_engine_*.c) */
+    _mysock_engine_start(connection_context);
 }
 
 int _mysock_wait_for_connection(mysock_context_t *ctx)
@@ -108,8 +103,7 @@ int _mysock_wait_for_connection(mysock_context_t *ctx)
     PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
     while (ctx->blocking)
     {
-        PTHREAD_CALL(pthread_cond_wait(&ctx->blocking_cond,
-                                       &ctx->blocking_lock));
+        _mysock_engine_wait(ctx, &ctx->blocking_cond, &ctx->blocking_lock);
     }
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->blocking_lock));
 
@@ -162,6 +156,10 @@ void _mysock_enqueue_buffer(mysock_context_t *ctx,
     }
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
     PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+
+    /* let the transport layer know it has something to do */
+    if (pq != &ctx->app_send_queue)
+        _mysock_engine_notify(ctx);
 }
 
 /* remove one packet from the head of the waiting packet queue, copying the
@@ -186,8 +184,8 @@ size_t _mysock_dequeue_buffer(mysock_context_t *ctx,
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
     while (!pq->head)
     {
-        PTHREAD_CALL(pthread_cond_wait(&ctx->data_ready_cond,
-                                       &ctx->data_ready_lock));
+        _mysock_engine_wait(ctx, &ctx->data_ready_cond,
+                            &ctx->data_ready_lock);
     }
 
     node = pq->head;
@@ -323,6 +321,7 @@ void _mysock_free_context(mysock_context_t *ctx)
     (void) _mysock_free_queue(ctx, &ctx->app_recv_queue);
     (void) _mysock_free_queue(ctx, &ctx->app_send_queue);
 
+    _network_emulate_close(&ctx->network_state);
     _network_close(&ctx->network_state);
 
     /* clear mysocket descriptor table entry */
@@ -334,31 +333,17 @@ void _mysock_free_context(mysock_context_t *ctx)
     free(ctx);
 }
 
-/* transport layer thread; transport_init() should not return until the
- * transport layer finishes (i.e. the connection is over).
+/* called by the transport engine once the transport layer has finished
+ * with a connection; both sides have closed the connection, so do some
+ * final cleanup here...
  */
-static void *transport_thread_func(void *arg_ptr)
+void _mysock_transport_done(mysock_context_t *ctx)
 {
-    mysock_context_t *ctx = (mysock_context_t *) arg_ptr;
     char eof_packet;
 
     assert(ctx);
     ASSERT_VALID_MYSOCKET_DESCRIPTOR(ctx, ctx->my_sd);
 
-    /* enter the STCP control loop.  transport_init() doesn't return until the
-     * connection's finished.  that function should first signal establishment
-     * of the connection after SYN/SYN-ACK (or an error condition if the
-     * connection couldn't be established) to the application by using
-     * stcp_unblock_application(); as the name suggests, this unblocks the
-     * calling code.  transport_init() then handles the connection,
-     * returning only after the connection is closed.
-     */
-    transport_init(ctx->my_sd, ctx->is_active);
-
-    /* transport_init() has returned; both sides have closed the connection,
-     * do some final cleanup here...
-     */
-
     PTHREAD_CALL(pthread_mutex_lock(&ctx->blocking_lock));
     if (ctx->blocking)
     {
@@ -386,7 +371,58 @@ static void *transport_thread_func(void *arg_ptr)
      * by the transport layer already in response to the peer's FIN).
      */
     _mysock_enqueue_buffer(ctx, &ctx->app_send_queue, &eof_packet, 0);
-    return NULL;
+
+    /* the last of what the transport layer sent may have been held back */
+    _network_send_flush(ctx->my_sd);
+}
+
+
+/* for transport engines that don't block in transport_init(): hand the
+ * transport layer whatever events are pending for the connection, as
+ * stcp_wait_for_event() would return them, for up to max_events rounds.
+ * this doesn't block.  returns FALSE if the transport layer has finished
+ * with the connection, in which case _mysock_transport_done() has been
+ * called.  otherwise, *more is set if there may be events still pending,
+ * and *timer_set and *deadline to the transport layer's timer, if it has
+ * one.  transport_start() must have been called for the connection first.
+ */
+bool_t _mysock_transport_poll(mysock_context_t *ctx, int max_events,
+                              bool_t *more, bool_t *timer_set,
+                              struct timespec *deadline)
+{
+    static const struct timespec poll_time = { 0, 0 };  /* don't block */
+    const struct timespec *abstime;
+    unsigned int flags, event;
+    struct timespec now;
+    int k;
+
+    assert(ctx && more && timer_set && deadline);
+
+    for (k = 0; k < max_events; ++k)
+    {
+        flags = transport_wait_flags(ctx->my_sd, &abstime);
+        event = stcp_wait_for_event(ctx->my_sd, flags, &poll_time);
+
+        if (event == TIMEOUT)
+        {
+            (void) _mysock_engine_gettime(&now);
+            if (!abstime || _mysock_timespec_before(&now, abstime))
+                break;
+        }
+
+        if (!transport_event(ctx->my_sd, event))
+        {
+            _mysock_transport_done(ctx);
+            return FALSE;
+        }
+    }
+
+    *more = (k == max_events);
+
+    (void) transport_wait_flags(ctx->my_sd, &abstime);
+    if ((*timer_set = (abstime != NULL)))
+        *deadline = *abstime;
+    return TRUE;
 }
 
 
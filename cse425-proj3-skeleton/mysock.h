@@ -35,6 +35,102 @@ typedef int mysocket_t;     /* mysocket descriptor */
 #endif
 
 
+/* mysocket options, for use with mysetsockopt() and mygetsockopt().
+ * options affecting connection setup must be set before myconnect() or
+ * mylisten(); connections accepted on a listening mysocket inherit its
+ * options.
+ */
+typedef enum
+{
+    MYSO_FEC_BLOCK = 1, /* int: data segments per FEC parity segment, or 0 to
+                         * disable forward error correction (default).  FEC
+                         * is used only if both peers enable it.
+                         */
+    MYSO_STATS,         /* mysock_stats_t (read only) */
+    MYSO_CONGESTION,    /* int: congestion control algorithm used when
+                         * sending (MYSOCK_CC_*)
+                         */
+    MYSO_ECN,           /* int: nonzero to react to explicit congestion
+                         * notification from the network, as DCTCP does.
+                         * ECN is used only if both peers enable it.
+                         */
+    MYSO_EMULATION      /* mysock_emulation_t: emulate a bottleneck link in
+                         * front of this mysocket's outgoing packets
+                         */
+} mysock_option_t;
+
+/* congestion control algorithms, for MYSO_CONGESTION */
+enum
+{
+    MYSOCK_CC_RENO = 0,     /* standard (default) */
+    MYSOCK_CC_LEDBAT        /* low priority: backs off as queueing delay
+                             * builds up, leaving the path to other traffic
+                             */
+};
+
+/* per-connection counters, as returned by mygetsockopt(MYSO_STATS) */
+typedef struct
+{
+    unsigned long fec_parity_sent;      /* FEC parity segments sent */
+    unsigned long fec_recovered;        /* lost segments rebuilt from parity */
+    unsigned long fec_retransmitted;    /* gaps that FEC couldn't fill, and
+                                         * which were filled by a later
+                                         * (retransmitted) segment instead
+                                         */
+    unsigned long retransmits;          /* segments sent more than once */
+    unsigned long timeouts;             /* retransmission timer expiries */
+    unsigned long spurious_timeouts;    /* ...of which turned out to be
+                                         * unnecessary, and were undone
+                                         */
+    unsigned long ecn_marks_received;   /* segments marked congestion
+                                         * experienced on the way in
+                                         */
+    unsigned long ecn_reductions;       /* window reductions due to ECN */
+} mysock_stats_t;
+
+/* a bottleneck link, emulated by the network layer (MYSO_EMULATION).
+ * packets are queued for a link of the given rate.  ECN-capable packets
+ * are marked congestion experienced if more than ecn_threshold bytes are
+ * queued ahead of them; others are dropped if more than queue_limit are.
+ *
+ * the link may also lose packets at random, or in bursts (a loss burst
+ * starts with probability burst_loss, and lasts burst_len packets on
+ * average), duplicate them, or reorder them (holding one back until after
+ * the next).  probabilities are in parts per million.  the choices are
+ * made with a random number generator seeded with seed, so a run can be
+ * repeated exactly.
+ *
+ * instead of a fixed rate, the link may follow a trace of when it could
+ * deliver packets (as used by Mahimahi): a file of times in milliseconds,
+ * one per line and in order, at each of which the link can deliver
+ * MAX_IP_PAYLOAD_LEN bytes.  the trace repeats once the last time is
+ * reached.  it's read when the option is set, and trace isn't kept (or
+ * returned by mygetsockopt()).
+ *
+ * packets are only held up by the link if it has a delay, jitter or a
+ * trace, in which case they're also held up for as long as they're queued;
+ * otherwise the queue only decides which packets are marked or dropped.
+ */
+typedef struct
+{
+    unsigned long rate;             /* bytes per second; 0 disables this */
+    unsigned long ecn_threshold;    /* bytes, or 0 never to mark */
+    unsigned long queue_limit;      /* bytes, or 0 never to drop */
+
+    unsigned long delay;            /* microseconds, one way */
+    unsigned long jitter;           /* microseconds; up to this much is
+                                     * added to the delay at random
+                                     */
+    unsigned long loss;             /* ppm */
+    unsigned long burst_loss;       /* ppm */
+    unsigned long burst_len;        /* packets */
+    unsigned long duplicate;        /* ppm */
+    unsigned long reorder;          /* ppm */
+    unsigned int  seed;             /* 0 for the default */
+    const char   *trace;            /* file name, or NULL */
+} mysock_emulation_t;
+
+
 extern mysocket_t mysocket();
 extern int mybind(mysocket_t sd, struct sockaddr *addr, int addrlen);
 extern int mylisten(mysocket_t sd, int backlog);
@@ -47,6 +143,10 @@ extern int mygetsockname(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
 extern int mygetpeername(mysocket_t sd, struct sockaddr *addr,
                          socklen_t *addrlen);
+extern int mysetsockopt(mysocket_t sd, int option,
+                        const void *value, socklen_t value_len);
+extern int mygetsockopt(mysocket_t sd, int option,
+                        void *value, socklen_t *value_len);
 
 /* return IP address of interface on which packets to/from peer_addr are
  * delivered.  peer_addr is in network byte order.
@@ -11,6 +11,7 @@
 #include "mysock.h"
 #include "mysock_impl.h"
 #include "network_io.h"
+#include "network_emul.h"
 #include "connection_demux.h"
 
 
@@ -132,13 +133,15 @@ int mylisten(mysocket_t sd, int backlog)
     MYSOCK_CHECK(ctx != NULL, EBADF);
     MYSOCK_CHECK(ctx->bound, EINVAL);
 
-    /* set up the socket for demultiplexing */
+    /* set up the socket for demultiplexing.  (the network layer may only
+     * settle on the socket's port once it's listening.)
+     */
     ctx->listening = TRUE;
-    _mysock_set_backlog(ctx, backlog);
-
     if (_network_listen(&ctx->network_state, backlog) < 0)
         return -1;
 
+    _mysock_set_backlog(ctx, backlog);
+
     /* since we don't spawn an STCP worker thread for passive sockets
      * (there's no transport layer related work to do, so
      * _mysock_transport_init() is never called for such sockets), we
@@ -154,9 +157,9 @@ int mylisten(mysocket_t sd, int backlog)
 }
 
 /* close the given mysocket.  note that the semantics of myclose() differ
- * slightly from a regular close(); STCP doesn't implement TIME_WAIT, so
- * myclose() simply discards all knowledge of the connection once the
- * connection is terminated.
+ * slightly from a regular close(); it blocks until the connection is
+ * terminated, including STCP's (short) TIME_WAIT, and then simply discards
+ * all knowledge of the connection.
  */
 int myclose(mysocket_t sd)
 {
@@ -170,15 +173,10 @@ int myclose(mysocket_t sd)
     ctx->close_requested = TRUE;
     PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
     PTHREAD_CALL(pthread_cond_broadcast(&ctx->data_ready_cond));
+    _mysock_engine_notify(ctx);
 
-    /* block until STCP thread exits */
-    if (ctx->transport_thread_started)
-    {
-        assert(!ctx->listening);
-        assert(ctx->is_active || ctx->listen_sd != -1);
-        PTHREAD_CALL(pthread_join(ctx->transport_thread, NULL));
-        ctx->transport_thread_started = FALSE;
-    }
+    /* block until STCP is done with the connection */
+    _mysock_engine_stop(ctx);
 
     _network_stop_recv_thread(ctx);
 
@@ -279,6 +277,109 @@ int mygetpeername(mysocket_t sd, struct sockaddr *name, socklen_t *namelen)
     return 0;
 }
 
+/* set a mysocket option (see mysock.h) */
+int mysetsockopt(mysocket_t sd, int option,
+                 const void *value, socklen_t value_len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(value != NULL, EFAULT);
+
+    switch (option)
+    {
+    case MYSO_FEC_BLOCK:
+        MYSOCK_CHECK(value_len == sizeof(int), EINVAL);
+        MYSOCK_CHECK(*(const int *) value >= 0, EINVAL);
+        ctx->options.fec_block = *(const int *) value;
+        break;
+
+    case MYSO_CONGESTION:
+        MYSOCK_CHECK(value_len == sizeof(int), EINVAL);
+        MYSOCK_CHECK(*(const int *) value == MYSOCK_CC_RENO ||
+                     *(const int *) value == MYSOCK_CC_LEDBAT, EINVAL);
+        ctx->options.congestion = *(const int *) value;
+        break;
+
+    case MYSO_ECN:
+        MYSOCK_CHECK(value_len == sizeof(int), EINVAL);
+        ctx->options.ecn = *(const int *) value;
+        break;
+
+    case MYSO_EMULATION:
+    {
+        const mysock_emulation_t *link = (const mysock_emulation_t *) value;
+        const network_trace_t *trace = NULL;
+
+        MYSOCK_CHECK(value_len == sizeof(mysock_emulation_t), EINVAL);
+        if (link->trace && !(trace = _network_load_trace(link->trace)))
+            return -1;
+
+        ctx->options.emulation = *link;
+        ctx->options.emulation.trace = NULL;    /* not kept */
+        ctx->options.emulation_trace = trace;
+        break;
+    }
+
+    case MYSO_STATS:
+        MYSOCK_ERROR_EXIT(EINVAL);  /* read only */
+
+    default:
+        MYSOCK_ERROR_EXIT(ENOPROTOOPT);
+    }
+
+    return 0;
+}
+
+/* get a mysocket option (see mysock.h).  on entry, *value_len is the size
+ * of the buffer pointed to by value; on return, it's the size of the option.
+ */
+int mygetsockopt(mysocket_t sd, int option, void *value, socklen_t *value_len)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    const void *src;
+    socklen_t src_len;
+
+    MYSOCK_CHECK(ctx != NULL, EBADF);
+    MYSOCK_CHECK(value != NULL && value_len != NULL, EFAULT);
+
+    switch (option)
+    {
+    case MYSO_FEC_BLOCK:
+        src = &ctx->options.fec_block;
+        src_len = sizeof(ctx->options.fec_block);
+        break;
+
+    case MYSO_CONGESTION:
+        src = &ctx->options.congestion;
+        src_len = sizeof(ctx->options.congestion);
+        break;
+
+    case MYSO_ECN:
+        src = &ctx->options.ecn;
+        src_len = sizeof(ctx->options.ecn);
+        break;
+
+    case MYSO_EMULATION:
+        src = &ctx->options.emulation;
+        src_len = sizeof(ctx->options.emulation);
+        break;
+
+    case MYSO_STATS:
+        src = &ctx->stats;
+        src_len = sizeof(ctx->stats);
+        break;
+
+    default:
+        MYSOCK_ERROR_EXIT(ENOPROTOOPT);
+    }
+
+    MYSOCK_CHECK(*value_len >= src_len, EINVAL);
+    memcpy(value, src, src_len);
+    *value_len = src_len;
+    return 0;
+}
+
 /* returns IP address of interface on which packets to/from network address
  * peer_addr (network byte order) are delivered.
  */
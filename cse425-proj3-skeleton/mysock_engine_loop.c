@@ -0,0 +1,489 @@
+/* mysock_engine_loop.c--transport engine running connections' transport
+ * layers from a few event loop threads, one per CPU.
+ *
+ * rather than blocking in transport_init() in a thread per connection,
+ * this drives the transport layer through transport_start() and
+ * transport_event().  each loop thread polls each of its connections that
+ * has been notified of an event (or whose timer is due) with
+ * stcp_wait_for_event(), without blocking, and hands it whatever is
+ * pending.  notified connections wait for their turn in a FIFO, and
+ * timers are kept in a min-heap, so a loop finds its next connection
+ * without looking at the rest.  when there's nothing left to do, it
+ * sleeps until the next notification or the earliest timer.
+ *
+ * a connection stays on the same loop (shard) for its lifetime, so its
+ * transport state is only ever touched by one thread, and each loop's
+ * lock is shared only with the threads feeding its own connections.
+ * connections we make are spread over the loops by a hash of their
+ * addresses and ports; connections accepted from a listening mysocket go
+ * to whichever loop has fewest connections at the time.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#ifdef LINUX
+#include <sched.h>
+#endif
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "transport.h"
+
+
+/* events handled for a connection before giving the others a turn */
+#define ENGINE_BATCH 16
+
+/* number of event loops; 0 for one per online CPU */
+#ifndef ENGINE_NUM_LOOPS
+#define ENGINE_NUM_LOOPS 0
+#endif
+
+#define ENGINE_MAX_LOOPS 64
+
+/* a connection run by the loop (engine_data in its mysock context) */
+typedef struct engine_conn
+{
+    mysock_context_t   *ctx;
+    struct engine_loop *loop;       /* the loop it's run by */
+    bool_t              started;    /* transport_start() has been called */
+    bool_t              ready;      /* on the ready queue */
+    bool_t              done;       /* the transport layer has finished */
+    bool_t              timer_set;  /* on the timer heap, due... */
+    struct timespec     deadline;   /* ...at this time */
+    int                 heap_index; /* where it is on the heap */
+    struct engine_conn *next_ready;
+} engine_conn_t;
+
+/* an event loop, the connections that may have events pending (in the
+ * order they get a turn), and the connections' timers (as a binary
+ * min-heap ordered by deadline).  everything here is protected by lock,
+ * apart from the started field of each connection, which is only used by
+ * the loop thread.
+ */
+typedef struct engine_loop
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  wakeup;     /* signalled when a connection is ready */
+    pthread_cond_t  finished;   /* signalled when a connection is done */
+    pthread_t       thread;
+    int             cpu;        /* CPU the thread runs on */
+    int             num_conns;
+    engine_conn_t  *ready;
+    engine_conn_t  *ready_tail;
+    engine_conn_t **timers;
+    int             num_timers;
+    int             max_timers;
+} engine_loop_t;
+
+static engine_loop_t *engine_loops;
+static int            engine_num_loops;
+static pthread_once_t engine_once = PTHREAD_ONCE_INIT;
+
+
+static void engine_init(void);
+static engine_loop_t *engine_choose_loop(mysock_context_t *ctx);
+static void *engine_thread_func(void *arg_ptr);
+static void engine_make_ready(engine_loop_t *loop, engine_conn_t *conn);
+static void engine_unready(engine_loop_t *loop, engine_conn_t *conn);
+static void engine_set_timer(engine_loop_t *loop, engine_conn_t *conn,
+                             const struct timespec *deadline);
+static void engine_timer_up(engine_loop_t *loop, int k);
+static void engine_timer_down(engine_loop_t *loop, int k);
+static void engine_timer_place(engine_loop_t *loop, int k,
+                               engine_conn_t *conn);
+
+
+/* hand a new connection to one of the event loops, starting them if need
+ * be.  the engine_data pointer in the mysock context is protected by its
+ * data_ready_lock, as it's used by whichever threads queue data for it.
+ */
+void _mysock_engine_start(mysock_context_t *ctx)
+{
+    engine_loop_t *loop;
+    engine_conn_t *conn;
+
+    assert(ctx && !ctx->engine_data);
+    PTHREAD_CALL(pthread_once(&engine_once, engine_init));
+
+    conn = (engine_conn_t *) calloc(1, sizeof(engine_conn_t));
+    assert(conn);
+    conn->ctx = ctx;
+    conn->loop = loop = engine_choose_loop(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&loop->lock));
+    engine_make_ready(loop, conn);
+    loop->num_conns++;
+    PTHREAD_CALL(pthread_mutex_unlock(&loop->lock));
+    PTHREAD_CALL(pthread_cond_signal(&loop->wakeup));
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->engine_data = conn;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+}
+
+/* give the connection a turn in its event loop */
+void _mysock_engine_notify(mysock_context_t *ctx)
+{
+    engine_loop_t *loop = NULL;
+    engine_conn_t *conn;
+
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    if ((conn = (engine_conn_t *) ctx->engine_data) != NULL)
+    {
+        loop = conn->loop;
+        PTHREAD_CALL(pthread_mutex_lock(&loop->lock));
+        if (!conn->done)
+            engine_make_ready(loop, conn);
+        PTHREAD_CALL(pthread_mutex_unlock(&loop->lock));
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    if (loop)
+        PTHREAD_CALL(pthread_cond_signal(&loop->wakeup));
+}
+
+/* block until the transport layer is done with the connection */
+void _mysock_engine_stop(mysock_context_t *ctx)
+{
+    engine_loop_t *loop;
+    engine_conn_t *conn;
+
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    conn = (engine_conn_t *) ctx->engine_data;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    if (!conn)
+        return;
+
+    assert(!ctx->listening);
+    assert(ctx->is_active || ctx->listen_sd != -1);
+
+    loop = conn->loop;
+    PTHREAD_CALL(pthread_mutex_lock(&loop->lock));
+    while (!conn->done)
+        PTHREAD_CALL(pthread_cond_wait(&loop->finished, &loop->lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&loop->lock));
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->engine_data = NULL;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    free(conn);
+}
+
+/* the transport layer runs in threads of its own, so just wait for it */
+void _mysock_engine_wait(mysock_context_t *ctx,
+                         pthread_cond_t *cond, pthread_mutex_t *lock)
+{
+    assert(cond && lock);
+    PTHREAD_CALL(pthread_cond_wait(cond, lock));
+}
+
+/* timers run by the system clock */
+bool_t _mysock_engine_gettime(struct timespec *now)
+{
+    assert(now);
+    clock_gettime(CLOCK_REALTIME, now);
+    return FALSE;
+}
+
+
+/* create the event loops, and start their threads */
+static void engine_init(void)
+{
+    int num_cpus = MAX((int) sysconf(_SC_NPROCESSORS_ONLN), 1);
+    int k;
+
+    engine_num_loops = ENGINE_NUM_LOOPS;
+    if (engine_num_loops <= 0)
+        engine_num_loops = num_cpus;
+    engine_num_loops = MIN(MAX(engine_num_loops, 1), ENGINE_MAX_LOOPS);
+
+    engine_loops = (engine_loop_t *) calloc(engine_num_loops,
+                                            sizeof(engine_loop_t));
+    assert(engine_loops);
+
+    for (k = 0; k < engine_num_loops; ++k)
+    {
+        engine_loop_t *loop = &engine_loops[k];
+
+        PTHREAD_CALL(pthread_mutex_init(&loop->lock, NULL));
+        PTHREAD_CALL(pthread_cond_init(&loop->wakeup, NULL));
+        PTHREAD_CALL(pthread_cond_init(&loop->finished, NULL));
+        loop->cpu = k % num_cpus;
+        loop->thread = _mysock_create_thread(engine_thread_func, loop, TRUE);
+    }
+}
+
+/* pick the loop to run a new connection */
+static engine_loop_t *engine_choose_loop(mysock_context_t *ctx)
+{
+    engine_loop_t *best = NULL;
+    int best_conns = 0, k;
+
+    assert(ctx);
+
+    if (ctx->is_active)
+    {
+        const struct sockaddr_in *local, *peer;
+        uint32_t hash;
+
+        local = (const struct sockaddr_in *) &ctx->network_state.local_addr;
+        peer  = (const struct sockaddr_in *) &ctx->network_state.peer_addr;
+
+        hash = ntohl(local->sin_addr.s_addr) ^ ntohl(peer->sin_addr.s_addr);
+        hash = hash * 2654435761U ^
+               ((uint32_t) _network_get_port(&ctx->network_state) << 16) ^
+               peer->sin_port;
+        hash *= 2654435761U;    /* Knuth's multiplicative hash */
+        return &engine_loops[(hash >> 16) % engine_num_loops];
+    }
+
+    /* accepted connections go wherever there are fewest connections */
+    for (k = 0; k < engine_num_loops; ++k)
+    {
+        engine_loop_t *loop = &engine_loops[k];
+        int num_conns;
+
+        PTHREAD_CALL(pthread_mutex_lock(&loop->lock));
+        num_conns = loop->num_conns;
+        PTHREAD_CALL(pthread_mutex_unlock(&loop->lock));
+
+        if (!best || num_conns < best_conns)
+        {
+            best = loop;
+            best_conns = num_conns;
+        }
+    }
+    return best;
+}
+
+
+/* the event loop itself.  this runs for as long as the process does. */
+static void *engine_thread_func(void *arg_ptr)
+{
+    engine_loop_t *loop = (engine_loop_t *) arg_ptr;
+
+    assert(loop);
+
+#ifdef LINUX
+    {
+        /* keep each loop's connections' state in its own CPU's caches */
+        cpu_set_t cpus;
+
+        CPU_ZERO(&cpus);
+        CPU_SET(loop->cpu, &cpus);
+        (void) pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+#endif
+
+    PTHREAD_CALL(pthread_mutex_lock(&loop->lock));
+    for (;;)
+    {
+        engine_conn_t *conn;
+        struct timespec now, deadline;
+        bool_t more, timer_set, alive;
+
+        /* connections whose timers are due join the back of the queue */
+        if (loop->num_timers > 0)
+        {
+            clock_gettime(CLOCK_REALTIME, &now);
+            while (loop->num_timers > 0 &&
+                   !_mysock_timespec_before(&now, &loop->timers[0]->deadline))
+            {
+                conn = loop->timers[0];
+                engine_set_timer(loop, conn, NULL);
+                engine_make_ready(loop, conn);
+            }
+        }
+
+        if (!(conn = loop->ready))
+        {
+            int rc;
+
+            if (loop->num_timers == 0)
+            {
+                PTHREAD_CALL(pthread_cond_wait(&loop->wakeup, &loop->lock));
+                continue;
+            }
+
+            deadline = loop->timers[0]->deadline;
+            rc = pthread_cond_timedwait(&loop->wakeup, &loop->lock,
+                                        &deadline);
+            assert(rc == 0 || rc == ETIMEDOUT || rc == EINTR);
+            continue;
+        }
+
+        /* if there's an event while it's running, it goes to the back of
+         * the queue, so the others get a turn
+         */
+        if (!(loop->ready = conn->next_ready))
+            loop->ready_tail = NULL;
+        conn->next_ready = NULL;
+        conn->ready = FALSE;
+
+        PTHREAD_CALL(pthread_mutex_unlock(&loop->lock));
+        if (!conn->started)
+        {
+            transport_start(conn->ctx->my_sd, conn->ctx->is_active);
+            conn->started = TRUE;
+        }
+        alive = _mysock_transport_poll(conn->ctx, ENGINE_BATCH, &more,
+                                       &timer_set, &deadline);
+        PTHREAD_CALL(pthread_mutex_lock(&loop->lock));
+
+        if (!alive)
+        {
+            /* it may have been notified in the meantime */
+            if (conn->ready)
+                engine_unready(loop, conn);
+            engine_set_timer(loop, conn, NULL);
+            loop->num_conns--;
+            conn->done = TRUE;
+            PTHREAD_CALL(pthread_cond_broadcast(&loop->finished));
+            continue;
+        }
+
+        if (more)
+            engine_make_ready(loop, conn);
+        engine_set_timer(loop, conn, timer_set ? &deadline : NULL);
+    }
+
+    /*NOTREACHED*/
+    PTHREAD_CALL(pthread_mutex_unlock(&loop->lock));
+    return NULL;
+}
+
+/* add a connection to the back of the loop's ready queue, unless it's
+ * already there
+ */
+static void engine_make_ready(engine_loop_t *loop, engine_conn_t *conn)
+{
+    assert(loop && conn && !conn->done);
+
+    if (conn->ready)
+        return;
+
+    conn->ready = TRUE;
+    conn->next_ready = NULL;
+    if (loop->ready_tail)
+        loop->ready_tail->next_ready = conn;
+    else
+        loop->ready = conn;
+    loop->ready_tail = conn;
+}
+
+/* take a connection off the loop's ready queue */
+static void engine_unready(engine_loop_t *loop, engine_conn_t *conn)
+{
+    engine_conn_t **prev, *last;
+
+    assert(loop && conn && conn->ready);
+
+    for (prev = &loop->ready, last = NULL; *prev != conn;
+         last = *prev, prev = &(*prev)->next_ready)
+        assert(*prev);
+    *prev = conn->next_ready;
+    if (loop->ready_tail == conn)
+        loop->ready_tail = last;
+    conn->next_ready = NULL;
+    conn->ready = FALSE;
+}
+
+/* set the connection's timer to the given deadline, replacing any previous
+ * one; or cancel it, if deadline is NULL
+ */
+static void engine_set_timer(engine_loop_t *loop, engine_conn_t *conn,
+                             const struct timespec *deadline)
+{
+    int k;
+
+    assert(loop && conn);
+
+    if (deadline)
+    {
+        conn->deadline = *deadline;
+        if (!conn->timer_set)
+        {
+            if (loop->num_timers == loop->max_timers)
+            {
+                loop->max_timers = MAX(2 * loop->max_timers, 16);
+                loop->timers = (engine_conn_t **)
+                    realloc(loop->timers,
+                            loop->max_timers * sizeof(engine_conn_t *));
+                assert(loop->timers);
+            }
+            conn->timer_set = TRUE;
+            engine_timer_place(loop, loop->num_timers++, conn);
+        }
+        engine_timer_up(loop, conn->heap_index);
+        engine_timer_down(loop, conn->heap_index);
+    }
+    else if (conn->timer_set)
+    {
+        assert(loop->timers[conn->heap_index] == conn);
+        k = conn->heap_index;
+        conn->timer_set = FALSE;
+        if (k != --loop->num_timers)
+        {
+            engine_timer_place(loop, k, loop->timers[loop->num_timers]);
+            engine_timer_up(loop, k);
+            engine_timer_down(loop, k);
+        }
+    }
+}
+
+/* restore the heap order after the timer at index k got earlier */
+static void engine_timer_up(engine_loop_t *loop, int k)
+{
+    engine_conn_t *conn = loop->timers[k];
+
+    while (k > 0)
+    {
+        engine_conn_t *parent = loop->timers[(k - 1) / 2];
+
+        if (!_mysock_timespec_before(&conn->deadline, &parent->deadline))
+            break;
+        engine_timer_place(loop, k, parent);
+        k = (k - 1) / 2;
+    }
+    engine_timer_place(loop, k, conn);
+}
+
+/* restore the heap order after the timer at index k got later */
+static void engine_timer_down(engine_loop_t *loop, int k)
+{
+    engine_conn_t *conn = loop->timers[k];
+
+    for (;;)
+    {
+        int child = 2 * k + 1;
+
+        if (child >= loop->num_timers)
+            break;
+        if (child + 1 < loop->num_timers &&
+            _mysock_timespec_before(&loop->timers[child + 1]->deadline,
+                                    &loop->timers[child]->deadline))
+            child++;
+        if (!_mysock_timespec_before(&loop->timers[child]->deadline,
+                                     &conn->deadline))
+            break;
+        engine_timer_place(loop, k, loop->timers[child]);
+        k = child;
+    }
+    engine_timer_place(loop, k, conn);
+}
+
+static void engine_timer_place(engine_loop_t *loop, int k,
+                               engine_conn_t *conn)
+{
+    loop->timers[k] = conn;
+    conn->heap_index = k;
+}
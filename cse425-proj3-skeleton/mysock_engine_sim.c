@@ -0,0 +1,471 @@
+/* mysock_engine_sim.c--transport engine running every connection's
+ * transport layer, and the applications using them (see mysock_sim.h), in
+ * one thread on a virtual clock.
+ *
+ * applications run as coroutines.  each runs until it has to wait for the
+ * transport layer (see _mysock_engine_wait()), and then the next gets a
+ * turn.  once none of them can go on, the connections that have been
+ * notified of an event are handed it, in the order they were notified, as
+ * mysock_engine_loop.c would; an application waiting for a connection is
+ * given another turn once the connection has been run.  once nothing at
+ * all is left to do, the clock is moved straight on to the earliest
+ * transport timer, or the next packet due off the emulated link's delay
+ * line (see network_emul.c), and whatever's due then is set off.
+ *
+ * everything happens in a fixed order, from a fixed starting time, so a
+ * simulation runs exactly the same way every time.  this must be linked
+ * with network_io_loopback.c, which passes packets on from the sending
+ * thread.  note that an application waiting in myaccept() holds a lock
+ * that mylisten() and closing a listening mysocket need, so listening
+ * mysockets are best set up and closed outside the applications.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <ucontext.h>
+#include <pthread.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "mysock_sim.h"
+#include "network_emul.h"
+#include "transport.h"
+
+
+/* events handled for a connection before giving the others a turn */
+#define SIM_BATCH 16
+
+/* the virtual clock starts at 00:00:00 GMT, January 1, 2000, rather than
+ * at zero, which the network layer takes to mean a time that isn't set
+ */
+#define SIM_EPOCH 946684800
+
+/* stack size of each application */
+#define SIM_STACK_SIZE (256 * 1024)
+
+/* a connection (engine_data in its mysock context) */
+typedef struct sim_conn
+{
+    mysock_context_t *ctx;
+    bool_t            started;      /* transport_start() has been called */
+    bool_t            ready;        /* on the ready queue */
+    bool_t            done;         /* the transport layer has finished */
+    bool_t            timer_set;    /* TRUE if the transport has a timer... */
+    struct timespec   deadline;     /* ...due at this time */
+    struct sim_conn  *next;         /* connections, in the order started */
+    struct sim_conn  *next_ready;
+} sim_conn_t;
+
+/* an application */
+typedef struct sim_app
+{
+    ucontext_t        context;
+    char             *stack;
+    mysim_func_t      func;
+    void             *arg;
+    bool_t            finished;
+    bool_t            waiting;      /* TRUE if it's waiting for... */
+    mysock_context_t *waiting_for;  /* ...this mysocket, or any if NULL */
+    struct sim_app   *next;         /* applications, in the order spawned */
+    struct sim_app   *next_runnable;
+} sim_app_t;
+
+static struct timespec sim_now = { SIM_EPOCH, 0 };
+static ucontext_t      sim_context;     /* where the running application
+                                         * was switched to from
+                                         */
+static sim_app_t      *sim_current;     /* the running application */
+static bool_t          sim_polling;     /* a transport layer is running */
+
+static sim_app_t  *sim_apps, *sim_runnable, *sim_runnable_tail;
+static sim_conn_t *sim_conns, *sim_conns_tail, *sim_ready, *sim_ready_tail;
+
+
+static void sim_wait(mysock_context_t *ctx);
+static bool_t sim_step(void);
+static void sim_resume(sim_app_t *app);
+static void sim_run_conn(sim_conn_t *conn);
+static bool_t sim_advance(void);
+static void sim_wake(mysock_context_t *ctx);
+static void sim_make_runnable(sim_app_t *app);
+static void sim_make_ready(sim_conn_t *conn);
+static void sim_remove_conn(sim_conn_t *conn);
+static void sim_app_main(void);
+
+
+/* add a new connection to those run, giving it a turn straight away */
+void _mysock_engine_start(mysock_context_t *ctx)
+{
+    sim_conn_t *conn;
+
+    assert(ctx && !ctx->engine_data);
+
+    conn = (sim_conn_t *) calloc(1, sizeof(sim_conn_t));
+    assert(conn);
+    conn->ctx = ctx;
+
+    if (sim_conns_tail)
+        sim_conns_tail->next = conn;
+    else
+        sim_conns = conn;
+    sim_conns_tail = conn;
+
+    ctx->engine_data = conn;
+    sim_make_ready(conn);
+}
+
+/* give the connection a turn */
+void _mysock_engine_notify(mysock_context_t *ctx)
+{
+    sim_conn_t *conn;
+
+    assert(ctx);
+
+    if ((conn = (sim_conn_t *) ctx->engine_data) != NULL && !conn->done)
+        sim_make_ready(conn);
+}
+
+/* run the simulation until the transport layer is done with the
+ * connection
+ */
+void _mysock_engine_stop(mysock_context_t *ctx)
+{
+    sim_conn_t *conn;
+
+    assert(ctx);
+
+    if (!(conn = (sim_conn_t *) ctx->engine_data))
+        return;
+
+    assert(!ctx->listening);
+    assert(ctx->is_active || ctx->listen_sd != -1);
+
+    while (!conn->done)
+        sim_wait(ctx);
+
+    ctx->engine_data = NULL;
+    free(conn);
+}
+
+/* switch away from the application until the transport layer has been
+ * run.  the lock is let go meanwhile, as pthread_cond_wait() would.
+ */
+void _mysock_engine_wait(mysock_context_t *ctx,
+                         pthread_cond_t *cond, pthread_mutex_t *lock)
+{
+    assert(cond && lock);
+
+    PTHREAD_CALL(pthread_mutex_unlock(lock));
+    sim_wait(ctx);
+    PTHREAD_CALL(pthread_mutex_lock(lock));
+}
+
+/* timers run by the virtual clock */
+bool_t _mysock_engine_gettime(struct timespec *now)
+{
+    assert(now);
+    *now = sim_now;
+    return TRUE;
+}
+
+
+void mysim_spawn(mysim_func_t func, void *arg)
+{
+    sim_app_t *app, **last;
+
+    assert(func);
+
+    app = (sim_app_t *) calloc(1, sizeof(sim_app_t));
+    assert(app);
+    app->stack = (char *) malloc(SIM_STACK_SIZE);
+    assert(app->stack);
+    app->func = func;
+    app->arg  = arg;
+
+    if (getcontext(&app->context) < 0)
+    {
+        perror("getcontext");
+        abort();
+    }
+    app->context.uc_stack.ss_sp   = app->stack;
+    app->context.uc_stack.ss_size = SIM_STACK_SIZE;
+    app->context.uc_link          = &sim_context;
+    makecontext(&app->context, sim_app_main, 0);
+
+    for (last = &sim_apps; *last; last = &(*last)->next)
+        ;
+    *last = app;
+
+    sim_make_runnable(app);
+}
+
+int mysim_run(void)
+{
+    assert(!sim_current);
+
+    while (sim_apps)
+    {
+        if (!sim_step())
+        {
+            errno = EDEADLK;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void mysim_gettime(struct timespec *now)
+{
+    assert(now);
+    *now = sim_now;
+}
+
+
+/* wait for the transport layer of the given mysocket (or of any, if it's
+ * NULL).  an application is switched away from until it's woken; anything
+ * else (e.g. the main thread, outside mysim_run()) runs the simulation on
+ * by a step instead.
+ */
+static void sim_wait(mysock_context_t *ctx)
+{
+    sim_app_t *app = sim_current;
+
+    assert(!sim_polling);   /* the transport layer mustn't block */
+
+    if (app)
+    {
+        app->waiting = TRUE;
+        app->waiting_for = ctx;
+        if (swapcontext(&app->context, &sim_context) < 0)
+        {
+            perror("swapcontext");
+            abort();
+        }
+        assert(sim_current == app);
+    }
+    else if (!sim_step())
+    {
+        fprintf(stderr, "simulation: waiting for an event that will "
+                "never happen\n");
+        abort();
+    }
+}
+
+/* do the next thing there is to do.  returns FALSE if there's nothing. */
+static bool_t sim_step(void)
+{
+    sim_app_t *app;
+    sim_conn_t *conn;
+
+    if ((app = sim_runnable) != NULL)
+    {
+        if (!(sim_runnable = app->next_runnable))
+            sim_runnable_tail = NULL;
+        app->next_runnable = NULL;
+        sim_resume(app);
+        return TRUE;
+    }
+
+    if ((conn = sim_ready) != NULL)
+    {
+        if (!(sim_ready = conn->next_ready))
+            sim_ready_tail = NULL;
+        conn->next_ready = NULL;
+        conn->ready = FALSE;
+        sim_run_conn(conn);
+        return TRUE;
+    }
+
+    return sim_advance();
+}
+
+/* run the application until it waits again, or finishes */
+static void sim_resume(sim_app_t *app)
+{
+    sim_app_t **prev;
+
+    assert(app && !sim_current);
+
+    sim_current = app;
+    if (swapcontext(&sim_context, &app->context) < 0)
+    {
+        perror("swapcontext");
+        abort();
+    }
+    sim_current = NULL;
+
+    if (app->finished)
+    {
+        for (prev = &sim_apps; *prev != app; prev = &(*prev)->next)
+            assert(*prev);
+        *prev = app->next;
+
+        free(app->stack);
+        free(app);
+    }
+}
+
+/* hand the connection's transport layer whatever events are pending */
+static void sim_run_conn(sim_conn_t *conn)
+{
+    mysock_context_t *ctx;
+    struct timespec deadline;
+    bool_t more, timer_set, alive;
+
+    assert(conn && !conn->done);
+    ctx = conn->ctx;
+
+    sim_polling = TRUE;
+    if (!conn->started)
+    {
+        transport_start(ctx->my_sd, ctx->is_active);
+        conn->started = TRUE;
+    }
+    alive = _mysock_transport_poll(ctx, SIM_BATCH, &more,
+                                   &timer_set, &deadline);
+    sim_polling = FALSE;
+
+    if (!alive)
+    {
+        conn->done = TRUE;
+        sim_remove_conn(conn);
+    }
+    else
+    {
+        if (more)
+            sim_make_ready(conn);
+        conn->timer_set = timer_set;
+        conn->deadline  = deadline;
+    }
+
+    sim_wake(ctx);
+}
+
+/* nothing can happen at the current time, so move the clock on to the next
+ * packet due off the delay line, or the next timer, whichever's first, and
+ * set off whatever's due then.  returns FALSE if nothing ever will be.
+ */
+static bool_t sim_advance(void)
+{
+    const struct timespec *next = NULL;
+    struct timespec release;
+    sim_conn_t *conn;
+
+    if (_network_emulate_release(&release))
+        next = &release;
+
+    for (conn = sim_conns; conn; conn = conn->next)
+    {
+        if (conn->timer_set &&
+            (!next || _mysock_timespec_before(&conn->deadline, next)))
+            next = &conn->deadline;
+    }
+
+    if (!next)
+        return FALSE;
+
+    if (_mysock_timespec_before(&sim_now, next))
+        sim_now = *next;
+
+    /* packets arrive before timers due at the same time go off */
+    (void) _network_emulate_release(&release);
+
+    for (conn = sim_conns; conn; conn = conn->next)
+    {
+        if (conn->timer_set &&
+            !_mysock_timespec_before(&sim_now, &conn->deadline))
+        {
+            conn->timer_set = FALSE;
+            sim_make_ready(conn);
+        }
+    }
+
+    /* e.g. a mysocket being closed, waiting for its last packets to go */
+    sim_wake(NULL);
+    return TRUE;
+}
+
+/* give the applications waiting for the given mysocket, or for any, another
+ * turn
+ */
+static void sim_wake(mysock_context_t *ctx)
+{
+    sim_app_t *app;
+
+    for (app = sim_apps; app; app = app->next)
+    {
+        if (!app->waiting || (app->waiting_for && app->waiting_for != ctx))
+            continue;
+
+        app->waiting = FALSE;
+        sim_make_runnable(app);
+    }
+}
+
+/* put the application on the back of the run queue */
+static void sim_make_runnable(sim_app_t *app)
+{
+    assert(app && !app->waiting);
+
+    app->next_runnable = NULL;
+    if (sim_runnable_tail)
+        sim_runnable_tail->next_runnable = app;
+    else
+        sim_runnable = app;
+    sim_runnable_tail = app;
+}
+
+/* put the connection on the back of the ready queue, if it isn't on it */
+static void sim_make_ready(sim_conn_t *conn)
+{
+    assert(conn && !conn->done);
+
+    if (conn->ready)
+        return;
+
+    conn->ready = TRUE;
+    conn->next_ready = NULL;
+    if (sim_ready_tail)
+        sim_ready_tail->next_ready = conn;
+    else
+        sim_ready = conn;
+    sim_ready_tail = conn;
+}
+
+/* forget a connection the transport layer has finished with */
+static void sim_remove_conn(sim_conn_t *conn)
+{
+    sim_conn_t **prev, *last;
+
+    assert(conn);
+
+    for (prev = &sim_conns, last = NULL; *prev != conn;
+         last = *prev, prev = &(*prev)->next)
+        assert(*prev);
+    *prev = conn->next;
+    if (sim_conns_tail == conn)
+        sim_conns_tail = last;
+
+    if (conn->ready)
+    {
+        for (prev = &sim_ready, last = NULL; *prev != conn;
+             last = *prev, prev = &(*prev)->next_ready)
+            assert(*prev);
+        *prev = conn->next_ready;
+        if (sim_ready_tail == conn)
+            sim_ready_tail = last;
+        conn->ready = FALSE;
+    }
+}
+
+/* where each application starts; it returns to sim_context when done */
+static void sim_app_main(void)
+{
+    sim_app_t *app = sim_current;
+
+    assert(app);
+    app->func(app->arg);
+    app->finished = TRUE;
+}
@@ -0,0 +1,208 @@
+/* mysock_engine_steal.c--transport engine running connections' transport
+ * layers as tasks on the work-stealing scheduler (see mysock_sched.c).
+ *
+ * each connection is a task, submitted whenever the connection may have
+ * an event pending, or its transport timer is due.  the task hands the
+ * transport layer whatever is pending (see _mysock_transport_poll()), so
+ * a busy connection is processed in short bursts by whichever worker is
+ * free, rather than staying on one thread; idle workers steal connections
+ * from busy ones.  a connection's task never runs on two workers at once,
+ * so its transport state is still only touched by one thread at a time.
+ */
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "mysock_sched.h"
+#include "transport.h"
+
+
+/* events handled for a connection before giving the others a turn */
+#define ENGINE_BATCH 16
+
+/* a connection (engine_data in its mysock context) */
+typedef struct
+{
+    mysock_task_t     task;     /* must be first */
+    mysock_timer_t    timer;    /* the transport layer's timer */
+    mysock_context_t *ctx;
+    bool_t            started;  /* transport_start() has been called */
+
+    /* the task is submitted only when it isn't already queued or running;
+     * if there's a new event while it's running, it's submitted again
+     * once it's done.  these are protected by lock.
+     */
+    pthread_mutex_t   lock;
+    pthread_cond_t    finished; /* signalled when done is set */
+    bool_t            queued;
+    bool_t            running;
+    bool_t            again;    /* there was an event while running */
+    bool_t            done;     /* the transport layer has finished */
+} engine_conn_t;
+
+
+static void engine_wake(engine_conn_t *conn);
+static void engine_task(mysock_task_t *task);
+static void engine_timer_expired(mysock_timer_t *timer);
+
+
+/* start running the transport layer for a new connection.  the
+ * engine_data pointer in the mysock context is protected by its
+ * data_ready_lock, as it's used by whichever threads queue data for it.
+ */
+void _mysock_engine_start(mysock_context_t *ctx)
+{
+    engine_conn_t *conn;
+
+    assert(ctx && !ctx->engine_data);
+
+    conn = (engine_conn_t *) calloc(1, sizeof(engine_conn_t));
+    assert(conn);
+    conn->task.run = engine_task;
+    conn->task.home = ctx->my_sd;
+    conn->timer.expire = engine_timer_expired;
+    conn->ctx = ctx;
+    PTHREAD_CALL(pthread_mutex_init(&conn->lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&conn->finished, NULL));
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->engine_data = conn;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    engine_wake(conn);
+}
+
+void _mysock_engine_notify(mysock_context_t *ctx)
+{
+    engine_conn_t *conn;
+
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    if ((conn = (engine_conn_t *) ctx->engine_data) != NULL)
+        engine_wake(conn);
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+}
+
+/* block until the transport layer is done with the connection */
+void _mysock_engine_stop(mysock_context_t *ctx)
+{
+    engine_conn_t *conn;
+
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    conn = (engine_conn_t *) ctx->engine_data;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    if (!conn)
+        return;
+
+    assert(!ctx->listening);
+    assert(ctx->is_active || ctx->listen_sd != -1);
+
+    PTHREAD_CALL(pthread_mutex_lock(&conn->lock));
+    while (!conn->done || conn->queued)
+        PTHREAD_CALL(pthread_cond_wait(&conn->finished, &conn->lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&conn->lock));
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    ctx->engine_data = NULL;
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+
+    PTHREAD_CALL(pthread_cond_destroy(&conn->finished));
+    PTHREAD_CALL(pthread_mutex_destroy(&conn->lock));
+    free(conn);
+}
+
+/* the transport layer runs in threads of its own, so just wait for it */
+void _mysock_engine_wait(mysock_context_t *ctx,
+                         pthread_cond_t *cond, pthread_mutex_t *lock)
+{
+    assert(cond && lock);
+    PTHREAD_CALL(pthread_cond_wait(cond, lock));
+}
+
+/* timers run by the system clock */
+bool_t _mysock_engine_gettime(struct timespec *now)
+{
+    assert(now);
+    clock_gettime(CLOCK_REALTIME, now);
+    return FALSE;
+}
+
+
+/* the connection may have something to do; submit its task if need be */
+static void engine_wake(engine_conn_t *conn)
+{
+    bool_t submit = FALSE;
+
+    PTHREAD_CALL(pthread_mutex_lock(&conn->lock));
+    if (conn->running)
+        conn->again = TRUE;
+    else if (!conn->queued && !conn->done)
+        submit = conn->queued = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&conn->lock));
+
+    if (submit)
+        _mysock_sched_submit(&conn->task);
+}
+
+/* run the transport layer for a while */
+static void engine_task(mysock_task_t *task)
+{
+    engine_conn_t *conn = (engine_conn_t *) task;
+    struct timespec deadline;
+    bool_t more, timer_set, alive, submit = FALSE;
+
+    PTHREAD_CALL(pthread_mutex_lock(&conn->lock));
+    assert(conn->queued && !conn->running);
+    conn->queued = FALSE;
+    if (conn->done)
+    {
+        /* _mysock_engine_stop() may be waiting for this */
+        PTHREAD_CALL(pthread_cond_broadcast(&conn->finished));
+        PTHREAD_CALL(pthread_mutex_unlock(&conn->lock));
+        return;
+    }
+    conn->running = TRUE;
+    conn->again = FALSE;
+    PTHREAD_CALL(pthread_mutex_unlock(&conn->lock));
+
+    if (!conn->started)
+    {
+        transport_start(conn->ctx->my_sd, conn->ctx->is_active);
+        conn->started = TRUE;
+    }
+    alive = _mysock_transport_poll(conn->ctx, ENGINE_BATCH, &more,
+                                   &timer_set, &deadline);
+    _mysock_sched_set_timer(&conn->timer,
+                            (alive && timer_set) ? &deadline : NULL);
+
+    PTHREAD_CALL(pthread_mutex_lock(&conn->lock));
+    conn->running = FALSE;
+    if (!alive)
+    {
+        conn->done = TRUE;
+        PTHREAD_CALL(pthread_cond_broadcast(&conn->finished));
+    }
+    else if (more || conn->again)
+    {
+        submit = conn->queued = TRUE;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&conn->lock));
+
+    if (submit)
+        _mysock_sched_submit(&conn->task);
+}
+
+/* the transport layer's timer is due */
+static void engine_timer_expired(mysock_timer_t *timer)
+{
+    engine_wake((engine_conn_t *) ((char *) timer -
+                                   offsetof(engine_conn_t, timer)));
+}
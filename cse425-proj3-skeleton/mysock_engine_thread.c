@@ -0,0 +1,83 @@
+/* mysock_engine_thread.c--transport engine running each connection's
+ * transport layer in a thread of its own
+ */
+
+#include <assert.h>
+#include <time.h>
+#include <pthread.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "transport.h"
+
+
+static void *transport_thread_func(void *arg_ptr);
+
+
+/* start a new transport layer thread */
+void _mysock_engine_start(mysock_context_t *ctx)
+{
+    assert(ctx && !ctx->transport_thread_started);
+
+    ctx->transport_thread = _mysock_create_thread(transport_thread_func,
+                                                  ctx, FALSE);
+    ctx->transport_thread_started = TRUE;
+}
+
+/* nothing to do; the transport thread is already woken by data_ready_cond */
+void _mysock_engine_notify(mysock_context_t *ctx)
+{
+    assert(ctx);
+}
+
+/* block until the transport layer thread exits */
+void _mysock_engine_stop(mysock_context_t *ctx)
+{
+    assert(ctx);
+
+    if (ctx->transport_thread_started)
+    {
+        assert(!ctx->listening);
+        assert(ctx->is_active || ctx->listen_sd != -1);
+        PTHREAD_CALL(pthread_join(ctx->transport_thread, NULL));
+        ctx->transport_thread_started = FALSE;
+    }
+}
+
+/* the transport layer runs in threads of its own, so just wait for it */
+void _mysock_engine_wait(mysock_context_t *ctx,
+                         pthread_cond_t *cond, pthread_mutex_t *lock)
+{
+    assert(cond && lock);
+    PTHREAD_CALL(pthread_cond_wait(cond, lock));
+}
+
+/* timers run by the system clock */
+bool_t _mysock_engine_gettime(struct timespec *now)
+{
+    assert(now);
+    clock_gettime(CLOCK_REALTIME, now);
+    return FALSE;
+}
+
+/* transport layer thread; transport_init() should not return until the
+ * transport layer finishes (i.e. the connection is over).
+ */
+static void *transport_thread_func(void *arg_ptr)
+{
+    mysock_context_t *ctx = (mysock_context_t *) arg_ptr;
+
+    assert(ctx);
+
+    /* enter the STCP control loop.  transport_init() doesn't return until the
+     * connection's finished.  that function should first signal establishment
+     * of the connection after SYN/SYN-ACK (or an error condition if the
+     * connection couldn't be established) to the application by using
+     * stcp_unblock_application(); as the name suggests, this unblocks the
+     * calling code.  transport_init() then handles the connection,
+     * returning only after the connection is closed.
+     */
+    transport_init(ctx->my_sd, ctx->is_active);
+
+    _mysock_transport_done(ctx);
+    return NULL;
+}
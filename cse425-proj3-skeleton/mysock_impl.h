@@ -11,9 +11,11 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
 #include <pthread.h>
 #include "mysock.h"
 #include "network_io.h"
+#include "transport.h"
 
 #ifdef __GNUC__
     #define INLINE __inline__
@@ -34,6 +36,14 @@ static INLINE void _pthread_call(int pthread_retval)
 
 #define PTHREAD_CALL(rc) _pthread_call(rc)
 
+/* TRUE if a is earlier than b */
+static INLINE bool_t _mysock_timespec_before(const struct timespec *a,
+                                             const struct timespec *b)
+{
+    return a->tv_sec < b->tv_sec ||
+           (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
 #define ARRAY_DIM(a) (sizeof(a) / sizeof(a[0]))
 
 #ifndef MIN
@@ -62,6 +72,16 @@ typedef struct
     packet_queue_node_t *tail;
 } packet_queue_t;
 
+/* mysocket options set by the application (see mysock.h) */
+typedef struct
+{
+    int fec_block;      /* MYSO_FEC_BLOCK */
+    int congestion;     /* MYSO_CONGESTION */
+    int ecn;            /* MYSO_ECN */
+    mysock_emulation_t emulation;   /* MYSO_EMULATION */
+    const struct network_trace *emulation_trace;    /* its trace, as read */
+} mysock_options_t;
+
 /* mysocket context (and the arguments provided to the transport layer
  * thread).  most of this is mysock/network layer working state, with STCP
  * working state maintained separately by the student.  there is one instance
@@ -72,9 +92,21 @@ typedef struct mysock_context
     /* connection parameters */
     int is_active;      /* true if we're connect()ing, false if accept()ing */
 
+    /* options set by the application, and counters reported back to it */
+    mysock_options_t options;
+    mysock_stats_t   stats;
+
     /* student's STCP implementation working state */
     void *stcp_state;
 
+    /* prebuilt header for header-only segments sent to the peer, with
+     * ports and data offset filled in and the variable fields zeroed;
+     * th_sum holds the checksum of the template itself.  this is built on
+     * first use by stcp_network_send_header().
+     */
+    struct tcphdr   hdr_template;
+    bool_t          hdr_template_valid;
+
     /* network layer working state */
     network_context_t network_state;
     bool_t            bound;        /* true if bound to a local address */
@@ -94,9 +126,12 @@ typedef struct mysock_context
     bool_t          blocking;
     int             stcp_errno;
 
-    /* STCP thread */
+    /* STCP thread, or other transport engine state (see
+     * mysock_engine_*.c)
+     */
     pthread_t       transport_thread;
     bool_t          transport_thread_started;
+    void           *engine_data;
 
     /* is data ready from either network or the app? */
     pthread_cond_t  data_ready_cond;
@@ -122,6 +157,12 @@ mysock_context_t *_mysock_get_context(mysocket_t sd);
 
 void _mysock_transport_init(mysocket_t sd, bool_t is_active);
 
+void _mysock_transport_done(mysock_context_t *ctx);
+
+bool_t _mysock_transport_poll(mysock_context_t *ctx, int max_events,
+                              bool_t *more, bool_t *timer_set,
+                              struct timespec *deadline);
+
 int _mysock_wait_for_connection(mysock_context_t *ctx);
 
 void _mysock_free_context(mysock_context_t *ctx);
@@ -141,5 +182,28 @@ int _mysock_bind_ephemeral(mysock_context_t *ctx);
 
 pthread_t _mysock_create_thread(void *(*start)(void *args), void *args,                                         bool_t create_detached);
 
+/* mysock_engine_*.c: the transport engine, which runs the transport layer
+ * for each connection; one of these is linked in (see SRCS_ENGINE in the
+ * Makefile).  _mysock_engine_start() starts the transport layer for a
+ * connection, _mysock_engine_notify() is called whenever there may be a
+ * new event for it (see stcp_wait_for_event()), and _mysock_engine_stop()
+ * blocks until the transport layer has finished with it.
+ *
+ * _mysock_engine_wait() is called by the application (with lock held, in
+ * a loop, like pthread_cond_wait()) whenever it has to wait for the
+ * transport layer of the given mysocket, or of any mysocket if ctx is
+ * NULL.  _mysock_engine_gettime() reads the clock the transport layer's
+ * timers run by, returning TRUE if it's a virtual one that only the engine
+ * moves on, in which case nothing else may wait for it in real time.  all
+ * engines but mysock_engine_sim.c just wait on cond and read the system
+ * clock.
+ */
+void _mysock_engine_start(mysock_context_t *ctx);
+void _mysock_engine_notify(mysock_context_t *ctx);
+void _mysock_engine_stop(mysock_context_t *ctx);
+void _mysock_engine_wait(mysock_context_t *ctx,
+                         pthread_cond_t *cond, pthread_mutex_t *lock);
+bool_t _mysock_engine_gettime(struct timespec *now);
+
 #endif  /* __MYSOCK_INTERNAL_H__ */
 
@@ -0,0 +1,480 @@
+/* mysock_sched.c--work-stealing task scheduler.
+ *
+ * there's one worker thread per online CPU, each with its own double-ended
+ * queue of tasks.  a worker adds tasks it submits itself to the back of
+ * its own queue, and runs tasks from the back too, so work tends to stay
+ * on the CPU that generated it.  a worker whose queue is empty picks
+ * another worker at random, and steals the task at the front (the oldest)
+ * of that worker's queue; it only goes to sleep once every queue is empty.
+ * each queue has its own lock, so the only thing shared by all the workers
+ * when they're busy is the count of queued tasks.  the queues are short
+ * locked lists rather than lock-free (Chase-Lev) deques:  a task is a
+ * whole burst of transport processing, so an uncontended lock is cheap
+ * beside it, and stealing stays simple.
+ *
+ * each worker also keeps the timers it arms in a min-heap of its own, and
+ * publishes the earliest of them, so a busy worker checks for due timers
+ * between tasks with one atomic load, and only takes its timer lock when
+ * one is due.  an idle worker expires due timers from every heap, then
+ * sleeps until the earliest timer of all.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "mysock.h"
+#include "mysock_impl.h"
+#include "mysock_sched.h"
+
+
+/* number of worker threads; 0 for one per online CPU */
+#ifndef SCHED_NUM_WORKERS
+#define SCHED_NUM_WORKERS 0
+#endif
+
+#define SCHED_MAX_WORKERS 64
+
+/* a worker, its queue of tasks, and its timers */
+typedef struct
+{
+    int               index;
+    unsigned int      random_seed;  /* for choosing whom to steal from */
+
+    pthread_mutex_t   lock;         /* protects the queue */
+    mysock_task_t    *head;         /* oldest task */
+    mysock_task_t    *tail;         /* newest task */
+
+    /* armed timers, as a binary min-heap ordered by expiry time, and the
+     * earliest expiry time (in nanoseconds, or 0 if there are no timers).
+     * next_timer is read without the lock, so it's accessed atomically.
+     */
+    pthread_mutex_t   timer_lock;   /* protects timers, and expiry */
+    mysock_timer_t  **timers;
+    int               num_timers;
+    int               max_timers;
+    volatile uint64_t next_timer;
+} sched_worker_t;
+
+static struct
+{
+    sched_worker_t *workers;
+    int             num_workers;
+    pthread_key_t   self_key;       /* a worker's own sched_worker_t */
+
+    /* tasks queued over all the workers, changed atomically */
+    volatile int    num_queued;
+
+    /* idle workers sleep on wakeup */
+    pthread_mutex_t lock;
+    pthread_cond_t  wakeup;
+    volatile int    num_sleeping;
+} sched;
+
+static pthread_once_t sched_once = PTHREAD_ONCE_INIT;
+
+
+static void sched_init(void);
+static void *sched_worker_func(void *arg_ptr);
+static void sched_push(sched_worker_t *worker, mysock_task_t *task);
+static mysock_task_t *sched_pop(sched_worker_t *worker);
+static mysock_task_t *sched_steal(sched_worker_t *self);
+static void sched_idle(void);
+static void sched_run_timers(sched_worker_t *worker);
+static bool_t sched_update_next_timer(sched_worker_t *worker);
+static void sched_timer_up(sched_worker_t *worker, int k);
+static void sched_timer_down(sched_worker_t *worker, int k);
+static void sched_timer_place(sched_worker_t *worker, int k,
+                              mysock_timer_t *timer);
+static uint64_t sched_nsec(const struct timespec *ts);
+
+
+void _mysock_sched_submit(mysock_task_t *task)
+{
+    sched_worker_t *worker;
+
+    assert(task && task->run);
+    PTHREAD_CALL(pthread_once(&sched_once, sched_init));
+
+    if (!(worker = (sched_worker_t *) pthread_getspecific(sched.self_key)))
+    {
+        assert(task->home >= 0);
+        worker = &sched.workers[task->home % sched.num_workers];
+    }
+
+    sched_push(worker, task);
+    (void) __sync_add_and_fetch(&sched.num_queued, 1);
+
+    /* see sched_idle() */
+    if (sched.num_sleeping > 0)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&sched.lock));
+        PTHREAD_CALL(pthread_cond_signal(&sched.wakeup));
+        PTHREAD_CALL(pthread_mutex_unlock(&sched.lock));
+    }
+}
+
+/* a timer goes on the heap of the worker arming it (or one picked by its
+ * address, if it's armed from elsewhere), and stays there until it's
+ * disarmed or expires.  its armed flag and worker can only change under
+ * that worker's timer lock, and only set_timer() can arm it, so if it's
+ * seen to be armed beforehand, it's either still on that worker's heap
+ * once the lock is held, or it's on no heap at all.
+ */
+void _mysock_sched_set_timer(mysock_timer_t *timer,
+                             const struct timespec *when)
+{
+    sched_worker_t *self, *worker;
+    bool_t earlier;
+    int k;
+
+    assert(timer && timer->expire);
+    PTHREAD_CALL(pthread_once(&sched_once, sched_init));
+
+    self = (sched_worker_t *) pthread_getspecific(sched.self_key);
+    if (timer->armed)
+        worker = &sched.workers[timer->worker];
+    else if (self)
+        worker = self;
+    else
+        worker = &sched.workers[((size_t) timer / sizeof(*timer)) %
+                                sched.num_workers];
+
+    PTHREAD_CALL(pthread_mutex_lock(&worker->timer_lock));
+    if (when)
+    {
+        timer->when = *when;
+        if (!timer->armed)
+        {
+            if (worker->num_timers == worker->max_timers)
+            {
+                worker->max_timers = MAX(2 * worker->max_timers, 16);
+                worker->timers = (mysock_timer_t **)
+                    realloc(worker->timers,
+                            worker->max_timers * sizeof(mysock_timer_t *));
+                assert(worker->timers);
+            }
+            timer->armed = TRUE;
+            timer->worker = worker->index;
+            sched_timer_place(worker, worker->num_timers++, timer);
+        }
+        sched_timer_up(worker, timer->heap_index);
+        sched_timer_down(worker, timer->heap_index);
+    }
+    else if (timer->armed)
+    {
+        assert(worker->timers[timer->heap_index] == timer);
+        k = timer->heap_index;
+        timer->armed = FALSE;
+        if (k != --worker->num_timers)
+        {
+            sched_timer_place(worker, k, worker->timers[worker->num_timers]);
+            sched_timer_up(worker, k);
+            sched_timer_down(worker, k);
+        }
+    }
+    earlier = sched_update_next_timer(worker);
+    PTHREAD_CALL(pthread_mutex_unlock(&worker->timer_lock));
+
+    /* the worker checks its own timers before its next task, but if it's
+     * someone else's, a sleeping worker may need to wake up sooner.  as in
+     * sched_idle(), the new time is published before checking for sleeping
+     * workers, and they count themselves before looking at the timers.
+     */
+    if (earlier && worker != self)
+    {
+        __sync_synchronize();
+        if (sched.num_sleeping > 0)
+        {
+            PTHREAD_CALL(pthread_mutex_lock(&sched.lock));
+            PTHREAD_CALL(pthread_cond_signal(&sched.wakeup));
+            PTHREAD_CALL(pthread_mutex_unlock(&sched.lock));
+        }
+    }
+}
+
+
+/* start the worker threads */
+static void sched_init(void)
+{
+    int k;
+
+    sched.num_workers = SCHED_NUM_WORKERS;
+    if (sched.num_workers <= 0)
+        sched.num_workers = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    sched.num_workers = MIN(MAX(sched.num_workers, 1), SCHED_MAX_WORKERS);
+
+    sched.workers = (sched_worker_t *) calloc(sched.num_workers,
+                                              sizeof(sched_worker_t));
+    assert(sched.workers);
+
+    PTHREAD_CALL(pthread_key_create(&sched.self_key, NULL));
+    PTHREAD_CALL(pthread_mutex_init(&sched.lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&sched.wakeup, NULL));
+
+    for (k = 0; k < sched.num_workers; ++k)
+    {
+        sched_worker_t *worker = &sched.workers[k];
+
+        worker->index = k;
+        worker->random_seed = 0x5bd1e995 * (k + 1);
+        PTHREAD_CALL(pthread_mutex_init(&worker->lock, NULL));
+        PTHREAD_CALL(pthread_mutex_init(&worker->timer_lock, NULL));
+    }
+
+    for (k = 0; k < sched.num_workers; ++k)
+        (void) _mysock_create_thread(sched_worker_func, &sched.workers[k],
+                                     TRUE);
+}
+
+/* a worker thread.  this runs for as long as the process does. */
+static void *sched_worker_func(void *arg_ptr)
+{
+    sched_worker_t *self = (sched_worker_t *) arg_ptr;
+
+    assert(self);
+    PTHREAD_CALL(pthread_setspecific(sched.self_key, self));
+
+    for (;;)
+    {
+        mysock_task_t *task;
+        int k;
+
+        sched_run_timers(self);
+
+        if (!(task = sched_pop(self)) && !(task = sched_steal(self)))
+        {
+            for (k = 0; k < sched.num_workers; ++k)
+                sched_run_timers(&sched.workers[k]);
+            sched_idle();
+            continue;
+        }
+
+        (void) __sync_sub_and_fetch(&sched.num_queued, 1);
+        task->home = self->index;
+        task->run(task);
+    }
+
+    /*NOTREACHED*/
+    return NULL;
+}
+
+/* add a task to the back of a worker's queue */
+static void sched_push(sched_worker_t *worker, mysock_task_t *task)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+    task->next = NULL;
+    task->prev = worker->tail;
+    if (worker->tail)
+        worker->tail->next = task;
+    else
+        worker->head = task;
+    worker->tail = task;
+    PTHREAD_CALL(pthread_mutex_unlock(&worker->lock));
+}
+
+/* take the newest task from our own queue */
+static mysock_task_t *sched_pop(sched_worker_t *worker)
+{
+    mysock_task_t *task;
+
+    PTHREAD_CALL(pthread_mutex_lock(&worker->lock));
+    if ((task = worker->tail) != NULL)
+    {
+        if (!(worker->tail = task->prev))
+            worker->head = NULL;
+        else
+            worker->tail->next = NULL;
+        task->prev = task->next = NULL;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&worker->lock));
+
+    return task;
+}
+
+/* take the oldest task from another worker's queue, trying each of them
+ * in turn, starting from one chosen at random
+ */
+static mysock_task_t *sched_steal(sched_worker_t *self)
+{
+    int first, k;
+
+    if (sched.num_queued == 0 || sched.num_workers < 2)
+        return NULL;
+
+    first = rand_r(&self->random_seed) % sched.num_workers;
+    for (k = 0; k < sched.num_workers; ++k)
+    {
+        sched_worker_t *victim;
+        mysock_task_t *task;
+
+        victim = &sched.workers[(first + k) % sched.num_workers];
+        if (victim == self)
+            continue;
+
+        PTHREAD_CALL(pthread_mutex_lock(&victim->lock));
+        if ((task = victim->head) != NULL)
+        {
+            if (!(victim->head = task->next))
+                victim->tail = NULL;
+            else
+                victim->head->prev = NULL;
+            task->prev = task->next = NULL;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&victim->lock));
+
+        if (task)
+            return task;
+    }
+
+    return NULL;
+}
+
+/* sleep until there's a task to run, or the earliest timer is due.
+ * _mysock_sched_submit() counts the new task (and _mysock_sched_set_timer()
+ * publishes the new time) before checking for sleeping workers, and we
+ * count ourselves as sleeping before checking for tasks and timers, so at
+ * least one of us sees the other.
+ */
+static void sched_idle(void)
+{
+    struct timespec abstime;
+    uint64_t next_timer = 0;
+    int k, rc;
+
+    PTHREAD_CALL(pthread_mutex_lock(&sched.lock));
+    sched.num_sleeping++;
+    __sync_synchronize();
+
+    if (sched.num_queued == 0)
+    {
+        for (k = 0; k < sched.num_workers; ++k)
+        {
+            uint64_t when = __atomic_load_n(&sched.workers[k].next_timer,
+                                            __ATOMIC_ACQUIRE);
+
+            if (when && (!next_timer || when < next_timer))
+                next_timer = when;
+        }
+
+        if (next_timer)
+        {
+            abstime.tv_sec = next_timer / 1000000000;
+            abstime.tv_nsec = next_timer % 1000000000;
+            rc = pthread_cond_timedwait(&sched.wakeup, &sched.lock,
+                                        &abstime);
+            assert(rc == 0 || rc == ETIMEDOUT || rc == EINTR);
+        }
+        else
+        {
+            PTHREAD_CALL(pthread_cond_wait(&sched.wakeup, &sched.lock));
+        }
+    }
+
+    sched.num_sleeping--;
+    PTHREAD_CALL(pthread_mutex_unlock(&sched.lock));
+}
+
+/* expire any of a worker's timers that are due.  this only takes the
+ * worker's timer lock if its earliest timer is.
+ */
+static void sched_run_timers(sched_worker_t *worker)
+{
+    struct timespec now;
+    uint64_t next_timer;
+
+    next_timer = __atomic_load_n(&worker->next_timer, __ATOMIC_ACQUIRE);
+    if (!next_timer)
+        return;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (sched_nsec(&now) < next_timer)
+        return;
+
+    PTHREAD_CALL(pthread_mutex_lock(&worker->timer_lock));
+    while (worker->num_timers > 0 &&
+           !_mysock_timespec_before(&now, &worker->timers[0]->when))
+    {
+        mysock_timer_t *timer = worker->timers[0];
+
+        if (--worker->num_timers > 0)
+        {
+            sched_timer_place(worker, 0, worker->timers[worker->num_timers]);
+            sched_timer_down(worker, 0);
+        }
+        timer->armed = FALSE;
+        timer->expire(timer);
+    }
+    (void) sched_update_next_timer(worker);
+    PTHREAD_CALL(pthread_mutex_unlock(&worker->timer_lock));
+}
+
+/* publish the earliest of a worker's timers, returning TRUE if it's earlier
+ * than before.  the worker's timer lock must be held.
+ */
+static bool_t sched_update_next_timer(sched_worker_t *worker)
+{
+    uint64_t old_next, next = 0;
+
+    old_next = worker->next_timer;
+    if (worker->num_timers > 0)
+        next = MAX(sched_nsec(&worker->timers[0]->when), 1);
+    __atomic_store_n(&worker->next_timer, next, __ATOMIC_RELEASE);
+
+    return next && (!old_next || next < old_next);
+}
+
+/* restore the heap order after the timer at index k got earlier */
+static void sched_timer_up(sched_worker_t *worker, int k)
+{
+    mysock_timer_t *timer = worker->timers[k];
+
+    while (k > 0)
+    {
+        mysock_timer_t *parent = worker->timers[(k - 1) / 2];
+
+        if (!_mysock_timespec_before(&timer->when, &parent->when))
+            break;
+        sched_timer_place(worker, k, parent);
+        k = (k - 1) / 2;
+    }
+    sched_timer_place(worker, k, timer);
+}
+
+/* restore the heap order after the timer at index k got later */
+static void sched_timer_down(sched_worker_t *worker, int k)
+{
+    mysock_timer_t *timer = worker->timers[k];
+
+    for (;;)
+    {
+        int child = 2 * k + 1;
+
+        if (child >= worker->num_timers)
+            break;
+        if (child + 1 < worker->num_timers &&
+            _mysock_timespec_before(&worker->timers[child + 1]->when,
+                                    &worker->timers[child]->when))
+            child++;
+        if (!_mysock_timespec_before(&worker->timers[child]->when,
+                                     &timer->when))
+            break;
+        sched_timer_place(worker, k, worker->timers[child]);
+        k = child;
+    }
+    sched_timer_place(worker, k, timer);
+}
+
+static void sched_timer_place(sched_worker_t *worker, int k,
+                              mysock_timer_t *timer)
+{
+    worker->timers[k] = timer;
+    timer->heap_index = k;
+}
+
+static uint64_t sched_nsec(const struct timespec *ts)
+{
+    return (uint64_t) ts->tv_sec * 1000000000 + ts->tv_nsec;
+}
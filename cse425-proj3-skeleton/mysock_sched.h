@@ -0,0 +1,58 @@
+/* mysock_sched.h--work-stealing task scheduler, used to spread work (such
+ * as transport layer processing, see mysock_engine_steal.c) over a pool
+ * of worker threads.
+ */
+
+#ifndef __MYSOCK_SCHED_H__
+#define __MYSOCK_SCHED_H__
+
+#include <time.h>
+#include "mysock.h"
+
+
+/* a unit of work, run by calling run() on one of the worker threads.
+ * tasks are queued in place rather than copied, so the caller owns the
+ * memory, and a task must not be submitted again before it starts
+ * running.  the remaining fields are the scheduler's.
+ */
+typedef struct mysock_task
+{
+    void (*run)(struct mysock_task *task);
+
+    int                 home;   /* worker whose queue it's added to, if it
+                                 * isn't submitted by a worker (modulo the
+                                 * number of workers)
+                                 */
+    struct mysock_task *prev;
+    struct mysock_task *next;
+} mysock_task_t;
+
+/* a timer, calling expire() on one of the worker threads once it's due.
+ * expire() is called with a worker's timer lock held, so it mustn't set
+ * any timers itself; typically it just submits a task.  the remaining
+ * fields are the scheduler's.
+ */
+typedef struct mysock_timer
+{
+    void (*expire)(struct mysock_timer *timer);
+
+    struct timespec when;
+    bool_t          armed;
+    int             worker;     /* whose heap it's on, if armed */
+    int             heap_index; /* and where */
+} mysock_timer_t;
+
+
+/* queue a task to be run.  a task submitted by a worker goes on that
+ * worker's own queue; idle workers steal tasks from the others.
+ */
+void _mysock_sched_submit(mysock_task_t *task);
+
+/* arm a timer to expire at the given (absolute, CLOCK_REALTIME) time,
+ * replacing any previous time; or disarm it, if when is NULL.  once this
+ * returns, a disarmed timer won't expire.
+ */
+void _mysock_sched_set_timer(mysock_timer_t *timer,
+                             const struct timespec *when);
+
+#endif  /* __MYSOCK_SCHED_H__ */
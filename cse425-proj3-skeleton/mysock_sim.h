@@ -0,0 +1,37 @@
+/* mysock_sim.h--running mysocket applications in simulated time.
+ *
+ * with the simulation engine (mysock_engine_sim.c) and the in-process
+ * network layer (network_io_loopback.c), any number of applications, and
+ * every connection between them, run in a single thread on a virtual
+ * clock.  the clock only moves on when nothing is left to do at the
+ * current time, straight to the next thing due, so a transfer that would
+ * take minutes takes as long as its packets do to process, and runs the
+ * same way every time.
+ */
+
+#ifndef __MYSOCK_SIM_H__
+#define __MYSOCK_SIM_H__
+
+#include <time.h>   /* timespec */
+#include "mysock.h"
+
+
+/* an application: it may use the mysocket interface as it likes, and is
+ * switched away from whenever it has to wait for it.  it's finished once
+ * func returns.
+ */
+typedef void (*mysim_func_t)(void *arg);
+
+/* add an application, to run func(arg) once mysim_run() is called */
+extern void mysim_spawn(mysim_func_t func, void *arg);
+
+/* run the simulation until every application has finished.  returns 0
+ * then, or -1 (with errno set to EDEADLK) if those left are waiting for
+ * something that can never happen.
+ */
+extern int mysim_run(void);
+
+/* the time on the virtual clock */
+extern void mysim_gettime(struct timespec *now);
+
+#endif  /* __MYSOCK_SIM_H__ */
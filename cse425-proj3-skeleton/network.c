@@ -13,6 +13,7 @@
 #include "mysock_impl.h"
 #include "network.h"
 #include "network_io.h"
+#include "network_emul.h"
 #include "transport.h"  /* for dprintf() */
 
 
@@ -27,9 +28,61 @@ int _network_send(mysocket_t sd, const void *buf, size_t len)
     assert(sock_ctx && buf);
     ctx = &sock_ctx->network_state;
 
+    if (_network_emulating(&sock_ctx->options.emulation,
+                           sock_ctx->options.emulation_trace))
+        return _network_emulate_send(ctx, &sock_ctx->options.emulation,
+                                     sock_ctx->options.emulation_trace,
+                                     buf, len);
+
     return _network_send_packet(ctx, buf, len);
 }
 
+/* helper function for stcp_network_sendv().  the pieces are passed down to
+ * the network layer as they are, unless the packet is to go through the
+ * emulated link, which keeps a copy of it.  if held_buf isn't NULL, the
+ * last piece lies in it (see stcp_network_send_held()).
+ */
+int _network_sendv(mysocket_t sd, const struct iovec *iov, int iovcnt,
+                   void *held_buf)
+{
+    mysock_context_t *sock_ctx = _mysock_get_context(sd);
+    char packet[MAX_IP_PAYLOAD_LEN];
+    ssize_t len;
+
+    assert(sock_ctx && iov);
+
+    if (!_network_emulating(&sock_ctx->options.emulation,
+                            sock_ctx->options.emulation_trace))
+    {
+        if (held_buf)
+            return _network_send_packet_held(&sock_ctx->network_state,
+                                             iov, iovcnt, held_buf);
+        return _network_send_packetv(&sock_ctx->network_state, iov, iovcnt);
+    }
+
+    if ((len = _network_gather_packet(packet, sizeof(packet),
+                                      iov, iovcnt)) < 0)
+        return -1;
+    return _network_emulate_send(&sock_ctx->network_state,
+                                 &sock_ctx->options.emulation,
+                                 sock_ctx->options.emulation_trace,
+                                 packet, len);
+}
+
+/* send anything held back since the last _network_send() */
+void _network_send_flush(mysocket_t sd)
+{
+    mysock_context_t *sock_ctx = _mysock_get_context(sd);
+
+    assert(sock_ctx);
+    if (_network_emulating(&sock_ctx->options.emulation,
+                           sock_ctx->options.emulation_trace))
+        _network_emulate_flush(&sock_ctx->network_state,
+                               &sock_ctx->options.emulation,
+                               sock_ctx->options.emulation_trace);
+    _network_flush(&sock_ctx->network_state);
+}
+
 /* helper function for stcp_network_recv() */
 int _network_recv(mysocket_t sd, void *dst, size_t max_len)
 {
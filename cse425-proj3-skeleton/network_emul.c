@@ -0,0 +1,655 @@
+/* network_emul.c--emulation of network conditions, applied to packets by
+ * the network layer as they're sent.  this lets congestion signalling and
+ * loss recovery be tried out without a real bottleneck (or router, or bad
+ * network) in the path, and tried again under exactly the same conditions.
+ *
+ * a packet passes through the following, in order:
+ *   - loss, at random or in bursts (a two-state Gilbert model: a burst
+ *     starts with probability burst_loss, and ends with probability
+ *     1/burst_len after each packet).
+ *   - the bottleneck queue, which may drop or mark it.  it drains at a
+ *     fixed rate, or as the link's trace has it: at each time in the
+ *     trace, up to MAX_IP_PAYLOAD_LEN bytes go.
+ *   - duplication.
+ *   - reordering: the packet is held back in the context's copy_buffer,
+ *     and sent after the next packet (or when the transport layer next
+ *     waits for an event, if that comes first).
+ *   - if the link has a delay, a rate or a trace, the delay line: a thread
+ *     that sends each packet once it's been queued for its delay (and
+ *     jitter), and for as long as it took to drain from the bottleneck
+ *     queue.  packets held up on one context stay in order.  while a link
+ *     has a delay, a rate or a trace, all of its packets are sent from
+ *     this thread.
+ *
+ * random choices are made from a sequence seeded with the link's seed and
+ * the ports at either end, so each connection over the link has its own.
+ * the sequence is a counter, hashed (as in splitmix), rather than rand_r(),
+ * whose runs of low values are long enough to cut a connection off.
+ *
+ * times are taken from the transport engine's clock.  if that's a virtual
+ * one (see mysock_engine_sim.c), there's no delay line thread; the engine
+ * sends packets off the line itself with _network_emulate_release(), as
+ * it moves its clock on.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include "mysock_impl.h"
+#include "network_emul.h"
+#include "transport.h"
+#include "tcp_sum.h"
+
+
+/* used if the link isn't given a seed of its own */
+#define EMUL_DEFAULT_SEED 0x632a
+
+#define PPM 1000000
+
+/* a delivery trace.  traces are kept on a list once read, and never
+ * freed, since the options of any number of mysockets may refer to them.
+ */
+struct network_trace
+{
+    char                 *filename;
+    uint64_t             *times;    /* microseconds into the trace */
+    size_t                num_times;
+    struct network_trace *next;
+};
+
+static pthread_mutex_t  trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static network_trace_t *traces;     /* protected by trace_lock */
+
+/* a packet on the delay line */
+typedef struct emul_packet
+{
+    network_context_t  *ctx;
+    uint64_t            release;    /* microseconds */
+    size_t              len;
+    char                data[MAX_IP_PAYLOAD_LEN];
+    struct emul_packet *prev;
+    struct emul_packet *next;
+} emul_packet_t;
+
+/* the delay line, kept in order of release time.  the thread is started
+ * with the first packet to be held up, and runs from then on; it's woken
+ * when a packet goes on the front of the line, and signals when it's sent
+ * one.
+ */
+static pthread_mutex_t    delay_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t     delay_wake = PTHREAD_COND_INITIALIZER;  /* due */
+static pthread_cond_t     delay_idle = PTHREAD_COND_INITIALIZER;  /* sent */
+static emul_packet_t     *delay_head, *delay_tail;
+static network_context_t *delay_sending;    /* whose packet is being sent */
+static bool_t             delay_started;
+
+
+static bool_t _network_emulate_queue(network_context_t        *ctx,
+                                     const mysock_emulation_t *link,
+                                     const network_trace_t    *trace,
+                                     void *packet, size_t len);
+static ssize_t _network_emulate_output(network_context_t        *ctx,
+                                       const mysock_emulation_t *link,
+                                       const network_trace_t    *trace,
+                                       const void *packet, size_t len);
+static network_trace_t *_network_read_trace(const char *filename);
+static uint64_t _network_trace_count(const network_trace_t *trace,
+                                     uint64_t t);
+static uint64_t _network_trace_time(const network_trace_t *trace,
+                                    uint64_t m);
+static bool_t _network_chance(network_context_t *ctx, unsigned long ppm);
+static uint32_t _network_random(network_context_t *ctx);
+static uint32_t _network_mix(uint32_t x);
+static uint64_t _network_usec(const struct timeval *tv);
+static bool_t _network_now(struct timeval *now);
+static void _network_mark_ce(struct tcphdr *hdr);
+static void _network_delay_send(emul_packet_t *p);
+static void *_network_delay_thread_func(void *arg_ptr);
+
+
+/* read a link's delivery trace, or find it if it's been read already */
+const network_trace_t *_network_load_trace(const char *filename)
+{
+    network_trace_t *trace;
+
+    assert(filename);
+
+    PTHREAD_CALL(pthread_mutex_lock(&trace_lock));
+    for (trace = traces; trace; trace = trace->next)
+    {
+        if (!strcmp(trace->filename, filename))
+            break;
+    }
+
+    if (!trace && (trace = _network_read_trace(filename)))
+    {
+        trace->next = traces;
+        traces = trace;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&trace_lock));
+
+    return trace;
+}
+
+/* returns TRUE if the link does anything at all to packets */
+bool_t _network_emulating(const mysock_emulation_t *link,
+                          const network_trace_t    *trace)
+{
+    assert(link);
+    return link->rate > 0 || link->delay > 0 || link->jitter > 0 ||
+           link->loss > 0 || link->burst_loss > 0 ||
+           link->duplicate > 0 || link->reorder > 0 || trace;
+}
+
+/* send a packet over the emulated link */
+ssize_t _network_emulate_send(network_context_t        *ctx,
+                              const mysock_emulation_t *link,
+                              const network_trace_t    *trace,
+                              const void *buf, size_t len)
+{
+    char packet[MAX_IP_PAYLOAD_LEN];
+    ssize_t rc;
+
+    assert(ctx && link && buf);
+    assert(len <= sizeof(packet));
+
+    if (ctx->emul_last_drain.tv_sec == 0)
+    {
+        /* first packet over the link */
+        const struct sockaddr_in *peer =
+            (const struct sockaddr_in *) &ctx->peer_addr;
+        uint32_t seed = link->seed ? link->seed : EMUL_DEFAULT_SEED;
+
+        (void) _network_now(&ctx->emul_last_drain);
+        ctx->emul_trace_start = ctx->emul_last_drain;
+
+        /* the seed and the ports are hashed apart, so that neighbouring
+         * seeds don't just swap sequences between neighbouring ports
+         */
+        ctx->random_seed =
+            _network_mix(seed) ^
+            _network_mix(((uint32_t) ntohs(_network_get_port(ctx)) << 16) |
+                         ntohs(peer->sin_port));
+    }
+
+    /* random and burst losses */
+    if (ctx->emul_in_burst)
+    {
+        if (link->burst_len <= 1 ||
+            _network_chance(ctx, PPM / link->burst_len))
+            ctx->emul_in_burst = FALSE;
+        return len;
+    }
+    if (_network_chance(ctx, link->burst_loss))
+    {
+        ctx->emul_in_burst = (link->burst_len > 1);
+        return len;
+    }
+    if (_network_chance(ctx, link->loss))
+        return len;
+
+    /* the link may mark the packet, so work on a copy */
+    memcpy(packet, buf, len);
+    if (!_network_emulate_queue(ctx, link, trace, packet, len))
+        return len; /* lost on the way */
+
+    if (_network_chance(ctx, link->duplicate) &&
+        _network_emulate_output(ctx, link, trace, packet, len) < 0)
+        return -1;
+
+    if (!ctx->copied && _network_chance(ctx, link->reorder))
+    {
+        memcpy(ctx->copy_buffer, packet, len);
+        ctx->copy_buf_len = len;
+        ctx->copied = TRUE;
+        return len;
+    }
+
+    if ((rc = _network_emulate_output(ctx, link, trace, packet, len)) < 0)
+        return rc;
+
+    _network_emulate_flush(ctx, link, trace);
+    return rc;
+}
+
+/* send the packet held back to be reordered, if there is one */
+void _network_emulate_flush(network_context_t        *ctx,
+                            const mysock_emulation_t *link,
+                            const network_trace_t    *trace)
+{
+    assert(ctx && link);
+
+    if (ctx->copied)
+    {
+        ctx->copied = FALSE;
+        (void) _network_emulate_output(ctx, link, trace,
+                                       ctx->copy_buffer, ctx->copy_buf_len);
+    }
+}
+
+/* wait for the context's packets on the delay line to be sent.  those
+ * are already on their way, like packets on a real link, so they're let go
+ * even if the context has finished with the connection; the last of them
+ * may well be the ACK of the peer's FIN.
+ */
+void _network_emulate_close(network_context_t *ctx)
+{
+    emul_packet_t *p;
+
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&delay_lock));
+    for (;;)
+    {
+        for (p = delay_head; p && p->ctx != ctx; p = p->next)
+            ;
+        if (!p && delay_sending != ctx)
+            break;
+
+        _mysock_engine_wait(NULL, &delay_idle, &delay_lock);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&delay_lock));
+}
+
+/* send the packets on the delay line that are due by the engine's (virtual)
+ * clock, as the delay line thread would
+ */
+bool_t _network_emulate_release(struct timespec *next)
+{
+    struct timeval now;
+    bool_t pending;
+
+    assert(next);
+    (void) _network_now(&now);
+
+    PTHREAD_CALL(pthread_mutex_lock(&delay_lock));
+    while (delay_head && delay_head->release <= _network_usec(&now))
+        _network_delay_send(delay_head);
+
+    if ((pending = (delay_head != NULL)))
+    {
+        next->tv_sec  = delay_head->release / 1000000;
+        next->tv_nsec = (delay_head->release % 1000000) * 1000;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&delay_lock));
+
+    return pending;
+}
+
+
+/* the emulated link is a FIFO queue, draining at link->rate bytes per
+ * second, or as its trace has it.  the queue length is all that's tracked;
+ * it's used to decide whether the packet is dropped, or marked if it would
+ * have had to wait behind more than link->ecn_threshold bytes.  returns
+ * FALSE if the packet is dropped.
+ */
+static bool_t _network_emulate_queue(network_context_t        *ctx,
+                                     const mysock_emulation_t *link,
+                                     const network_trace_t    *trace,
+                                     void *packet, size_t len)
+{
+    struct tcphdr *hdr = (struct tcphdr *) packet;
+    struct timeval now;
+    uint64_t elapsed, drained;
+
+    assert(ctx && link && packet);
+
+    if (link->rate == 0 && !trace)
+        return TRUE;    /* no bottleneck */
+
+    (void) _network_now(&now);
+
+    /* take off what the link has sent since we last looked.  the clock
+     * only moves on once at least a byte has gone, so that nothing is lost
+     * to rounding when packets are sent in quick succession.
+     */
+    if (trace)
+    {
+        uint64_t start = _network_usec(&ctx->emul_trace_start);
+
+        drained = MAX_IP_PAYLOAD_LEN *
+            (_network_trace_count(trace, _network_usec(&now) - start) -
+             _network_trace_count(trace,
+                                  _network_usec(&ctx->emul_last_drain) -
+                                  start));
+    }
+    else
+    {
+        elapsed = _network_usec(&now) - _network_usec(&ctx->emul_last_drain);
+        drained = elapsed * link->rate / 1000000;
+    }
+    if (drained > 0)
+    {
+        ctx->emul_queue_len = (drained >= ctx->emul_queue_len)
+            ? 0 : ctx->emul_queue_len - drained;
+        ctx->emul_last_drain = now;
+    }
+
+    if (link->queue_limit > 0 &&
+        ctx->emul_queue_len + len > link->queue_limit)
+    {
+        return FALSE;   /* tail drop */
+    }
+
+    if (link->ecn_threshold > 0 &&
+        ctx->emul_queue_len > link->ecn_threshold &&
+        len >= sizeof(struct tcphdr) && (hdr->th_x2 & TH_X2_ECT))
+    {
+        _network_mark_ce(hdr);
+    }
+
+    ctx->emul_queue_len += len;
+    return TRUE;
+}
+
+/* pass a packet that's made it over the link on to the network layer,
+ * through the delay line if the link has a delay, a rate or a trace
+ */
+static ssize_t _network_emulate_output(network_context_t        *ctx,
+                                       const mysock_emulation_t *link,
+                                       const network_trace_t    *trace,
+                                       const void *packet, size_t len)
+{
+    emul_packet_t *p, *q;
+    struct timeval now;
+    bool_t virtual_time;
+    uint64_t release;
+
+    assert(ctx && link && packet);
+
+    if (link->delay == 0 && link->jitter == 0 && link->rate == 0 && !trace)
+        return _network_send_packet(ctx, packet, len);
+
+    /* the packet leaves once everything ahead of it in the queue has
+     * drained, and arrives after the delay, but not before the packet
+     * ahead of it
+     */
+    virtual_time = _network_now(&now);
+    if (trace)
+    {
+        /* it goes with the delivery that takes the last of it */
+        uint64_t start = _network_usec(&ctx->emul_trace_start);
+        uint64_t deliveries = MAX(1, (ctx->emul_queue_len +
+                                      MAX_IP_PAYLOAD_LEN - 1) /
+                                     MAX_IP_PAYLOAD_LEN);
+
+        release = start + link->delay +
+            _network_trace_time(trace,
+                                _network_trace_count(trace,
+                                                     _network_usec(&now) -
+                                                     start) + deliveries);
+    }
+    else
+    {
+        release = _network_usec(&now) + link->delay;
+        if (link->rate > 0)
+            release += (uint64_t) ctx->emul_queue_len * 1000000 / link->rate;
+    }
+    if (link->jitter > 0)
+        release += _network_random(ctx) % (link->jitter + 1);
+    if (release < _network_usec(&ctx->emul_last_release))
+        release = _network_usec(&ctx->emul_last_release);
+    ctx->emul_last_release.tv_sec  = release / 1000000;
+    ctx->emul_last_release.tv_usec = release % 1000000;
+
+    p = (emul_packet_t *) malloc(sizeof(*p));
+    assert(p);
+    p->ctx     = ctx;
+    p->release = release;
+    p->len     = len;
+    memcpy(p->data, packet, len);
+
+    PTHREAD_CALL(pthread_mutex_lock(&delay_lock));
+    if (!delay_started && !virtual_time)
+    {
+        (void) _mysock_create_thread(_network_delay_thread_func, NULL, TRUE);
+        delay_started = TRUE;
+    }
+
+    /* packets mostly go at the end, so look for their place from there */
+    for (q = delay_tail; q && q->release > release; q = q->prev)
+        ;
+    p->prev = q;
+    p->next = q ? q->next : delay_head;
+    if (p->next)
+        p->next->prev = p;
+    else
+        delay_tail = p;
+    if (q)
+        q->next = p;
+    else
+    {
+        delay_head = p;
+        PTHREAD_CALL(pthread_cond_signal(&delay_wake));
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&delay_lock));
+
+    return len;
+}
+
+/* read a trace from its file: times in milliseconds, one per line and in
+ * order, the last of them after the start
+ */
+static network_trace_t *_network_read_trace(const char *filename)
+{
+    network_trace_t *trace;
+    size_t max_times = 1024;
+    unsigned long ms;
+    FILE *fp;
+    int rc;
+
+    assert(filename);
+
+    if (!(fp = fopen(filename, "r")))
+        return NULL;
+
+    trace = (network_trace_t *) calloc(1, sizeof(*trace));
+    assert(trace);
+    trace->times = (uint64_t *) malloc(max_times * sizeof(uint64_t));
+    assert(trace->times);
+
+    while ((rc = fscanf(fp, "%lu", &ms)) == 1)
+    {
+        if (trace->num_times > 0 &&
+            ms * 1000 < trace->times[trace->num_times - 1])
+            break;  /* out of order */
+
+        if (trace->num_times == max_times)
+        {
+            max_times *= 2;
+            trace->times = (uint64_t *)
+                realloc(trace->times, max_times * sizeof(uint64_t));
+            assert(trace->times);
+        }
+        trace->times[trace->num_times++] = (uint64_t) ms * 1000;
+    }
+    fclose(fp);
+
+    if (rc != EOF || trace->num_times == 0 ||
+        trace->times[trace->num_times - 1] == 0)
+    {
+        free(trace->times);
+        free(trace);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    trace->filename = strdup(filename);
+    assert(trace->filename);
+    return trace;
+}
+
+/* returns the number of deliveries the trace has up to (and including)
+ * time t, in microseconds since it started.  the trace repeats every
+ * times[num_times - 1] microseconds.
+ */
+static uint64_t _network_trace_count(const network_trace_t *trace,
+                                     uint64_t t)
+{
+    uint64_t period, offset;
+    size_t lo, hi;
+
+    assert(trace && trace->num_times > 0);
+    period = trace->times[trace->num_times - 1];
+    offset = t % period;
+
+    /* find the first delivery after the offset */
+    for (lo = 0, hi = trace->num_times; lo < hi; )
+    {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (trace->times[mid] <= offset)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return (t / period) * trace->num_times + lo;
+}
+
+/* returns the time (in microseconds since the trace started) of the trace's
+ * m'th delivery, counting from 1
+ */
+static uint64_t _network_trace_time(const network_trace_t *trace,
+                                    uint64_t m)
+{
+    assert(trace && trace->num_times > 0 && m > 0);
+    return ((m - 1) / trace->num_times) * trace->times[trace->num_times - 1] +
+           trace->times[(m - 1) % trace->num_times];
+}
+
+/* returns TRUE with the given probability (in parts per million) */
+static bool_t _network_chance(network_context_t *ctx, unsigned long ppm)
+{
+    assert(ctx);
+
+    if (ppm == 0)
+        return FALSE;
+    return (_network_random(ctx) / 4294967296.0) * PPM < ppm;
+}
+
+/* the next number in the context's random sequence */
+static uint32_t _network_random(network_context_t *ctx)
+{
+    assert(ctx);
+
+    ctx->random_seed += 0x9e3779b9U;    /* 2^32 / the golden ratio */
+    return _network_mix(ctx->random_seed);
+}
+
+/* hash a 32-bit value, so that every bit of it affects every bit of the
+ * result (the "lowbias32" integer hash)
+ */
+static uint32_t _network_mix(uint32_t x)
+{
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+static uint64_t _network_usec(const struct timeval *tv)
+{
+    assert(tv);
+    return (uint64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+/* the time by the transport engine's clock; returns TRUE if it's virtual */
+static bool_t _network_now(struct timeval *now)
+{
+    struct timespec ts;
+    bool_t virtual_time;
+
+    assert(now);
+    virtual_time = _mysock_engine_gettime(&ts);
+    now->tv_sec  = ts.tv_sec;
+    now->tv_usec = ts.tv_nsec / 1000;
+    return virtual_time;
+}
+
+/* set the congestion experienced bit in a packet's header, updating its
+ * checksum to match
+ */
+static void _network_mark_ce(struct tcphdr *hdr)
+{
+    /* th_x2 shares a 16-bit word of the header with th_off and th_flags */
+    uint16_t *word = (uint16_t *) ((char *) hdr +
+                                   offsetof(struct tcphdr, th_ack) +
+                                   sizeof(hdr->th_ack));
+    uint16_t old_word = *word;
+
+    if (hdr->th_x2 & TH_X2_CE)
+        return;
+
+    hdr->th_x2 |= TH_X2_CE;
+    hdr->th_sum = _mysock_checksum_adjust(hdr->th_sum, old_word, *word);
+}
+
+/* take the packet at the front of the delay line off it, and send it.
+ * this is called with delay_lock held, which is let go while it's sent.
+ */
+static void _network_delay_send(emul_packet_t *p)
+{
+    assert(p && p == delay_head);
+
+    delay_head = p->next;
+    if (p->next)
+        p->next->prev = NULL;
+    else
+        delay_tail = NULL;
+    delay_sending = p->ctx;
+    PTHREAD_CALL(pthread_mutex_unlock(&delay_lock));
+
+    (void) _network_send_packet(p->ctx, p->data, p->len);
+    _network_flush(p->ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&delay_lock));
+    delay_sending = NULL;
+    PTHREAD_CALL(pthread_cond_broadcast(&delay_idle));
+    free(p);
+}
+
+/* send packets off the delay line as they become due */
+static void *_network_delay_thread_func(void *arg_ptr)
+{
+    struct timeval now;
+    struct timespec due;
+    emul_packet_t *p;
+
+    PTHREAD_CALL(pthread_mutex_lock(&delay_lock));
+    for (;;)
+    {
+        if (!(p = delay_head))
+        {
+            PTHREAD_CALL(pthread_cond_wait(&delay_wake,
+                                           &delay_lock));
+            continue;
+        }
+
+        (void) _network_now(&now);
+        if (p->release > _network_usec(&now))
+        {
+            int rc;
+
+            due.tv_sec  = p->release / 1000000;
+            due.tv_nsec = (p->release % 1000000) * 1000;
+            rc = pthread_cond_timedwait(&delay_wake,
+                                        &delay_lock, &due);
+            assert(rc == 0 || rc == ETIMEDOUT);
+            continue;
+        }
+
+        _network_delay_send(p);
+    }
+
+    /*NOTREACHED*/
+    return NULL;
+}
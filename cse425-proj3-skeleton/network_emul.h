@@ -0,0 +1,50 @@
+/* internal header--emulation of network conditions in the network layer */
+
+#ifndef __NETWORK_EMUL_H__
+#define __NETWORK_EMUL_H__
+
+#include "mysock.h"
+#include "network_io.h"
+
+/* a link's delivery trace, as read from its file (see mysock.h) */
+typedef struct network_trace network_trace_t;
+
+/* read a link's delivery trace.  a trace is kept once it's been read, and
+ * the same one returned for its file from then on.  returns NULL, with
+ * errno set, if the file can't be read or isn't a proper trace.
+ */
+const network_trace_t *_network_load_trace(const char *filename);
+
+/* returns TRUE if the link (with the given trace, if any) does anything
+ * at all to packets
+ */
+bool_t _network_emulating(const mysock_emulation_t *link,
+                          const network_trace_t    *trace);
+
+/* send an outgoing packet over the emulated link, which may drop, mark,
+ * duplicate, reorder or hold it up on the way.  returns len (even if the
+ * link drops the packet), or -1 if it couldn't be sent.
+ */
+ssize_t _network_emulate_send(network_context_t        *ctx,
+                              const mysock_emulation_t *link,
+                              const network_trace_t    *trace,
+                              const void *packet, size_t len);
+
+/* send any packet the link has held back to reorder */
+void _network_emulate_flush(network_context_t        *ctx,
+                            const mysock_emulation_t *link,
+                            const network_trace_t    *trace);
+
+/* for a transport engine with a virtual clock, which has no delay line
+ * thread: send whatever packets on the delay line are due by now.  returns
+ * TRUE, with *next set to when the next of them is due, if any are left.
+ */
+bool_t _network_emulate_release(struct timespec *next);
+
+/* wait for whatever the link is still holding up for the context to be
+ * sent.  this must be done before its network layer is closed.
+ */
+void _network_emulate_close(network_context_t *ctx);
+
+#endif  /* __NETWORK_EMUL_H__ */
+
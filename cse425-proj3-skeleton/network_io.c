@@ -1,6 +1,8 @@
 /* network_io.c:  routines shared amongst all network layer instantiations */
 
 #include <assert.h>
+#include <string.h>
+#include <errno.h>
 #include <netinet/in.h>
 #include "mysock_impl.h"
 #include "network_io.h"
@@ -29,3 +31,27 @@ uint32_t _network_get_local_addr(network_context_t *ctx)
         ((struct sockaddr_in *) &ctx->peer_addr)->sin_addr.s_addr);
 }
 
+
+/* gather a packet's pieces into one buffer */
+ssize_t _network_gather_packet(void *dst, size_t max_len,
+                               const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    int k;
+
+    assert(dst && iov && iovcnt > 0);
+
+    for (k = 0; k < iovcnt; ++k)
+    {
+        if (iov[k].iov_len > max_len - len)
+        {
+            errno = EMSGSIZE;
+            return -1;
+        }
+
+        memcpy((char *) dst + len, iov[k].iov_base, iov[k].iov_len);
+        len += iov[k].iov_len;
+    }
+
+    return len;
+}
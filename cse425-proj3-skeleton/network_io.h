@@ -9,9 +9,12 @@
 #ifdef LINUX
 #include <stdint.h>
 #endif
+#include <sys/time.h>
+#include <sys/uio.h>
 #include "mysock.h"
 
 #define MAX_IP_PAYLOAD_LEN 1500
+#define MAX_PACKET_IOV     16   /* most pieces a packet may be sent in */
 
 
 struct mysock_context;
@@ -30,11 +33,20 @@ typedef struct
     /* additional (opaque) data used by underlying I/O implementation */
     void *impl_data;
 
-    /* packet reordering/duplication simulation */
+    /* packet loss/reordering/duplication simulation (see network_emul.c).
+     * copy_buffer holds a packet that's been held back to be reordered.
+     */
     unsigned int random_seed;
     bool_t       copied;
     char         copy_buffer[MAX_IP_PAYLOAD_LEN];
     size_t       copy_buf_len;
+
+    /* bottleneck link emulation (see network_emul.c) */
+    unsigned long  emul_queue_len;  /* bytes */
+    struct timeval emul_last_drain;
+    bool_t         emul_in_burst;   /* losing every packet */
+    struct timeval emul_last_release;   /* of the last packet held up */
+    struct timeval emul_trace_start;    /* when the link's trace began */
 } network_context_t;
 
 
@@ -65,8 +77,45 @@ uint32_t _network_get_interface_ip(uint32_t peer_addr);
 ssize_t _network_send_packet(network_context_t *ctx,
                              const void *src, size_t len);
 
-/* start/stop per-mysocket network receive thread.  the stop() interface
- * must not return until the network receive thread has exited.
+/* the same, for a packet given as iovcnt (at most MAX_PACKET_IOV) pieces,
+ * e.g. its header, and the payload where it lies.  returns the packet's
+ * length.
+ */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt);
+
+/* the same, where the last piece lies in buf, a block from malloc() that
+ * the network layer may go on referring to after this returns, rather than
+ * copy that piece (e.g. to send it with MSG_ZEROCOPY).  buf isn't changed
+ * by the caller until it's given back with _network_free_buffer().
+ */
+ssize_t _network_send_packet_held(network_context_t *ctx,
+                                  const struct iovec *iov, int iovcnt,
+                                  void *buf);
+
+/* free a block given to _network_send_packet_held(), now or once the network
+ * layer is done with it
+ */
+void _network_free_buffer(network_context_t *ctx, void *buf);
+
+/* copy the pieces of a packet into dst, which has room for max_len bytes,
+ * for network layers that keep their own copy of the packets they send.
+ * returns the packet's length, or -1 (with errno set to EMSGSIZE) if it's
+ * too long.
+ */
+ssize_t _network_gather_packet(void *dst, size_t max_len,
+                               const struct iovec *iov, int iovcnt);
+
+/* send any packets held back by _network_send_packet().  packets the
+ * transport layer sends while handling an event may be held back, so they
+ * can go out together; this is called before it waits for the next event,
+ * and once it's done with the connection.
+ */
+void _network_flush(network_context_t *ctx);
+
+/* start/stop receiving network input for a mysocket (with a receive
+ * thread per mysocket, or a reactor shared by all of them).  the stop()
+ * interface must not return until no more input will be passed on.
  */
 int _network_start_recv_thread(struct mysock_context *ctx);
 void _network_stop_recv_thread(struct mysock_context *ctx);
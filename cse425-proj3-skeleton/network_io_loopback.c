@@ -0,0 +1,414 @@
+/* network_io_loopback.c: in-process instantiation of the underlying
+ * datagram service.
+ *
+ * packets are passed straight from the sending mysocket to its peer's
+ * receive queue, without going through the kernel, so both ends of every
+ * connection must be in the same process.  ports are handed out here
+ * rather than by the kernel, and every address is taken to be this
+ * process's own; connections are told apart by their ports alone.
+ *
+ *   - an active mysocket, and each connection accepted by a listening
+ *     mysocket, is found by its local and peer ports.  an accepted
+ *     connection shares its listening mysocket's port.
+ *   - a packet that isn't for any connection goes to whichever mysocket
+ *     is listening on the port it's sent to (where a SYN sets up a new
+ *     connection).  a SYN for a port nobody's listening on is refused, as
+ *     it would be by the kernel.
+ *   - packets are passed on by the sending thread itself, so there are no
+ *     receive threads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include "mysock_impl.h"
+#include "mysock_hash.h"
+#include "network_io.h"
+#include "connection_demux.h"
+
+
+/* ephemeral ports are allocated from this range */
+#define LOOPBACK_FIRST_EPHEMERAL 32768
+#define LOOPBACK_LAST_EPHEMERAL  60999
+
+/* state for the mysocket; this is pointed to by impl_data in the
+ * network_context_t structure.  everything here but sock_ctx is protected
+ * by loopback_lock.
+ */
+typedef struct
+{
+    mysock_context_t *sock_ctx;
+    uint16_t          port;         /* local port (host byte order) */
+    bool_t            bound;        /* port is ours, rather than shared */
+    bool_t            connected;    /* in conn_table */
+    bool_t            receiving;    /* packets may be passed to it */
+    int               busy;         /* packets being passed to it */
+} network_context_loopback_t;
+
+/* (local port, peer port) -> connection */
+#define LOOPBACK_CONN_KEY(local, peer) \
+    (((uint32_t) (local) << 16) | (uint32_t) (peer))
+
+HASH_TABLE_DECLARE(port_table, uint16_t, mysock_context_t *, 256);
+HASH_TABLE_DECLARE(conn_table, uint32_t, mysock_context_t *,
+                   MAX_NUM_CONNECTIONS);
+
+static pthread_mutex_t loopback_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  loopback_idle = PTHREAD_COND_INITIALIZER;   /* busy
+                                                                    * went
+                                                                    * to 0
+                                                                    */
+static uint16_t next_ephemeral = LOOPBACK_FIRST_EPHEMERAL;
+
+
+static uint16_t loopback_peer_port(const network_context_t *ctx);
+
+
+int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    network_context_loopback_t *lo_ctx;
+
+    assert(sock_ctx && net_ctx);
+    assert(!net_ctx->impl_data);
+
+    lo_ctx = (network_context_loopback_t *)
+        calloc(1, sizeof(network_context_loopback_t));
+    assert(lo_ctx);
+
+    lo_ctx->sock_ctx = sock_ctx;
+    net_ctx->impl_data = lo_ctx;
+    return 0;
+}
+
+void _network_close(network_context_t *ctx)
+{
+    network_context_loopback_t *lo_ctx;
+
+    assert(ctx);
+    lo_ctx = (network_context_loopback_t *) ctx->impl_data;
+    assert(lo_ctx);
+    assert(!lo_ctx->connected && !lo_ctx->receiving && !lo_ctx->busy);
+
+    PTHREAD_CALL(pthread_mutex_lock(&loopback_lock));
+    if (lo_ctx->bound)
+    {
+        assert(HASH_LOOKUP_PTR(port_table, lo_ctx->port) ==
+               lo_ctx->sock_ctx);
+        HASH_DELETE(port_table, lo_ctx->port);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&loopback_lock));
+
+    free(lo_ctx);
+    ctx->impl_data = NULL;
+}
+
+/* claim the given local port, or an unused one if it's zero.  the
+ * address itself doesn't matter.
+ */
+int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
+{
+    network_context_loopback_t *lo_ctx;
+    struct sockaddr_in *sin = (struct sockaddr_in *) addr;
+    uint16_t port;
+    int k;
+
+    assert(ctx && addr);
+    lo_ctx = (network_context_loopback_t *) ctx->impl_data;
+    assert(lo_ctx && !lo_ctx->bound);
+
+    if (addrlen < (int) sizeof(struct sockaddr_in) ||
+        addr->sa_family != AF_INET)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&loopback_lock));
+    if ((port = ntohs(sin->sin_port)) == 0)
+    {
+        for (k = 0; k <= LOOPBACK_LAST_EPHEMERAL - LOOPBACK_FIRST_EPHEMERAL;
+             ++k)
+        {
+            uint16_t candidate = next_ephemeral;
+
+            if (++next_ephemeral > LOOPBACK_LAST_EPHEMERAL)
+                next_ephemeral = LOOPBACK_FIRST_EPHEMERAL;
+            if (!HASH_LOOKUP_PTR(port_table, candidate))
+            {
+                port = candidate;
+                break;
+            }
+        }
+    }
+
+    if (port == 0 || HASH_LOOKUP_PTR(port_table, port))
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&loopback_lock));
+        errno = EADDRINUSE;
+        return -1;
+    }
+
+    HASH_INSERT(port_table, port, lo_ctx->sock_ctx);
+    lo_ctx->port  = port;
+    lo_ctx->bound = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&loopback_lock));
+
+    return 0;
+}
+
+/* there's nothing to do; connection requests are passed to the listening
+ * mysocket once it starts receiving
+ */
+int _network_listen(network_context_t *ctx, int backlog)
+{
+    assert(ctx && ctx->impl_data);
+    return 0;
+}
+
+/* returns the local port, in network byte order */
+int _network_get_port(network_context_t *ctx)
+{
+    network_context_loopback_t *lo_ctx;
+    uint16_t port;
+
+    assert(ctx);
+    lo_ctx = (network_context_loopback_t *) ctx->impl_data;
+    assert(lo_ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&loopback_lock));
+    port = lo_ctx->port;
+    PTHREAD_CALL(pthread_mutex_unlock(&loopback_lock));
+
+    return htons(port);
+}
+
+/* every address is our own, so packets to the peer are sent from the same
+ * address they're sent to
+ */
+uint32_t _network_get_interface_ip(uint32_t peer_addr)
+{
+    return (peer_addr != htonl(INADDR_ANY)) ? peer_addr
+                                            : htonl(INADDR_LOOPBACK);
+}
+
+/* the new mysocket shares the listening mysocket's port, and gets the
+ * packets sent to that port from its peer
+ */
+void _network_update_passive_state(network_context_t *new_ctx,
+                                   network_context_t *accept_ctx,
+                                   void *user_data,
+                                   const void *syn_packet, size_t syn_len)
+{
+    network_context_loopback_t *new_lo_ctx, *accept_lo_ctx;
+    uint32_t key;
+
+    assert(new_ctx && accept_ctx && syn_packet);
+    assert(!user_data);
+    assert(new_ctx->peer_addr_valid);
+
+    new_lo_ctx = (network_context_loopback_t *) new_ctx->impl_data;
+    accept_lo_ctx = (network_context_loopback_t *) accept_ctx->impl_data;
+    assert(new_lo_ctx && accept_lo_ctx);
+    assert(!new_lo_ctx->bound && accept_lo_ctx->bound);
+
+    PTHREAD_CALL(pthread_mutex_lock(&loopback_lock));
+    new_lo_ctx->port = accept_lo_ctx->port;
+
+    key = LOOPBACK_CONN_KEY(new_lo_ctx->port, loopback_peer_port(new_ctx));
+    assert(!HASH_LOOKUP_PTR(conn_table, key));
+    HASH_INSERT(conn_table, key, new_lo_ctx->sock_ctx);
+    new_lo_ctx->connected = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&loopback_lock));
+}
+
+/* start passing packets on to the mysocket.  an active mysocket is
+ * entered in the connection table here, before it sends its SYN.
+ */
+int _network_start_recv_thread(mysock_context_t *ctx)
+{
+    network_context_loopback_t *lo_ctx;
+    network_context_t *net_ctx;
+    int rc = 0;
+
+    assert(ctx);
+    net_ctx = &ctx->network_state;
+    lo_ctx = (network_context_loopback_t *) net_ctx->impl_data;
+    assert(lo_ctx && lo_ctx->port != 0);
+
+    PTHREAD_CALL(pthread_mutex_lock(&loopback_lock));
+    if (ctx->is_active && !lo_ctx->connected)
+    {
+        uint32_t key;
+
+        assert(net_ctx->peer_addr_valid);
+        key = LOOPBACK_CONN_KEY(lo_ctx->port, loopback_peer_port(net_ctx));
+        if (HASH_LOOKUP_PTR(conn_table, key))
+        {
+            errno = EADDRINUSE;
+            rc = -1;
+        }
+        else
+        {
+            HASH_INSERT(conn_table, key, ctx);
+            lo_ctx->connected = TRUE;
+        }
+    }
+    lo_ctx->receiving = (rc == 0);
+    PTHREAD_CALL(pthread_mutex_unlock(&loopback_lock));
+
+    return rc;
+}
+
+/* block until no more packets will be passed on to the mysocket */
+void _network_stop_recv_thread(mysock_context_t *ctx)
+{
+    network_context_loopback_t *lo_ctx;
+    network_context_t *net_ctx;
+
+    assert(ctx);
+    net_ctx = &ctx->network_state;
+    lo_ctx = (network_context_loopback_t *) net_ctx->impl_data;
+    assert(lo_ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&loopback_lock));
+    if (lo_ctx->connected)
+    {
+        HASH_DELETE(conn_table,
+                    LOOPBACK_CONN_KEY(lo_ctx->port,
+                                      loopback_peer_port(net_ctx)));
+        lo_ctx->connected = FALSE;
+    }
+    lo_ctx->receiving = FALSE;
+
+    while (lo_ctx->busy > 0)
+        PTHREAD_CALL(pthread_cond_wait(&loopback_idle, &loopback_lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&loopback_lock));
+}
+
+/* pass the given packet on to the peer */
+ssize_t _network_send_packet(network_context_t *ctx,
+                             const void *src, size_t len)
+{
+    network_context_loopback_t *lo_ctx, *peer_lo_ctx;
+    mysock_context_t *peer;
+    struct sockaddr_in from;
+    uint16_t peer_port;
+
+    assert(ctx && src);
+    assert(ctx->peer_addr_valid);
+    assert(ctx->peer_addr.sa_family == AF_INET);
+
+    lo_ctx = (network_context_loopback_t *) ctx->impl_data;
+    assert(lo_ctx);
+
+    if (len > MAX_IP_PAYLOAD_LEN)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&loopback_lock));
+    peer_port = loopback_peer_port(ctx);
+    if (!(peer = HASH_LOOKUP_PTR(conn_table,
+                                 LOOPBACK_CONN_KEY(peer_port, lo_ctx->port))))
+    {
+        /* nothing from us yet; is anyone listening? */
+        if ((peer = HASH_LOOKUP_PTR(port_table, peer_port)) != NULL &&
+            !peer->listening)
+            peer = NULL;
+    }
+
+    peer_lo_ctx = peer ? (network_context_loopback_t *)
+                         peer->network_state.impl_data : NULL;
+    if (!peer_lo_ctx || !peer_lo_ctx->receiving)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&loopback_lock));
+
+        if (len >= sizeof(struct tcphdr) &&
+            (((const struct tcphdr *) src)->th_flags & (TH_SYN | TH_ACK)) ==
+            TH_SYN)
+        {
+            /* connection refused; signal an error to the transport layer */
+            _mysock_enqueue_buffer(lo_ctx->sock_ctx,
+                                   &lo_ctx->sock_ctx->network_recv_queue,
+                                   NULL, 0);
+        }
+        return len;     /* otherwise, lost on the way */
+    }
+
+    peer_lo_ctx->busy++;
+    PTHREAD_CALL(pthread_mutex_unlock(&loopback_lock));
+
+    if (peer->listening)
+    {
+        /* the peer sees this address as ours */
+        memset(&from, 0, sizeof(from));
+        from.sin_family      = AF_INET;
+        from.sin_port        = htons(lo_ctx->port);
+        from.sin_addr.s_addr = _network_get_local_addr(ctx);
+
+        _mysock_enqueue_connection(peer, src, len,
+                                   (const struct sockaddr *) &from,
+                                   sizeof(from), NULL);
+    }
+    else
+    {
+        _mysock_enqueue_buffer(peer, &peer->network_recv_queue, src, len);
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&loopback_lock));
+    if (--peer_lo_ctx->busy == 0)
+        PTHREAD_CALL(pthread_cond_broadcast(&loopback_idle));
+    PTHREAD_CALL(pthread_mutex_unlock(&loopback_lock));
+
+    return len;
+}
+
+/* the peer is given a copy of each packet, so one given in pieces is simply
+ * gathered up first
+ */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
+{
+    char packet[MAX_IP_PAYLOAD_LEN];
+    ssize_t len;
+
+    assert(ctx && iov);
+
+    if ((len = _network_gather_packet(packet, sizeof(packet),
+                                      iov, iovcnt)) < 0)
+        return -1;
+    return _network_send_packet(ctx, packet, len);
+}
+
+/* nothing is referred to once it's been sent, so held buffers are just
+ * sent as any others, and may be freed straight away
+ */
+ssize_t _network_send_packet_held(network_context_t *ctx,
+                                  const struct iovec *iov, int iovcnt,
+                                  void *buf)
+{
+    return _network_send_packetv(ctx, iov, iovcnt);
+}
+
+void _network_free_buffer(network_context_t *ctx, void *buf)
+{
+    free(buf);
+}
+
+/* packets are passed on as they're sent, so nothing is ever held back */
+void _network_flush(network_context_t *ctx)
+{
+}
+
+
+/* the peer's port (host byte order) */
+static uint16_t loopback_peer_port(const network_context_t *ctx)
+{
+    assert(ctx && ctx->peer_addr.sa_family == AF_INET);
+    return ntohs(((const struct sockaddr_in *) &ctx->peer_addr)->sin_port);
+}
@@ -0,0 +1,1137 @@
+/* network_io_mux.c: TCP instantiation of the underlying datagram service,
+ * with many connections multiplexed over each TCP connection.
+ *
+ * network_io_tcp.c makes a TCP connection (and uses a descriptor) for
+ * every mysocket, so each STCP connection costs a kernel handshake before
+ * its SYN can even be sent.  here, connections to the same peer share a
+ * long-lived TCP connection, or carrier, instead:
+ *
+ *   - a carrier is made to a listening mysocket's port the first time a
+ *     connection is made to it, and kept open afterwards for those that
+ *     follow; up to MUX_CARRIERS_PER_PEER of them are made to each peer,
+ *     and connections are spread over them by local port.
+ *   - packets are framed as with network_io_tcp.c (a two byte length,
+ *     then the packet), and told apart by the ports in their STCP headers:
+ *     a packet goes to whichever connection on its carrier has those
+ *     ports.  on a carrier a listening mysocket accepted, the rest go to
+ *     that mysocket (where a SYN sets up a new connection, see
+ *     _network_update_passive_state()).
+ *   - so a port only has to tell apart the connections on a carrier; the
+ *     ports connections are made from are handed out here, rather than by
+ *     the kernel, and have no sockets of their own.  only a listening
+ *     mysocket (or one bound to a particular port) has a socket, which is
+ *     bound to its port so peers can make carriers to it.
+ *   - each carrier has a receive thread, serving every connection on it,
+ *     and a listening mysocket has a thread that accepts carriers.
+ *   - should a carrier fail, every connection on it is told, as with a
+ *     TCP RST.
+ *
+ * network_io_recv.c isn't used with this.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include "mysock_impl.h"
+#include "mysock_hash.h"
+#include "network_io.h"
+#include "network_io_socket.h"
+#include "connection_demux.h"
+
+
+/* <netinet/tcp.h> can't be included alongside transport.h's tcphdr */
+#ifndef TCP_NODELAY
+#define TCP_NODELAY 1
+#endif
+
+/* carriers made to each peer; connections are shared out amongst them */
+#ifndef MUX_CARRIERS_PER_PEER
+#define MUX_CARRIERS_PER_PEER 1
+#endif
+
+/* ephemeral ports are allocated from this range */
+#define MUX_FIRST_EPHEMERAL 32768
+#define MUX_LAST_EPHEMERAL  60999
+
+/* a TCP connection carrying packets for any number of mysockets.  this is
+ * held by each mysocket using it, and by itself for as long as it's up;
+ * once it's gone down and the last of these is done with it, its receive
+ * thread closes it.  everything but the descriptor and receive buffer is
+ * protected by mux_lock.
+ */
+typedef struct mux_carrier
+{
+    socket_t           fd;
+    int                refs;
+    bool_t             connecting;  /* not yet connected (active side) */
+    bool_t             down;
+    struct sockaddr_in peer;        /* the other end, and our own */
+    struct sockaddr_in local;
+
+    bool_t             in_table;    /* in peer_table, under key */
+    unsigned int       slot;
+
+    mysock_context_t  *listener;    /* gets packets for no connection (if
+                                     * it was accepted by a listening
+                                     * mysocket)
+                                     */
+    struct network_context_mux *conns;  /* connections on it */
+    struct mux_carrier *prev, *next;    /* in mux_carriers */
+
+    pthread_mutex_t    send_lock;   /* so frames aren't interleaved */
+
+    /* frames read but not yet passed on; only the receive thread uses
+     * these
+     */
+    char               recv_buf[TCP_RECV_BUF_LEN];
+    size_t             recv_start;
+    size_t             recv_end;
+} mux_carrier_t;
+
+/* state for the mysocket; this is pointed to by impl_data in the
+ * network_context_t structure.  everything here but sock_ctx and the
+ * sockets is protected by mux_lock.
+ */
+typedef struct network_context_mux
+{
+    mysock_context_t *sock_ctx;
+    uint16_t          port;         /* local port (host byte order) */
+    bool_t            ephemeral;    /* port is in port_table */
+    socket_t          listen_socket;    /* bound to port, if it isn't
+                                         * ephemeral
+                                         */
+
+    pthread_t         accept_thread;    /* if listening */
+    bool_t            accepting;
+    int               exit_fd;      /* eventfd, readable once the accept
+                                     * thread should exit
+                                     */
+
+    mux_carrier_t    *carrier;      /* once connected (or accepted) */
+    bool_t            mapped;       /* in conn_table, and carrier's list */
+    int               busy;         /* packets being passed to it */
+    struct network_context_mux *prev, *next;    /* on carrier */
+} network_context_mux_t;
+
+/* key for finding a connection from the packets on its carrier */
+typedef struct
+{
+    const mux_carrier_t *carrier;
+    uint16_t             local_port;    /* host byte order */
+    uint16_t             peer_port;
+} mux_conn_key_t;
+
+/* key for finding a carrier to a peer */
+typedef struct
+{
+    uint32_t     addr;              /* peer's address and port */
+    uint16_t     port;
+    unsigned int slot;
+} mux_peer_key_t;
+
+static INLINE bool_t mux_conn_equal(mux_conn_key_t a, mux_conn_key_t b)
+{
+    return a.carrier == b.carrier && a.local_port == b.local_port &&
+           a.peer_port == b.peer_port;
+}
+
+static INLINE unsigned int mux_conn_hash(mux_conn_key_t key,
+                                         unsigned int size)
+{
+    return ((((unsigned long) key.carrier >> 4) * 2654435761U) ^
+            ((unsigned int) key.local_port << 16) ^ key.peer_port) % size;
+}
+
+static INLINE bool_t mux_peer_equal(mux_peer_key_t a, mux_peer_key_t b)
+{
+    return a.addr == b.addr && a.port == b.port && a.slot == b.slot;
+}
+
+static INLINE unsigned int mux_peer_hash(mux_peer_key_t key,
+                                         unsigned int size)
+{
+    return ((key.addr * 2654435761U) ^ key.port ^ key.slot) % size;
+}
+
+HASH_TABLE_DECLARE(port_table, uint16_t, mysock_context_t *, 256);
+HASH_TABLE_DECLARE_EXTENDED(conn_table, mux_conn_key_t, mysock_context_t *,
+                            mux_conn_hash, mux_conn_equal,
+                            MAX_NUM_CONNECTIONS);
+HASH_TABLE_DECLARE_EXTENDED(peer_table, mux_peer_key_t, mux_carrier_t *,
+                            mux_peer_hash, mux_peer_equal, 64);
+
+/* protects the tables, carriers and mysocket state above.  mux_idle is
+ * signalled when a packet has been passed on, a carrier connected, or a
+ * reference to a carrier dropped.
+ */
+static pthread_mutex_t mux_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  mux_idle = PTHREAD_COND_INITIALIZER;
+static mux_carrier_t *mux_carriers;     /* every carrier */
+static uint16_t next_ephemeral;
+
+
+static uint16_t mux_peer_port(const network_context_t *ctx);
+static mux_peer_key_t mux_peer_key(const struct sockaddr_in *peer,
+                                   unsigned int slot);
+static mux_conn_key_t mux_conn_key(const mux_carrier_t *carrier,
+                                   uint16_t local_port, uint16_t peer_port);
+static void mux_map(network_context_mux_t *mux_ctx, mux_carrier_t *carrier,
+                    uint16_t peer_port);
+static mux_carrier_t *mux_new_carrier(socket_t fd);
+static void mux_free_carrier(mux_carrier_t *carrier);
+static int mux_start_carrier(mux_carrier_t *carrier);
+static mux_carrier_t *mux_get_carrier(const struct sockaddr_in *peer,
+                                      unsigned int slot);
+static void mux_release(mux_carrier_t *carrier);
+static void *mux_accept_thread_func(void *arg_ptr);
+static void *mux_recv_thread_func(void *arg_ptr);
+static void mux_deliver(mux_carrier_t *carrier,
+                        const void *packet, size_t len);
+static void mux_carrier_down(mux_carrier_t *carrier);
+static int mux_writev(socket_t fd, struct iovec *iov, int iovcnt);
+
+
+int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    network_context_mux_t *mux_ctx;
+
+    assert(sock_ctx && net_ctx);
+    assert(!net_ctx->impl_data);
+
+    memset(net_ctx, 0, sizeof(*net_ctx));
+    net_ctx->random_seed = 0x632a;
+
+    mux_ctx = (network_context_mux_t *) calloc(1, sizeof(*mux_ctx));
+    assert(mux_ctx);
+
+    mux_ctx->sock_ctx      = sock_ctx;
+    mux_ctx->listen_socket = -1;
+    mux_ctx->exit_fd       = -1;
+    net_ctx->impl_data = mux_ctx;
+    return 0;
+}
+
+void _network_close(network_context_t *ctx)
+{
+    network_context_mux_t *mux_ctx;
+
+    assert(ctx);
+    mux_ctx = (network_context_mux_t *) ctx->impl_data;
+    assert(mux_ctx);
+    assert(!mux_ctx->mapped && !mux_ctx->busy && !mux_ctx->accepting);
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    if (mux_ctx->ephemeral)
+    {
+        assert(HASH_LOOKUP_PTR(port_table, mux_ctx->port) ==
+               mux_ctx->sock_ctx);
+        HASH_DELETE(port_table, mux_ctx->port);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+
+    if (mux_ctx->carrier)
+        mux_release(mux_ctx->carrier);
+
+    if (mux_ctx->listen_socket >= 0)
+    {
+        DEBUG_LOG(("mux network layer, closing socket %d\n",
+                   (int) mux_ctx->listen_socket));
+        closesocket(mux_ctx->listen_socket);
+    }
+    if (mux_ctx->exit_fd >= 0)
+        close(mux_ctx->exit_fd);
+
+    free(mux_ctx);
+    ctx->impl_data = NULL;
+}
+
+/* claim the given local port, or an unused one if it's zero.  a port
+ * that's asked for is bound in the kernel, so it can be listened on; an
+ * ephemeral one is only ours, until it's listened on.
+ */
+int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
+{
+    network_context_mux_t *mux_ctx;
+    struct sockaddr_in *sin = (struct sockaddr_in *) addr;
+    uint16_t port;
+    int k;
+
+    assert(ctx && addr);
+    mux_ctx = (network_context_mux_t *) ctx->impl_data;
+    assert(mux_ctx && !mux_ctx->port);
+
+    if (addrlen < (int) sizeof(struct sockaddr_in) ||
+        addr->sa_family != AF_INET)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((port = ntohs(sin->sin_port)) != 0)
+    {
+        socket_t sd;
+
+        if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            return -1;
+        if (bind(sd, addr, addrlen) < 0)
+        {
+            int bind_errno = errno;
+
+            closesocket(sd);
+            errno = bind_errno;
+            return -1;
+        }
+
+        mux_ctx->listen_socket = sd;
+        PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+        mux_ctx->port = port;
+        PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+        return 0;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    if (next_ephemeral == 0)
+    {
+        /* start somewhere different in each process, so a peer doesn't
+         * see every process on a host connect from the same ports
+         */
+        next_ephemeral = MUX_FIRST_EPHEMERAL +
+            getpid() % (MUX_LAST_EPHEMERAL - MUX_FIRST_EPHEMERAL + 1);
+    }
+
+    for (k = 0; k <= MUX_LAST_EPHEMERAL - MUX_FIRST_EPHEMERAL && !port; ++k)
+    {
+        uint16_t candidate = next_ephemeral;
+
+        if (++next_ephemeral > MUX_LAST_EPHEMERAL)
+            next_ephemeral = MUX_FIRST_EPHEMERAL;
+        if (!HASH_LOOKUP_PTR(port_table, candidate))
+            port = candidate;
+    }
+
+    if (port == 0)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+        errno = EADDRINUSE;
+        return -1;
+    }
+
+    HASH_INSERT(port_table, port, mux_ctx->sock_ctx);
+    mux_ctx->port      = port;
+    mux_ctx->ephemeral = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+
+    return 0;
+}
+
+/* listen for carriers on the mysocket's port.  a mysocket bound to an
+ * ephemeral port trades it for one from the kernel here.
+ */
+int _network_listen(network_context_t *ctx, int backlog)
+{
+    network_context_mux_t *mux_ctx;
+
+    assert(ctx);
+    mux_ctx = (network_context_mux_t *) ctx->impl_data;
+    assert(mux_ctx && mux_ctx->port);
+
+    if (mux_ctx->listen_socket < 0)
+    {
+        struct sockaddr_in sin;
+        socklen_t sin_len = sizeof(sin);
+        socket_t sd;
+
+        memset(&sin, 0, sizeof(sin));
+        sin.sin_family      = AF_INET;
+        sin.sin_addr.s_addr = ((struct sockaddr_in *)
+                               &ctx->local_addr)->sin_addr.s_addr;
+
+        if ((sd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            return -1;
+        if (bind(sd, (struct sockaddr *) &sin, sizeof(sin)) < 0 ||
+            getsockname(sd, (struct sockaddr *) &sin, &sin_len) < 0)
+        {
+            int bind_errno = errno;
+
+            closesocket(sd);
+            errno = bind_errno;
+            return -1;
+        }
+
+        mux_ctx->listen_socket = sd;
+        PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+        assert(mux_ctx->ephemeral);
+        HASH_DELETE(port_table, mux_ctx->port);
+        mux_ctx->ephemeral = FALSE;
+        mux_ctx->port      = ntohs(sin.sin_port);
+        PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+    }
+
+    return listen(mux_ctx->listen_socket, backlog);
+}
+
+/* returns the local port, in network byte order */
+int _network_get_port(network_context_t *ctx)
+{
+    network_context_mux_t *mux_ctx;
+    uint16_t port;
+
+    assert(ctx);
+    mux_ctx = (network_context_mux_t *) ctx->impl_data;
+    assert(mux_ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    port = mux_ctx->port;
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+
+    return htons(port);
+}
+
+/* packets to the peer are sent from whichever address a carrier to it was
+ * made from (or accepted on), so both ends agree on the addresses in the
+ * checksum, even on a multi-homed host
+ */
+uint32_t _network_get_interface_ip(uint32_t peer_addr)
+{
+    mux_carrier_t *carrier;
+    uint32_t addr = (peer_addr != htonl(INADDR_ANY)) ? peer_addr
+                                                     : htonl(INADDR_LOOPBACK);
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    for (carrier = mux_carriers; carrier; carrier = carrier->next)
+    {
+        if (!carrier->connecting &&
+            carrier->peer.sin_addr.s_addr == peer_addr)
+        {
+            addr = carrier->local.sin_addr.s_addr;
+            break;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+
+    return addr;
+}
+
+/* the new mysocket shares the listening mysocket's port, and gets the
+ * packets from its peer on the carrier the SYN arrived on (user_data)
+ */
+void _network_update_passive_state(network_context_t *new_ctx,
+                                   network_context_t *accept_ctx,
+                                   void *user_data,
+                                   const void *syn_packet, size_t syn_len)
+{
+    network_context_mux_t *new_mux_ctx, *accept_mux_ctx;
+    mux_carrier_t *carrier = (mux_carrier_t *) user_data;
+
+    assert(new_ctx && accept_ctx && syn_packet && carrier);
+    assert(new_ctx->peer_addr_valid);
+
+    new_mux_ctx = (network_context_mux_t *) new_ctx->impl_data;
+    accept_mux_ctx = (network_context_mux_t *) accept_ctx->impl_data;
+    assert(new_mux_ctx && accept_mux_ctx);
+    assert(!new_mux_ctx->sock_ctx->listening);
+    assert(!new_mux_ctx->sock_ctx->is_active);
+    assert(!new_mux_ctx->port && !new_mux_ctx->carrier);
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    new_mux_ctx->port = accept_mux_ctx->port;
+    carrier->refs++;
+    mux_map(new_mux_ctx, carrier, mux_peer_port(new_ctx));
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+}
+
+/* start receiving for the mysocket.  a listening mysocket starts accepting
+ * carriers; an active one finds a carrier to its peer (making one if
+ * there isn't one yet), and is entered in the connection table before it
+ * sends its SYN.
+ */
+int _network_start_recv_thread(mysock_context_t *ctx)
+{
+    network_context_mux_t *mux_ctx;
+    network_context_t *net_ctx;
+    mux_carrier_t *carrier;
+    int rc = 0;
+
+    assert(ctx);
+    net_ctx = &ctx->network_state;
+    mux_ctx = (network_context_mux_t *) net_ctx->impl_data;
+    assert(mux_ctx && mux_ctx->port);
+
+    if (ctx->listening)
+    {
+        assert(mux_ctx->listen_socket >= 0 && !mux_ctx->accepting);
+
+        if ((mux_ctx->exit_fd = eventfd(0, 0)) < 0)
+        {
+            perror("eventfd");
+            return -1;
+        }
+
+        mux_ctx->accepting = TRUE;
+        mux_ctx->accept_thread =
+            _mysock_create_thread(mux_accept_thread_func, ctx, FALSE);
+        return 0;
+    }
+
+    if (mux_ctx->carrier)
+    {
+        /* an accepted connection, already on its carrier */
+        assert(!ctx->is_active && mux_ctx->mapped);
+        return 0;
+    }
+
+    assert(ctx->is_active);
+    assert(net_ctx->peer_addr_valid);
+    assert(net_ctx->peer_addr.sa_family == AF_INET);
+
+    if (!(carrier = mux_get_carrier((struct sockaddr_in *) &net_ctx->peer_addr,
+                                    mux_ctx->port % MUX_CARRIERS_PER_PEER)))
+    {
+        /* connection refused; signal an error to the transport layer */
+        _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue, NULL, 0);
+        return 0;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    if (HASH_LOOKUP_PTR(conn_table,
+                        mux_conn_key(carrier, mux_ctx->port,
+                                     mux_peer_port(net_ctx))))
+    {
+        errno = EADDRINUSE;
+        rc = -1;
+    }
+    else
+    {
+        mux_map(mux_ctx, carrier, mux_peer_port(net_ctx));
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+
+    if (rc < 0)
+        mux_release(carrier);
+    else
+        mux_ctx->carrier = carrier;
+    return rc;
+}
+
+/* block until no more packets will be passed on to the mysocket */
+void _network_stop_recv_thread(mysock_context_t *ctx)
+{
+    network_context_mux_t *mux_ctx;
+    mux_carrier_t *carrier;
+
+    assert(ctx);
+    mux_ctx = (network_context_mux_t *) ctx->network_state.impl_data;
+    assert(mux_ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    if (mux_ctx->mapped)
+    {
+        carrier = mux_ctx->carrier;
+        assert(carrier);
+
+        HASH_DELETE(conn_table,
+                    mux_conn_key(carrier, mux_ctx->port,
+                                 mux_peer_port(&ctx->network_state)));
+        if (mux_ctx->prev)
+            mux_ctx->prev->next = mux_ctx->next;
+        else
+            carrier->conns = mux_ctx->next;
+        if (mux_ctx->next)
+            mux_ctx->next->prev = mux_ctx->prev;
+        mux_ctx->mapped = FALSE;
+    }
+
+    /* the carriers it accepted go on carrying its connections */
+    for (carrier = mux_carriers; carrier; carrier = carrier->next)
+    {
+        if (carrier->listener == ctx)
+            carrier->listener = NULL;
+    }
+
+    while (mux_ctx->busy > 0)
+        PTHREAD_CALL(pthread_cond_wait(&mux_idle, &mux_lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+
+    if (mux_ctx->accepting)
+    {
+        uint64_t one = 1;
+
+        if (write(mux_ctx->exit_fd, &one, sizeof(one)) != sizeof(one))
+        {
+            assert(0);
+            abort();
+        }
+        PTHREAD_CALL(pthread_join(mux_ctx->accept_thread, NULL));
+        mux_ctx->accepting = FALSE;
+    }
+}
+
+/* send the given packet to the peer */
+ssize_t _network_send_packet(network_context_t *ctx,
+                             const void *src, size_t len)
+{
+    struct iovec iov;
+
+    assert(ctx && src);
+
+    iov.iov_base = (void *) src;
+    iov.iov_len  = len;
+    return _network_send_packetv(ctx, &iov, 1);
+}
+
+/* send a packet given in pieces to the peer, framed as a whole on its
+ * carrier (see network_io_tcp.c).  the carrier is held for the frame, so
+ * frames from different connections don't end up interleaved.
+ */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
+{
+    network_context_mux_t *mux_ctx;
+    struct iovec frame[1 + MAX_PACKET_IOV];
+    uint16_t packet_len;    /* network byte order */
+    mux_carrier_t *carrier;
+    size_t len;
+    int k, rc;
+
+    assert(ctx && iov);
+    assert(iovcnt > 0 && iovcnt <= MAX_PACKET_IOV);
+    assert(ctx->peer_addr_len > 0);
+
+    mux_ctx = (network_context_mux_t *) ctx->impl_data;
+    assert(mux_ctx);
+    DEBUG_PEER(ctx);
+
+    for (len = 0, k = 0; k < iovcnt; ++k)
+    {
+        frame[1 + k] = iov[k];
+        len += iov[k].iov_len;
+    }
+
+    if (len > MAX_IP_PAYLOAD_LEN)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (!(carrier = mux_ctx->carrier))
+        return len;     /* refused; lost on the way */
+
+    packet_len = htons(len);
+    frame[0].iov_base = &packet_len;
+    frame[0].iov_len  = sizeof(packet_len);
+
+    PTHREAD_CALL(pthread_mutex_lock(&carrier->send_lock));
+    rc = mux_writev(carrier->fd, frame, 1 + iovcnt);
+    PTHREAD_CALL(pthread_mutex_unlock(&carrier->send_lock));
+
+    return (rc < 0) ? -1 : (ssize_t) len;
+}
+
+/* nothing is referred to once it's been sent, so held buffers are just
+ * sent as any others, and may be freed straight away
+ */
+ssize_t _network_send_packet_held(network_context_t *ctx,
+                                  const struct iovec *iov, int iovcnt,
+                                  void *buf)
+{
+    return _network_send_packetv(ctx, iov, iovcnt);
+}
+
+void _network_free_buffer(network_context_t *ctx, void *buf)
+{
+    free(buf);
+}
+
+/* packets are written as they're sent, so nothing is ever held back */
+void _network_flush(network_context_t *ctx)
+{
+}
+
+
+/* the peer's port (host byte order) */
+static uint16_t mux_peer_port(const network_context_t *ctx)
+{
+    assert(ctx && ctx->peer_addr.sa_family == AF_INET);
+    return ntohs(((const struct sockaddr_in *) &ctx->peer_addr)->sin_port);
+}
+
+static mux_peer_key_t mux_peer_key(const struct sockaddr_in *peer,
+                                   unsigned int slot)
+{
+    mux_peer_key_t key;
+
+    assert(peer);
+
+    memset(&key, 0, sizeof(key));
+    key.addr = peer->sin_addr.s_addr;
+    key.port = peer->sin_port;
+    key.slot = slot;
+    return key;
+}
+
+static mux_conn_key_t mux_conn_key(const mux_carrier_t *carrier,
+                                   uint16_t local_port, uint16_t peer_port)
+{
+    mux_conn_key_t key;
+
+    assert(carrier);
+
+    memset(&key, 0, sizeof(key));
+    key.carrier    = carrier;
+    key.local_port = local_port;
+    key.peer_port  = peer_port;
+    return key;
+}
+
+/* enter a connection in the connection table, and on its carrier's list
+ * (with mux_lock held).  the caller has taken a reference to the carrier
+ * for it.
+ */
+static void mux_map(network_context_mux_t *mux_ctx, mux_carrier_t *carrier,
+                    uint16_t peer_port)
+{
+    mux_conn_key_t key;
+
+    assert(mux_ctx && carrier && !mux_ctx->mapped);
+
+    key = mux_conn_key(carrier, mux_ctx->port, peer_port);
+    assert(!HASH_LOOKUP_PTR(conn_table, key));
+    HASH_INSERT(conn_table, key, mux_ctx->sock_ctx);
+
+    mux_ctx->carrier = carrier;
+    mux_ctx->prev    = NULL;
+    mux_ctx->next    = carrier->conns;
+    if (carrier->conns)
+        carrier->conns->prev = mux_ctx;
+    carrier->conns  = mux_ctx;
+    mux_ctx->mapped = TRUE;
+}
+
+/* a new carrier, holding a reference to itself (with mux_lock held) */
+static mux_carrier_t *mux_new_carrier(socket_t fd)
+{
+    mux_carrier_t *carrier;
+
+    carrier = (mux_carrier_t *) calloc(1, sizeof(mux_carrier_t));
+    assert(carrier);
+
+    carrier->fd   = fd;
+    carrier->refs = 1;
+    PTHREAD_CALL(pthread_mutex_init(&carrier->send_lock, NULL));
+
+    carrier->next = mux_carriers;
+    if (mux_carriers)
+        mux_carriers->prev = carrier;
+    mux_carriers = carrier;
+    return carrier;
+}
+
+/* close a carrier nobody has a reference to any more (with mux_lock
+ * held)
+ */
+static void mux_free_carrier(mux_carrier_t *carrier)
+{
+    assert(carrier && !carrier->in_table && !carrier->conns);
+
+    if (carrier->prev)
+        carrier->prev->next = carrier->next;
+    else
+        mux_carriers = carrier->next;
+    if (carrier->next)
+        carrier->next->prev = carrier->prev;
+
+    DEBUG_LOG(("mux network layer, closing carrier %d\n", (int) carrier->fd));
+    closesocket(carrier->fd);
+    PTHREAD_CALL(pthread_mutex_destroy(&carrier->send_lock));
+    free(carrier);
+}
+
+/* find out the ends of a carrier that's just been connected or accepted,
+ * and start its receive thread (with mux_lock held).  frames from
+ * different connections have nothing to do with each other, so none is
+ * held up waiting for another's ACK.
+ */
+static int mux_start_carrier(mux_carrier_t *carrier)
+{
+    socklen_t peer_len = sizeof(carrier->peer);
+    socklen_t local_len = sizeof(carrier->local);
+    int one = 1;
+
+    assert(carrier && carrier->fd >= 0);
+
+    if (getpeername(carrier->fd, (struct sockaddr *) &carrier->peer,
+                    &peer_len) < 0 ||
+        getsockname(carrier->fd, (struct sockaddr *) &carrier->local,
+                    &local_len) < 0)
+        return -1;
+
+    (void) setsockopt(carrier->fd, IPPROTO_TCP, TCP_NODELAY,
+                      &one, sizeof(one));
+
+    (void) _mysock_create_thread(mux_recv_thread_func, carrier, TRUE);
+    return 0;
+}
+
+/* take a reference to a carrier to the given peer, making one if there
+ * isn't one yet.  returns NULL if the peer can't be connected to.
+ */
+static mux_carrier_t *mux_get_carrier(const struct sockaddr_in *peer,
+                                      unsigned int slot)
+{
+    mux_peer_key_t key = mux_peer_key(peer, slot);
+    mux_carrier_t *carrier;
+    socket_t fd;
+    int rc = -1;
+
+    assert(peer);
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    while ((carrier = HASH_LOOKUP_PTR(peer_table, key)) != NULL)
+    {
+        if (!carrier->connecting)
+        {
+            carrier->refs++;
+            PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+            return carrier;
+        }
+
+        /* someone else is making it; see how they got on */
+        PTHREAD_CALL(pthread_cond_wait(&mux_idle, &mux_lock));
+    }
+
+    if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        perror("socket (network_io_mux)");
+        PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+        return NULL;
+    }
+
+    carrier = mux_new_carrier(fd);
+    carrier->connecting = TRUE;
+    carrier->in_table   = TRUE;
+    carrier->slot       = slot;
+    HASH_INSERT(peer_table, key, carrier);
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+
+    DEBUG_LOG(("mux network layer, connecting carrier %d...\n", (int) fd));
+    if (connect(fd, (const struct sockaddr *) peer, sizeof(*peer)) < 0)
+        perror("connect (network_io_mux)");
+    else
+        rc = 0;
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    carrier->connecting = FALSE;
+    if (rc == 0)
+        rc = mux_start_carrier(carrier);
+
+    if (rc < 0)
+    {
+        /* nobody else has a reference to it, so it can go straight away */
+        HASH_DELETE(peer_table, key);
+        carrier->in_table = FALSE;
+        mux_free_carrier(carrier);
+        carrier = NULL;
+    }
+    else
+    {
+        carrier->refs++;
+    }
+    PTHREAD_CALL(pthread_cond_broadcast(&mux_idle));
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+
+    return carrier;
+}
+
+/* a mysocket is done with a carrier.  (the carrier holds a reference to
+ * itself while it's up, so it's only once it's gone down that the last
+ * of these leaves its receive thread to close it.)
+ */
+static void mux_release(mux_carrier_t *carrier)
+{
+    assert(carrier);
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    assert(carrier->refs > 0);
+    if (--carrier->refs == 0)
+        PTHREAD_CALL(pthread_cond_broadcast(&mux_idle));
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+}
+
+/* the accept thread for a listening mysocket.  this accepts carriers from
+ * its peers, whose packets are passed on to it (or the connections it
+ * accepts from them), until it's closed.
+ */
+static void *mux_accept_thread_func(void *arg_ptr)
+{
+    mysock_context_t *ctx = (mysock_context_t *) arg_ptr;
+    network_context_mux_t *mux_ctx;
+
+    assert(ctx);
+    mux_ctx = (network_context_mux_t *) ctx->network_state.impl_data;
+    assert(mux_ctx);
+
+    DEBUG_LOG(("started mux accept thread\n"));
+    for (;;)
+    {
+        struct pollfd fds[] =
+        {
+            { mux_ctx->exit_fd, POLLIN, 0 },
+            { mux_ctx->listen_socket, POLLIN, 0 }
+        };
+        mux_carrier_t *carrier;
+        socket_t fd;
+
+        if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) < 0)
+        {
+            assert(errno == EINTR);
+            continue;
+        }
+
+        if (fds[0].revents)
+            break;
+        if (!fds[1].revents)
+            continue;
+
+        if ((fd = accept(mux_ctx->listen_socket, NULL, NULL)) < 0)
+        {
+            if (errno != EINTR && errno != EAGAIN && errno != ECONNABORTED)
+                perror("accept (network_io_mux)");
+            continue;
+        }
+
+        PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+        carrier = mux_new_carrier(fd);
+        carrier->listener = ctx;
+        if (mux_start_carrier(carrier) < 0)
+        {
+            /* there's no thread to close it, so it's closed here */
+            mux_free_carrier(carrier);
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+    }
+
+    return NULL;
+}
+
+/* the receive thread for a carrier.  this reads frames into the carrier's
+ * receive buffer as many at a time as will fit, passing each on to
+ * whichever mysocket it's for, until the carrier goes down.
+ */
+static void *mux_recv_thread_func(void *arg_ptr)
+{
+    mux_carrier_t *carrier = (mux_carrier_t *) arg_ptr;
+
+    assert(carrier);
+    DEBUG_LOG(("started mux receive thread for carrier %d\n",
+               (int) carrier->fd));
+
+    for (;;)
+    {
+        char *buf = carrier->recv_buf;
+        uint16_t packet_len;
+        ssize_t rc;
+
+        /* make room after whatever's left of a partial frame */
+        if (carrier->recv_start > 0)
+        {
+            memmove(buf, buf + carrier->recv_start,
+                    carrier->recv_end - carrier->recv_start);
+            carrier->recv_end  -= carrier->recv_start;
+            carrier->recv_start = 0;
+        }
+
+        assert(carrier->recv_end < sizeof(carrier->recv_buf));
+        if ((rc = recv(carrier->fd, buf + carrier->recv_end,
+                       sizeof(carrier->recv_buf) - carrier->recv_end,
+                       0)) < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+        {
+            DEBUG_LOG(("mux carrier %d went down: %d\n",
+                       (int) carrier->fd, (int) rc));
+            break;
+        }
+        carrier->recv_end += rc;
+
+        while (carrier->recv_end - carrier->recv_start >= sizeof(packet_len))
+        {
+            const char *frame = buf + carrier->recv_start;
+
+            memcpy(&packet_len, frame, sizeof(packet_len));
+            packet_len = ntohs(packet_len);
+            if (packet_len > MAX_IP_PAYLOAD_LEN)
+                break;
+            if (carrier->recv_end - carrier->recv_start <
+                sizeof(packet_len) + packet_len)
+                break;
+
+            mux_deliver(carrier, frame + sizeof(packet_len), packet_len);
+            carrier->recv_start += sizeof(packet_len) + packet_len;
+        }
+
+        if (carrier->recv_end - carrier->recv_start >= sizeof(packet_len) &&
+            packet_len > MAX_IP_PAYLOAD_LEN)
+        {
+            /* no packet is that long, so the frames are out of step */
+            DEBUG_LOG(("mux carrier %d: bad frame length %u\n",
+                       (int) carrier->fd, (unsigned) packet_len));
+            break;
+        }
+    }
+
+    mux_carrier_down(carrier);
+    return NULL;
+}
+
+/* pass a packet from a carrier on to the mysocket it's for: the connection
+ * on the carrier with its ports, or else the listening mysocket that
+ * accepted the carrier.  anything else is dropped.
+ */
+static void mux_deliver(mux_carrier_t *carrier,
+                        const void *packet, size_t len)
+{
+    const struct tcphdr *header = (const struct tcphdr *) packet;
+    network_context_mux_t *mux_ctx;
+    mysock_context_t *ctx;
+
+    assert(carrier && packet);
+
+    if (len < sizeof(struct tcphdr))
+        return;
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    if (!(ctx = HASH_LOOKUP_PTR(conn_table,
+                                mux_conn_key(carrier,
+                                             ntohs(header->th_dport),
+                                             ntohs(header->th_sport)))))
+        ctx = carrier->listener;
+
+    if (!ctx)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+        return;
+    }
+
+    mux_ctx = (network_context_mux_t *) ctx->network_state.impl_data;
+    assert(mux_ctx);
+    if (ctx->listening && ntohs(header->th_dport) != mux_ctx->port)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+        return;
+    }
+    mux_ctx->busy++;
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+
+    if (ctx->listening)
+    {
+        struct sockaddr_in from = carrier->peer;
+
+        /* if it's a SYN, this sets up a new connection on the carrier */
+        from.sin_port = header->th_sport;
+        _mysock_enqueue_connection(ctx, packet, len,
+                                   (const struct sockaddr *) &from,
+                                   sizeof(from), carrier);
+    }
+    else
+    {
+        _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue, packet, len);
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    if (--mux_ctx->busy == 0)
+        PTHREAD_CALL(pthread_cond_broadcast(&mux_idle));
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+}
+
+/* a carrier's gone down.  every connection on it is told, and no new ones
+ * are made on it; once the last of them is done with it, it's closed.
+ */
+static void mux_carrier_down(mux_carrier_t *carrier)
+{
+    network_context_mux_t *conns[MAX_NUM_CONNECTIONS];
+    network_context_mux_t *mux_ctx;
+    int num_conns = 0, k;
+
+    assert(carrier);
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    carrier->down     = TRUE;
+    carrier->listener = NULL;
+    if (carrier->in_table)
+    {
+        HASH_DELETE(peer_table, mux_peer_key(&carrier->peer, carrier->slot));
+        carrier->in_table = FALSE;
+    }
+
+    for (mux_ctx = carrier->conns; mux_ctx; mux_ctx = mux_ctx->next)
+    {
+        assert(num_conns < MAX_NUM_CONNECTIONS);
+        mux_ctx->busy++;
+        conns[num_conns++] = mux_ctx;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+
+    /* signal an error to each connection's transport layer */
+    for (k = 0; k < num_conns; ++k)
+    {
+        mysock_context_t *ctx = conns[k]->sock_ctx;
+
+        _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue, NULL, 0);
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&mux_lock));
+    for (k = 0; k < num_conns; ++k)
+        --conns[k]->busy;
+    PTHREAD_CALL(pthread_cond_broadcast(&mux_idle));
+
+    assert(carrier->refs > 0);
+    --carrier->refs;
+    while (carrier->refs > 0)
+        PTHREAD_CALL(pthread_cond_wait(&mux_idle, &mux_lock));
+
+    mux_free_carrier(carrier);
+    PTHREAD_CALL(pthread_mutex_unlock(&mux_lock));
+}
+
+/* write out all of the given pieces, which are used up along the way */
+static int mux_writev(socket_t fd, struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+
+    assert(iov && iovcnt > 0);
+
+    while (iovcnt > 0)
+    {
+        ssize_t rc;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = iov;
+        msg.msg_iovlen = iovcnt;
+        if ((rc = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+        {
+            DEBUG_LOG(("mux_writev rc: %d\n", (int) rc));
+            return -1;
+        }
+
+        /* skip over whatever was written, should it fall short */
+        for (; iovcnt > 0 && (size_t) rc >= iov->iov_len; ++iov, --iovcnt)
+            rc -= iov->iov_len;
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+
+    return 0;
+}
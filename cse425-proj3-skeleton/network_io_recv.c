@@ -0,0 +1,519 @@
+/* network_io_recv.c--receiving network input for socket-based network
+ * layers that hand out one packet at a time with _network_recv_packet()
+ * (see network_io_tcp.c).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <assert.h>
+#ifdef LINUX
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "network_io_socket.h"
+#include "connection_demux.h"
+
+
+#define EXIT_PIPE_READ_INDEX  0
+#define EXIT_PIPE_WRITE_INDEX 1
+
+/* number of receive reactor threads; 0 for one per online CPU */
+#ifndef NETWORK_RECV_THREADS
+#define NETWORK_RECV_THREADS 0
+#endif
+
+#define NETWORK_MAX_RECV_THREADS 64
+
+/* events fetched by a reactor thread at a time */
+#define NETWORK_RECV_EVENTS 16
+
+
+static bool_t network_recv_input(mysock_context_t *ctx,
+                                 void *packet_buf, size_t buf_len);
+
+#ifdef LINUX
+/* the receive reactor.  rather than a thread per mysocket, waiting for
+ * input on its socket, a few threads wait for input on all the sockets at
+ * once with epoll.  each socket is registered with EPOLLONESHOT, so only
+ * one thread reads from it at a time; it's rearmed once that thread has
+ * passed the packet on.  events carry the mysocket descriptor and a
+ * registration ID, so those for a socket that has since been stopped are
+ * ignored.
+ *
+ * the threads are started with the first socket, and stopped (through
+ * an eventfd) when the last one is; pool_lock serialises the two.
+ */
+#define REACTOR_KEY(sd, id) (((uint64_t) (id) << 32) | (uint32_t) (sd))
+#define REACTOR_EXIT_KEY    (~(uint64_t) 0)
+
+static struct
+{
+    pthread_mutex_t   pool_lock;
+    pthread_mutex_t   lock;         /* protects everything below */
+    pthread_cond_t    idle;         /* signalled when a read finishes */
+    int               epoll_fd;
+    int               exit_fd;      /* readable once the threads should exit */
+    pthread_t         threads[NETWORK_MAX_RECV_THREADS];
+    int               num_threads;  /* 0 if the reactor isn't running */
+    int               num_sockets;
+    unsigned int      next_id;
+    mysock_context_t *sockets[MAX_NUM_CONNECTIONS];  /* by mysocket */
+} reactor;
+
+static pthread_once_t reactor_once = PTHREAD_ONCE_INIT;
+
+static void reactor_init(void);
+static int reactor_add(mysock_context_t *ctx);
+static void reactor_remove(mysock_context_t *ctx);
+static int reactor_start(void);
+static void reactor_stop(void);
+static void *reactor_thread_func(void *arg_ptr);
+static void reactor_dispatch(uint64_t key, void *packet_buf, size_t buf_len);
+#else
+static void *network_recv_thread_func(void *arg_ptr);
+#endif
+
+int _network_start_recv_thread(mysock_context_t *ctx)
+{
+    network_context_socket_t *net_ctx =
+        (network_context_socket_t *) ctx->network_state.impl_data;
+
+    assert(net_ctx);
+
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    {
+        perror("signal(SIGPIPE)");
+        assert(0);
+        return -1;
+    }
+
+#ifdef LINUX
+    return reactor_add(ctx);
+#else
+    net_ctx->recv_thread = _mysock_create_thread(network_recv_thread_func,
+                                                 ctx, FALSE);
+    net_ctx->recv_thread_started = TRUE;
+    return 0;
+#endif
+}
+
+/* block until no more network input will be passed on for the mysocket */
+void _network_stop_recv_thread(mysock_context_t *ctx)
+{
+    network_context_socket_t *net_ctx =
+        (network_context_socket_t *) ctx->network_state.impl_data;
+
+    DEBUG_LOG(("stopping receive thread\n"));
+    assert(net_ctx);
+
+#ifdef LINUX
+    reactor_remove(ctx);
+#else
+    if (net_ctx->recv_thread_started)
+    {
+        char dummy = 'X';
+        if (write(net_ctx->exit_pipe[EXIT_PIPE_WRITE_INDEX],
+                  &dummy, sizeof(dummy)) < 0)
+        {
+            assert(0);
+            abort();
+        }
+
+
+        PTHREAD_CALL(pthread_join(net_ctx->recv_thread, NULL));
+        net_ctx->recv_thread_started = FALSE;
+    }
+#endif
+    DEBUG_LOG(("stopped receive thread\n"));
+}
+
+/* read a packet from the mysocket's network connection, and pass it on,
+ * along with any others the network layer has already read with it.
+ * returns FALSE if there's nothing more to be read from the connection.
+ */
+static bool_t network_recv_input(mysock_context_t *ctx,
+                                 void *packet_buf, size_t buf_len)
+{
+    ssize_t bytes_read;
+
+    assert(ctx && packet_buf);
+
+    do
+    {
+        /* the socket has been reported readable, so this doesn't block
+         * (except, without epoll, to read a new connection's SYN).
+         */
+        if ((bytes_read = _network_recv_packet(&ctx->network_state,
+                                               packet_buf, buf_len)) <= 0)
+        {
+            if (bytes_read < 0 && errno == EAGAIN)
+                return TRUE;    /* nothing (more) there after all */
+
+            DEBUG_LOG(("_network_recv_packet interrupted, errno=%d\n",
+                       errno));
+            //signal an error to the transport layer
+            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue, NULL, 0);
+            return FALSE;
+        }
+
+        assert(bytes_read <= (int)buf_len);
+        if (ctx->listening)
+        {
+            /* if the socket was accepting new connections, incoming
+             * packets need to be demultiplexed and dispatched to the
+             * appropriate mysocket context.
+             */
+            _mysock_enqueue_connection(ctx, packet_buf, bytes_read,
+                                       &ctx->network_state.peer_addr,
+                                       ctx->network_state.peer_addr_len,
+                                       NULL);
+            break;
+        }
+
+        /* enqueue the packet directly for this context */
+        _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue,
+                               packet_buf, bytes_read);
+    } while (_network_recv_pending(&ctx->network_state));
+
+    return TRUE;
+}
+
+#ifdef LINUX
+static void reactor_init(void)
+{
+    PTHREAD_CALL(pthread_mutex_init(&reactor.pool_lock, NULL));
+    PTHREAD_CALL(pthread_mutex_init(&reactor.lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&reactor.idle, NULL));
+    reactor.epoll_fd = reactor.exit_fd = -1;
+}
+
+/* start watching the mysocket's network connection for input */
+static int reactor_add(mysock_context_t *ctx)
+{
+    network_context_socket_t *net_ctx =
+        (network_context_socket_t *) ctx->network_state.impl_data;
+    struct epoll_event event;
+    int rc = 0;
+
+    assert(net_ctx);
+    assert(ctx->my_sd >= 0 && ctx->my_sd < MAX_NUM_CONNECTIONS);
+    PTHREAD_CALL(pthread_once(&reactor_once, reactor_init));
+
+    PTHREAD_CALL(pthread_mutex_lock(&reactor.pool_lock));
+    if (!reactor.num_threads && reactor_start() < 0)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&reactor.pool_lock));
+        return -1;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&reactor.lock));
+    assert(!reactor.sockets[ctx->my_sd]);
+    net_ctx->recv_id = ++reactor.next_id;
+    net_ctx->recv_busy = FALSE;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.u64 = REACTOR_KEY(ctx->my_sd, net_ctx->recv_id);
+    if (epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD,
+                  GET_POLL_SOCKET(net_ctx), &event) < 0)
+    {
+        perror("epoll_ctl");
+        assert(0);
+        rc = -1;
+    }
+    else
+    {
+        reactor.sockets[ctx->my_sd] = ctx;
+        reactor.num_sockets++;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&reactor.lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&reactor.pool_lock));
+
+    return rc;
+}
+
+/* stop watching the mysocket's network connection, waiting for any read
+ * in progress to finish
+ */
+static void reactor_remove(mysock_context_t *ctx)
+{
+    network_context_socket_t *net_ctx =
+        (network_context_socket_t *) ctx->network_state.impl_data;
+    bool_t last;
+
+    assert(net_ctx);
+    PTHREAD_CALL(pthread_once(&reactor_once, reactor_init));
+
+    PTHREAD_CALL(pthread_mutex_lock(&reactor.lock));
+    if (reactor.sockets[ctx->my_sd] != ctx)
+    {
+        /* input was never started */
+        PTHREAD_CALL(pthread_mutex_unlock(&reactor.lock));
+        return;
+    }
+
+    while (net_ctx->recv_busy)
+        PTHREAD_CALL(pthread_cond_wait(&reactor.idle, &reactor.lock));
+
+    (void) epoll_ctl(reactor.epoll_fd, EPOLL_CTL_DEL,
+                     GET_POLL_SOCKET(net_ctx), NULL);
+    reactor.sockets[ctx->my_sd] = NULL;
+    last = (--reactor.num_sockets == 0);
+    PTHREAD_CALL(pthread_mutex_unlock(&reactor.lock));
+
+    if (last)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&reactor.pool_lock));
+        PTHREAD_CALL(pthread_mutex_lock(&reactor.lock));
+        last = (reactor.num_sockets == 0 && reactor.num_threads > 0);
+        PTHREAD_CALL(pthread_mutex_unlock(&reactor.lock));
+        if (last)
+            reactor_stop();
+        PTHREAD_CALL(pthread_mutex_unlock(&reactor.pool_lock));
+    }
+}
+
+/* create the epoll instance, and start the reactor threads.  pool_lock
+ * must be held.
+ */
+static int reactor_start(void)
+{
+    struct epoll_event event;
+    int num_threads, k;
+
+    assert(!reactor.num_threads);
+
+    if ((reactor.epoll_fd = epoll_create(MAX_NUM_CONNECTIONS)) < 0)
+    {
+        perror("epoll_create");
+        assert(0);
+        return -1;
+    }
+
+    if ((reactor.exit_fd = eventfd(0, 0)) < 0)
+    {
+        perror("eventfd");
+        assert(0);
+        close(reactor.epoll_fd);
+        reactor.epoll_fd = -1;
+        return -1;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u64 = REACTOR_EXIT_KEY;
+    if (epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD,
+                  reactor.exit_fd, &event) < 0)
+    {
+        perror("epoll_ctl");
+        assert(0);
+        close(reactor.exit_fd);
+        close(reactor.epoll_fd);
+        reactor.epoll_fd = reactor.exit_fd = -1;
+        return -1;
+    }
+
+    num_threads = NETWORK_RECV_THREADS;
+    if (num_threads <= 0)
+        num_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    num_threads = MIN(MAX(num_threads, 1), NETWORK_MAX_RECV_THREADS);
+
+    for (k = 0; k < num_threads; ++k)
+    {
+        reactor.threads[k] = _mysock_create_thread(reactor_thread_func,
+                                                   NULL, FALSE);
+    }
+    reactor.num_threads = num_threads;
+    return 0;
+}
+
+/* stop the reactor threads once there are no sockets left.  pool_lock
+ * must be held.
+ */
+static void reactor_stop(void)
+{
+    uint64_t one = 1;
+    int k;
+
+    assert(reactor.num_threads > 0 && !reactor.num_sockets);
+
+    /* the eventfd stays readable, so every thread sees it */
+    if (write(reactor.exit_fd, &one, sizeof(one)) != sizeof(one))
+    {
+        assert(0);
+        abort();
+    }
+
+    for (k = 0; k < reactor.num_threads; ++k)
+        PTHREAD_CALL(pthread_join(reactor.threads[k], NULL));
+    reactor.num_threads = 0;
+
+    close(reactor.exit_fd);
+    close(reactor.epoll_fd);
+    reactor.epoll_fd = reactor.exit_fd = -1;
+}
+
+/* process network input.
+ * this just loops around, waiting for data to arrive on any of the
+ * sockets, and buffering it for later consumption by network_recv().
+ * (outgoing data is sent immediately via network_send(), and so does not
+ * require its own thread).
+ */
+static void *reactor_thread_func(void *arg_ptr)
+{
+    char packet_buf[MAX_IP_PAYLOAD_LEN];
+    struct epoll_event events[NETWORK_RECV_EVENTS];
+
+    DEBUG_LOG(("started receive reactor thread\n"));
+
+    for (;;)
+    {
+        int num_events, k;
+
+        if ((num_events = epoll_wait(reactor.epoll_fd, events,
+                                     NETWORK_RECV_EVENTS, -1)) < 0)
+        {
+            assert(errno == EINTR);
+            continue;
+        }
+
+        for (k = 0; k < num_events; ++k)
+        {
+            /* any other events are for sockets that have been stopped */
+            if (events[k].data.u64 == REACTOR_EXIT_KEY)
+                return NULL;
+
+            reactor_dispatch(events[k].data.u64,
+                             packet_buf, sizeof(packet_buf));
+        }
+    }
+
+    /*NOTREACHED*/
+    return NULL;
+}
+
+/* read from the socket an event was reported for, then rearm it */
+static void reactor_dispatch(uint64_t key, void *packet_buf, size_t buf_len)
+{
+    mysocket_t sd = (mysocket_t) (key & 0xffffffff);
+    unsigned int id = (unsigned int) (key >> 32);
+    network_context_socket_t *net_ctx;
+    mysock_context_t *ctx;
+    bool_t more;
+
+    assert(sd >= 0 && sd < MAX_NUM_CONNECTIONS);
+
+    PTHREAD_CALL(pthread_mutex_lock(&reactor.lock));
+    if (!(ctx = reactor.sockets[sd]) ||
+        ((network_context_socket_t *)
+         ctx->network_state.impl_data)->recv_id != id)
+    {
+        /* stale */
+        PTHREAD_CALL(pthread_mutex_unlock(&reactor.lock));
+        return;
+    }
+
+    net_ctx = (network_context_socket_t *) ctx->network_state.impl_data;
+    assert(!net_ctx->recv_busy);
+    net_ctx->recv_busy = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&reactor.lock));
+
+    more = network_recv_input(ctx, packet_buf, buf_len);
+
+    PTHREAD_CALL(pthread_mutex_lock(&reactor.lock));
+    net_ctx->recv_busy = FALSE;
+    if (more)
+    {
+        struct epoll_event event;
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.u64 = key;
+        if (epoll_ctl(reactor.epoll_fd, EPOLL_CTL_MOD,
+                      GET_POLL_SOCKET(net_ctx), &event) < 0)
+        {
+            perror("epoll_ctl");
+            assert(0);
+        }
+    }
+    PTHREAD_CALL(pthread_cond_broadcast(&reactor.idle));
+    PTHREAD_CALL(pthread_mutex_unlock(&reactor.lock));
+}
+
+#else   /* !LINUX */
+
+/* process network input.
+ * this just loops around, waiting for data to arrive, and buffering it
+ * for later consumption by network_recv().  (outgoing data is sent
+ * immediately via network_send(), and so does not require its own thread).
+ * 
+ * this runs in its own thread, mostly because the transport layer needs to
+ * wait with a timeout for incoming data from the peer.  [usual mechanisms
+ * for I/O with timeouts such as poll(), select(), or asynchronous I/O
+ * don't work with all underlying I/O mechanisms we might support (e.g.
+ * VNS).  so we implement the timeout in a more generic (I/O-independent)
+ * manner using the pthreads API instead].
+ */
+static void *network_recv_thread_func(void *arg_ptr)
+{
+    char packet_buf[MAX_IP_PAYLOAD_LEN];
+    mysock_context_t *ctx;
+    network_context_socket_t *net_ctx;
+
+    DEBUG_LOG(("started receive thread\n"));
+    ctx = (mysock_context_t *) arg_ptr;
+    assert(ctx);
+
+    net_ctx = (network_context_socket_t *) ctx->network_state.impl_data;
+    assert(net_ctx);
+
+    for (;;)
+    {
+        bool_t packet_ready = FALSE;
+        bool_t done = FALSE;
+        struct pollfd fds[] =
+        {
+            { net_ctx->exit_pipe[EXIT_PIPE_READ_INDEX], POLLIN, 0 },
+            { GET_POLL_SOCKET(net_ctx), POLLIN, 0 }
+        };
+
+
+        while (!packet_ready && !done)
+        {
+            switch (poll(fds, sizeof(fds) / sizeof(fds[0]), -1))
+            {
+            case -1:
+                assert(errno == EINTR);
+                break;
+
+            case 0:
+                assert(0);
+                break;
+
+            default:
+                assert(!(fds[0].revents & POLLERR));
+                assert(!(fds[1].revents & POLLERR));
+
+                if (fds[0].revents)
+                    done = TRUE;
+                if (fds[1].revents)
+                    packet_ready = TRUE;
+                break;
+            }
+        }
+
+        if (done ||
+            !network_recv_input(ctx, packet_buf, sizeof(packet_buf)))
+            break;
+    }
+
+    return NULL;
+}
+#endif  /* LINUX */
@@ -0,0 +1,925 @@
+/* network_io_shm.c: shared memory instantiation of the underlying datagram
+ * service, for connections between processes on the same host.
+ *
+ * each connection has a region of shared memory (a memfd, mapped by both
+ * processes) holding two single-producer/single-consumer rings of packets,
+ * one for each direction.  a packet is copied into a ring by the sender
+ * and straight out of it into the receiver's queue, without passing
+ * through the kernel.  each ring has an eventfd to wake up its consumer,
+ * written by the producer only when the ring goes from empty to non-empty.
+ *
+ *   - a port is claimed by binding a Unix domain socket with a name (in
+ *     the abstract namespace) made from it.  a listening mysocket listens
+ *     on that socket.
+ *   - an active mysocket sets up the region and eventfds, connects to the
+ *     listening mysocket's socket, and passes them over it (SCM_RIGHTS),
+ *     along with the address it sends from.  the connected socket is then
+ *     only kept to tell when the peer goes away, as a TCP connection
+ *     would.
+ *   - each connection has a receive thread, waiting on its eventfd.  until
+ *     a connection is accepted, packets on it go to the listening mysocket
+ *     (where a SYN sets up a new connection, taking over the connection).
+ *   - as with loopback, every address is taken to be this host's own, so
+ *     packets are sent from whatever address they're sent to.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <stddef.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "connection_demux.h"
+
+
+#define SHM_RING_SLOTS   256    /* packets a ring holds */
+#define SHM_NAME_FORMAT  "stcp-shm-%u"  /* abstract socket for a port */
+
+/* ephemeral ports are chosen from this range */
+#define SHM_FIRST_EPHEMERAL 32768
+#define SHM_LAST_EPHEMERAL  60999
+
+/* a ring of packets in shared memory.  head is only written by the
+ * consumer, and tail by the producer; they're kept on separate cache
+ * lines.
+ */
+typedef struct
+{
+    volatile uint32_t head;     /* next slot to be read */
+    char              pad1[60];
+    volatile uint32_t tail;     /* next slot to be written */
+    char              pad2[60];
+
+    struct
+    {
+        uint16_t len;
+        char     data[MAX_IP_PAYLOAD_LEN];
+    } slots[SHM_RING_SLOTS];
+} shm_ring_t;
+
+/* the shared region: ring[0] carries packets from the active side, and
+ * ring[1] those to it
+ */
+typedef struct
+{
+    shm_ring_t ring[2];
+} shm_region_t;
+
+/* sent by the active side when it connects, with the region's memfd and
+ * the rings' eventfds
+ */
+typedef struct
+{
+    struct sockaddr_in from;    /* the active side's address, as it sees it */
+} shm_hello_t;
+
+/* a connection, in one of the two processes */
+typedef struct shm_conn
+{
+    int                sock;        /* connected to the peer process */
+    int                recv_fd;     /* eventfd: our ring has packets */
+    int                send_fd;     /* eventfd: the peer's has packets */
+    int                exit_fd;     /* eventfd: the receive thread should
+                                     * exit
+                                     */
+    shm_region_t      *region;
+    shm_ring_t        *rx;
+    shm_ring_t        *tx;
+    pthread_t          recv_thread;
+
+    /* who packets are passed on to; protected by shm_lock.  until it's
+     * accepted, a connection is on its listening mysocket's pending list.
+     */
+    bool_t             adopted;     /* a mysocket has (or had) it; only
+                                     * changed by the receive thread
+                                     */
+    mysock_context_t  *owner;
+    mysock_context_t  *listener;
+    struct sockaddr_in peer_addr;   /* for the listening mysocket */
+    struct shm_conn   *next_pending;
+} shm_conn_t;
+
+/* state for the mysocket; this is pointed to by impl_data in the
+ * network_context_t structure.
+ */
+typedef struct
+{
+    mysock_context_t *sock_ctx;
+    int               sock;         /* bound to our port, if it's ours */
+    uint16_t          port;         /* local port (host byte order) */
+    shm_conn_t       *conn;
+
+    /* listening mysockets accept connections in a thread of their own */
+    pthread_t         accept_thread;
+    int               accept_exit_fd;
+    bool_t            accepting;
+
+    /* protected by shm_lock */
+    shm_conn_t       *pending;      /* connections not yet accepted */
+    int               busy;         /* packets being passed to it */
+} network_context_shm_t;
+
+/* protects the connections' owners, and the mysockets' pending lists and
+ * busy counts
+ */
+static pthread_mutex_t shm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  shm_idle = PTHREAD_COND_INITIALIZER;    /* a busy
+                                                                * count
+                                                                * went to 0
+                                                                */
+
+
+static socklen_t shm_port_name(uint16_t port, struct sockaddr_un *sun);
+static shm_conn_t *shm_connect(network_context_t *ctx);
+static shm_conn_t *shm_accept(int sock);
+static shm_conn_t *shm_new_conn(int sock, int region_fd, int recv_fd,
+                                int send_fd, bool_t active);
+static void shm_free_conn(shm_conn_t *conn);
+static void shm_release_conn(shm_conn_t *conn);
+static void shm_stop_thread(pthread_t thread, int exit_fd);
+static void *shm_accept_thread_func(void *arg_ptr);
+static void *shm_recv_thread_func(void *arg_ptr);
+static bool_t shm_deliver(shm_conn_t *conn, const void *packet, size_t len);
+static void shm_signal(int fd);
+
+
+int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    network_context_shm_t *shm_ctx;
+
+    assert(sock_ctx && net_ctx);
+    assert(!net_ctx->impl_data);
+
+    shm_ctx = (network_context_shm_t *) calloc(1, sizeof(*shm_ctx));
+    assert(shm_ctx);
+
+    shm_ctx->sock_ctx = sock_ctx;
+    shm_ctx->sock = -1;
+    shm_ctx->accept_exit_fd = -1;
+    net_ctx->impl_data = shm_ctx;
+    return 0;
+}
+
+void _network_close(network_context_t *ctx)
+{
+    network_context_shm_t *shm_ctx;
+
+    assert(ctx);
+    shm_ctx = (network_context_shm_t *) ctx->impl_data;
+    assert(shm_ctx && !shm_ctx->accepting && !shm_ctx->busy);
+
+    if (shm_ctx->conn)
+        shm_free_conn(shm_ctx->conn);
+    if (shm_ctx->sock >= 0)
+        close(shm_ctx->sock);
+    if (shm_ctx->accept_exit_fd >= 0)
+        close(shm_ctx->accept_exit_fd);
+
+    free(shm_ctx);
+    ctx->impl_data = NULL;
+}
+
+/* claim the given local port, or an unused one if it's zero, by binding
+ * its socket.  the address itself doesn't matter.
+ */
+int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
+{
+    network_context_shm_t *shm_ctx;
+    struct sockaddr_un sun;
+    uint16_t port, first;
+    int sock, k;
+
+    assert(ctx && addr);
+    shm_ctx = (network_context_shm_t *) ctx->impl_data;
+    assert(shm_ctx && shm_ctx->sock < 0);
+
+    if (addrlen < (int) sizeof(struct sockaddr_in) ||
+        addr->sa_family != AF_INET)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+        return -1;
+
+    if ((port = ntohs(((struct sockaddr_in *) addr)->sin_port)) != 0)
+    {
+        if (bind(sock, (struct sockaddr *) &sun,
+                 shm_port_name(port, &sun)) < 0)
+        {
+            close(sock);
+            return -1;
+        }
+    }
+    else
+    {
+        /* start somewhere different in each process */
+        first = SHM_FIRST_EPHEMERAL +
+                (getpid() * 7919 + ctx->random_seed) %
+                (SHM_LAST_EPHEMERAL - SHM_FIRST_EPHEMERAL + 1);
+
+        for (k = 0; ; ++k)
+        {
+            if (k > SHM_LAST_EPHEMERAL - SHM_FIRST_EPHEMERAL)
+            {
+                close(sock);
+                errno = EADDRINUSE;
+                return -1;
+            }
+
+            port = first + k;
+            if (port > SHM_LAST_EPHEMERAL)
+                port -= SHM_LAST_EPHEMERAL - SHM_FIRST_EPHEMERAL + 1;
+
+            if (bind(sock, (struct sockaddr *) &sun,
+                     shm_port_name(port, &sun)) == 0)
+                break;
+            if (errno != EADDRINUSE)
+            {
+                close(sock);
+                return -1;
+            }
+        }
+    }
+
+    shm_ctx->sock = sock;
+    shm_ctx->port = port;
+    return 0;
+}
+
+int _network_listen(network_context_t *ctx, int backlog)
+{
+    network_context_shm_t *shm_ctx;
+
+    assert(ctx);
+    shm_ctx = (network_context_shm_t *) ctx->impl_data;
+    assert(shm_ctx && shm_ctx->sock >= 0);
+
+    return listen(shm_ctx->sock, backlog);
+}
+
+/* returns the local port, in network byte order */
+int _network_get_port(network_context_t *ctx)
+{
+    assert(ctx && ctx->impl_data);
+    return htons(((network_context_shm_t *) ctx->impl_data)->port);
+}
+
+/* every address is our own, so packets to the peer are sent from the same
+ * address they're sent to
+ */
+uint32_t _network_get_interface_ip(uint32_t peer_addr)
+{
+    return (peer_addr != htonl(INADDR_ANY)) ? peer_addr
+                                            : htonl(INADDR_LOOPBACK);
+}
+
+/* the new mysocket takes over the connection the SYN arrived on (which is
+ * passed as user_data), and shares the listening mysocket's port
+ */
+void _network_update_passive_state(network_context_t *new_ctx,
+                                   network_context_t *accept_ctx,
+                                   void *user_data,
+                                   const void *syn_packet, size_t syn_len)
+{
+    network_context_shm_t *new_shm_ctx, *accept_shm_ctx;
+    shm_conn_t *conn = (shm_conn_t *) user_data;
+    shm_conn_t **prev;
+
+    assert(new_ctx && accept_ctx && syn_packet && conn);
+
+    new_shm_ctx = (network_context_shm_t *) new_ctx->impl_data;
+    accept_shm_ctx = (network_context_shm_t *) accept_ctx->impl_data;
+    assert(new_shm_ctx && accept_shm_ctx);
+    assert(!new_shm_ctx->conn && new_shm_ctx->sock < 0);
+
+    new_shm_ctx->port = accept_shm_ctx->port;
+    new_shm_ctx->conn = conn;
+
+    PTHREAD_CALL(pthread_mutex_lock(&shm_lock));
+    assert(!conn->owner && conn->listener == accept_shm_ctx->sock_ctx);
+    for (prev = &accept_shm_ctx->pending; *prev != conn;
+         prev = &(*prev)->next_pending)
+    {
+        assert(*prev);
+    }
+    *prev = conn->next_pending;
+    conn->next_pending = NULL;
+    conn->listener = NULL;
+    conn->owner = new_shm_ctx->sock_ctx;
+    conn->adopted = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&shm_lock));
+}
+
+/* a listening mysocket starts accepting connections; an active one sets
+ * up its connection to the peer
+ */
+int _network_start_recv_thread(mysock_context_t *ctx)
+{
+    network_context_shm_t *shm_ctx;
+
+    assert(ctx);
+    shm_ctx = (network_context_shm_t *) ctx->network_state.impl_data;
+    assert(shm_ctx);
+
+    if (ctx->listening)
+    {
+        if ((shm_ctx->accept_exit_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+            return -1;
+
+        shm_ctx->accepting = TRUE;
+        shm_ctx->accept_thread =
+            _mysock_create_thread(shm_accept_thread_func, ctx, FALSE);
+    }
+    else if (ctx->is_active)
+    {
+        assert(!shm_ctx->conn);
+
+        if (!(shm_ctx->conn = shm_connect(&ctx->network_state)))
+        {
+            /* signal the error to the transport layer, as for a TCP
+             * connection that's refused
+             */
+            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue, NULL, 0);
+            return 0;
+        }
+
+        shm_ctx->conn->owner = ctx;
+        shm_ctx->conn->adopted = TRUE;
+        shm_ctx->conn->recv_thread =
+            _mysock_create_thread(shm_recv_thread_func, shm_ctx->conn, FALSE);
+    }
+
+    /* an accepted connection's receive thread is already running */
+    return 0;
+}
+
+/* block until no more packets will be passed on to the mysocket */
+void _network_stop_recv_thread(mysock_context_t *ctx)
+{
+    network_context_shm_t *shm_ctx;
+    shm_conn_t *conn;
+
+    assert(ctx);
+    shm_ctx = (network_context_shm_t *) ctx->network_state.impl_data;
+    assert(shm_ctx);
+
+    if (shm_ctx->accepting)
+    {
+        shm_stop_thread(shm_ctx->accept_thread, shm_ctx->accept_exit_fd);
+        shm_ctx->accepting = FALSE;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&shm_lock));
+    if (shm_ctx->conn && shm_ctx->conn->owner == ctx)
+        shm_ctx->conn->owner = NULL;
+
+    /* connections that haven't been accepted are closed by their receive
+     * threads, once they see nobody's listening
+     */
+    while ((conn = shm_ctx->pending) != NULL)
+    {
+        shm_ctx->pending = conn->next_pending;
+        conn->next_pending = NULL;
+        conn->listener = NULL;
+        shm_signal(conn->exit_fd);
+    }
+
+    while (shm_ctx->busy > 0)
+        PTHREAD_CALL(pthread_cond_wait(&shm_idle, &shm_lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&shm_lock));
+}
+
+/* send the given packet to the peer */
+ssize_t _network_send_packet(network_context_t *ctx,
+                             const void *src, size_t len)
+{
+    struct iovec iov;
+
+    assert(ctx && src);
+
+    iov.iov_base = (void *) src;
+    iov.iov_len  = len;
+    return _network_send_packetv(ctx, &iov, 1);
+}
+
+/* gather the packet's pieces into the peer's ring, waking it up if the ring
+ * was empty.  this is only called by the mysocket's transport layer, so
+ * there's only ever one producer.  a packet that doesn't fit is dropped, as
+ * it might have been on the way.
+ */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
+{
+    network_context_shm_t *shm_ctx;
+    shm_ring_t *ring;
+    uint32_t tail;
+    size_t len;
+    int k;
+
+    assert(ctx && iov && iovcnt > 0);
+    shm_ctx = (network_context_shm_t *) ctx->impl_data;
+    assert(shm_ctx);
+
+    if (!shm_ctx->conn)
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    for (len = 0, k = 0; k < iovcnt; ++k)
+        len += iov[k].iov_len;
+    if (len > MAX_IP_PAYLOAD_LEN)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    ring = shm_ctx->conn->tx;
+    tail = ring->tail;
+    if (tail - ring->head >= SHM_RING_SLOTS)
+    {
+        DEBUG_LOG(("shared memory ring full, dropping packet\n"));
+        return len;
+    }
+
+    (void) _network_gather_packet(ring->slots[tail % SHM_RING_SLOTS].data,
+                                  MAX_IP_PAYLOAD_LEN, iov, iovcnt);
+    ring->slots[tail % SHM_RING_SLOTS].len = (uint16_t) len;
+
+    /* the slot is filled in before it's published; and the consumer
+     * either sees the new tail before it sleeps, or has caught up with
+     * us by the time we look at head (see shm_recv_thread_func())
+     */
+    __sync_synchronize();
+    ring->tail = tail + 1;
+    __sync_synchronize();
+    if (ring->head == tail)
+        shm_signal(shm_ctx->conn->send_fd);
+
+    return len;
+}
+
+/* nothing is referred to once it's been sent, so held buffers are just
+ * sent as any others, and may be freed straight away
+ */
+ssize_t _network_send_packet_held(network_context_t *ctx,
+                                  const struct iovec *iov, int iovcnt,
+                                  void *buf)
+{
+    return _network_send_packetv(ctx, iov, iovcnt);
+}
+
+void _network_free_buffer(network_context_t *ctx, void *buf)
+{
+    free(buf);
+}
+
+/* packets are put in the ring as they're sent, so nothing is held back */
+void _network_flush(network_context_t *ctx)
+{
+}
+
+
+/* the abstract socket name for a port */
+static socklen_t shm_port_name(uint16_t port, struct sockaddr_un *sun)
+{
+    int len;
+
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    len = snprintf(sun->sun_path + 1, sizeof(sun->sun_path) - 1,
+                   SHM_NAME_FORMAT, (unsigned int) port);
+    assert(len > 0 && len < (int) sizeof(sun->sun_path) - 1);
+
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/* set up a connection to the peer's listening mysocket, returning NULL if
+ * nobody's listening
+ */
+static shm_conn_t *shm_connect(network_context_t *ctx)
+{
+    struct sockaddr_un sun;
+    struct sockaddr_in *peer;
+    shm_hello_t hello;
+    struct msghdr msg;
+    struct iovec iov;
+    union
+    {
+        char           buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct cmsghdr *cmsg;
+    int sock, region_fd = -1, fds[2] = { -1, -1 };
+    shm_conn_t *conn;
+
+    assert(ctx && ctx->peer_addr_valid);
+    assert(ctx->peer_addr.sa_family == AF_INET);
+    peer = (struct sockaddr_in *) &ctx->peer_addr;
+
+    if ((sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0)) < 0)
+        return NULL;
+    if (connect(sock, (struct sockaddr *) &sun,
+                shm_port_name(ntohs(peer->sin_port), &sun)) < 0)
+    {
+        DEBUG_LOG(("shm connect failed (errno=%d)\n", errno));
+        close(sock);
+        return NULL;
+    }
+
+    if ((region_fd = memfd_create("stcp-shm", MFD_CLOEXEC)) < 0 ||
+        ftruncate(region_fd, sizeof(shm_region_t)) < 0 ||
+        (fds[0] = eventfd(0, EFD_CLOEXEC)) < 0 ||
+        (fds[1] = eventfd(0, EFD_CLOEXEC)) < 0)
+    {
+        perror("network_io_shm");
+        goto fail;
+    }
+
+    memset(&hello, 0, sizeof(hello));
+    hello.from.sin_family      = AF_INET;
+    hello.from.sin_port        = _network_get_port(ctx);
+    hello.from.sin_addr.s_addr = _network_get_local_addr(ctx);
+
+    iov.iov_base = &hello;
+    iov.iov_len  = sizeof(hello);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(3 * sizeof(int));
+    ((int *) CMSG_DATA(cmsg))[0] = region_fd;
+    ((int *) CMSG_DATA(cmsg))[1] = fds[0];
+    ((int *) CMSG_DATA(cmsg))[2] = fds[1];
+
+    if (sendmsg(sock, &msg, MSG_NOSIGNAL) != (ssize_t) sizeof(hello))
+    {
+        DEBUG_LOG(("shm connect failed (errno=%d)\n", errno));
+        goto fail;
+    }
+
+    /* we read ring[1], and write ring[0] */
+    if (!(conn = shm_new_conn(sock, region_fd, fds[1], fds[0], TRUE)))
+        goto fail;
+    return conn;
+
+fail:
+    if (region_fd >= 0)
+        close(region_fd);
+    if (fds[0] >= 0)
+        close(fds[0]);
+    if (fds[1] >= 0)
+        close(fds[1]);
+    close(sock);
+    return NULL;
+}
+
+/* accept a connection on a listening socket, returning NULL if it isn't
+ * set up properly
+ */
+static shm_conn_t *shm_accept(int listen_sock)
+{
+    shm_hello_t hello;
+    struct msghdr msg;
+    struct iovec iov;
+    union
+    {
+        char           buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct cmsghdr *cmsg;
+    int sock, fds[3], num_fds = 0, k;
+    shm_conn_t *conn = NULL;
+    ssize_t rc;
+
+    if ((sock = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC)) < 0)
+        return NULL;
+
+    iov.iov_base = &hello;
+    iov.iov_len  = sizeof(hello);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        {
+            num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            memcpy(fds, CMSG_DATA(cmsg), MIN(num_fds, 3) * sizeof(int));
+        }
+    }
+
+    if (rc == (ssize_t) sizeof(hello) && num_fds == 3 &&
+        hello.from.sin_family == AF_INET)
+    {
+        /* we read ring[0], and write ring[1] */
+        if ((conn = shm_new_conn(sock, fds[0], fds[1], fds[2], FALSE)))
+            conn->peer_addr = hello.from;
+    }
+
+    if (!conn)
+    {
+        DEBUG_LOG(("shm accept: bad connection request\n"));
+        for (k = 0; k < MIN(num_fds, 3); ++k)
+            close(fds[k]);
+        close(sock);
+    }
+    return conn;
+}
+
+/* map the shared region; the connection owns the descriptors it's given
+ * (other than the region's, which isn't needed once it's mapped)
+ */
+static shm_conn_t *shm_new_conn(int sock, int region_fd, int recv_fd,
+                                int send_fd, bool_t active)
+{
+    shm_conn_t *conn;
+    struct stat st;
+    void *region;
+
+    if (fstat(region_fd, &st) < 0 ||
+        st.st_size != (off_t) sizeof(shm_region_t) ||
+        (region = mmap(NULL, sizeof(shm_region_t), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, region_fd, 0)) == MAP_FAILED)
+    {
+        return NULL;
+    }
+    close(region_fd);
+
+    conn = (shm_conn_t *) calloc(1, sizeof(shm_conn_t));
+    assert(conn);
+    conn->sock    = sock;
+    conn->recv_fd = recv_fd;
+    conn->send_fd = send_fd;
+    conn->region  = (shm_region_t *) region;
+    conn->rx      = &conn->region->ring[active ? 1 : 0];
+    conn->tx      = &conn->region->ring[active ? 0 : 1];
+
+    if ((conn->exit_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+    {
+        perror("eventfd");
+        abort();
+    }
+    return conn;
+}
+
+/* stop the connection's receive thread, and release it */
+static void shm_free_conn(shm_conn_t *conn)
+{
+    assert(conn && conn->adopted && !conn->owner);
+
+    shm_stop_thread(conn->recv_thread, conn->exit_fd);
+    shm_release_conn(conn);
+}
+
+static void shm_release_conn(shm_conn_t *conn)
+{
+    assert(conn && !conn->owner && !conn->listener);
+
+    (void) munmap(conn->region, sizeof(shm_region_t));
+    close(conn->sock);
+    close(conn->recv_fd);
+    close(conn->send_fd);
+    close(conn->exit_fd);
+    free(conn);
+}
+
+static void shm_stop_thread(pthread_t thread, int exit_fd)
+{
+    shm_signal(exit_fd);
+    PTHREAD_CALL(pthread_join(thread, NULL));
+}
+
+/* accept connections for a listening mysocket, starting a receive thread
+ * for each, until the mysocket stops receiving
+ */
+static void *shm_accept_thread_func(void *arg_ptr)
+{
+    mysock_context_t *ctx = (mysock_context_t *) arg_ptr;
+    network_context_shm_t *shm_ctx;
+
+    assert(ctx);
+    shm_ctx = (network_context_shm_t *) ctx->network_state.impl_data;
+    assert(shm_ctx);
+
+    for (;;)
+    {
+        struct pollfd fds[] =
+        {
+            { shm_ctx->accept_exit_fd, POLLIN, 0 },
+            { shm_ctx->sock, POLLIN, 0 }
+        };
+        shm_conn_t *conn;
+
+        if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) < 0)
+        {
+            assert(errno == EINTR);
+            continue;
+        }
+
+        if (fds[0].revents)
+            break;
+        if (!fds[1].revents || !(conn = shm_accept(shm_ctx->sock)))
+            continue;
+
+        PTHREAD_CALL(pthread_mutex_lock(&shm_lock));
+        conn->listener = ctx;
+        conn->next_pending = shm_ctx->pending;
+        shm_ctx->pending = conn;
+        PTHREAD_CALL(pthread_mutex_unlock(&shm_lock));
+
+        conn->recv_thread =
+            _mysock_create_thread(shm_recv_thread_func, conn, FALSE);
+    }
+
+    return NULL;
+}
+
+/* the receive thread for a connection.  this passes on packets from the
+ * ring, straight out of shared memory, until there's nobody left to pass
+ * them to (or the peer goes away).  a connection that was never accepted
+ * is released here.
+ */
+static void *shm_recv_thread_func(void *arg_ptr)
+{
+    shm_conn_t *conn = (shm_conn_t *) arg_ptr;
+    shm_ring_t *ring;
+    bool_t done = FALSE;
+    uint32_t head;
+    uint64_t count;
+
+    assert(conn);
+    ring = conn->rx;
+    head = ring->head;
+
+    while (!done)
+    {
+        struct pollfd fds[] =
+        {
+            { conn->exit_fd, POLLIN, 0 },
+            { conn->recv_fd, POLLIN, 0 },
+            { conn->sock, POLLIN, 0 }
+        };
+
+        while (head != ring->tail && !done)
+        {
+            /* the slot is read after it's published, and only given back
+             * once we're done with it
+             */
+            __sync_synchronize();
+            done = !shm_deliver(conn, ring->slots[head % SHM_RING_SLOTS].data,
+                                MIN(ring->slots[head % SHM_RING_SLOTS].len,
+                                    MAX_IP_PAYLOAD_LEN));
+            __sync_synchronize();
+            ring->head = ++head;
+        }
+
+        /* either we see a packet published after our last look at tail, or
+         * its producer sees our head, and wakes us up
+         */
+        __sync_synchronize();
+        if (done || head != ring->tail)
+            continue;
+
+        if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) < 0)
+        {
+            assert(errno == EINTR);
+            continue;
+        }
+
+        if (fds[1].revents)
+        {
+            if (read(conn->recv_fd, &count, sizeof(count)) < 0)
+                assert(errno == EAGAIN || errno == EINTR);
+        }
+
+        if (fds[0].revents)
+        {
+            /* nobody's left to pass anything to */
+            done = TRUE;
+        }
+        else if (fds[2].revents && head == ring->tail)
+        {
+            /* the peer has gone away, and there's nothing more from it */
+            (void) shm_deliver(conn, NULL, 0);
+            done = TRUE;
+        }
+    }
+
+    if (!conn->adopted)
+    {
+        /* nobody else knows about a connection that was never accepted
+         * (only this thread hands connections over), so it's released here
+         */
+        PTHREAD_CALL(pthread_mutex_lock(&shm_lock));
+        if (conn->listener)
+        {
+            network_context_shm_t *shm_ctx = (network_context_shm_t *)
+                conn->listener->network_state.impl_data;
+            shm_conn_t **prev;
+
+            for (prev = &shm_ctx->pending; *prev != conn;
+                 prev = &(*prev)->next_pending)
+            {
+                assert(*prev);
+            }
+            *prev = conn->next_pending;
+            conn->next_pending = NULL;
+            conn->listener = NULL;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&shm_lock));
+
+        PTHREAD_CALL(pthread_detach(pthread_self()));
+        shm_release_conn(conn);
+    }
+
+    return NULL;
+}
+
+/* pass a packet on to the mysocket that has the connection, or to the
+ * listening mysocket if it hasn't been accepted yet; or an error (if
+ * packet is NULL) to the mysocket that has it.  returns FALSE if there's
+ * nobody to pass it to.
+ */
+static bool_t shm_deliver(shm_conn_t *conn, const void *packet, size_t len)
+{
+    network_context_shm_t *shm_ctx;
+    mysock_context_t *ctx;
+
+    assert(conn);
+
+    PTHREAD_CALL(pthread_mutex_lock(&shm_lock));
+    if (!(ctx = conn->owner) && packet)
+        ctx = conn->listener;
+    if (!ctx)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&shm_lock));
+        return FALSE;
+    }
+
+    shm_ctx = (network_context_shm_t *) ctx->network_state.impl_data;
+    assert(shm_ctx);
+    shm_ctx->busy++;
+    PTHREAD_CALL(pthread_mutex_unlock(&shm_lock));
+
+    if (!packet)
+    {
+        /* signal an error to the transport layer */
+        _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue, NULL, 0);
+    }
+    else if (ctx->listening)
+    {
+        /* if it's a SYN, this hands the connection over to a new mysocket;
+         * if not (or the listen queue is full), it stays with the
+         * listening mysocket, for the SYN to be sent again
+         */
+        _mysock_enqueue_connection(ctx, packet, len,
+                                   (const struct sockaddr *) &conn->peer_addr,
+                                   sizeof(conn->peer_addr), conn);
+    }
+    else
+    {
+        _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue, packet, len);
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&shm_lock));
+    if (--shm_ctx->busy == 0)
+        PTHREAD_CALL(pthread_cond_broadcast(&shm_idle));
+    PTHREAD_CALL(pthread_mutex_unlock(&shm_lock));
+
+    return TRUE;
+}
+
+/* wake up whoever is waiting on the eventfd */
+static void shm_signal(int fd)
+{
+    uint64_t one = 1;
+
+    if (write(fd, &one, sizeof(one)) != sizeof(one))
+    {
+        assert(0);
+        abort();
+    }
+}
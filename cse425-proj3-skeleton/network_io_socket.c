@@ -2,17 +2,14 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <signal.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <errno.h>
 #include <unistd.h>
-#include <poll.h>
 #include <assert.h>
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "network_io_socket.h"
-#include "connection_demux.h"
 
 #include <string.h>
 #include <netinet/in.h>
@@ -21,9 +18,6 @@
 
 
 
-#define EXIT_PIPE_READ_INDEX  0
-#define EXIT_PIPE_WRITE_INDEX 1
-
 #ifndef MAXHOSTNAMELEN
 #ifdef HOST_NAME_MAX
 #define MAXHOSTNAMELEN HOST_NAME_MAX
@@ -36,7 +30,6 @@
 static network_context_socket_t *
     _network_alloc_context_socket(int socket_type, size_t ctx_len);
 static void _network_destroy_context_socket(network_context_socket_t *ctx);
-static void *network_recv_thread_func(void *arg_ptr);
 
 
 
@@ -111,53 +104,6 @@ uint32_t _network_get_interface_ip(uint32_t peer_addr)
     return ((struct in_addr *) *h->h_addr_list)->s_addr;
 }
 
-int _network_start_recv_thread(mysock_context_t *ctx)
-{
-    network_context_socket_t *net_ctx =
-        (network_context_socket_t *) ctx->network_state.impl_data;
-
-    assert(net_ctx);
-
-    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
-    {
-        perror("signal(SIGPIPE)");
-        assert(0);
-        return -1;
-    }
-
-    net_ctx->recv_thread = _mysock_create_thread(network_recv_thread_func,
-                                                 ctx, FALSE);
-    net_ctx->recv_thread_started = TRUE;
-    return 0;
-}
-
-/* block until the network receive thread completes */
-void _network_stop_recv_thread(mysock_context_t *ctx)
-{
-    network_context_socket_t *net_ctx =
-        (network_context_socket_t *) ctx->network_state.impl_data;
-
-    DEBUG_LOG(("stopping receive thread\n"));
-    assert(net_ctx);
-
-
-    if (net_ctx->recv_thread_started)
-    {
-        char dummy = 'X';
-        if (write(net_ctx->exit_pipe[EXIT_PIPE_WRITE_INDEX],
-                  &dummy, sizeof(dummy)) < 0)
-        {
-            assert(0);
-            abort();
-        }
-
-
-        PTHREAD_CALL(pthread_join(net_ctx->recv_thread, NULL));
-        net_ctx->recv_thread_started = FALSE;
-    }
-    DEBUG_LOG(("stopped receive thread\n"));
-}
-
 
 /* initialise the network subsystem.  this function should be called before
  * making use of any of the other network layer functions.
@@ -193,104 +139,6 @@ int _network_bind_socket(network_context_t *ctx,
 }
 
 
-/* process network input.
- * this just loops around, waiting for data to arrive, and buffering it
- * for later consumption by network_recv().  (outgoing data is sent
- * immediately via network_send(), and so does not require its own thread).
- * 
- * this runs in its own thread, mostly because the transport layer needs to
- * wait with a timeout for incoming data from the peer.  [usual mechanisms
- * for I/O with timeouts such as poll(), select(), or asynchronous I/O
- * don't work with all underlying I/O mechanisms we might support (e.g.
- * VNS).  so we implement the timeout in a more generic (I/O-independent)
- * manner using the pthreads API instead].
- */
-static void *network_recv_thread_func(void *arg_ptr)
-{
-    char packet_buf[MAX_IP_PAYLOAD_LEN];
-    mysock_context_t *ctx;
-    network_context_socket_t *net_ctx;
-
-    DEBUG_LOG(("started receive thread\n"));
-    ctx = (mysock_context_t *) arg_ptr;
-    assert(ctx);
-
-    net_ctx = (network_context_socket_t *) ctx->network_state.impl_data;
-    assert(net_ctx);
-
-    for (;;)
-    {
-        ssize_t bytes_read;
-        bool_t packet_ready = FALSE;
-        bool_t done = FALSE;
-        struct pollfd fds[] =
-        {
-            { net_ctx->exit_pipe[EXIT_PIPE_READ_INDEX], POLLIN, 0 },
-            { net_ctx->socket, POLLIN, 0 }
-        };
-
-
-        while (!packet_ready && !done)
-        {
-            switch (poll(fds, sizeof(fds) / sizeof(fds[0]), -1))
-            {
-            case -1:
-                assert(errno == EINTR);
-                break;
-
-            case 0:
-                assert(0);
-                break;
-
-            default:
-                assert(!(fds[0].revents & POLLERR));
-                assert(!(fds[1].revents & POLLERR));
-
-                if (fds[0].revents)
-                    done = TRUE;
-                if (fds[1].revents)
-                    packet_ready = TRUE;
-                break;
-            }
-        }
-
-        if (done)
-            break;
-
-        /* block, waiting for network input.  (the system call will be
-         * interrupted by the transport layer thread if we're to exit).
-         */
-        if ((bytes_read = _network_recv_packet(&ctx->network_state,
-                                               packet_buf,
-                                               sizeof(packet_buf))) <= 0)
-        {
-            DEBUG_LOG(("_network_recv_packet interrupted, errno=%d\n", errno));
-            //signal an error to the transport layer
-            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue, NULL, 0);
-            break;
-        }
-
-        assert(bytes_read <= (int)sizeof(packet_buf));
-        if (ctx->listening)
-        {
-            /* if the socket was accepting new connections, incoming
-             * packets need to be demultiplexed and dispatched to the
-             * appropriate mysocket context.
-             */
-            _mysock_enqueue_connection(ctx, packet_buf, bytes_read,
-                                       &ctx->network_state.peer_addr,
-                                       ctx->network_state.peer_addr_len, NULL);
-        }
-        else
-        {
-            /* enqueue the packet directly for this context */
-            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue,
-                                   packet_buf, bytes_read);
-        }
-    }
-
-    return NULL;
-}
 
 static network_context_socket_t *
 _network_alloc_context_socket(int socket_type, size_t ctx_len)
@@ -299,7 +147,7 @@ _network_alloc_context_socket(int socket_type, size_t ctx_len)
         (network_context_socket_t *) calloc(1, ctx_len);
 
     assert(ctx);
-
+    ctx->poll_socket = -1;
 
     /* create the actual socket used for communication to the peer */
     if ((ctx->socket = socket(AF_INET, socket_type, 0)) < 0)
@@ -310,6 +158,7 @@ _network_alloc_context_socket(int socket_type, size_t ctx_len)
         ctx = NULL;
     }
 
+#ifndef LINUX
     ctx->exit_pipe[0] = ctx->exit_pipe[1] = -1;
     if (pipe(ctx->exit_pipe) < 0)
     {
@@ -318,6 +167,7 @@ _network_alloc_context_socket(int socket_type, size_t ctx_len)
         _network_destroy_context_socket(ctx);
         ctx = NULL;
     }
+#endif
 
     return ctx;
 }
@@ -333,6 +183,7 @@ static void _network_destroy_context_socket(network_context_socket_t *ctx)
         ctx->socket = -1;
     }
 
+#ifndef LINUX
     if (ctx->exit_pipe[0] >= 0)
     {
         close(ctx->exit_pipe[0]);
@@ -344,6 +195,7 @@ static void _network_destroy_context_socket(network_context_socket_t *ctx)
         close(ctx->exit_pipe[1]);
         ctx->exit_pipe[1] = -1;
     }
+#endif
 
     free(ctx);
 }
@@ -16,27 +16,70 @@
 
 typedef int socket_t;
 
+/* room for several full-sized frames, so a burst of them is read at once */
+#define TCP_RECV_BUF_LEN (8 * (2 + MAX_IP_PAYLOAD_LEN))
+
 /* socket-based network layer additional state.
  * this is pointed to by impl_data in the network_context_t structure.
  */
 typedef struct
 {
+#ifdef LINUX
+    /* registration with the shared receive reactor (see
+     * network_io_socket.c); protected by the reactor's lock.
+     */
+    unsigned int       recv_id;     /* tells stale events apart */
+    bool_t             recv_busy;   /* a reactor thread is reading input */
+#else
     pthread_t          recv_thread;
     bool_t             recv_thread_started;
+    int                exit_pipe[2];    /* used to wake up read thread */
+#endif
 
     socket_t           socket;  /* socket used for communication to peer */
-    int                exit_pipe[2];    /* used to wake up read thread */
+    socket_t           poll_socket;     /* watched for input in place of
+                                         * socket, if it isn't -1 (e.g. an
+                                         * epoll set of several sockets)
+                                         */
 } network_context_socket_t;
 
+/* frames read from a socket but not yet passed on (see
+ * _network_recv_packet()).  skip counts what's still to come of a frame
+ * that's being discarded.
+ */
+typedef struct
+{
+    char   buf[TCP_RECV_BUF_LEN];
+    size_t start;
+    size_t end;
+    size_t skip;
+} tcp_frame_buf_t;
+
 typedef struct
 {
     network_context_socket_t base;
 
     /* additional state required by TCP-based network layer */
     mysock_context_t *sock_ctx;
-    socket_t          new_socket;   /* temporary result of accept() */
     pthread_mutex_t   connect_lock;
-    bool_t            connected;
+    bool_t            connected;    /* atomic; see _tcp_connect() */
+
+    tcp_frame_buf_t   recv;         /* read from socket */
+
+    /* MSG_ZEROCOPY sends the kernel hasn't finished with yet, or NULL if
+     * they aren't used on this connection (see network_io_tcp.c)
+     */
+    struct tcp_zerocopy *zc;
+
+    /* the connection's other sockets, if it's striped across several
+     * (see network_io_tcp.c), or NULL
+     */
+    struct tcp_stripes *stripes;
+
+    /* for a listening mysocket, the connections it's accepted whose first
+     * frames haven't been taken yet (see network_io_tcp.c), or NULL
+     */
+    struct tcp_listener *listener;
 } network_context_socket_tcp_t;
 
 
@@ -45,6 +88,10 @@ typedef struct
 #define GET_SOCKET(ctx) ((network_context_socket_t *) ctx->impl_data)->socket
 #define VERIFY_SOCKET(ctx) assert(ctx->impl_data && GET_SOCKET(ctx) >= 0)
 
+/* the socket to watch for input, given a network_context_socket_t */
+#define GET_POLL_SOCKET(net_ctx) \
+    (((net_ctx)->poll_socket >= 0) ? (net_ctx)->poll_socket : (net_ctx)->socket)
+
 #ifdef __GNUC__
 #define DEBUG_PEER(ctx) \
     DEBUG_LOG(("%s peer:  %s:%d\n", __FUNCTION__, \
@@ -68,11 +115,17 @@ int _network_bind_socket(network_context_t *ctx,
 
 
 /* this is not called directly.  use network_start_recv_thread() and
- * network_stop_recv_thread() instead.
+ * network_stop_recv_thread() instead.  returns -1, with errno set to
+ * EAGAIN, if the socket was reported readable but there's nothing to read.
  */
 ssize_t _network_recv_packet(network_context_t *ctx,
                              void *dst, size_t max_len);
 
+/* returns TRUE if _network_recv_packet() already has another packet to
+ * hand out, without waiting for the socket to be reported readable
+ */
+bool_t _network_recv_pending(network_context_t *ctx);
+
 
 #endif  /* __NETWORK_IO_SOCKET_H__ */
 
@@ -5,9 +5,14 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdlib.h>
-#include <alloca.h>
+#include <string.h>
+#ifdef LINUX
+#include <sys/epoll.h>
+#include <linux/errqueue.h>
+#endif
 #include "mysock_impl.h"
 #include "network_io.h"
 #include "network_io_socket.h"
@@ -15,10 +20,224 @@
 
 #define MAX_NUM_PENDING_CONNECTIONS 10
 
-typedef ssize_t (*io_func_t)(socket_t sd, void *buf, size_t count);
+/* <netinet/tcp.h> can't be included alongside transport.h's tcphdr */
+#ifndef TCP_NODELAY
+#define TCP_NODELAY 1
+#endif
+
+/* payloads of at least TCP_ZEROCOPY_MIN_LEN bytes that the transport layer
+ * leaves with us (see _network_send_packet_held()) are sent with
+ * MSG_ZEROCOPY if this is set, and the kernel supports it.  pinning the
+ * pages and fielding the completions costs more than the copy it saves
+ * until segments are several KB long, so it's off by default.
+ */
+#ifndef TCP_USE_ZEROCOPY
+#define TCP_USE_ZEROCOPY 0
+#endif
+#if TCP_USE_ZEROCOPY && !(defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY) && \
+                          defined(SO_EE_ORIGIN_ZEROCOPY))
+#undef TCP_USE_ZEROCOPY
+#define TCP_USE_ZEROCOPY 0
+#endif
+
+#ifndef TCP_ZEROCOPY_MIN_LEN
+#define TCP_ZEROCOPY_MIN_LEN 512
+#endif
+
+#define TCP_ZC_MAX_SENDS 64 /* zero-copy sends in flight per connection */
+#define TCP_ZC_HEAD_LEN  64 /* length prefix and STCP header, copied */
+
+/* a zero-copy send.  the kernel numbers a socket's zero-copy sends in turn,
+ * and reports ranges of those numbers as it finishes with them.
+ */
+typedef struct
+{
+    uint32_t id;
+    bool_t   released;
+    void    *buf;   /* the block the payload lies in */
+    char     head[TCP_ZC_HEAD_LEN];
+} tcp_zc_send_t;
+
+/* zero-copy state for a connection, protected by lock: the sends in
+ * flight, in the order they were made, and the blocks the transport layer
+ * has freed while they were still in use.  sends come from the transport
+ * layer, while completions are fielded wherever the socket's error queue
+ * is looked at; the lock isn't held while sending, so a connection that's
+ * waiting to send doesn't hold up its input.
+ */
+typedef struct tcp_zerocopy
+{
+    pthread_mutex_t lock;
+    bool_t          enabled;    /* cleared if the kernel copies anyway */
+    uint32_t        next_id;
+    tcp_zc_send_t   sends[TCP_ZC_MAX_SENDS];
+    unsigned int    first, num_sends;
+    void           *freed[TCP_ZC_MAX_SENDS];
+    unsigned int    num_freed;
+} tcp_zerocopy_t;
+
+/* if TCP_STRIPES is more than 1, each connection is carried over that many
+ * TCP connections (stripes), and its packets are sent over them in turn.
+ * one TCP connection is held to what its own congestion window allows, and
+ * a loss on it holds up everything behind it until it's repaired; over a
+ * long path, a bulk transfer striped across several goes that much faster.
+ * packets arrive out of order across the stripes, which the STCP receiver
+ * sorts out as it would any other reordering.  both ends must be built with
+ * the same setting.
+ */
+#ifndef TCP_STRIPES
+#define TCP_STRIPES 1
+#endif
+#if TCP_STRIPES < 1 || TCP_STRIPES > 16
+#error TCP_STRIPES must be between 1 and 16
+#endif
+#if TCP_STRIPES > 1 && !defined(LINUX)
+#error TCP_STRIPES needs epoll
+#endif
+
+#if TCP_STRIPES > 1
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include "mysock_hash.h"
+
+#define TCP_JOIN_MAGIC 0x53545250U  /* "STRP" */
+
+/* the first frame on each of a connection's other stripes, saying which
+ * connection it joins.  it's shorter than any STCP packet, so the passive
+ * side can't take it for one.
+ */
+typedef struct
+{
+    uint32_t magic;     /* network byte order, as are the rest */
+    uint16_t port;      /* the active side's port for its first stripe */
+    uint16_t stripe;
+} tcp_join_t;
+
+/* key for finding the accepted connection a stripe joins */
+typedef struct
+{
+    uint32_t addr;      /* the active side's address and port */
+    uint16_t port;
+} tcp_join_key_t;
+
+/* a striped connection's sockets, protected by lock.  the first stripe is
+ * the connection's own socket, whose frames are read into its usual
+ * receive buffer; the others have buffers of their own here.  all of them
+ * are in an epoll set, which is what's watched for input.  a stripe that
+ * fails is taken out of the set and not sent on again, but it's left open
+ * until the connection is closed, so its descriptor can't be reused under
+ * a thread that's still using it.
+ */
+typedef struct tcp_stripes
+{
+    pthread_mutex_t lock;
+    int             epoll_fd;
+    socket_t        fds[TCP_STRIPES];   /* -1 until joined; [0] unused */
+    bool_t          failed[TCP_STRIPES];
+    tcp_frame_buf_t bufs[TCP_STRIPES];  /* [0] unused */
+    unsigned int    next_send;
+    unsigned int    next_recv;          /* used only by the receiver */
+    bool_t          started;            /* the rest have been connected */
+    bool_t          joinable;           /* in join_table, under key */
+    tcp_join_key_t  key;
+} tcp_stripes_t;
+
+static INLINE bool_t tcp_join_equal(tcp_join_key_t a, tcp_join_key_t b)
+{
+    return a.addr == b.addr && a.port == b.port;
+}
+
+static INLINE unsigned int tcp_join_hash(tcp_join_key_t key,
+                                         unsigned int size)
+{
+    return ((key.addr * 2654435761U) ^ key.port) % size;
+}
+
+HASH_TABLE_DECLARE_EXTENDED(join_table, tcp_join_key_t,
+                            network_context_socket_tcp_t *,
+                            tcp_join_hash, tcp_join_equal,
+                            MAX_NUM_CONNECTIONS);
+
+/* protects join_table.  it's taken before a connection's stripe lock. */
+static pthread_mutex_t join_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/* connections a listening mysocket holds before refusing more */
+#define TCP_MAX_PARKED (MAX_NUM_CONNECTIONS * TCP_STRIPES)
+
+/* a connection accepted by a listening mysocket, held (parked) until its
+ * first frame is taken: a SYN, once it's been dispatched to a new context
+ * that takes the connection over, or a stripe's join, once the connection
+ * it joins is there.  if the SYN is dropped (the listen queue being full),
+ * the connection stays parked, and the peer's retransmission of it is read
+ * later.
+ */
+typedef struct
+{
+    socket_t        sd;
+    struct sockaddr peer_addr;
+    socklen_t       peer_addr_len;
+    tcp_frame_buf_t recv;
+#if TCP_STRIPES > 1
+    bool_t          joining;    /* a stripe whose connection isn't here */
+    tcp_join_t      join;
+#endif
+} tcp_parked_t;
+
+/* a listening mysocket's parked connections.  on Linux, these are watched
+ * for input along with the listening socket itself, in an epoll set that
+ * is the mysocket's poll_socket, and every read from them is non-blocking;
+ * so a peer that connects and then sends nothing holds up no one else.
+ * only the thread reading the mysocket's input touches any of this.
+ */
+typedef struct tcp_listener
+{
+#ifdef LINUX
+    int           epoll_fd;
+#endif
+    tcp_parked_t *parked[TCP_MAX_PARKED];
+    int           num_parked;
+    tcp_parked_t *last;     /* where the last frame handed out came from */
+} tcp_listener_t;
 
-static int _tcp_io(socket_t, void *, size_t, io_func_t);
+static ssize_t _tcp_sendmsg(socket_t, struct iovec *, int, int);
+static int _tcp_writev(socket_t, struct iovec *, int);
 static int _tcp_connect(network_context_t *ctx);
+static void _tcp_zc_start(network_context_socket_tcp_t *tcp_io_ctx);
+static void _tcp_nodelay(socket_t tcp_sd);
+#if TCP_USE_ZEROCOPY
+static void _tcp_zc_reap(network_context_socket_tcp_t *tcp_io_ctx);
+#endif
+static bool_t _tcp_frame_ready(const tcp_frame_buf_t *fb);
+static ssize_t _tcp_next_frame(tcp_frame_buf_t *fb, void *dst, size_t max_len);
+static ssize_t _tcp_fill(socket_t, tcp_frame_buf_t *, int);
+static void _tcp_move_frames(tcp_frame_buf_t *dst, tcp_frame_buf_t *src);
+static int _tcp_listener_new(network_context_socket_tcp_t *tcp_io_ctx);
+static void _tcp_listener_free(network_context_socket_tcp_t *tcp_io_ctx);
+static ssize_t _tcp_listener_recv(network_context_t *ctx,
+                                  void *dst, size_t max_len);
+static tcp_parked_t *_tcp_park(network_context_t *ctx);
+static void _tcp_unpark(tcp_listener_t *listener, tcp_parked_t *p,
+                        bool_t close_it);
+#if TCP_STRIPES > 1
+static void _tcp_stripes_new(network_context_socket_tcp_t *tcp_io_ctx);
+static void _tcp_stripes_free(network_context_socket_tcp_t *tcp_io_ctx);
+static void _tcp_stripes_connect(network_context_t *ctx);
+static void _tcp_stripes_accepted(network_context_socket_tcp_t *tcp_io_ctx);
+static bool_t _tcp_stripe_join_frame(tcp_listener_t *listener,
+                                     tcp_parked_t *p,
+                                     const void *frame, size_t len);
+static bool_t _tcp_stripe_join(tcp_listener_t *listener, tcp_parked_t *p);
+static void _tcp_stripes_rejoin(tcp_listener_t *listener);
+static int _tcp_stripe_pick(network_context_socket_tcp_t *tcp_io_ctx,
+                            const struct iovec *iov, socket_t *sd);
+static void _tcp_stripe_failed(network_context_socket_tcp_t *tcp_io_ctx,
+                               int stripe);
+static ssize_t _tcp_stripes_recv(network_context_t *ctx,
+                                 void *dst, size_t max_len);
+static bool_t _tcp_stripes_pending(network_context_socket_tcp_t *tcp_io_ctx);
+#endif
 
 
 /* a few words about using TCP to emulate the underlying datagram
@@ -32,7 +251,11 @@ static int _tcp_connect(network_context_t *ctx);
  *     the passive side, for the purpose of sending the SYN packet.
  *   - the passive side dispatches the SYN packet to the right STCP
  *     context, and updates the new context's TCP socket to be that of the
- *     newly accepted (real TCP) connection.
+ *     newly accepted (real TCP) connection.  until then, the connection
+ *     is parked with the listening mysocket (see tcp_parked_t).
+ *   - if connections are striped, the active side then connects the rest
+ *     of the stripes, each starting with a join frame; the passive side's
+ *     listening socket hands each on to the connection it names.
  */
 
 
@@ -55,10 +278,15 @@ int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
     assert(tcp_io_ctx);
 
     tcp_io_ctx->sock_ctx = sock_ctx;
-    tcp_io_ctx->new_socket = -1;
     tcp_io_ctx->connected = FALSE;
+    tcp_io_ctx->zc = NULL;
+    tcp_io_ctx->stripes = NULL;
+    tcp_io_ctx->listener = NULL;
 
     PTHREAD_CALL(pthread_mutex_init(&tcp_io_ctx->connect_lock, NULL));
+#if TCP_STRIPES > 1
+    _tcp_stripes_new(tcp_io_ctx);
+#endif
 
     return 0;
 }
@@ -72,12 +300,33 @@ void _network_close(network_context_t *ctx)
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
     assert(tcp_io_ctx);
 
-    if (tcp_io_ctx->new_socket != -1)
+    if (tcp_io_ctx->listener)
+        _tcp_listener_free(tcp_io_ctx);
+
+#if TCP_USE_ZEROCOPY
+    if (tcp_io_ctx->zc)
     {
-        DEBUG_LOG(("closing TCP network layer socket %d...\n",
-                   (int) tcp_io_ctx->new_socket));
-        closesocket(tcp_io_ctx->new_socket);
+        tcp_zerocopy_t *zc = tcp_io_ctx->zc;
+
+        /* the transport layer is done with the connection, so the peer has
+         * all it's going to want of what the kernel may still hold on to
+         */
+        PTHREAD_CALL(pthread_mutex_lock(&zc->lock));
+        _tcp_zc_reap(tcp_io_ctx);
+        while (zc->num_freed > 0)
+            free(zc->freed[--zc->num_freed]);
+        PTHREAD_CALL(pthread_mutex_unlock(&zc->lock));
+
+        PTHREAD_CALL(pthread_mutex_destroy(&zc->lock));
+        free(zc);
+        tcp_io_ctx->zc = NULL;
     }
+#endif
+
+#if TCP_STRIPES > 1
+    if (tcp_io_ctx->stripes)
+        _tcp_stripes_free(tcp_io_ctx);
+#endif
 
     PTHREAD_CALL(pthread_mutex_destroy(&tcp_io_ctx->connect_lock));
 
@@ -95,10 +344,22 @@ int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
 
 int _network_listen(network_context_t *ctx, int backlog)
 {
+    network_context_socket_tcp_t *tcp_io_ctx;
+
     assert(ctx);
     VERIFY_SOCKET(ctx);
 
-    return listen(GET_SOCKET(ctx), backlog);
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx && !tcp_io_ctx->listener);
+
+#if TCP_STRIPES > 1
+    /* a listening socket isn't striped; it hands stripes on */
+    if (tcp_io_ctx->stripes)
+        _tcp_stripes_free(tcp_io_ctx);
+#endif
+    if (listen(GET_SOCKET(ctx), backlog) < 0)
+        return -1;
+    return _tcp_listener_new(tcp_io_ctx);
 }
 
 void _network_update_passive_state(network_context_t *new_ctx,
@@ -108,6 +369,7 @@ void _network_update_passive_state(network_context_t *new_ctx,
 {
     network_context_socket_tcp_t *new_tcp_ctx;
     network_context_socket_tcp_t *accept_tcp_ctx;
+    tcp_parked_t *p;
 
     assert(new_ctx && accept_ctx && syn_packet);
     assert(!user_data);
@@ -115,17 +377,32 @@ void _network_update_passive_state(network_context_t *new_ctx,
     new_tcp_ctx = (network_context_socket_tcp_t *) new_ctx->impl_data;
     accept_tcp_ctx = (network_context_socket_tcp_t *) accept_ctx->impl_data;
 
-    assert(new_tcp_ctx && accept_tcp_ctx);
+    assert(new_tcp_ctx && accept_tcp_ctx && accept_tcp_ctx->listener);
+    p = accept_tcp_ctx->listener->last;
+    assert(p);
 
-    /* result of accept() in listening socket is used for reading/writing
-     * by the new context.
+    /* the connection the SYN arrived on is used for reading/writing by the
+     * new context.
      */
     assert(!new_tcp_ctx->sock_ctx->listening);
     assert(!new_tcp_ctx->sock_ctx->is_active);
     closesocket(new_tcp_ctx->base.socket);
-    new_tcp_ctx->base.socket = accept_tcp_ctx->new_socket;
-    new_tcp_ctx->connected = TRUE;
-    accept_tcp_ctx->new_socket = -1;
+    new_tcp_ctx->base.socket = p->sd;
+    _tcp_zc_start(new_tcp_ctx);
+    __atomic_store_n(&new_tcp_ctx->connected, TRUE, __ATOMIC_RELEASE);
+
+    /* as is whatever's been read from it after the SYN */
+    _tcp_move_frames(&new_tcp_ctx->recv, &p->recv);
+    _tcp_unpark(accept_tcp_ctx->listener, p, FALSE);
+#if TCP_STRIPES > 1
+    if (new_tcp_ctx->stripes)
+    {
+        _tcp_stripes_accepted(new_tcp_ctx);
+
+        /* any of its stripes that got here first can join it now */
+        _tcp_stripes_rejoin(accept_tcp_ctx->listener);
+    }
+#endif
     DEBUG_LOG(("passed accepted socket %d on to new context...\n",
                new_tcp_ctx->base.socket));
 }
@@ -135,36 +412,250 @@ void _network_update_passive_state(network_context_t *new_ctx,
 ssize_t _network_send_packet(network_context_t *ctx,
                              const void *src, size_t len)
 {
-    network_context_socket_tcp_t *tcp_io_ctx;
-    uint16_t packet_len;    /* network byte order */
+    struct iovec iov;
 
     assert(ctx && src);
+
+    iov.iov_base = (void *) src;
+    iov.iov_len  = len;
+    return _network_send_packetv(ctx, &iov, 1);
+}
+
+/* send a packet given in pieces to the peer.  the length prefix and the
+ * pieces go out together in a single sendmsg(), straight from where they
+ * lie, so a packet is never copied on its way to the socket, nor split
+ * across two writes (which Nagle's algorithm may hold the second of).
+ */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
+{
+    struct iovec frame[1 + MAX_PACKET_IOV];
+    uint16_t packet_len;    /* network byte order */
+    socket_t sd;
+    size_t len;
+    int k;
+#if TCP_STRIPES > 1
+    network_context_socket_tcp_t *tcp_io_ctx;
+    int stripe = 0;
+#endif
+
+    assert(ctx && iov);
+    assert(iovcnt > 0 && iovcnt <= MAX_PACKET_IOV);
     assert(ctx->peer_addr_len > 0);
 
+    VERIFY_SOCKET(ctx);
+    DEBUG_PEER(ctx);
+
+    if (_tcp_connect(ctx) < 0)
+        return -1;
+
+    for (len = 0, k = 0; k < iovcnt; ++k)
+    {
+        frame[1 + k] = iov[k];
+        len += iov[k].iov_len;
+    }
+    assert(len <= 0xffff);
+
+    packet_len = htons(len);
+    frame[0].iov_base = &packet_len;
+    frame[0].iov_len  = sizeof(packet_len);
+
+    sd = GET_SOCKET(ctx);
+#if TCP_STRIPES > 1
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
     assert(tcp_io_ctx);
+    if (tcp_io_ctx->stripes)
+        stripe = _tcp_stripe_pick(tcp_io_ctx, iov, &sd);
+#endif
 
-    VERIFY_SOCKET(ctx);
-    DEBUG_PEER(ctx);
+    if (_tcp_writev(sd, frame, 1 + iovcnt) < 0)
+    {
+#if TCP_STRIPES > 1
+        /* the connection goes on without a stripe that's failed; STCP
+         * resends what was lost with it, as it would any other loss
+         */
+        if (stripe > 0)
+        {
+            _tcp_stripe_failed(tcp_io_ctx, stripe);
+            return len;
+        }
+#endif
+        return -1;
+    }
+
+#if TCP_STRIPES > 1
+    if (tcp_io_ctx->stripes && tcp_io_ctx->sock_ctx->is_active &&
+        stripe == 0 && !tcp_io_ctx->stripes->started)
+        _tcp_stripes_connect(ctx);
+#endif
+    return len;
+}
+
+/* send a packet whose payload (the last piece) lies in buf, which we may
+ * hold on to.  a large enough payload is sent with MSG_ZEROCOPY, so the
+ * kernel reads it from where it lies; buf is then kept until the kernel
+ * says it's done with it.  the rest of the frame is copied, as it may be
+ * changed as soon as this returns.
+ */
+ssize_t _network_send_packet_held(network_context_t *ctx,
+                                  const struct iovec *iov, int iovcnt,
+                                  void *buf)
+{
+#if TCP_USE_ZEROCOPY
+    network_context_socket_tcp_t *tcp_io_ctx;
+    tcp_zerocopy_t *zc;
+    tcp_zc_send_t *send;
+    struct iovec frame[2];
+    uint16_t packet_len;    /* network byte order */
+    size_t head_len, len;
+    ssize_t rc;
+    int k;
+
+    assert(ctx && iov && buf);
+    assert(iovcnt > 0 && iovcnt <= MAX_PACKET_IOV);
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx);
 
     if (_tcp_connect(ctx) < 0)
         return -1;
+    if (!(zc = tcp_io_ctx->zc) ||
+        iov[iovcnt - 1].iov_len < TCP_ZEROCOPY_MIN_LEN)
+        return _network_send_packetv(ctx, iov, iovcnt);
+
+    for (head_len = sizeof(packet_len), k = 0; k < iovcnt - 1; ++k)
+        head_len += iov[k].iov_len;
+    len = head_len - sizeof(packet_len) + iov[iovcnt - 1].iov_len;
+    assert(len <= 0xffff);
+
+    PTHREAD_CALL(pthread_mutex_lock(&zc->lock));
+    if (zc->num_sends == TCP_ZC_MAX_SENDS)
+        _tcp_zc_reap(tcp_io_ctx);
+    if (!zc->enabled || zc->num_sends == TCP_ZC_MAX_SENDS ||
+        head_len > TCP_ZC_HEAD_LEN)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&zc->lock));
+        return _network_send_packetv(ctx, iov, iovcnt);
+    }
+
+    /* only the transport layer sends, so the send's number is known */
+    send = &zc->sends[(zc->first + zc->num_sends) % TCP_ZC_MAX_SENDS];
+    send->id       = zc->next_id;
+    send->released = FALSE;
+    send->buf      = buf;
+    zc->num_sends++;
+    PTHREAD_CALL(pthread_mutex_unlock(&zc->lock));
 
     packet_len = htons(len);
-    if (_tcp_io(GET_SOCKET(ctx), &packet_len, sizeof(packet_len),
-                (io_func_t) write) < 0 ||
-        _tcp_io(GET_SOCKET(ctx), (void *) src, len, (io_func_t) write) < 0)
+    memcpy(send->head, &packet_len, sizeof(packet_len));
+    (void) _network_gather_packet(send->head + sizeof(packet_len),
+                                  head_len - sizeof(packet_len),
+                                  iov, iovcnt - 1);
+
+    frame[0].iov_base = send->head;
+    frame[0].iov_len  = head_len;
+    frame[1] = iov[iovcnt - 1];
+    rc = _tcp_sendmsg(GET_SOCKET(ctx), frame, 2, MSG_ZEROCOPY);
+
+    PTHREAD_CALL(pthread_mutex_lock(&zc->lock));
+    if (rc <= 0)
+    {
+        /* nothing was sent, so the number wasn't used */
+        assert(zc->num_sends > 0);
+        zc->num_sends--;
+        PTHREAD_CALL(pthread_mutex_unlock(&zc->lock));
+
+        if (rc < 0 && errno == ENOBUFS)
+            return _network_send_packetv(ctx, iov, iovcnt);
         return -1;
+    }
+    zc->next_id++;
+    PTHREAD_CALL(pthread_mutex_unlock(&zc->lock));
+
+    /* if it fell short, the rest is copied */
+    if ((size_t) rc < head_len + frame[1].iov_len)
+    {
+        int n = 2;
+        struct iovec *rest = frame;
+
+        for (; n > 0 && (size_t) rc >= rest->iov_len; ++rest, --n)
+            rc -= rest->iov_len;
+        rest->iov_base = (char *) rest->iov_base + rc;
+        rest->iov_len -= rc;
+        if (_tcp_writev(GET_SOCKET(ctx), rest, n) < 0)
+            return -1;
+    }
 
     return len;
+#else
+    return _network_send_packetv(ctx, iov, iovcnt);
+#endif
+}
+
+/* free a block passed to _network_send_packet_held(), unless the kernel is
+ * still sending from it; it's freed once the kernel's done with it then.
+ */
+void _network_free_buffer(network_context_t *ctx, void *buf)
+{
+#if TCP_USE_ZEROCOPY
+    network_context_socket_tcp_t *tcp_io_ctx;
+    tcp_zerocopy_t *zc;
+    unsigned int k;
+
+    assert(ctx);
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx);
+
+    if (!buf)
+        return;
+    if (!(zc = tcp_io_ctx->zc))
+    {
+        free(buf);
+        return;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&zc->lock));
+    _tcp_zc_reap(tcp_io_ctx);
+    for (k = 0; k < zc->num_sends; ++k)
+    {
+        tcp_zc_send_t *send = &zc->sends[(zc->first + k) % TCP_ZC_MAX_SENDS];
+
+        if (!send->released && send->buf == buf)
+            break;
+    }
+
+    if (k < zc->num_sends)
+    {
+        /* every block waiting here is in one of the sends */
+        assert(zc->num_freed < TCP_ZC_MAX_SENDS);
+        zc->freed[zc->num_freed++] = buf;
+        buf = NULL;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&zc->lock));
+
+    free(buf);
+#else
+    free(buf);
+#endif
+}
+
+/* packets are written as they're sent, so nothing is ever held back */
+void _network_flush(network_context_t *ctx)
+{
 }
 
-/* read a packet from the peer */
+/* read a packet from the peer.  frames are read into the connection's
+ * receive buffer as many at a time as will fit, and handed out from there
+ * one by one; only once there's no whole frame left is the socket read
+ * again.  returns -1, with errno set to EAGAIN, if no whole frame is there
+ * yet.
+ */
 ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
 {
     network_context_socket_tcp_t *tcp_io_ctx;
-    uint16_t packet_len;
     socket_t io_socket;
+    ssize_t len;
     int rc;
 
     assert(ctx && dst);
@@ -176,34 +667,33 @@ ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
     VERIFY_SOCKET(ctx);
     io_socket = tcp_io_ctx->base.socket;
 
-    if (tcp_io_ctx->sock_ctx->is_active && _tcp_connect(ctx) < 0)
-        return -1;
+    if (tcp_io_ctx->sock_ctx->listening)
+        return _tcp_listener_recv(ctx, dst, max_len);
 
-    if (tcp_io_ctx->sock_ctx->listening/* ||
-        (tcp_io_ctx->sock_ctx->is_active && !tcp_io_ctx->connected)*/)
+#if TCP_STRIPES > 1
+    if (tcp_io_ctx->stripes)
     {
-        socket_t tmp_sd;
+        if (tcp_io_ctx->sock_ctx->is_active && _tcp_connect(ctx) < 0)
+            return -1;
+        return _tcp_stripes_recv(ctx, dst, max_len);
+    }
+#endif
 
-        ctx->peer_addr_len = sizeof(ctx->peer_addr);
-        if ((tmp_sd = accept(GET_SOCKET(ctx),
-                             &ctx->peer_addr,
-                             &ctx->peer_addr_len)) < 0)
-        {
-            perror("accept (network_io_tcp)");
-            return tmp_sd;
-        }
+    if ((len = _tcp_next_frame(&tcp_io_ctx->recv, dst, max_len)) > 0)
+        return len;
 
-        DEBUG_LOG(("accepted from peer, tmp_sd=%d...\n", (int) tmp_sd));
+    if (tcp_io_ctx->sock_ctx->is_active && _tcp_connect(ctx) < 0)
+        return -1;
 
-        /* keep listening socket open for futher connection requests */
-        /* we will not reenter this function until this SYN packet has
-         * been dispatched to the right context, and that context's
-         * socket updated to be 'new_socket'
-         */
-        assert(tcp_io_ctx->new_socket == -1);
-        tcp_io_ctx->new_socket = tmp_sd;
-        io_socket = tmp_sd;
+#if TCP_USE_ZEROCOPY
+    /* completions make the socket look readable until they're fielded */
+    if (tcp_io_ctx->zc)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&tcp_io_ctx->zc->lock));
+        _tcp_zc_reap(tcp_io_ctx);
+        PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->zc->lock));
     }
+#endif
 
     DEBUG_PEER(ctx);
 
@@ -215,86 +705,1089 @@ ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
     }
 #endif
 
-    if ((rc = _tcp_io(io_socket, &packet_len, sizeof(packet_len), read)) <= 0)
-    {
-        DEBUG_LOG(("couldn't read packet len: %d\n", rc));
-        return rc;
-    }
-
-    packet_len = ntohs(packet_len);
-    if ((rc = _tcp_io(io_socket, dst, MIN(packet_len, max_len), read)) <= 0)
+    /* a connection's socket may be reported readable before it's
+     * connected, so it's read without blocking
+     */
+    if ((rc = _tcp_fill(io_socket, &tcp_io_ctx->recv, MSG_DONTWAIT)) <= 0)
     {
         DEBUG_LOG(("couldn't read packet: %d\n", rc));
         return rc;
     }
 
-    if (packet_len > max_len)
+    if ((len = _tcp_next_frame(&tcp_io_ctx->recv, dst, max_len)) == 0)
     {
-        /* discard unread remainder of packet */
-        char *dummy = (char *) alloca(packet_len - max_len);
-        (void) _tcp_io(io_socket, dummy, packet_len - max_len, read);
+        errno = EAGAIN;     /* the rest of the frame isn't here yet */
+        return -1;
     }
+    return len;
+}
+
+/* returns TRUE if there's a whole frame in the receive buffer, so that
+ * _network_recv_packet() can be called again without reading the socket
+ */
+bool_t _network_recv_pending(network_context_t *ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+
+    assert(ctx);
 
-    return packet_len;
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx);
+
+#if TCP_STRIPES > 1
+    if (tcp_io_ctx->stripes)
+        return _tcp_stripes_pending(tcp_io_ctx);
+#endif
+    return _tcp_frame_ready(&tcp_io_ctx->recv);
 }
 
 
-/* read/write count bytes into/from buf */
-static int _tcp_io(socket_t tcp_sd, void *buf, size_t count, io_func_t io_func)
+/* returns TRUE if there's a whole frame in the given buffer */
+static bool_t _tcp_frame_ready(const tcp_frame_buf_t *fb)
 {
-    char *cbuf = (char *) buf;
-    size_t bytes_remaining;
+    uint16_t packet_len;
+    size_t buffered;
+
+    assert(fb);
+
+    buffered = fb->end - fb->start;
+    if (buffered < sizeof(packet_len))
+        return FALSE;
+
+    memcpy(&packet_len, fb->buf + fb->start, sizeof(packet_len));
+    return buffered >= sizeof(packet_len) + ntohs(packet_len);
+}
+
+/* copy the first whole frame in the receive buffer into dst, and return
+ * its length, or 0 if there isn't one.  frames that are longer than
+ * max_len are dropped (and may have to be skipped over as they arrive,
+ * if they don't fit in the buffer).
+ */
+static ssize_t _tcp_next_frame(tcp_frame_buf_t *fb, void *dst, size_t max_len)
+{
+    assert(fb && dst);
 
-    assert(buf && io_func);
-    for (bytes_remaining = count; bytes_remaining > 0; )
+    for (;;)
     {
-        int rc;
+        char    *frame    = fb->buf + fb->start;
+        size_t   buffered = fb->end - fb->start;
+        uint16_t packet_len;
 
-        if ((rc = io_func(tcp_sd, cbuf, bytes_remaining)) <= 0)
+        if (fb->skip > 0)
         {
-            DEBUG_LOG(("_tcp_io rc: %d\n", rc));
-            return rc;
+            size_t skip = MIN(fb->skip, buffered);
+
+            fb->start += skip;
+            fb->skip  -= skip;
+            if (fb->skip > 0)
+                break;
+            continue;
+        }
+
+        if (buffered < sizeof(packet_len))
+            break;
+
+        memcpy(&packet_len, frame, sizeof(packet_len));
+        packet_len = ntohs(packet_len);
+
+        if (packet_len > max_len)
+        {
+            DEBUG_LOG(("discarding %u byte packet\n", (unsigned) packet_len));
+            fb->start += sizeof(packet_len);
+            fb->skip   = packet_len;
+            continue;
         }
 
-        assert(rc <= (int)bytes_remaining);
-        bytes_remaining -= rc;
-        cbuf += rc;
+        if (buffered < sizeof(packet_len) + packet_len)
+            break;
+
+        memcpy(dst, frame + sizeof(packet_len), packet_len);
+        fb->start += sizeof(packet_len) + packet_len;
+        if (packet_len > 0)
+            return packet_len;
+    }
+
+    if (fb->start == fb->end)
+        fb->start = fb->end = 0;
+    return 0;
+}
+
+/* read whatever the socket has into the space after what's left of a
+ * partial frame in the buffer.  returns what recv() does.
+ */
+static ssize_t _tcp_fill(socket_t tcp_sd, tcp_frame_buf_t *fb, int flags)
+{
+    ssize_t rc;
+
+    assert(fb);
+
+    if (fb->start > 0)
+    {
+        memmove(fb->buf, fb->buf + fb->start, fb->end - fb->start);
+        fb->end  -= fb->start;
+        fb->start = 0;
     }
 
-    return count;
+    assert(fb->end < sizeof(fb->buf));
+    if ((rc = recv(tcp_sd, fb->buf + fb->end, sizeof(fb->buf) - fb->end,
+                   flags)) > 0)
+        fb->end += rc;
+    return rc;
 }
 
-static int _tcp_connect(network_context_t *ctx)
+/* hand what's left in one buffer over to another, which is empty */
+static void _tcp_move_frames(tcp_frame_buf_t *dst, tcp_frame_buf_t *src)
 {
-    network_context_socket_tcp_t *tcp_io_ctx;
+    assert(dst && src);
+    assert(dst->start == dst->end && !dst->skip);
+
+    dst->end = src->end - src->start;
+    memcpy(dst->buf, src->buf + src->start, dst->end);
+    dst->start = 0;
+    dst->skip  = src->skip;
+    src->start = src->end = 0;
+    src->skip  = 0;
+}
 
-    assert(ctx);
+
+/* set a listening mysocket up to park the connections it accepts */
+static int _tcp_listener_new(network_context_socket_tcp_t *tcp_io_ctx)
+{
+    tcp_listener_t *listener;
+
+    assert(tcp_io_ctx && !tcp_io_ctx->listener);
+
+    listener = (tcp_listener_t *) calloc(1, sizeof(tcp_listener_t));
+    assert(listener);
+
+#ifdef LINUX
+    {
+        struct epoll_event event;
+
+        memset(&event, 0, sizeof(event));
+        event.events   = EPOLLIN;
+        event.data.ptr = NULL;  /* the listening socket */
+        if ((listener->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+            epoll_ctl(listener->epoll_fd, EPOLL_CTL_ADD,
+                      tcp_io_ctx->base.socket, &event) < 0)
+        {
+            perror("epoll (_tcp_listener_new)");
+            if (listener->epoll_fd >= 0)
+                close(listener->epoll_fd);
+            free(listener);
+            return -1;
+        }
+        tcp_io_ctx->base.poll_socket = listener->epoll_fd;
+    }
+#endif
+
+    tcp_io_ctx->listener = listener;
+    return 0;
+}
+
+static void _tcp_listener_free(network_context_socket_tcp_t *tcp_io_ctx)
+{
+    tcp_listener_t *listener;
+
+    assert(tcp_io_ctx && tcp_io_ctx->listener);
+    listener = tcp_io_ctx->listener;
+
+    while (listener->num_parked > 0)
+        _tcp_unpark(listener, listener->parked[0], TRUE);
+#ifdef LINUX
+    close(listener->epoll_fd);
+    tcp_io_ctx->base.poll_socket = -1;
+#endif
+    free(listener);
+    tcp_io_ctx->listener = NULL;
+}
+
+/* read a frame for a listening mysocket from one of its parked
+ * connections, taking the peer's address to be that connection's, or
+ * accept a new connection and park it.  returns -1, with errno set to
+ * EAGAIN, if there's no whole frame to hand out.
+ */
+static ssize_t _tcp_listener_recv(network_context_t *ctx,
+                                  void *dst, size_t max_len)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+    tcp_listener_t *listener;
+    tcp_parked_t *p;
+    ssize_t len;
+    int rc;
 
     tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
-    assert(tcp_io_ctx);
+    assert(tcp_io_ctx && tcp_io_ctx->listener);
+    listener = tcp_io_ctx->listener;
 
-    PTHREAD_CALL(pthread_mutex_lock(&tcp_io_ctx->connect_lock));
-    if (!tcp_io_ctx->connected)
+#ifdef LINUX
     {
-        assert(ctx->peer_addr_valid);
-        assert(ctx->peer_addr.sa_family == AF_INET);
-        assert(((struct sockaddr_in *) &ctx->peer_addr)->sin_port > 0);
+        struct epoll_event event;
 
-        DEBUG_LOG(("_tcp_connect (my_sd=%d): connecting on socket %d...\n",
-                   tcp_io_ctx->sock_ctx->my_sd, (int)GET_SOCKET(ctx)));
-        if ((connect(GET_SOCKET(ctx), &ctx->peer_addr,
-                     sizeof(ctx->peer_addr))) < 0)
+        /* if the last SYN was dropped, its connection is still parked */
+        listener->last = NULL;
+
+        if (epoll_wait(listener->epoll_fd, &event, 1, 0) <= 0)
         {
-            perror("connect (_tcp_connect)");
-            fprintf(stderr, "(errno=%d)\n", errno);
-	    PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
+            errno = EAGAIN;
             return -1;
         }
 
-        tcp_io_ctx->connected = TRUE;
+        if (!(p = (tcp_parked_t *) event.data.ptr))
+        {
+            (void) _tcp_park(ctx);
+            errno = EAGAIN; /* its first frame is read once it's there */
+            return -1;
+        }
     }
-    PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
 
-    return 0;
-}
+#if TCP_STRIPES > 1
+    if (p->joining)
+    {
+        /* only a hangup is watched for while a stripe waits */
+        DEBUG_LOG(("dropping waiting stripe %d\n", (int) p->sd));
+        _tcp_unpark(listener, p, TRUE);
+        errno = EAGAIN;
+        return -1;
+    }
+#endif
 
+    if ((len = _tcp_next_frame(&p->recv, dst, max_len)) == 0)
+    {
+        if ((rc = _tcp_fill(p->sd, &p->recv, MSG_DONTWAIT)) <= 0)
+        {
+            if (rc == 0 || errno != EAGAIN)
+            {
+                /* the peer went away before its SYN was taken */
+                DEBUG_LOG(("dropping parked connection %d\n", (int) p->sd));
+                _tcp_unpark(listener, p, TRUE);
+            }
+            errno = EAGAIN;
+            return -1;
+        }
+
+        if ((len = _tcp_next_frame(&p->recv, dst, max_len)) == 0)
+        {
+            errno = EAGAIN; /* the rest of the frame isn't here yet */
+            return -1;
+        }
+    }
+#else
+    /* without epoll, parked connections can't be watched along with the
+     * listening socket.  so a new connection's first frame is waited for
+     * as it's accepted, and one whose SYN was dropped is given up on.
+     */
+    if (listener->last)
+        _tcp_unpark(listener, listener->last, TRUE);
+
+    if (!(p = _tcp_park(ctx)))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    do
+    {
+        if ((rc = _tcp_fill(p->sd, &p->recv, 0)) <= 0)
+        {
+            DEBUG_LOG(("couldn't read packet: %d\n", rc));
+            _tcp_unpark(listener, p, TRUE);
+            errno = EAGAIN;
+            return -1;
+        }
+    } while ((len = _tcp_next_frame(&p->recv, dst, max_len)) == 0);
+#endif
+
+    memcpy(&ctx->peer_addr, &p->peer_addr, p->peer_addr_len);
+    ctx->peer_addr_len = p->peer_addr_len;
+    DEBUG_PEER(ctx);
+
+#if TCP_STRIPES > 1
+    /* a stripe joining a connection isn't one of its own */
+    if (_tcp_stripe_join_frame(listener, p, dst, len))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+#endif
+
+    listener->last = p;
+    return len;
+}
+
+/* accept a connection on a listening mysocket's socket, and park it until
+ * its first frame is taken.  it's refused if there are too many parked
+ * already.
+ */
+static tcp_parked_t *_tcp_park(network_context_t *ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+    tcp_listener_t *listener;
+    tcp_parked_t *p;
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx && tcp_io_ctx->listener);
+    listener = tcp_io_ctx->listener;
+
+    p = (tcp_parked_t *) calloc(1, sizeof(tcp_parked_t));
+    assert(p);
+
+    p->peer_addr_len = sizeof(p->peer_addr);
+    if ((p->sd = accept(GET_SOCKET(ctx), &p->peer_addr,
+                        &p->peer_addr_len)) < 0)
+    {
+        perror("accept (network_io_tcp)");
+        free(p);
+        return NULL;
+    }
+    _tcp_nodelay(p->sd);
+
+    if (listener->num_parked == TCP_MAX_PARKED)
+    {
+        DEBUG_LOG(("refusing connection %d\n", (int) p->sd));
+        closesocket(p->sd);
+        free(p);
+        return NULL;
+    }
+
+#ifdef LINUX
+    {
+        struct epoll_event event;
+
+        memset(&event, 0, sizeof(event));
+        event.events   = EPOLLIN;
+        event.data.ptr = p;
+        if (epoll_ctl(listener->epoll_fd, EPOLL_CTL_ADD, p->sd, &event) < 0)
+        {
+            perror("epoll_ctl (_tcp_park)");
+            closesocket(p->sd);
+            free(p);
+            return NULL;
+        }
+    }
+#endif
+
+    DEBUG_LOG(("accepted from peer, sd=%d...\n", (int) p->sd));
+    listener->parked[listener->num_parked++] = p;
+    return p;
+}
+
+/* stop holding a parked connection, closing it unless it's been taken
+ * over
+ */
+static void _tcp_unpark(tcp_listener_t *listener, tcp_parked_t *p,
+                        bool_t close_it)
+{
+    int k;
+
+    assert(listener && p);
+
+    for (k = 0; k < listener->num_parked && listener->parked[k] != p; ++k)
+        ;
+    assert(k < listener->num_parked);
+
+#ifdef LINUX
+    (void) epoll_ctl(listener->epoll_fd, EPOLL_CTL_DEL, p->sd, NULL);
+#endif
+    if (close_it)
+        closesocket(p->sd);
+    if (listener->last == p)
+        listener->last = NULL;
+
+    listener->parked[k] = listener->parked[--listener->num_parked];
+    free(p);
+}
+
+/* write as much of the given pieces as the socket takes in one go */
+static ssize_t _tcp_sendmsg(socket_t tcp_sd, struct iovec *iov, int iovcnt,
+                            int flags)
+{
+    struct msghdr msg;
+
+    assert(iov && iovcnt > 0);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = iovcnt;
+    return sendmsg(tcp_sd, &msg, flags | MSG_NOSIGNAL);
+}
+
+/* write out all of the given pieces, which are used up along the way */
+static int _tcp_writev(socket_t tcp_sd, struct iovec *iov, int iovcnt)
+{
+    assert(iov && iovcnt > 0);
+
+    while (iovcnt > 0)
+    {
+        ssize_t rc;
+
+        if ((rc = _tcp_sendmsg(tcp_sd, iov, iovcnt, 0)) <= 0)
+        {
+            DEBUG_LOG(("_tcp_writev rc: %d\n", (int) rc));
+            return -1;
+        }
+
+        /* skip over whatever was written, should it fall short */
+        for (; iovcnt > 0 && (size_t) rc >= iov->iov_len; ++iov, --iovcnt)
+            rc -= iov->iov_len;
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *) iov->iov_base + rc;
+            iov->iov_len -= rc;
+        }
+    }
+
+    return 0;
+}
+
+static int _tcp_connect(network_context_t *ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+
+    assert(ctx);
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx);
+
+    /* connected only ever goes from FALSE to TRUE, and stays that way, so
+     * once it's been seen set there's nothing left to serialise against.
+     * it's read here without the lock, so it's set (with release ordering)
+     * only once the socket is ready, and read with acquire ordering, lest
+     * another thread see it set before the connection it stands for.
+     */
+    if (__atomic_load_n(&tcp_io_ctx->connected, __ATOMIC_ACQUIRE))
+        return 0;
+
+    PTHREAD_CALL(pthread_mutex_lock(&tcp_io_ctx->connect_lock));
+    if (!tcp_io_ctx->connected)
+    {
+        assert(ctx->peer_addr_valid);
+        assert(ctx->peer_addr.sa_family == AF_INET);
+        assert(((struct sockaddr_in *) &ctx->peer_addr)->sin_port > 0);
+
+        DEBUG_LOG(("_tcp_connect (my_sd=%d): connecting on socket %d...\n",
+                   tcp_io_ctx->sock_ctx->my_sd, (int)GET_SOCKET(ctx)));
+        if ((connect(GET_SOCKET(ctx), &ctx->peer_addr,
+                     sizeof(ctx->peer_addr))) < 0)
+        {
+            perror("connect (_tcp_connect)");
+            fprintf(stderr, "(errno=%d)\n", errno);
+	    PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
+            return -1;
+        }
+
+        _tcp_nodelay(GET_SOCKET(ctx));
+        _tcp_zc_start(tcp_io_ctx);
+        __atomic_store_n(&tcp_io_ctx->connected, TRUE, __ATOMIC_RELEASE);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&tcp_io_ctx->connect_lock));
+
+    return 0;
+}
+
+
+/* send each frame as soon as it's written.  a frame is a whole packet, so
+ * Nagle's algorithm only holds small ones (ACKs, and the FEC parity that
+ * follows a block's last segment) back behind unacknowledged data, for
+ * up to a round trip or a delayed ACK, and buys no coalescing worth it.
+ */
+static void _tcp_nodelay(socket_t tcp_sd)
+{
+    int one = 1;
+
+    (void) setsockopt(tcp_sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+/* turn on zero-copy sends for a newly connected socket, if they're used */
+static void _tcp_zc_start(network_context_socket_tcp_t *tcp_io_ctx)
+{
+#if TCP_USE_ZEROCOPY
+    tcp_zerocopy_t *zc;
+    int one = 1;
+
+    assert(tcp_io_ctx && !tcp_io_ctx->zc);
+
+    /* the completions would have to be fielded from every stripe */
+    if (tcp_io_ctx->stripes)
+        return;
+
+    if (setsockopt(tcp_io_ctx->base.socket, SOL_SOCKET, SO_ZEROCOPY,
+                   &one, sizeof(one)) < 0)
+    {
+        DEBUG_LOG(("SO_ZEROCOPY unsupported (errno=%d)\n", errno));
+        return;
+    }
+
+    zc = (tcp_zerocopy_t *) calloc(1, sizeof(tcp_zerocopy_t));
+    assert(zc);
+    PTHREAD_CALL(pthread_mutex_init(&zc->lock, NULL));
+    zc->enabled = TRUE;
+    tcp_io_ctx->zc = zc;
+#endif
+}
+
+#if TCP_USE_ZEROCOPY
+/* field the completions on the socket's error queue, then forget the sends
+ * the kernel's done with, and free any blocks none of the rest are using.
+ * the connection's zero-copy lock must be held.
+ */
+static void _tcp_zc_reap(network_context_socket_tcp_t *tcp_io_ctx)
+{
+    tcp_zerocopy_t *zc;
+    char control[128];
+    struct msghdr msg;
+    unsigned int k, j;
+
+    assert(tcp_io_ctx && tcp_io_ctx->zc);
+    zc = tcp_io_ctx->zc;
+
+    for (;;)
+    {
+        struct cmsghdr *cm;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(tcp_io_ctx->base.socket, &msg,
+                    MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            struct sock_extended_err *serr;
+
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR))
+                continue;
+
+            serr = (struct sock_extended_err *) CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+                serr->ee_errno != 0)
+                continue;
+
+            /* sends ee_info through ee_data are done with.  if the kernel
+             * had to copy them after all (as it does over loopback), it's
+             * not worth going on.
+             */
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                zc->enabled = FALSE;
+            for (k = 0; k < zc->num_sends; ++k)
+            {
+                tcp_zc_send_t *send =
+                    &zc->sends[(zc->first + k) % TCP_ZC_MAX_SENDS];
+
+                if (send->id - serr->ee_info <= serr->ee_data - serr->ee_info)
+                    send->released = TRUE;
+            }
+        }
+    }
+
+    while (zc->num_sends > 0 && zc->sends[zc->first].released)
+    {
+        zc->first = (zc->first + 1) % TCP_ZC_MAX_SENDS;
+        zc->num_sends--;
+    }
+
+    for (j = 0; j < zc->num_freed; )
+    {
+        for (k = 0; k < zc->num_sends; ++k)
+        {
+            tcp_zc_send_t *send =
+                &zc->sends[(zc->first + k) % TCP_ZC_MAX_SENDS];
+
+            if (!send->released && send->buf == zc->freed[j])
+                break;
+        }
+
+        if (k < zc->num_sends)
+        {
+            ++j;
+            continue;
+        }
+
+        free(zc->freed[j]);
+        zc->freed[j] = zc->freed[--zc->num_freed];
+    }
+}
+#endif
+
+#if TCP_STRIPES > 1
+/* the buffer a stripe's frames are read into */
+static INLINE tcp_frame_buf_t *
+_tcp_stripe_buf(network_context_socket_tcp_t *tcp_io_ctx, int stripe)
+{
+    return (stripe > 0) ?
+        &tcp_io_ctx->stripes->bufs[stripe] : &tcp_io_ctx->recv;
+}
+
+/* set a new connection up to be striped, with its own socket as the first
+ * stripe.  if that can't be done, the connection just isn't striped.
+ */
+static void _tcp_stripes_new(network_context_socket_tcp_t *tcp_io_ctx)
+{
+    tcp_stripes_t *stripes;
+    struct epoll_event event;
+    int k;
+
+    assert(tcp_io_ctx && !tcp_io_ctx->stripes);
+
+    stripes = (tcp_stripes_t *) calloc(1, sizeof(tcp_stripes_t));
+    assert(stripes);
+
+    memset(&event, 0, sizeof(event));
+    event.events   = EPOLLIN;
+    event.data.u32 = 0;
+    if ((stripes->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+        epoll_ctl(stripes->epoll_fd, EPOLL_CTL_ADD,
+                  tcp_io_ctx->base.socket, &event) < 0)
+    {
+        perror("epoll (_tcp_stripes_new)");
+        if (stripes->epoll_fd >= 0)
+            close(stripes->epoll_fd);
+        free(stripes);
+        return;
+    }
+
+    for (k = 0; k < TCP_STRIPES; ++k)
+        stripes->fds[k] = -1;
+    PTHREAD_CALL(pthread_mutex_init(&stripes->lock, NULL));
+
+    tcp_io_ctx->stripes = stripes;
+    tcp_io_ctx->base.poll_socket = stripes->epoll_fd;
+}
+
+static void _tcp_stripes_free(network_context_socket_tcp_t *tcp_io_ctx)
+{
+    tcp_stripes_t *stripes;
+    int k;
+
+    assert(tcp_io_ctx && tcp_io_ctx->stripes);
+    stripes = tcp_io_ctx->stripes;
+
+    /* once it's out of the table, nothing else can get at it */
+    PTHREAD_CALL(pthread_mutex_lock(&join_lock));
+    if (stripes->joinable)
+    {
+        HASH_DELETE(join_table, stripes->key);
+        stripes->joinable = FALSE;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&join_lock));
+
+    for (k = 1; k < TCP_STRIPES; ++k)
+    {
+        if (stripes->fds[k] >= 0)
+            closesocket(stripes->fds[k]);
+    }
+    close(stripes->epoll_fd);
+    PTHREAD_CALL(pthread_mutex_destroy(&stripes->lock));
+    free(stripes);
+
+    tcp_io_ctx->stripes = NULL;
+    tcp_io_ctx->base.poll_socket = -1;
+}
+
+/* connect the rest of an active connection's stripes, and send each its
+ * join frame.  this waits until the SYN has gone out on the first, so the
+ * peer usually has the connection before its stripes turn up (any that get
+ * there first are held until it does).
+ * they're connected all at once, so this takes about one round trip
+ * however many there are.  a stripe that can't be connected is left out.
+ */
+static void _tcp_stripes_connect(network_context_t *ctx)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+    tcp_stripes_t *stripes;
+    socket_t fds[TCP_STRIPES];
+    int k;
+
+    assert(ctx);
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx && tcp_io_ctx->stripes);
+    stripes = tcp_io_ctx->stripes;
+
+    PTHREAD_CALL(pthread_mutex_lock(&stripes->lock));
+    if (stripes->started)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&stripes->lock));
+        return;
+    }
+    stripes->started = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&stripes->lock));
+
+    for (k = 1; k < TCP_STRIPES; ++k)
+    {
+        if ((fds[k] = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0)
+            continue;
+        _tcp_nodelay(fds[k]);
+
+        if (fcntl(fds[k], F_SETFL, O_NONBLOCK) < 0 ||
+            (connect(fds[k], &ctx->peer_addr, sizeof(ctx->peer_addr)) < 0 &&
+             errno != EINPROGRESS))
+        {
+            closesocket(fds[k]);
+            fds[k] = -1;
+        }
+    }
+
+    for (k = 1; k < TCP_STRIPES; ++k)
+    {
+        struct pollfd pfd;
+        struct epoll_event event;
+        struct iovec frame[2];
+        uint16_t packet_len;    /* network byte order */
+        tcp_join_t join;
+        int error = 0;
+        socklen_t error_len = sizeof(error);
+
+        if (fds[k] < 0)
+            continue;
+
+        pfd.fd      = fds[k];
+        pfd.events  = POLLOUT;
+        pfd.revents = 0;
+        while (poll(&pfd, 1, -1) < 0 && errno == EINTR)
+            ;
+
+        join.magic  = htonl(TCP_JOIN_MAGIC);
+        join.port   = _network_get_port(ctx);
+        join.stripe = htons(k);
+
+        packet_len = htons(sizeof(join));
+        frame[0].iov_base = &packet_len;
+        frame[0].iov_len  = sizeof(packet_len);
+        frame[1].iov_base = &join;
+        frame[1].iov_len  = sizeof(join);
+
+        memset(&event, 0, sizeof(event));
+        event.events   = EPOLLIN;
+        event.data.u32 = k;
+
+        if (getsockopt(fds[k], SOL_SOCKET, SO_ERROR, &error, &error_len) < 0 ||
+            error != 0 ||
+            fcntl(fds[k], F_SETFL, 0) < 0 ||
+            _tcp_writev(fds[k], frame, 2) < 0 ||
+            epoll_ctl(stripes->epoll_fd, EPOLL_CTL_ADD, fds[k], &event) < 0)
+        {
+            DEBUG_LOG(("couldn't connect stripe %d (errno=%d)\n",
+                       k, error ? error : errno));
+            closesocket(fds[k]);
+            continue;
+        }
+
+        PTHREAD_CALL(pthread_mutex_lock(&stripes->lock));
+        stripes->fds[k] = fds[k];
+        PTHREAD_CALL(pthread_mutex_unlock(&stripes->lock));
+    }
+}
+
+/* make a newly accepted connection's socket its first stripe, in place of
+ * the one it was set up with (which took itself out of the epoll set as it
+ * was closed), and let the rest of its stripes join it
+ */
+static void _tcp_stripes_accepted(network_context_socket_tcp_t *tcp_io_ctx)
+{
+    tcp_stripes_t *stripes;
+    struct epoll_event event;
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+
+    assert(tcp_io_ctx && tcp_io_ctx->stripes);
+    stripes = tcp_io_ctx->stripes;
+
+    memset(&event, 0, sizeof(event));
+    event.events   = EPOLLIN;
+    event.data.u32 = 0;
+    if (epoll_ctl(stripes->epoll_fd, EPOLL_CTL_ADD,
+                  tcp_io_ctx->base.socket, &event) < 0)
+    {
+        /* its input isn't being watched yet, so it can do without */
+        perror("epoll_ctl (_tcp_stripes_accepted)");
+        _tcp_stripes_free(tcp_io_ctx);
+        return;
+    }
+
+    if (getpeername(tcp_io_ctx->base.socket,
+                    (struct sockaddr *) &peer, &peer_len) < 0)
+        return;
+
+    stripes->key.addr = peer.sin_addr.s_addr;
+    stripes->key.port = peer.sin_port;
+
+    PTHREAD_CALL(pthread_mutex_lock(&join_lock));
+    if (!HASH_LOOKUP_PTR(join_table, stripes->key))
+    {
+        HASH_INSERT(join_table, stripes->key, tcp_io_ctx);
+        stripes->joinable = TRUE;
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&join_lock));
+}
+
+/* if the first frame read from a parked connection is a join, the
+ * connection is a stripe of the one it names: hand it on to that one, or
+ * if that's not here yet, keep it parked, without reading any more of it,
+ * until it is (see _tcp_stripes_rejoin()).  returns TRUE if so.
+ */
+static bool_t _tcp_stripe_join_frame(tcp_listener_t *listener,
+                                     tcp_parked_t *p,
+                                     const void *frame, size_t len)
+{
+    struct epoll_event event;
+    unsigned int k;
+
+    assert(listener && p && frame);
+
+    if (len != sizeof(p->join))
+        return FALSE;
+    memcpy(&p->join, frame, sizeof(p->join));
+    if (ntohl(p->join.magic) != TCP_JOIN_MAGIC)
+        return FALSE;
+
+    k = ntohs(p->join.stripe);
+    if (k == 0 || k >= TCP_STRIPES || p->peer_addr.sa_family != AF_INET)
+    {
+        DEBUG_LOG(("bad stripe %u, closing it\n", k));
+        _tcp_unpark(listener, p, TRUE);
+        return TRUE;
+    }
+
+    if (_tcp_stripe_join(listener, p))
+        return TRUE;
+
+    /* its packets are left in the socket until it's joined, but the peer
+     * may still give up on it
+     */
+    memset(&event, 0, sizeof(event));
+    event.events   = EPOLLRDHUP;
+    event.data.ptr = p;
+    (void) epoll_ctl(listener->epoll_fd, EPOLL_CTL_MOD, p->sd, &event);
+    p->joining = TRUE;
+    return TRUE;
+}
+
+/* hand a parked stripe, and whatever's been read from it since its join,
+ * on to the connection it names.  returns FALSE if there's no such
+ * connection (yet), or TRUE once the stripe is no longer parked.
+ */
+static bool_t _tcp_stripe_join(tcp_listener_t *listener, tcp_parked_t *p)
+{
+    network_context_socket_tcp_t *conn;
+    tcp_join_key_t key;
+    unsigned int k = ntohs(p->join.stripe);
+    bool_t joined = FALSE;
+
+    key.addr = ((struct sockaddr_in *) &p->peer_addr)->sin_addr.s_addr;
+    key.port = p->join.port;
+
+    PTHREAD_CALL(pthread_mutex_lock(&join_lock));
+    if ((conn = HASH_LOOKUP_PTR(join_table, key)) != NULL)
+    {
+        tcp_stripes_t *stripes = conn->stripes;
+        struct epoll_event event;
+
+        memset(&event, 0, sizeof(event));
+        event.events   = EPOLLIN;
+        event.data.u32 = k;
+
+        PTHREAD_CALL(pthread_mutex_lock(&stripes->lock));
+        if (stripes->fds[k] < 0 &&
+            epoll_ctl(stripes->epoll_fd, EPOLL_CTL_ADD, p->sd, &event) == 0)
+        {
+            _tcp_move_frames(&stripes->bufs[k], &p->recv);
+            stripes->fds[k] = p->sd;
+            joined = TRUE;
+        }
+        PTHREAD_CALL(pthread_mutex_unlock(&stripes->lock));
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&join_lock));
+
+    if (!conn)
+        return FALSE;
+    if (!joined)
+    {
+        DEBUG_LOG(("couldn't join stripe %u, closing it\n", k));
+    }
+    _tcp_unpark(listener, p, !joined);
+    return TRUE;
+}
+
+/* let any parked stripes whose connection has just been accepted join it */
+static void _tcp_stripes_rejoin(tcp_listener_t *listener)
+{
+    int k;
+
+    assert(listener);
+
+    for (k = 0; k < listener->num_parked; )
+    {
+        /* a stripe that's joined is replaced by the last one parked */
+        if (!listener->parked[k]->joining ||
+            !_tcp_stripe_join(listener, listener->parked[k]))
+            ++k;
+    }
+}
+
+/* choose the stripe to send a packet on, returning it, with its socket in
+ * *sd.  packets go out on each live stripe in turn, except for SYNs, which
+ * have to go on the connection's own socket (and so does anything whose
+ * header can't be seen at a glance).
+ */
+static int _tcp_stripe_pick(network_context_socket_tcp_t *tcp_io_ctx,
+                            const struct iovec *iov, socket_t *sd)
+{
+    tcp_stripes_t *stripes;
+    unsigned int k, j;
+
+    assert(tcp_io_ctx && tcp_io_ctx->stripes && iov && sd);
+    stripes = tcp_io_ctx->stripes;
+
+    if (iov[0].iov_len < sizeof(struct tcphdr) ||
+        (((const struct tcphdr *) iov[0].iov_base)->th_flags & TH_SYN))
+        return 0;
+
+    PTHREAD_CALL(pthread_mutex_lock(&stripes->lock));
+    for (j = 0; j < TCP_STRIPES; ++j)
+    {
+        k = stripes->next_send;
+        stripes->next_send = (k + 1) % TCP_STRIPES;
+        if (k == 0 || (stripes->fds[k] >= 0 && !stripes->failed[k]))
+            break;
+    }
+    assert(j < TCP_STRIPES);
+    if (k > 0)
+        *sd = stripes->fds[k];
+    PTHREAD_CALL(pthread_mutex_unlock(&stripes->lock));
+
+    return k;
+}
+
+/* stop using a stripe that's failed, other than the first */
+static void _tcp_stripe_failed(network_context_socket_tcp_t *tcp_io_ctx,
+                               int stripe)
+{
+    tcp_stripes_t *stripes;
+
+    assert(tcp_io_ctx && tcp_io_ctx->stripes);
+    assert(stripe > 0 && stripe < TCP_STRIPES);
+    stripes = tcp_io_ctx->stripes;
+
+    PTHREAD_CALL(pthread_mutex_lock(&stripes->lock));
+    if (!stripes->failed[stripe])
+    {
+        DEBUG_LOG(("stripe %d failed (errno=%d)\n", stripe, errno));
+        stripes->failed[stripe] = TRUE;
+        (void) epoll_ctl(stripes->epoll_fd, EPOLL_CTL_DEL,
+                         stripes->fds[stripe], NULL);
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&stripes->lock));
+}
+
+/* read a packet from whichever of a connection's stripes has one.  frames
+ * already read are handed out from each stripe in turn, so none is starved;
+ * once there are none left, the stripes that are readable are read again.
+ * the end of the first stripe is only reported once the others have been
+ * drained, as the peer may have sent its last packets on them.
+ */
+static ssize_t _tcp_stripes_recv(network_context_t *ctx,
+                                 void *dst, size_t max_len)
+{
+    network_context_socket_tcp_t *tcp_io_ctx;
+    tcp_stripes_t *stripes;
+    struct epoll_event events[TCP_STRIPES];
+    socket_t fds[TCP_STRIPES];
+    ssize_t len, rc, first_rc = 1;
+    int first_errno = 0;
+    int num_events, pass, j;
+    unsigned int k;
+
+    assert(ctx && dst);
+
+    tcp_io_ctx = (network_context_socket_tcp_t *) ctx->impl_data;
+    assert(tcp_io_ctx && tcp_io_ctx->stripes);
+    stripes = tcp_io_ctx->stripes;
+
+    /* stripes that join after this are read next time around */
+    PTHREAD_CALL(pthread_mutex_lock(&stripes->lock));
+    memcpy(fds, stripes->fds, sizeof(fds));
+    PTHREAD_CALL(pthread_mutex_unlock(&stripes->lock));
+    fds[0] = tcp_io_ctx->base.socket;
+
+    for (pass = 0; pass < 2; ++pass)
+    {
+        for (j = 0; j < TCP_STRIPES; ++j)
+        {
+            k = (stripes->next_recv + j) % TCP_STRIPES;
+            if (fds[k] >= 0 &&
+                (len = _tcp_next_frame(_tcp_stripe_buf(tcp_io_ctx, k),
+                                       dst, max_len)) > 0)
+            {
+                stripes->next_recv = (k + 1) % TCP_STRIPES;
+                return len;
+            }
+        }
+
+        if (pass > 0)
+            break;
+
+        if ((num_events = epoll_wait(stripes->epoll_fd,
+                                     events, TCP_STRIPES, 0)) < 0)
+            return -1;
+
+        for (j = 0; j < num_events; ++j)
+        {
+            k = events[j].data.u32;
+            assert(k < TCP_STRIPES);
+            if (fds[k] < 0)
+                continue;
+
+            rc = _tcp_fill(fds[k], _tcp_stripe_buf(tcp_io_ctx, k),
+                           MSG_DONTWAIT);
+            if (rc > 0 ||
+                (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)))
+                continue;
+
+            if (k == 0)
+            {
+                first_rc    = rc;
+                first_errno = errno;
+            }
+            else
+            {
+                _tcp_stripe_failed(tcp_io_ctx, k);
+            }
+        }
+    }
+
+    if (first_rc <= 0)
+    {
+        DEBUG_LOG(("couldn't read packet: %d\n", (int) first_rc));
+        errno = first_errno;
+        return first_rc;
+    }
+
+    errno = EAGAIN;
+    return -1;
+}
+
+/* returns TRUE if there's a whole frame buffered from any of the stripes */
+static bool_t _tcp_stripes_pending(network_context_socket_tcp_t *tcp_io_ctx)
+{
+    tcp_stripes_t *stripes;
+    socket_t fds[TCP_STRIPES];
+    int k;
+
+    assert(tcp_io_ctx && tcp_io_ctx->stripes);
+    stripes = tcp_io_ctx->stripes;
+
+    PTHREAD_CALL(pthread_mutex_lock(&stripes->lock));
+    memcpy(fds, stripes->fds, sizeof(fds));
+    PTHREAD_CALL(pthread_mutex_unlock(&stripes->lock));
+    fds[0] = tcp_io_ctx->base.socket;
+
+    for (k = 0; k < TCP_STRIPES; ++k)
+    {
+        if (fds[k] >= 0 && _tcp_frame_ready(_tcp_stripe_buf(tcp_io_ctx, k)))
+            return TRUE;
+    }
+    return FALSE;
+}
+#endif
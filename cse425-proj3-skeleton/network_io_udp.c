@@ -0,0 +1,879 @@
+/* network_io_udp.c: UDP instantiation of the underlying datagram service.
+ *
+ * each STCP packet is carried in a UDP datagram of its own, so losses,
+ * reordering and congestion are the transport layer's to deal with (as
+ * they would be over IP), rather than hidden by a TCP connection.
+ *
+ *   - an active mysocket has a UDP socket of its own, connected to its
+ *     peer.
+ *   - a listening mysocket's UDP socket is shared with every connection
+ *     accepted from it.  datagrams arriving on it are demultiplexed by the
+ *     peer's address: those from a peer with a connection go to that
+ *     connection's mysocket, and the rest to the listening mysocket (where
+ *     a SYN sets up a new connection, see _network_update_passive_state()).
+ *   - each UDP socket has one receive thread, which reads datagrams in
+ *     batches with recvmmsg(); for a listening socket, that thread serves
+ *     all of its connections.
+ *   - datagrams are sent in batches with sendmmsg().  those the transport
+ *     layer sends while handling an event are queued until it's done (see
+ *     _network_flush()); a thread that finds another already sending on
+ *     the socket leaves its datagrams for that thread to pick up along with
+ *     any others once its current batch is sent.
+ *   - where the kernel supports it, a run of equal-sized datagrams to the
+ *     same peer is handed over as one large buffer, for the kernel to
+ *     split up (UDP_SEGMENT); and coalesced datagrams are received (UDP_GRO),
+ *     several to a buffer.  either falls back to a datagram at a time if
+ *     it's not supported.
+ *
+ * network_io_recv.c isn't used with this.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include "mysock_impl.h"
+#include "mysock_hash.h"
+#include "network_io.h"
+#include "network_io_socket.h"
+#include "connection_demux.h"
+
+
+#define UDP_BATCH   32      /* datagrams sent or received at a time */
+
+/* segmentation and receive offload are used if the kernel supports them */
+#ifndef UDP_USE_OFFLOAD
+#define UDP_USE_OFFLOAD 1
+#endif
+
+#define UDP_GSO_MAX_LEN  65507  /* largest buffer the kernel will segment */
+#define UDP_GRO_BATCH    8      /* coalesced buffers received at a time */
+#define UDP_GRO_BUF_LEN  65536
+
+
+/* a datagram waiting to be sent */
+typedef struct
+{
+    struct sockaddr_in to;
+    size_t             len;
+    char               data[MAX_IP_PAYLOAD_LEN];
+} udp_packet_t;
+
+/* a UDP socket, with its receive thread.  this is used by a single active
+ * mysocket, or shared by a listening mysocket and the connections accepted
+ * from it; the socket is closed once the last of these is done with it.
+ * the owners and reference count are protected by udp_lock.
+ */
+typedef struct udp_socket
+{
+    socket_t          fd;
+    int               refs;
+    mysock_context_t *peer_ctx;     /* gets everything, if connected */
+    mysock_context_t *listener;     /* gets datagrams from unknown peers */
+
+    pthread_t         recv_thread;
+    int               exit_fd;      /* eventfd, readable once the receive
+                                     * thread should exit
+                                     */
+
+    /* datagrams are added to queue while the thread that's sending is
+     * busy with batch.  these are protected by send_lock.
+     */
+    pthread_mutex_t   send_lock;
+    pthread_cond_t    send_space;   /* signalled when queue is emptied */
+    bool_t            sending;
+    int               num_queued;
+    udp_packet_t     *queue;
+    udp_packet_t     *batch;
+
+    bool_t            gso;          /* UDP_SEGMENT works for sends (only
+                                     * changed by the sending thread)
+                                     */
+    bool_t            gro;          /* coalesced datagrams are received */
+} udp_socket_t;
+
+/* room for a UDP_SEGMENT or UDP_GRO control message */
+typedef union
+{
+    char           buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+} udp_cmsg_t;
+
+/* additional state for the mysocket; this is pointed to by impl_data in
+ * the network_context_t structure.
+ */
+typedef struct
+{
+    network_context_socket_t base;
+
+    mysock_context_t *sock_ctx;
+    udp_socket_t     *sock;         /* once receiving (or accepted) */
+    bool_t            mapped;       /* in peer_table */
+    bool_t            busy;         /* a packet is being passed to it */
+} network_context_socket_udp_t;
+
+/* key for finding an accepted connection from its peer */
+typedef struct
+{
+    socket_t  fd;                   /* shared UDP socket */
+    uint32_t  addr;                 /* peer's address and port */
+    uint16_t  port;
+} udp_peer_key_t;
+
+static INLINE bool_t udp_peer_equal(udp_peer_key_t a, udp_peer_key_t b)
+{
+    return a.fd == b.fd && a.addr == b.addr && a.port == b.port;
+}
+
+static INLINE unsigned int udp_peer_hash(udp_peer_key_t key,
+                                         unsigned int size)
+{
+    return ((key.addr * 2654435761U) ^ key.port ^ key.fd) % size;
+}
+
+HASH_TABLE_DECLARE_EXTENDED(peer_table, udp_peer_key_t, mysock_context_t *,
+                            udp_peer_hash, udp_peer_equal,
+                            MAX_NUM_CONNECTIONS);
+
+/* protects peer_table, and the UDP sockets' owners and reference counts */
+static pthread_mutex_t udp_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  udp_idle = PTHREAD_COND_INITIALIZER;  /* signalled
+                                                               * when a
+                                                               * packet has
+                                                               * been passed
+                                                               * on
+                                                               */
+
+
+static udp_peer_key_t udp_peer_key(const udp_socket_t *sock,
+                                   const struct sockaddr_in *peer);
+static udp_socket_t *udp_new_socket(socket_t fd);
+static void udp_release(udp_socket_t *sock);
+static void udp_queue(udp_socket_t *sock, const struct sockaddr_in *to,
+                      const void *src, size_t len);
+static void udp_flush(udp_socket_t *sock);
+static void udp_send_batch(udp_socket_t *sock, int num_packets);
+static int udp_gso_run(const udp_socket_t *sock, int first, int num_packets);
+static void *udp_recv_thread_func(void *arg_ptr);
+static bool_t udp_deliver(udp_socket_t *sock, const struct sockaddr_in *from,
+                          const void *packet, size_t len);
+
+
+/* initialise the network subsystem.  this function should be called before
+ * making use of any of the other network layer functions.
+ */
+int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    network_context_socket_udp_t *udp_ctx;
+    int rc;
+
+    assert(sock_ctx && net_ctx);
+    if ((rc = _network_init_socket(sock_ctx,
+                                   net_ctx,
+                                   SOCK_DGRAM,
+                                   sizeof(network_context_socket_udp_t))) < 0)
+        return rc;
+
+    udp_ctx = (network_context_socket_udp_t *) net_ctx->impl_data;
+    assert(udp_ctx);
+
+    udp_ctx->sock_ctx = sock_ctx;
+    return 0;
+}
+
+void _network_close(network_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_ctx;
+
+    assert(ctx);
+
+    udp_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_ctx && !udp_ctx->mapped && !udp_ctx->busy);
+
+    if (udp_ctx->sock)
+    {
+        /* the UDP socket closes the descriptor itself */
+        udp_release(udp_ctx->sock);
+        udp_ctx->sock = NULL;
+        udp_ctx->base.socket = -1;
+    }
+
+    _network_close_socket(ctx);
+}
+
+/* set the local port associated with the given network layer context */
+int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
+{
+    assert(ctx && addr);
+    VERIFY_SOCKET(ctx);
+
+    return _network_bind_socket(ctx, addr, addrlen);
+}
+
+/* there's nothing to do for UDP; datagrams from new peers are passed to
+ * the listening mysocket once it starts receiving
+ */
+int _network_listen(network_context_t *ctx, int backlog)
+{
+    assert(ctx);
+    VERIFY_SOCKET(ctx);
+
+    return 0;
+}
+
+/* the new mysocket shares the listening mysocket's UDP socket, and gets
+ * the datagrams that arrive on it from its peer
+ */
+void _network_update_passive_state(network_context_t *new_ctx,
+                                   network_context_t *accept_ctx,
+                                   void *user_data,
+                                   const void *syn_packet, size_t syn_len)
+{
+    network_context_socket_udp_t *new_udp_ctx;
+    network_context_socket_udp_t *accept_udp_ctx;
+    udp_socket_t *sock;
+
+    assert(new_ctx && accept_ctx && syn_packet);
+    assert(!user_data);
+    assert(new_ctx->peer_addr_valid);
+
+    new_udp_ctx = (network_context_socket_udp_t *) new_ctx->impl_data;
+    accept_udp_ctx = (network_context_socket_udp_t *) accept_ctx->impl_data;
+    assert(new_udp_ctx && accept_udp_ctx);
+    assert(!new_udp_ctx->sock_ctx->listening);
+    assert(!new_udp_ctx->sock_ctx->is_active);
+
+    sock = accept_udp_ctx->sock;
+    assert(sock && !new_udp_ctx->sock);
+
+    closesocket(new_udp_ctx->base.socket);
+    new_udp_ctx->base.socket = sock->fd;
+    new_udp_ctx->sock = sock;
+
+    PTHREAD_CALL(pthread_mutex_lock(&udp_lock));
+    sock->refs++;
+    HASH_INSERT(peer_table,
+                udp_peer_key(sock,
+                             (struct sockaddr_in *) &new_ctx->peer_addr),
+                new_udp_ctx->sock_ctx);
+    new_udp_ctx->mapped = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&udp_lock));
+}
+
+/* start receiving for the mysocket.  an active mysocket's UDP socket is
+ * connected to its peer here.
+ */
+int _network_start_recv_thread(mysock_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_ctx;
+    network_context_t *net_ctx;
+    udp_socket_t *sock;
+
+    assert(ctx);
+    net_ctx = &ctx->network_state;
+    udp_ctx = (network_context_socket_udp_t *) net_ctx->impl_data;
+    assert(udp_ctx);
+
+    if (udp_ctx->sock)
+    {
+        /* an accepted connection, on its listening mysocket's socket */
+        assert(!ctx->listening && !ctx->is_active);
+        return 0;
+    }
+
+    if (!ctx->listening)
+    {
+        assert(ctx->is_active);
+        assert(net_ctx->peer_addr_valid);
+        assert(net_ctx->peer_addr.sa_family == AF_INET);
+
+        if (connect(GET_SOCKET(net_ctx), &net_ctx->peer_addr,
+                    sizeof(net_ctx->peer_addr)) < 0)
+        {
+            perror("connect (network_io_udp)");
+            return -1;
+        }
+    }
+
+    if (!(sock = udp_new_socket(GET_SOCKET(net_ctx))))
+        return -1;
+
+    if (ctx->listening)
+        sock->listener = ctx;
+    else
+        sock->peer_ctx = ctx;
+    udp_ctx->sock = sock;
+
+    sock->recv_thread = _mysock_create_thread(udp_recv_thread_func, sock,
+                                              FALSE);
+    return 0;
+}
+
+/* block until no more network input will be passed on for the mysocket */
+void _network_stop_recv_thread(mysock_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_ctx;
+    udp_socket_t *sock;
+
+    assert(ctx);
+    udp_ctx = (network_context_socket_udp_t *) ctx->network_state.impl_data;
+    assert(udp_ctx);
+
+    if (!(sock = udp_ctx->sock))
+        return;
+
+    PTHREAD_CALL(pthread_mutex_lock(&udp_lock));
+    if (udp_ctx->mapped)
+    {
+        HASH_DELETE(peer_table,
+                    udp_peer_key(sock, (struct sockaddr_in *)
+                                       &ctx->network_state.peer_addr));
+        udp_ctx->mapped = FALSE;
+    }
+    if (sock->listener == ctx)
+        sock->listener = NULL;
+    if (sock->peer_ctx == ctx)
+        sock->peer_ctx = NULL;
+
+    while (udp_ctx->busy)
+        PTHREAD_CALL(pthread_cond_wait(&udp_idle, &udp_lock));
+    PTHREAD_CALL(pthread_mutex_unlock(&udp_lock));
+}
+
+/* send the given packet to the peer */
+ssize_t _network_send_packet(network_context_t *ctx,
+                             const void *src, size_t len)
+{
+    network_context_socket_udp_t *udp_ctx;
+
+    assert(ctx && src);
+    assert(ctx->peer_addr_len > 0);
+    assert(ctx->peer_addr.sa_family == AF_INET);
+
+    udp_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_ctx);
+    VERIFY_SOCKET(ctx);
+    DEBUG_PEER(ctx);
+
+    if (len > MAX_IP_PAYLOAD_LEN)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (!udp_ctx->sock)
+    {
+        /* nothing's being received yet, so there's no queue */
+        return sendto(GET_SOCKET(ctx), src, len, 0,
+                      &ctx->peer_addr, sizeof(struct sockaddr_in));
+    }
+
+    udp_queue(udp_ctx->sock, (struct sockaddr_in *) &ctx->peer_addr,
+              src, len);
+    return len;
+}
+
+/* datagrams are copied as they're queued, so a packet given in pieces is
+ * simply gathered up first
+ */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
+{
+    char packet[MAX_IP_PAYLOAD_LEN];
+    ssize_t len;
+
+    assert(ctx && iov);
+
+    if ((len = _network_gather_packet(packet, sizeof(packet),
+                                      iov, iovcnt)) < 0)
+        return -1;
+    return _network_send_packet(ctx, packet, len);
+}
+
+/* nothing is referred to once it's been sent, so held buffers are just
+ * sent as any others, and may be freed straight away
+ */
+ssize_t _network_send_packet_held(network_context_t *ctx,
+                                  const struct iovec *iov, int iovcnt,
+                                  void *buf)
+{
+    return _network_send_packetv(ctx, iov, iovcnt);
+}
+
+void _network_free_buffer(network_context_t *ctx, void *buf)
+{
+    free(buf);
+}
+
+/* send whatever has been queued on the mysocket's UDP socket */
+void _network_flush(network_context_t *ctx)
+{
+    network_context_socket_udp_t *udp_ctx;
+
+    assert(ctx);
+    udp_ctx = (network_context_socket_udp_t *) ctx->impl_data;
+    assert(udp_ctx);
+
+    if (udp_ctx->sock)
+        udp_flush(udp_ctx->sock);
+}
+
+
+static udp_peer_key_t udp_peer_key(const udp_socket_t *sock,
+                                   const struct sockaddr_in *peer)
+{
+    udp_peer_key_t key;
+
+    assert(sock && peer);
+
+    memset(&key, 0, sizeof(key));
+    key.fd   = sock->fd;
+    key.addr = peer->sin_addr.s_addr;
+    key.port = peer->sin_port;
+    return key;
+}
+
+static udp_socket_t *udp_new_socket(socket_t fd)
+{
+    udp_socket_t *sock;
+
+    assert(fd >= 0);
+
+    sock = (udp_socket_t *) calloc(1, sizeof(udp_socket_t));
+    assert(sock);
+    sock->fd   = fd;
+    sock->refs = 1;
+
+    if ((sock->exit_fd = eventfd(0, 0)) < 0)
+    {
+        perror("eventfd");
+        free(sock);
+        return NULL;
+    }
+
+    sock->queue = (udp_packet_t *) malloc(UDP_BATCH * sizeof(udp_packet_t));
+    sock->batch = (udp_packet_t *) malloc(UDP_BATCH * sizeof(udp_packet_t));
+    assert(sock->queue && sock->batch);
+    PTHREAD_CALL(pthread_mutex_init(&sock->send_lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&sock->send_space, NULL));
+
+#if UDP_USE_OFFLOAD
+    {
+        /* a segment size of zero leaves sends alone, unless it's given
+         * with each one; this just finds out if the option is known
+         */
+        int zero = 0, one = 1;
+
+        sock->gso = setsockopt(fd, SOL_UDP, UDP_SEGMENT,
+                               &zero, sizeof(zero)) == 0;
+        sock->gro = setsockopt(fd, SOL_UDP, UDP_GRO,
+                               &one, sizeof(one)) == 0;
+    }
+#endif
+
+    return sock;
+}
+
+/* a mysocket is done with the UDP socket; the last one to go stops the
+ * receive thread, and closes it
+ */
+static void udp_release(udp_socket_t *sock)
+{
+    uint64_t one = 1;
+    bool_t last;
+
+    assert(sock);
+
+    PTHREAD_CALL(pthread_mutex_lock(&udp_lock));
+    assert(sock->refs > 0);
+    last = (--sock->refs == 0);
+    PTHREAD_CALL(pthread_mutex_unlock(&udp_lock));
+
+    if (!last)
+        return;
+
+    assert(!sock->listener && !sock->peer_ctx && !sock->sending);
+
+    if (write(sock->exit_fd, &one, sizeof(one)) != sizeof(one))
+    {
+        assert(0);
+        abort();
+    }
+    PTHREAD_CALL(pthread_join(sock->recv_thread, NULL));
+
+    DEBUG_LOG(("UDP network layer, closing socket %d\n", (int) sock->fd));
+    closesocket(sock->fd);
+    close(sock->exit_fd);
+    PTHREAD_CALL(pthread_cond_destroy(&sock->send_space));
+    PTHREAD_CALL(pthread_mutex_destroy(&sock->send_lock));
+    free(sock->queue);
+    free(sock->batch);
+    free(sock);
+}
+
+/* queue a datagram, to be sent by the next udp_flush() */
+static void udp_queue(udp_socket_t *sock, const struct sockaddr_in *to,
+                      const void *src, size_t len)
+{
+    udp_packet_t *packet;
+
+    assert(sock && to && src);
+    assert(len <= MAX_IP_PAYLOAD_LEN);
+
+    PTHREAD_CALL(pthread_mutex_lock(&sock->send_lock));
+    while (sock->num_queued == UDP_BATCH)
+    {
+        if (!sock->sending)
+        {
+            /* it's up to us to make room */
+            PTHREAD_CALL(pthread_mutex_unlock(&sock->send_lock));
+            udp_flush(sock);
+            PTHREAD_CALL(pthread_mutex_lock(&sock->send_lock));
+            continue;
+        }
+
+        PTHREAD_CALL(pthread_cond_wait(&sock->send_space, &sock->send_lock));
+    }
+
+    packet = &sock->queue[sock->num_queued++];
+    packet->to  = *to;
+    packet->len = len;
+    memcpy(packet->data, src, len);
+    PTHREAD_CALL(pthread_mutex_unlock(&sock->send_lock));
+}
+
+/* send everything queued on the socket, unless another thread is already
+ * sending on it (in which case it picks up what's queued once it's done)
+ */
+static void udp_flush(udp_socket_t *sock)
+{
+    assert(sock);
+
+    PTHREAD_CALL(pthread_mutex_lock(&sock->send_lock));
+    if (sock->sending)
+    {
+        PTHREAD_CALL(pthread_mutex_unlock(&sock->send_lock));
+        return;
+    }
+
+    sock->sending = TRUE;
+    while (sock->num_queued > 0)
+    {
+        udp_packet_t *full = sock->queue;
+        int num_packets = sock->num_queued;
+
+        sock->queue = sock->batch;
+        sock->batch = full;
+        sock->num_queued = 0;
+        PTHREAD_CALL(pthread_cond_broadcast(&sock->send_space));
+
+        PTHREAD_CALL(pthread_mutex_unlock(&sock->send_lock));
+        udp_send_batch(sock, num_packets);
+        PTHREAD_CALL(pthread_mutex_lock(&sock->send_lock));
+    }
+    sock->sending = FALSE;
+    PTHREAD_CALL(pthread_cond_broadcast(&sock->send_space));
+    PTHREAD_CALL(pthread_mutex_unlock(&sock->send_lock));
+}
+
+/* send the datagrams in the socket's batch, a run of them at a time if
+ * the kernel will segment them.  a datagram that can't be sent is dropped,
+ * as it might have been on the way.
+ */
+static void udp_send_batch(udp_socket_t *sock, int num_packets)
+{
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    udp_cmsg_t control[UDP_BATCH];
+    int num_msgs, k, rc;
+
+    assert(sock && num_packets > 0 && num_packets <= UDP_BATCH);
+
+    memset(msgs, 0, num_packets * sizeof(msgs[0]));
+    for (k = 0; k < num_packets; ++k)
+    {
+        iov[k].iov_base = sock->batch[k].data;
+        iov[k].iov_len  = sock->batch[k].len;
+    }
+
+    for (k = num_msgs = 0; k < num_packets; ++num_msgs)
+    {
+        struct msghdr *hdr = &msgs[num_msgs].msg_hdr;
+        udp_packet_t *packet = &sock->batch[k];
+        int run = udp_gso_run(sock, k, num_packets);
+
+        hdr->msg_name    = &packet->to;
+        hdr->msg_namelen = sizeof(packet->to);
+        hdr->msg_iov     = &iov[k];
+        hdr->msg_iovlen  = run;
+
+        if (run > 1)
+        {
+            struct cmsghdr *cmsg;
+
+            hdr->msg_control    = control[num_msgs].buf;
+            hdr->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            cmsg = CMSG_FIRSTHDR(hdr);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type  = UDP_SEGMENT;
+            cmsg->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+            *(uint16_t *) CMSG_DATA(cmsg) = (uint16_t) packet->len;
+        }
+
+        k += run;
+    }
+
+    for (k = 0; k < num_msgs; )
+    {
+        struct msghdr *hdr = &msgs[k].msg_hdr;
+
+        if ((rc = sendmmsg(sock->fd, &msgs[k], num_msgs - k, 0)) >= 0)
+        {
+            k += rc;
+            continue;
+        }
+
+        if (errno == EINTR)
+            continue;
+
+        if (hdr->msg_control &&
+            (errno == EIO || errno == EINVAL ||
+             errno == EOPNOTSUPP || errno == ENOPROTOOPT))
+        {
+            /* the kernel (or the device) won't segment it after all, so
+             * send the datagrams one at a time from now on
+             */
+            size_t j;
+
+            DEBUG_LOG(("UDP_SEGMENT failed (errno=%d), not using it\n",
+                       errno));
+            sock->gso = FALSE;
+            for (j = 0; j < hdr->msg_iovlen; ++j)
+            {
+                (void) sendto(sock->fd, hdr->msg_iov[j].iov_base,
+                              hdr->msg_iov[j].iov_len, 0,
+                              (struct sockaddr *) hdr->msg_name,
+                              hdr->msg_namelen);
+            }
+        }
+        else
+        {
+            DEBUG_LOG(("sendmmsg failed (errno=%d), dropping datagram\n",
+                       errno));
+        }
+        ++k;
+    }
+}
+
+/* the number of datagrams, starting from first in the socket's batch, that
+ * can be sent as one buffer for the kernel to segment: the rest must be to
+ * the same peer and of the same size, except that the last may be shorter
+ */
+static int udp_gso_run(const udp_socket_t *sock, int first, int num_packets)
+{
+    const udp_packet_t *head = &sock->batch[first];
+    size_t total = head->len;
+    int run = 1;
+
+    if (!sock->gso)
+        return 1;
+
+    while (first + run < num_packets)
+    {
+        const udp_packet_t *next = &sock->batch[first + run];
+
+        if (next->to.sin_addr.s_addr != head->to.sin_addr.s_addr ||
+            next->to.sin_port != head->to.sin_port ||
+            next->len > head->len || total + next->len > UDP_GSO_MAX_LEN)
+        {
+            break;
+        }
+
+        total += next->len;
+        ++run;
+        if (next->len < head->len)
+            break;  /* only the last may be shorter */
+    }
+
+    return run;
+}
+
+/* the receive thread for a UDP socket.  this reads datagrams in batches,
+ * passing each on to whichever mysocket it's for, until the last mysocket
+ * using the socket is done with it.
+ */
+static void *udp_recv_thread_func(void *arg_ptr)
+{
+    udp_socket_t *sock = (udp_socket_t *) arg_ptr;
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iov[UDP_BATCH];
+    struct sockaddr_in from[UDP_BATCH];
+    udp_cmsg_t control[UDP_BATCH];
+    int num_bufs, buf_len;
+    bool_t done = FALSE;
+    char *bufs;
+    int k;
+
+    assert(sock);
+    DEBUG_LOG(("started UDP receive thread\n"));
+
+    /* with UDP_GRO, a buffer may hold several coalesced datagrams */
+    num_bufs = sock->gro ? UDP_GRO_BATCH : UDP_BATCH;
+    buf_len  = sock->gro ? UDP_GRO_BUF_LEN : MAX_IP_PAYLOAD_LEN;
+    bufs = (char *) malloc(num_bufs * buf_len);
+    assert(bufs);
+
+    while (!done)
+    {
+        struct pollfd fds[] =
+        {
+            { sock->exit_fd, POLLIN, 0 },
+            { sock->fd, POLLIN, 0 }
+        };
+        int num_msgs;
+
+        if (poll(fds, sizeof(fds) / sizeof(fds[0]), -1) < 0)
+        {
+            assert(errno == EINTR);
+            continue;
+        }
+
+        if (fds[0].revents)
+            break;
+        if (!fds[1].revents)
+            continue;
+
+        memset(msgs, 0, sizeof(msgs));
+        for (k = 0; k < num_bufs; ++k)
+        {
+            iov[k].iov_base = bufs + k * buf_len;
+            iov[k].iov_len  = buf_len;
+            msgs[k].msg_hdr.msg_name    = &from[k];
+            msgs[k].msg_hdr.msg_namelen = sizeof(from[k]);
+            msgs[k].msg_hdr.msg_iov     = &iov[k];
+            msgs[k].msg_hdr.msg_iovlen  = 1;
+            if (sock->gro)
+            {
+                msgs[k].msg_hdr.msg_control    = control[k].buf;
+                msgs[k].msg_hdr.msg_controllen = sizeof(control[k].buf);
+            }
+        }
+
+        if ((num_msgs = recvmmsg(sock->fd, msgs, num_bufs,
+                                 MSG_DONTWAIT, NULL)) < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+                continue;
+
+            /* e.g. an ICMP port unreachable on a connected socket; this
+             * is passed on as an error, as a TCP RST would be.
+             */
+            DEBUG_LOG(("recvmmsg failed (errno=%d)\n", errno));
+            done = !udp_deliver(sock, NULL, NULL, 0);
+            continue;
+        }
+
+        for (k = 0; k < num_msgs; ++k)
+        {
+            struct msghdr *hdr = &msgs[k].msg_hdr;
+            const char *buf = (const char *) iov[k].iov_base;
+            size_t len = msgs[k].msg_len, seg_len = len, offset;
+            struct cmsghdr *cmsg;
+
+            if ((hdr->msg_flags & MSG_TRUNC) ||
+                hdr->msg_namelen != sizeof(from[k]) ||
+                from[k].sin_family != AF_INET)
+            {
+                continue;   /* not one of ours */
+            }
+
+            for (cmsg = CMSG_FIRSTHDR(hdr); cmsg;
+                 cmsg = CMSG_NXTHDR(hdr, cmsg))
+            {
+                if (cmsg->cmsg_level == SOL_UDP &&
+                    cmsg->cmsg_type == UDP_GRO)
+                    seg_len = *(const int *) CMSG_DATA(cmsg);
+            }
+
+            if (seg_len == 0 || seg_len > MAX_IP_PAYLOAD_LEN)
+                continue;
+
+            /* coalesced datagrams are all seg_len long, except the last */
+            for (offset = 0; offset < len; offset += seg_len)
+            {
+                (void) udp_deliver(sock, &from[k], buf + offset,
+                                   MIN(seg_len, len - offset));
+            }
+        }
+    }
+
+    free(bufs);
+    return NULL;
+}
+
+/* pass a datagram on to the mysocket it's for, or an error (if packet is
+ * NULL) to the connected mysocket.  returns FALSE if there's nobody left
+ * to pass anything to.
+ */
+static bool_t udp_deliver(udp_socket_t *sock, const struct sockaddr_in *from,
+                          const void *packet, size_t len)
+{
+    network_context_socket_udp_t *udp_ctx;
+    mysock_context_t *ctx;
+
+    assert(sock);
+    assert(!packet || from);
+
+    PTHREAD_CALL(pthread_mutex_lock(&udp_lock));
+    if (!(ctx = sock->peer_ctx) && packet &&
+        !(ctx = HASH_LOOKUP_PTR(peer_table, udp_peer_key(sock, from))))
+        ctx = sock->listener;
+
+    if (!ctx)
+    {
+        bool_t connected = !sock->listener;
+
+        PTHREAD_CALL(pthread_mutex_unlock(&udp_lock));
+        return !connected;
+    }
+
+    udp_ctx = (network_context_socket_udp_t *) ctx->network_state.impl_data;
+    assert(udp_ctx && !udp_ctx->busy);
+    udp_ctx->busy = TRUE;
+    PTHREAD_CALL(pthread_mutex_unlock(&udp_lock));
+
+    if (!packet)
+    {
+        /* signal an error to the transport layer */
+        _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue, NULL, 0);
+    }
+    else if (ctx->listening)
+    {
+        /* a datagram from a new peer; if it's a SYN, this sets up a new
+         * connection
+         */
+        _mysock_enqueue_connection(ctx, packet, len,
+                                   (const struct sockaddr *) from,
+                                   sizeof(*from), NULL);
+    }
+    else
+    {
+        /* enqueue the packet directly for this context */
+        _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue, packet, len);
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&udp_lock));
+    udp_ctx->busy = FALSE;
+    PTHREAD_CALL(pthread_cond_broadcast(&udp_idle));
+    PTHREAD_CALL(pthread_mutex_unlock(&udp_lock));
+
+    return packet != NULL;
+}
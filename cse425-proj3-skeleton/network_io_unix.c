@@ -0,0 +1,570 @@
+/* network_io_unix.c: Unix domain socket instantiation of the underlying
+ * datagram service, for connections between processes on the same host.
+ *
+ * this works like network_io_tcp.c (and reads packets with
+ * network_io_recv.c), but over SOCK_SEQPACKET sockets rather than TCP
+ * connections.  these keep the boundaries between packets, so each packet
+ * is sent and received whole with a single call, without a length prefix,
+ * and without going through the kernel's TCP stack at all.
+ *
+ *   - a port is claimed by binding the mysocket's socket with a name (in
+ *     the abstract namespace) made from it.  a listening mysocket listens
+ *     on that socket.
+ *   - on an STCP SYN, the active side connects to the listening socket,
+ *     and sends the address it sends from (which a Unix domain socket
+ *     can't tell the passive side) ahead of the SYN.
+ *   - the passive side dispatches the SYN to a new context, whose socket
+ *     is updated to be the newly accepted connection, as with TCP.  until
+ *     then, the connection is parked with the listening mysocket, which
+ *     waits for input on an epoll set of its socket and all its parked
+ *     connections; so if the SYN is dropped (the listen queue being
+ *     full), a retransmission of it is read later.
+ *   - as with loopback, every address is taken to be this host's own, so
+ *     packets are sent from whatever address they're sent to.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stddef.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "network_io_socket.h"
+
+#ifndef LINUX
+#error the abstract socket namespace is specific to Linux
+#endif
+
+
+#define UNIX_NAME_FORMAT "stcp-unix-%u"    /* abstract socket for a port */
+
+/* ephemeral ports are chosen from this range */
+#define UNIX_FIRST_EPHEMERAL 32768
+#define UNIX_LAST_EPHEMERAL  60999
+
+/* connections a listening mysocket holds before refusing more */
+#define UNIX_MAX_PARKED MAX_NUM_CONNECTIONS
+
+/* sent by the active side when it connects, ahead of the SYN */
+typedef struct
+{
+    struct sockaddr_in from;    /* the active side's address, as it sees it */
+} unix_hello_t;
+
+/* an accepted connection that hasn't been taken over by a new context */
+typedef struct
+{
+    socket_t           sd;
+    struct sockaddr_in from;
+} unix_parked_t;
+
+typedef struct
+{
+    network_context_socket_t base;  /* for a listening mysocket, the
+                                     * socket is its epoll set
+                                     */
+
+    /* additional state required by Unix domain network layer */
+    mysock_context_t *sock_ctx;
+    socket_t          new_socket;   /* connection the last SYN came from */
+    pthread_mutex_t   connect_lock;
+    bool_t            connected;
+    uint16_t          port;         /* local port (host byte order) */
+
+    /* listening mysockets only */
+    socket_t          listen_socket;
+    unix_parked_t    *parked;
+    int               num_parked;
+} network_context_socket_unix_t;
+
+
+static socklen_t unix_port_name(uint16_t port, struct sockaddr_un *sun);
+static int unix_connect(network_context_t *ctx);
+static void unix_accept(network_context_socket_unix_t *unix_io_ctx);
+static void unix_unpark(network_context_socket_unix_t *unix_io_ctx, int k,
+                        bool_t close_it);
+
+
+/* initialise the network subsystem.  this function should be called before
+ * making use of any of the other network layer functions.
+ */
+int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    network_context_socket_unix_t *unix_io_ctx;
+
+    assert(sock_ctx && net_ctx);
+
+    memset(net_ctx, 0, sizeof(*net_ctx));
+    net_ctx->random_seed = 0x632a;
+
+    unix_io_ctx = (network_context_socket_unix_t *)
+        calloc(1, sizeof(network_context_socket_unix_t));
+    assert(unix_io_ctx);
+
+    if ((unix_io_ctx->base.socket = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+    {
+        perror("socket");
+        assert(0);
+        free(unix_io_ctx);
+        return -1;
+    }
+
+    unix_io_ctx->sock_ctx = sock_ctx;
+    unix_io_ctx->new_socket = -1;
+    unix_io_ctx->connected = FALSE;
+    unix_io_ctx->listen_socket = -1;
+    unix_io_ctx->base.poll_socket = -1;
+
+    PTHREAD_CALL(pthread_mutex_init(&unix_io_ctx->connect_lock, NULL));
+
+    net_ctx->impl_data = unix_io_ctx;
+    return 0;
+}
+
+void _network_close(network_context_t *ctx)
+{
+    network_context_socket_unix_t *unix_io_ctx;
+
+    assert(ctx);
+
+    unix_io_ctx = (network_context_socket_unix_t *) ctx->impl_data;
+    assert(unix_io_ctx);
+
+    while (unix_io_ctx->num_parked > 0)
+        unix_unpark(unix_io_ctx, unix_io_ctx->num_parked - 1, TRUE);
+    if (unix_io_ctx->listen_socket != -1)
+        closesocket(unix_io_ctx->listen_socket);
+
+    DEBUG_LOG(("unix network layer, closing socket %d\n",
+               (int) unix_io_ctx->base.socket));
+    closesocket(unix_io_ctx->base.socket);
+
+    PTHREAD_CALL(pthread_mutex_destroy(&unix_io_ctx->connect_lock));
+
+    free(unix_io_ctx->parked);
+    free(unix_io_ctx);
+    ctx->impl_data = NULL;
+}
+
+/* claim the given local port, or an unused one if it's zero, by binding
+ * the socket.  the address itself doesn't matter.
+ */
+int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
+{
+    network_context_socket_unix_t *unix_io_ctx;
+    struct sockaddr_un sun;
+    uint16_t port, first;
+    int k;
+
+    assert(ctx && addr);
+    VERIFY_SOCKET(ctx);
+
+    unix_io_ctx = (network_context_socket_unix_t *) ctx->impl_data;
+
+    if (addrlen < (int) sizeof(struct sockaddr_in) ||
+        addr->sa_family != AF_INET)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if ((port = ntohs(((struct sockaddr_in *) addr)->sin_port)) != 0)
+    {
+        if (bind(GET_SOCKET(ctx), (struct sockaddr *) &sun,
+                 unix_port_name(port, &sun)) < 0)
+            return -1;
+    }
+    else
+    {
+        /* start somewhere different in each process */
+        first = UNIX_FIRST_EPHEMERAL +
+                (getpid() * 7919 + ctx->random_seed) %
+                (UNIX_LAST_EPHEMERAL - UNIX_FIRST_EPHEMERAL + 1);
+
+        for (k = 0; ; ++k)
+        {
+            if (k > UNIX_LAST_EPHEMERAL - UNIX_FIRST_EPHEMERAL)
+            {
+                errno = EADDRINUSE;
+                return -1;
+            }
+
+            port = first + k;
+            if (port > UNIX_LAST_EPHEMERAL)
+                port -= UNIX_LAST_EPHEMERAL - UNIX_FIRST_EPHEMERAL + 1;
+
+            if (bind(GET_SOCKET(ctx), (struct sockaddr *) &sun,
+                     unix_port_name(port, &sun)) == 0)
+                break;
+            if (errno != EADDRINUSE)
+                return -1;
+        }
+    }
+
+    unix_io_ctx->port = port;
+    return 0;
+}
+
+/* listen on the socket, and wait for input on an epoll set of it (and the
+ * connections accepted from it) from now on
+ */
+int _network_listen(network_context_t *ctx, int backlog)
+{
+    network_context_socket_unix_t *unix_io_ctx;
+    struct epoll_event event;
+    socket_t epoll_fd;
+
+    assert(ctx);
+    VERIFY_SOCKET(ctx);
+
+    unix_io_ctx = (network_context_socket_unix_t *) ctx->impl_data;
+    assert(unix_io_ctx->listen_socket == -1);
+
+    if (listen(GET_SOCKET(ctx), backlog) < 0)
+        return -1;
+
+    if ((epoll_fd = epoll_create1(0)) < 0)
+        return -1;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = GET_SOCKET(ctx);
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, GET_SOCKET(ctx), &event) < 0)
+    {
+        closesocket(epoll_fd);
+        return -1;
+    }
+
+    unix_io_ctx->parked = (unix_parked_t *)
+        calloc(UNIX_MAX_PARKED, sizeof(unix_parked_t));
+    assert(unix_io_ctx->parked);
+
+    unix_io_ctx->listen_socket = GET_SOCKET(ctx);
+    unix_io_ctx->base.socket = epoll_fd;
+    return 0;
+}
+
+/* returns the local port, in network byte order */
+int _network_get_port(network_context_t *ctx)
+{
+    assert(ctx && ctx->impl_data);
+    return htons(((network_context_socket_unix_t *) ctx->impl_data)->port);
+}
+
+/* every address is our own, so packets to the peer are sent from the same
+ * address they're sent to
+ */
+uint32_t _network_get_interface_ip(uint32_t peer_addr)
+{
+    return (peer_addr != htonl(INADDR_ANY)) ? peer_addr
+                                            : htonl(INADDR_LOOPBACK);
+}
+
+void _network_update_passive_state(network_context_t *new_ctx,
+                                   network_context_t *accept_ctx,
+                                   void *user_data,
+                                   const void *syn_packet, size_t syn_len)
+{
+    network_context_socket_unix_t *new_unix_ctx;
+    network_context_socket_unix_t *accept_unix_ctx;
+    int k;
+
+    assert(new_ctx && accept_ctx && syn_packet);
+    assert(!user_data);
+
+    new_unix_ctx = (network_context_socket_unix_t *) new_ctx->impl_data;
+    accept_unix_ctx = (network_context_socket_unix_t *) accept_ctx->impl_data;
+
+    assert(new_unix_ctx && accept_unix_ctx);
+    assert(accept_unix_ctx->new_socket != -1);
+
+    /* the connection the SYN arrived on is used for reading/writing by the
+     * new context, which shares the listening socket's port.
+     */
+    for (k = 0; accept_unix_ctx->parked[k].sd != accept_unix_ctx->new_socket;
+         ++k)
+        assert(k < accept_unix_ctx->num_parked);
+    unix_unpark(accept_unix_ctx, k, FALSE);
+
+    assert(!new_unix_ctx->sock_ctx->listening);
+    assert(!new_unix_ctx->sock_ctx->is_active);
+    closesocket(new_unix_ctx->base.socket);
+    new_unix_ctx->base.socket = accept_unix_ctx->new_socket;
+    new_unix_ctx->connected = TRUE;
+    new_unix_ctx->port = accept_unix_ctx->port;
+    accept_unix_ctx->new_socket = -1;
+    DEBUG_LOG(("passed accepted socket %d on to new context...\n",
+               new_unix_ctx->base.socket));
+}
+
+
+/* send the given packet to the peer */
+ssize_t _network_send_packet(network_context_t *ctx,
+                             const void *src, size_t len)
+{
+    struct iovec iov;
+
+    assert(ctx && src);
+
+    iov.iov_base = (void *) src;
+    iov.iov_len  = len;
+    return _network_send_packetv(ctx, &iov, 1);
+}
+
+/* send a packet given in pieces to the peer.  a SOCK_SEQPACKET socket keeps
+ * the pieces of one sendmsg() together as a single record.
+ */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
+{
+    struct msghdr msg;
+    ssize_t rc;
+
+    assert(ctx && iov && iovcnt > 0);
+    assert(ctx->peer_addr_len > 0);
+
+    VERIFY_SOCKET(ctx);
+    DEBUG_PEER(ctx);
+
+    if (unix_connect(ctx) < 0)
+        return -1;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = (struct iovec *) iov;
+    msg.msg_iovlen = iovcnt;
+    if ((rc = sendmsg(GET_SOCKET(ctx), &msg, MSG_NOSIGNAL)) < 0)
+    {
+        DEBUG_LOG(("unix send failed (errno=%d)\n", errno));
+        return -1;
+    }
+
+    return rc;
+}
+
+/* nothing is referred to once it's been sent, so held buffers are just
+ * sent as any others, and may be freed straight away
+ */
+ssize_t _network_send_packet_held(network_context_t *ctx,
+                                  const struct iovec *iov, int iovcnt,
+                                  void *buf)
+{
+    return _network_send_packetv(ctx, iov, iovcnt);
+}
+
+void _network_free_buffer(network_context_t *ctx, void *buf)
+{
+    free(buf);
+}
+
+/* packets are written as they're sent, so nothing is ever held back */
+void _network_flush(network_context_t *ctx)
+{
+}
+
+/* read a packet from the peer.  for a listening mysocket, this accepts a
+ * new connection, or reads a packet from one of its parked connections,
+ * taking the peer's address to be that connection's.
+ */
+ssize_t _network_recv_packet(network_context_t *ctx, void *dst, size_t max_len)
+{
+    network_context_socket_unix_t *unix_io_ctx;
+    struct epoll_event event;
+    ssize_t rc;
+    int k;
+
+    assert(ctx && dst);
+
+    unix_io_ctx = (network_context_socket_unix_t *) ctx->impl_data;
+    assert(unix_io_ctx);
+    assert(unix_io_ctx->sock_ctx);
+
+    VERIFY_SOCKET(ctx);
+
+    if (!unix_io_ctx->sock_ctx->listening)
+    {
+        /* an unconnected socket is reported as hung up, so it may be read
+         * before the SYN has been sent
+         */
+        if (unix_io_ctx->sock_ctx->is_active && unix_connect(ctx) < 0)
+            return -1;
+
+        if ((rc = recv(GET_SOCKET(ctx), dst, max_len, MSG_DONTWAIT)) <= 0)
+        {
+            DEBUG_LOG(("couldn't read packet: %d\n", (int) rc));
+        }
+        return rc;
+    }
+
+    /* if the last SYN was dropped, its connection is still parked */
+    unix_io_ctx->new_socket = -1;
+
+    if (epoll_wait(GET_SOCKET(ctx), &event, 1, 0) <= 0)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (event.data.fd == unix_io_ctx->listen_socket)
+    {
+        unix_accept(unix_io_ctx);
+        errno = EAGAIN; /* its SYN is read once it's there */
+        return -1;
+    }
+
+    for (k = 0; unix_io_ctx->parked[k].sd != event.data.fd; ++k)
+        assert(k < unix_io_ctx->num_parked);
+
+    if ((rc = recv(event.data.fd, dst, max_len, MSG_DONTWAIT)) <= 0)
+    {
+        if (rc == 0 || errno != EAGAIN)
+        {
+            /* the peer went away before its SYN was taken */
+            DEBUG_LOG(("dropping parked connection %d\n", event.data.fd));
+            unix_unpark(unix_io_ctx, k, TRUE);
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+
+    memcpy(&ctx->peer_addr, &unix_io_ctx->parked[k].from,
+           sizeof(unix_io_ctx->parked[k].from));
+    ctx->peer_addr_len = sizeof(unix_io_ctx->parked[k].from);
+    unix_io_ctx->new_socket = event.data.fd;
+    return rc;
+}
+
+/* each packet is read from the socket as it's handed out */
+bool_t _network_recv_pending(network_context_t *ctx)
+{
+    return FALSE;
+}
+
+
+/* the abstract socket name for a port */
+static socklen_t unix_port_name(uint16_t port, struct sockaddr_un *sun)
+{
+    int len;
+
+    memset(sun, 0, sizeof(*sun));
+    sun->sun_family = AF_UNIX;
+    len = snprintf(sun->sun_path + 1, sizeof(sun->sun_path) - 1,
+                   UNIX_NAME_FORMAT, (unsigned int) port);
+    assert(len > 0 && len < (int) sizeof(sun->sun_path) - 1);
+
+    return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+/* connect to the peer's listening mysocket, if we haven't already, and
+ * tell it who we are
+ */
+static int unix_connect(network_context_t *ctx)
+{
+    network_context_socket_unix_t *unix_io_ctx;
+    struct sockaddr_un sun;
+    socklen_t sun_len;
+    unix_hello_t hello;
+    int rc = 0;
+
+    assert(ctx);
+
+    unix_io_ctx = (network_context_socket_unix_t *) ctx->impl_data;
+    assert(unix_io_ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&unix_io_ctx->connect_lock));
+    if (!unix_io_ctx->connected)
+    {
+        assert(ctx->peer_addr_valid);
+        assert(ctx->peer_addr.sa_family == AF_INET);
+        assert(((struct sockaddr_in *) &ctx->peer_addr)->sin_port > 0);
+
+        memset(&hello, 0, sizeof(hello));
+        hello.from.sin_family      = AF_INET;
+        hello.from.sin_port        = _network_get_port(ctx);
+        hello.from.sin_addr.s_addr = _network_get_local_addr(ctx);
+
+        sun_len = unix_port_name(
+            ntohs(((struct sockaddr_in *) &ctx->peer_addr)->sin_port), &sun);
+
+        DEBUG_LOG(("unix_connect (my_sd=%d): connecting on socket %d...\n",
+                   unix_io_ctx->sock_ctx->my_sd, (int) GET_SOCKET(ctx)));
+        if (connect(GET_SOCKET(ctx), (struct sockaddr *) &sun, sun_len) < 0 ||
+            send(GET_SOCKET(ctx), &hello, sizeof(hello), MSG_NOSIGNAL) < 0)
+        {
+            DEBUG_LOG(("unix connect failed (errno=%d)\n", errno));
+            rc = -1;
+        }
+        else
+        {
+            unix_io_ctx->connected = TRUE;
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&unix_io_ctx->connect_lock));
+
+    return rc;
+}
+
+/* accept a connection on the listening socket, read the peer's address
+ * from it, and park it until its SYN is taken.  the connection is refused
+ * if it isn't set up properly, or there are too many parked already.
+ */
+static void unix_accept(network_context_socket_unix_t *unix_io_ctx)
+{
+    struct epoll_event event;
+    unix_parked_t *p;
+    socket_t sd;
+
+    assert(unix_io_ctx && unix_io_ctx->parked);
+
+    if ((sd = accept(unix_io_ctx->listen_socket, NULL, NULL)) < 0)
+    {
+        DEBUG_LOG(("unix accept failed (errno=%d)\n", errno));
+        return;
+    }
+
+    p = &unix_io_ctx->parked[unix_io_ctx->num_parked];
+    if (unix_io_ctx->num_parked == UNIX_MAX_PARKED ||
+        recv(sd, &p->from, sizeof(p->from), 0) != (ssize_t) sizeof(p->from) ||
+        p->from.sin_family != AF_INET)
+    {
+        DEBUG_LOG(("unix accept: refusing connection\n"));
+        closesocket(sd);
+        return;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = sd;
+    if (epoll_ctl(unix_io_ctx->base.socket, EPOLL_CTL_ADD, sd, &event) < 0)
+    {
+        perror("epoll_ctl (network_io_unix)");
+        closesocket(sd);
+        return;
+    }
+
+    DEBUG_LOG(("accepted from peer, sd=%d...\n", (int) sd));
+    p->sd = sd;
+    unix_io_ctx->num_parked++;
+}
+
+/* stop waiting for input on a parked connection, closing it unless it's
+ * been taken over
+ */
+static void unix_unpark(network_context_socket_unix_t *unix_io_ctx, int k,
+                        bool_t close_it)
+{
+    assert(unix_io_ctx && k >= 0 && k < unix_io_ctx->num_parked);
+
+    (void) epoll_ctl(unix_io_ctx->base.socket, EPOLL_CTL_DEL,
+                     unix_io_ctx->parked[k].sd, NULL);
+    if (close_it)
+        closesocket(unix_io_ctx->parked[k].sd);
+
+    unix_io_ctx->parked[k] = unix_io_ctx->parked[--unix_io_ctx->num_parked];
+}
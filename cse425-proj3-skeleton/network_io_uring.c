@@ -0,0 +1,1085 @@
+/* network_io_uring.c: TCP instantiation of the underlying datagram
+ * service, doing its I/O through io_uring (Linux 6.0 or later).
+ *
+ * packets are framed exactly as in network_io_tcp.c (a two-byte length,
+ * then the packet), so either end may use either implementation.  but
+ * rather than a blocking write() or two per packet sent, and a read() or
+ * two per packet received, all the connections share a single io_uring:
+ *   - each connection has a multishot receive outstanding, taking buffers
+ *     from a ring of receive buffers registered with the kernel.  the
+ *     completions are split into packets (putting together any that span
+ *     buffers), and passed on, by a single completion thread.
+ *   - packets sent are added to the connection's send buffer.  one send
+ *     is in flight per connection at a time; packets sent meanwhile are
+ *     batched into the next send once it completes.
+ *   - submissions are left to the completion thread, which submits
+ *     whatever has been queued each time it goes back to the kernel for
+ *     more completions.  only if it's already waiting does the sender
+ *     submit itself.
+ *   - a listening socket has an accept outstanding.  an accepted
+ *     connection's input goes to the listening mysocket until its SYN has
+ *     been dispatched to a new mysocket (which, if the listen queue is
+ *     full, waits for the SYN to be resent), then to that mysocket.
+ *
+ * connections are set up and torn down with ordinary system calls, and
+ * network_io_socket.c is used for everything not to do with the data
+ * path.  network_io_recv.c isn't used with this.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "mysock_impl.h"
+#include "network_io.h"
+#include "network_io_socket.h"
+#include "connection_demux.h"
+
+
+#define URING_ENTRIES       256     /* submission queue size */
+#define URING_NUM_BUFS      64      /* receive buffers (a power of two) */
+#define URING_BUF_LEN       16384
+#define URING_BUF_GROUP     0
+#define URING_SEND_BUF_LEN  65536   /* per connection, for each of two */
+
+/* operations, kept in the low bits of a request's user_data (the rest is
+ * the connection it's for)
+ */
+#define URING_OP_RECV       0
+#define URING_OP_SEND       1
+#define URING_OP_ACCEPT     2
+#define URING_OP_MASK       3
+
+#define URING_LOAD_ACQUIRE(p)       __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define URING_STORE_RELEASE(p, v)   __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+#define URING_FRAME_HEADER_LEN      sizeof(uint16_t)
+
+
+/* a TCP connection (or listening socket) driven through the ring.  this
+ * owns the socket, which is closed only once there are no more requests
+ * outstanding for it.  everything here is protected by the ring's lock,
+ * apart from the receive state, which is only used by the completion
+ * thread.
+ */
+typedef struct uring_conn
+{
+    int                 fd;
+    bool_t              listening;
+    mysock_context_t   *owner;      /* where input goes; NULL once stopped */
+    bool_t              busy;       /* input is being passed to the owner */
+    bool_t              eof;        /* there's no more input */
+    bool_t              closed;     /* the mysocket is done with it */
+    int                 num_ops;    /* requests outstanding */
+
+    struct sockaddr     peer_addr;  /* for accepted connections */
+    socklen_t           peer_addr_len;
+
+    /* packets are added to send_buf[pending], while the other buffer's
+     * contents are in flight (if sending is set)
+     */
+    char               *send_buf[2];
+    size_t              send_len[2];
+    int                 pending;
+    size_t              sent;       /* of the buffer in flight, so far */
+    bool_t              sending;
+    int                 send_error; /* errno of a failed send, or 0 */
+
+    /* receive state: a packet that spans receive buffers is put back
+     * together here
+     */
+    size_t              frame_len;
+    char                frame[URING_FRAME_HEADER_LEN + 0xffff];
+
+    struct uring_conn  *next;       /* in ring.conns */
+} uring_conn_t;
+
+/* additional state for the mysocket; this is pointed to by impl_data in
+ * the network_context_t structure.
+ */
+typedef struct
+{
+    network_context_socket_t base;
+
+    mysock_context_t *sock_ctx;
+    uring_conn_t     *conn;         /* once connected or listening */
+    uring_conn_t     *new_conn;     /* connection whose SYN is being
+                                     * dispatched, if listening
+                                     */
+} network_context_socket_uring_t;
+
+static struct
+{
+    bool_t                    ok;       /* the ring was set up */
+    int                       fd;
+
+    /* protects the submission queue, and all the connections */
+    pthread_mutex_t           lock;
+    pthread_cond_t            changed;  /* a connection stopped being busy,
+                                         * or finished sending
+                                         */
+
+    unsigned int             *sq_head;
+    unsigned int             *sq_tail;
+    unsigned int             *sq_array;
+    unsigned int              sq_mask;
+    unsigned int              sq_entries;
+    struct io_uring_sqe      *sqes;
+    unsigned int              sqe_tail;
+    bool_t                    waiting;      /* the completion thread is
+                                             * waiting in the kernel
+                                             */
+
+    unsigned int             *cq_head;
+    unsigned int             *cq_tail;
+    unsigned int              cq_mask;
+    struct io_uring_cqe      *cqes;
+
+    struct io_uring_buf_ring *buf_ring;
+    uint16_t                  buf_tail;
+    char                     *bufs;
+
+    uring_conn_t             *conns;
+} ring;
+
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+
+
+static void uring_init(void);
+static int uring_enter(unsigned int to_submit, unsigned int min_complete,
+                       unsigned int flags);
+static struct io_uring_sqe *uring_get_sqe(uring_conn_t *conn, int op);
+static void uring_commit_sqe(void);
+static unsigned int uring_unsubmitted(void);
+static void uring_flush(void);
+static void uring_recycle_buf(unsigned int bid);
+static uring_conn_t *uring_new_conn(int fd, mysock_context_t *owner);
+static void uring_release(uring_conn_t *conn);
+static void uring_shutdown(uring_conn_t *conn);
+static void uring_queue_recv(uring_conn_t *conn);
+static void uring_queue_accept(uring_conn_t *conn);
+static void uring_queue_send(uring_conn_t *conn);
+static void *uring_thread_func(void *arg_ptr);
+static void uring_complete(uint64_t user_data, int res, unsigned int flags);
+static void uring_recv_done(uring_conn_t *conn, int res, unsigned int flags);
+static void uring_send_done(uring_conn_t *conn, int res);
+static void uring_accept_done(uring_conn_t *conn, int res);
+static void uring_input(uring_conn_t *conn, const char *buf, size_t len);
+static void uring_deliver(uring_conn_t *conn, const char *packet,
+                          size_t len);
+
+
+/* initialise the network subsystem.  this function should be called before
+ * making use of any of the other network layer functions.
+ */
+int _network_init(mysock_context_t *sock_ctx, network_context_t *net_ctx)
+{
+    network_context_socket_uring_t *uring_ctx;
+    int rc;
+
+    assert(sock_ctx && net_ctx);
+
+    PTHREAD_CALL(pthread_once(&ring_once, uring_init));
+    if (!ring.ok)
+    {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    if ((rc = _network_init_socket(sock_ctx,
+                                   net_ctx,
+                                   SOCK_STREAM,
+                                   sizeof(network_context_socket_uring_t))) < 0)
+        return rc;
+
+    uring_ctx = (network_context_socket_uring_t *) net_ctx->impl_data;
+    assert(uring_ctx);
+
+    uring_ctx->sock_ctx = sock_ctx;
+    return 0;
+}
+
+/* wait for anything still to be sent to be handed to the kernel, then let
+ * go of the connection
+ */
+void _network_close(network_context_t *ctx)
+{
+    network_context_socket_uring_t *uring_ctx;
+    uring_conn_t *conn;
+
+    assert(ctx);
+
+    uring_ctx = (network_context_socket_uring_t *) ctx->impl_data;
+    assert(uring_ctx && !uring_ctx->new_conn);
+
+    if ((conn = uring_ctx->conn) != NULL)
+    {
+        PTHREAD_CALL(pthread_mutex_lock(&ring.lock));
+        while (conn->sending && !conn->send_error)
+            PTHREAD_CALL(pthread_cond_wait(&ring.changed, &ring.lock));
+
+        assert(!conn->busy && !conn->owner);
+        conn->closed = TRUE;
+        uring_shutdown(conn);
+        uring_release(conn);
+        PTHREAD_CALL(pthread_mutex_unlock(&ring.lock));
+
+        /* the connection closes the socket itself */
+        uring_ctx->conn = NULL;
+        uring_ctx->base.socket = -1;
+    }
+
+    _network_close_socket(ctx);
+}
+
+/* set the local port associated with the given network layer context */
+int _network_bind(network_context_t *ctx, struct sockaddr *addr, int addrlen)
+{
+    assert(ctx && addr);
+    VERIFY_SOCKET(ctx);
+
+    return _network_bind_socket(ctx, addr, addrlen);
+}
+
+int _network_listen(network_context_t *ctx, int backlog)
+{
+    assert(ctx);
+    VERIFY_SOCKET(ctx);
+
+    return listen(GET_SOCKET(ctx), backlog);
+}
+
+/* the accepted connection whose SYN is being dispatched is handed to the
+ * new mysocket
+ */
+void _network_update_passive_state(network_context_t *new_ctx,
+                                   network_context_t *accept_ctx,
+                                   void *user_data,
+                                   const void *syn_packet, size_t syn_len)
+{
+    network_context_socket_uring_t *new_uring_ctx;
+    network_context_socket_uring_t *accept_uring_ctx;
+    uring_conn_t *conn;
+
+    assert(new_ctx && accept_ctx && syn_packet);
+    assert(!user_data);
+
+    new_uring_ctx = (network_context_socket_uring_t *) new_ctx->impl_data;
+    accept_uring_ctx =
+        (network_context_socket_uring_t *) accept_ctx->impl_data;
+    assert(new_uring_ctx && accept_uring_ctx);
+    assert(!new_uring_ctx->sock_ctx->listening);
+    assert(!new_uring_ctx->sock_ctx->is_active);
+
+    conn = accept_uring_ctx->new_conn;
+    assert(conn && !new_uring_ctx->conn);
+    accept_uring_ctx->new_conn = NULL;
+
+    closesocket(new_uring_ctx->base.socket);
+    new_uring_ctx->base.socket = conn->fd;
+    new_uring_ctx->conn = conn;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ring.lock));
+    assert(conn->owner == accept_uring_ctx->sock_ctx);
+    conn->owner = new_uring_ctx->sock_ctx;
+    PTHREAD_CALL(pthread_mutex_unlock(&ring.lock));
+
+    DEBUG_LOG(("passed accepted socket %d on to new context...\n",
+               conn->fd));
+}
+
+/* start passing on network input for the mysocket.  an active mysocket is
+ * connected to its peer here, as there's nothing to receive until it is.
+ */
+int _network_start_recv_thread(mysock_context_t *ctx)
+{
+    network_context_socket_uring_t *uring_ctx;
+    network_context_t *net_ctx;
+
+    assert(ctx);
+    net_ctx = &ctx->network_state;
+    uring_ctx = (network_context_socket_uring_t *) net_ctx->impl_data;
+    assert(uring_ctx);
+
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+    {
+        perror("signal(SIGPIPE)");
+        assert(0);
+        return -1;
+    }
+
+    if (uring_ctx->conn)
+    {
+        /* an accepted connection, already receiving */
+        assert(!ctx->listening && !ctx->is_active);
+        return 0;
+    }
+
+    if (!ctx->listening)
+    {
+        assert(ctx->is_active);
+        assert(net_ctx->peer_addr_valid);
+        assert(net_ctx->peer_addr.sa_family == AF_INET);
+
+        if (connect(GET_SOCKET(net_ctx), &net_ctx->peer_addr,
+                    sizeof(net_ctx->peer_addr)) < 0)
+        {
+            perror("connect (network_io_uring)");
+
+            /* signal the error to the transport layer */
+            _mysock_enqueue_buffer(ctx, &ctx->network_recv_queue, NULL, 0);
+            return 0;
+        }
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&ring.lock));
+    uring_ctx->conn = uring_new_conn(GET_SOCKET(net_ctx), ctx);
+    uring_ctx->conn->listening = ctx->listening;
+    if (ctx->listening)
+        uring_queue_accept(uring_ctx->conn);
+    else
+        uring_queue_recv(uring_ctx->conn);
+    uring_flush();
+    PTHREAD_CALL(pthread_mutex_unlock(&ring.lock));
+
+    return 0;
+}
+
+/* block until no more network input will be passed on for the mysocket */
+void _network_stop_recv_thread(mysock_context_t *ctx)
+{
+    network_context_socket_uring_t *uring_ctx;
+    uring_conn_t *conn;
+
+    assert(ctx);
+    uring_ctx = (network_context_socket_uring_t *) ctx->network_state.impl_data;
+    assert(uring_ctx);
+
+    if (!(conn = uring_ctx->conn))
+        return;
+
+    PTHREAD_CALL(pthread_mutex_lock(&ring.lock));
+    while (conn->busy)
+        PTHREAD_CALL(pthread_cond_wait(&ring.changed, &ring.lock));
+    conn->owner = NULL;
+
+    if (ctx->listening)
+    {
+        uring_conn_t *accepted;
+
+        /* drop any accepted connections that haven't sent their SYN */
+        for (accepted = ring.conns; accepted; accepted = accepted->next)
+        {
+            if (accepted->owner != ctx)
+                continue;
+
+            while (accepted->busy)
+                PTHREAD_CALL(pthread_cond_wait(&ring.changed, &ring.lock));
+            accepted->owner = NULL;
+            accepted->closed = TRUE;
+            uring_shutdown(accepted);
+        }
+    }
+    PTHREAD_CALL(pthread_mutex_unlock(&ring.lock));
+}
+
+/* send the given packet to the peer */
+ssize_t _network_send_packet(network_context_t *ctx,
+                             const void *src, size_t len)
+{
+    struct iovec iov;
+
+    assert(ctx && src);
+
+    iov.iov_base = (void *) src;
+    iov.iov_len  = len;
+    return _network_send_packetv(ctx, &iov, 1);
+}
+
+/* send a packet given in pieces to the peer; they're gathered straight into
+ * the connection's send buffer.  this only blocks if that's full.
+ */
+ssize_t _network_send_packetv(network_context_t *ctx,
+                              const struct iovec *iov, int iovcnt)
+{
+    network_context_socket_uring_t *uring_ctx;
+    uring_conn_t *conn;
+    uint16_t packet_len;    /* network byte order */
+    size_t len;
+    char *dst;
+    int k;
+
+    assert(ctx && iov && iovcnt > 0);
+
+    for (len = 0, k = 0; k < iovcnt; ++k)
+        len += iov[k].iov_len;
+    assert(len <= 0xffff);
+    assert(URING_FRAME_HEADER_LEN + len <= URING_SEND_BUF_LEN);
+
+    uring_ctx = (network_context_socket_uring_t *) ctx->impl_data;
+    assert(uring_ctx);
+
+    if (!(conn = uring_ctx->conn))
+    {
+        errno = ENOTCONN;
+        return -1;
+    }
+
+    PTHREAD_CALL(pthread_mutex_lock(&ring.lock));
+    while (!conn->send_error &&
+           conn->send_len[conn->pending] + URING_FRAME_HEADER_LEN + len >
+           URING_SEND_BUF_LEN)
+    {
+        PTHREAD_CALL(pthread_cond_wait(&ring.changed, &ring.lock));
+    }
+
+    if (conn->send_error)
+    {
+        errno = conn->send_error;
+        PTHREAD_CALL(pthread_mutex_unlock(&ring.lock));
+        return -1;
+    }
+
+    packet_len = htons(len);
+    dst = conn->send_buf[conn->pending] + conn->send_len[conn->pending];
+    memcpy(dst, &packet_len, sizeof(packet_len));
+    (void) _network_gather_packet(dst + sizeof(packet_len), len, iov, iovcnt);
+    conn->send_len[conn->pending] += sizeof(packet_len) + len;
+
+    if (!conn->sending)
+        uring_queue_send(conn);
+
+    /* otherwise, the completion thread submits it the next time round */
+    if (ring.waiting)
+        uring_flush();
+    PTHREAD_CALL(pthread_mutex_unlock(&ring.lock));
+
+    return len;
+}
+
+/* nothing is referred to once it's been sent, so held buffers are just
+ * sent as any others, and may be freed straight away
+ */
+ssize_t _network_send_packet_held(network_context_t *ctx,
+                                  const struct iovec *iov, int iovcnt,
+                                  void *buf)
+{
+    return _network_send_packetv(ctx, iov, iovcnt);
+}
+
+void _network_free_buffer(network_context_t *ctx, void *buf)
+{
+    free(buf);
+}
+
+/* a packet is submitted as soon as the connection isn't already sending,
+ * and otherwise along with the rest of the send buffer once it's done, so
+ * there's nothing to do here
+ */
+void _network_flush(network_context_t *ctx)
+{
+}
+
+
+/* set up the ring, register the receive buffers, and start the completion
+ * thread.  ring.ok is left FALSE if the kernel isn't up to it.
+ */
+static void uring_init(void)
+{
+    struct io_uring_params params;
+    struct io_uring_buf_reg buf_reg;
+    size_t sq_len, cq_len;
+    char *sq_ring, *cq_ring;
+    void *mem;
+    unsigned int k;
+
+    PTHREAD_CALL(pthread_mutex_init(&ring.lock, NULL));
+    PTHREAD_CALL(pthread_cond_init(&ring.changed, NULL));
+
+    memset(&params, 0, sizeof(params));
+    if ((ring.fd = (int) syscall(__NR_io_uring_setup,
+                                 URING_ENTRIES, &params)) < 0)
+    {
+        perror("io_uring_setup");
+        return;
+    }
+
+    sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    cq_len = params.cq_off.cqes +
+             params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+        sq_len = cq_len = MAX(sq_len, cq_len);
+
+    sq_ring = (char *) mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring.fd,
+                            IORING_OFF_SQ_RING);
+    cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP)
+        ? sq_ring
+        : (char *) mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring.fd,
+                        IORING_OFF_CQ_RING);
+    ring.sqes = (struct io_uring_sqe *)
+        mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd,
+             IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED ||
+        ring.sqes == MAP_FAILED)
+    {
+        perror("mmap (io_uring)");
+        return;
+    }
+
+    ring.sq_head    = (unsigned int *) (sq_ring + params.sq_off.head);
+    ring.sq_tail    = (unsigned int *) (sq_ring + params.sq_off.tail);
+    ring.sq_array   = (unsigned int *) (sq_ring + params.sq_off.array);
+    ring.sq_mask    = *(unsigned int *) (sq_ring + params.sq_off.ring_mask);
+    ring.sq_entries = params.sq_entries;
+    ring.sqe_tail   = *ring.sq_tail;
+
+    ring.cq_head = (unsigned int *) (cq_ring + params.cq_off.head);
+    ring.cq_tail = (unsigned int *) (cq_ring + params.cq_off.tail);
+    ring.cq_mask = *(unsigned int *) (cq_ring + params.cq_off.ring_mask);
+    ring.cqes    = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+
+    /* the receive buffers, handed to the kernel through a buffer ring */
+    if (posix_memalign(&mem, sysconf(_SC_PAGESIZE),
+                       URING_NUM_BUFS * sizeof(struct io_uring_buf)) != 0 ||
+        !(ring.bufs = (char *) malloc(URING_NUM_BUFS * URING_BUF_LEN)))
+    {
+        assert(0);
+        return;
+    }
+    ring.buf_ring = (struct io_uring_buf_ring *) mem;
+    memset(ring.buf_ring, 0, URING_NUM_BUFS * sizeof(struct io_uring_buf));
+
+    memset(&buf_reg, 0, sizeof(buf_reg));
+    buf_reg.ring_addr    = (uint64_t) (uintptr_t) ring.buf_ring;
+    buf_reg.ring_entries = URING_NUM_BUFS;
+    buf_reg.bgid         = URING_BUF_GROUP;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING,
+                &buf_reg, 1) < 0)
+    {
+        perror("io_uring_register (buffer ring)");
+        return;
+    }
+
+    for (k = 0; k < URING_NUM_BUFS; ++k)
+        uring_recycle_buf(k);
+
+    ring.ok = TRUE;
+    (void) _mysock_create_thread(uring_thread_func, NULL, TRUE);
+}
+
+static int uring_enter(unsigned int to_submit, unsigned int min_complete,
+                       unsigned int flags)
+{
+    return (int) syscall(__NR_io_uring_enter, ring.fd, to_submit,
+                         min_complete, flags, NULL, 0);
+}
+
+/* start a request for the connection; once it's filled in, and committed,
+ * it's submitted by uring_flush(), or by the completion thread.  the ring's
+ * lock must be held.
+ */
+static struct io_uring_sqe *uring_get_sqe(uring_conn_t *conn, int op)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int index;
+
+    assert(conn && !((uintptr_t) conn & URING_OP_MASK));
+
+    while (uring_unsubmitted() >= ring.sq_entries)
+        uring_flush();  /* the submission queue is full */
+
+    index = ring.sqe_tail & ring.sq_mask;
+    sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = conn->fd;
+    sqe->user_data = (uint64_t) (uintptr_t) conn | op;
+    ring.sq_array[index] = index;
+    conn->num_ops++;
+
+    return sqe;
+}
+
+/* make the request last returned by uring_get_sqe() visible to the kernel,
+ * once it's filled in
+ */
+static void uring_commit_sqe(void)
+{
+    URING_STORE_RELEASE(ring.sq_tail, ++ring.sqe_tail);
+}
+
+/* requests queued but not yet consumed by the kernel.  (if two threads
+ * submit these at once, the kernel takes each request once, from whichever
+ * gets there first.)  the ring's lock must be held.
+ */
+static unsigned int uring_unsubmitted(void)
+{
+    return ring.sqe_tail - URING_LOAD_ACQUIRE(ring.sq_head);
+}
+
+/* submit whatever has been queued.  the ring's lock must be held. */
+static void uring_flush(void)
+{
+    unsigned int to_submit = uring_unsubmitted();
+
+    if (to_submit > 0 && uring_enter(to_submit, 0, 0) < 0)
+    {
+        /* the completion thread will try again */
+        assert(errno == EINTR || errno == EAGAIN || errno == EBUSY);
+    }
+}
+
+/* give a receive buffer back to the kernel.  (the ring's entries are
+ * indexed from its start, rather than through its bufs member, as the
+ * kernel header's flexible array is offset when compiled as C++.)
+ */
+static void uring_recycle_buf(unsigned int bid)
+{
+    struct io_uring_buf *buf;
+
+    assert(bid < URING_NUM_BUFS);
+
+    buf = (struct io_uring_buf *) ring.buf_ring +
+          (ring.buf_tail & (URING_NUM_BUFS - 1));
+    buf->addr = (uint64_t) (uintptr_t) (ring.bufs + bid * URING_BUF_LEN);
+    buf->len  = URING_BUF_LEN;
+    buf->bid  = bid;
+    URING_STORE_RELEASE(&ring.buf_ring->tail, ++ring.buf_tail);
+}
+
+/* the ring's lock must be held */
+static uring_conn_t *uring_new_conn(int fd, mysock_context_t *owner)
+{
+    uring_conn_t *conn;
+
+    assert(fd >= 0);
+
+    conn = (uring_conn_t *) calloc(1, sizeof(uring_conn_t));
+    assert(conn);
+    conn->fd    = fd;
+    conn->owner = owner;
+    conn->send_buf[0] = (char *) malloc(URING_SEND_BUF_LEN);
+    conn->send_buf[1] = (char *) malloc(URING_SEND_BUF_LEN);
+    assert(conn->send_buf[0] && conn->send_buf[1]);
+
+    conn->next = ring.conns;
+    ring.conns = conn;
+    return conn;
+}
+
+/* free a connection the mysocket is done with, once there are no requests
+ * outstanding for it.  the ring's lock must be held.
+ */
+static void uring_release(uring_conn_t *conn)
+{
+    uring_conn_t **prev;
+
+    assert(conn);
+    if (!conn->closed || conn->num_ops > 0)
+        return;
+
+    assert(!conn->busy);
+    for (prev = &ring.conns; *prev != conn; prev = &(*prev)->next)
+        assert(*prev);
+    *prev = conn->next;
+
+    DEBUG_LOG(("io_uring network layer, closing socket %d\n", conn->fd));
+    closesocket(conn->fd);
+    free(conn->send_buf[0]);
+    free(conn->send_buf[1]);
+    free(conn);
+}
+
+/* end any receive or accept outstanding on the connection */
+static void uring_shutdown(uring_conn_t *conn)
+{
+    assert(conn);
+    (void) shutdown(conn->fd, SHUT_RDWR);
+}
+
+/* the ring's lock must be held for these */
+static void uring_queue_recv(uring_conn_t *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(conn, URING_OP_RECV);
+
+    sqe->opcode    = IORING_OP_RECV;
+    sqe->ioprio    = IORING_RECV_MULTISHOT;
+    sqe->flags     = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    uring_commit_sqe();
+}
+
+static void uring_queue_accept(uring_conn_t *conn)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(conn, URING_OP_ACCEPT);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    uring_commit_sqe();
+}
+
+/* send whatever's pending, or as much of what's in flight as is left */
+static void uring_queue_send(uring_conn_t *conn)
+{
+    struct io_uring_sqe *sqe;
+    int flight;
+
+    assert(conn);
+
+    if (!conn->sending)
+    {
+        if (!conn->send_len[conn->pending])
+            return;
+
+        conn->pending ^= 1;
+        conn->sent = 0;
+        conn->sending = TRUE;
+    }
+
+    flight = conn->pending ^ 1;
+    assert(conn->sent < conn->send_len[flight]);
+
+    sqe = uring_get_sqe(conn, URING_OP_SEND);
+    sqe->opcode    = IORING_OP_SEND;
+    sqe->addr      = (uint64_t) (uintptr_t) (conn->send_buf[flight] +
+                                             conn->sent);
+    sqe->len       = conn->send_len[flight] - conn->sent;
+    sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+    uring_commit_sqe();
+}
+
+
+/* the completion thread.  this runs for as long as the process does. */
+static void *uring_thread_func(void *arg_ptr)
+{
+    PTHREAD_CALL(pthread_mutex_lock(&ring.lock));
+    for (;;)
+    {
+        unsigned int to_submit, head;
+
+        /* submit everything queued since last time, and wait for more
+         * completions.  senders submit for themselves while we wait.
+         */
+        to_submit = uring_unsubmitted();
+        ring.waiting = TRUE;
+        PTHREAD_CALL(pthread_mutex_unlock(&ring.lock));
+
+        if (uring_enter(to_submit, 1, IORING_ENTER_GETEVENTS) < 0)
+            assert(errno == EINTR || errno == EAGAIN || errno == EBUSY);
+
+        PTHREAD_CALL(pthread_mutex_lock(&ring.lock));
+        ring.waiting = FALSE;
+
+        for (head = *ring.cq_head;
+             head != URING_LOAD_ACQUIRE(ring.cq_tail); )
+        {
+            const struct io_uring_cqe *cqe = &ring.cqes[head & ring.cq_mask];
+            uint64_t user_data = cqe->user_data;
+            int res = cqe->res;
+            unsigned int flags = cqe->flags;
+
+            /* free the slot first, as handling it may drop the lock */
+            URING_STORE_RELEASE(ring.cq_head, ++head);
+            uring_complete(user_data, res, flags);
+        }
+    }
+
+    /*NOTREACHED*/
+    PTHREAD_CALL(pthread_mutex_unlock(&ring.lock));
+    return NULL;
+}
+
+/* handle a completion.  the ring's lock is held, but dropped while input
+ * is passed on.
+ */
+static void uring_complete(uint64_t user_data, int res, unsigned int flags)
+{
+    uring_conn_t *conn =
+        (uring_conn_t *) (uintptr_t) (user_data & ~(uint64_t) URING_OP_MASK);
+
+    assert(conn);
+    switch ((int) (user_data & URING_OP_MASK))
+    {
+    case URING_OP_RECV:
+        uring_recv_done(conn, res, flags);
+        break;
+
+    case URING_OP_SEND:
+        uring_send_done(conn, res);
+        break;
+
+    case URING_OP_ACCEPT:
+        uring_accept_done(conn, res);
+        break;
+
+    default:
+        assert(0);
+        break;
+    }
+}
+
+static void uring_recv_done(uring_conn_t *conn, int res, unsigned int flags)
+{
+    mysock_context_t *owner;
+
+    assert(conn && !conn->listening);
+
+    if (res > 0)
+    {
+        unsigned int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+        assert(flags & IORING_CQE_F_BUFFER);
+        if (conn->owner && !conn->eof)
+        {
+            conn->busy = TRUE;
+            PTHREAD_CALL(pthread_mutex_unlock(&ring.lock));
+            uring_input(conn, ring.bufs + bid * URING_BUF_LEN, res);
+            PTHREAD_CALL(pthread_mutex_lock(&ring.lock));
+            conn->busy = FALSE;
+            PTHREAD_CALL(pthread_cond_broadcast(&ring.changed));
+        }
+        uring_recycle_buf(bid);
+    }
+
+    if (flags & IORING_CQE_F_MORE)
+        return;
+
+    /* the multishot receive is over */
+    assert(conn->num_ops > 0);
+    conn->num_ops--;
+
+    if (res > 0 || res == -ENOBUFS)
+    {
+        if (!conn->eof && !conn->closed)
+            uring_queue_recv(conn);
+    }
+    else if (!conn->eof)
+    {
+        conn->eof = TRUE;
+        DEBUG_LOG(("io_uring receive ended on socket %d: %d\n",
+                   conn->fd, res));
+
+        if ((owner = conn->owner) != NULL && owner->listening)
+        {
+            /* an accepted connection that never sent its SYN */
+            conn->owner = NULL;
+            conn->closed = TRUE;
+        }
+        else if (owner)
+        {
+            /* signal an error to the transport layer */
+            conn->busy = TRUE;
+            PTHREAD_CALL(pthread_mutex_unlock(&ring.lock));
+            _mysock_enqueue_buffer(owner, &owner->network_recv_queue,
+                                   NULL, 0);
+            PTHREAD_CALL(pthread_mutex_lock(&ring.lock));
+            conn->busy = FALSE;
+            PTHREAD_CALL(pthread_cond_broadcast(&ring.changed));
+        }
+    }
+
+    uring_release(conn);
+}
+
+static void uring_send_done(uring_conn_t *conn, int res)
+{
+    assert(conn && conn->sending);
+    assert(conn->num_ops > 0);
+    conn->num_ops--;
+
+    if (res < 0)
+    {
+        DEBUG_LOG(("io_uring send failed on socket %d: %d\n",
+                   conn->fd, res));
+        conn->send_error = -res;
+        conn->sending = FALSE;
+        conn->send_len[0] = conn->send_len[1] = 0;
+    }
+    else
+    {
+        int flight = conn->pending ^ 1;
+
+        conn->sent += res;
+        if (conn->sent >= conn->send_len[flight])
+        {
+            /* move on to whatever was sent meanwhile */
+            conn->send_len[flight] = 0;
+            conn->sending = FALSE;
+        }
+        uring_queue_send(conn);
+    }
+
+    PTHREAD_CALL(pthread_cond_broadcast(&ring.changed));
+    uring_release(conn);
+}
+
+static void uring_accept_done(uring_conn_t *conn, int res)
+{
+    assert(conn && conn->listening);
+    assert(conn->num_ops > 0);
+    conn->num_ops--;
+
+    if (res >= 0)
+    {
+        if (conn->owner && !conn->closed)
+        {
+            uring_conn_t *accepted = uring_new_conn(res, conn->owner);
+
+            DEBUG_LOG(("accepted from peer, socket %d...\n", res));
+            accepted->peer_addr_len = sizeof(accepted->peer_addr);
+            if (getpeername(res, &accepted->peer_addr,
+                            &accepted->peer_addr_len) < 0)
+            {
+                accepted->owner = NULL;
+                accepted->closed = TRUE;
+                uring_release(accepted);
+            }
+            else
+            {
+                uring_queue_recv(accepted);
+            }
+        }
+        else
+        {
+            closesocket(res);
+        }
+    }
+    else if (res != -EINVAL && res != -ECANCELED && res != -EBADF)
+    {
+        errno = -res;
+        perror("accept (network_io_uring)");
+    }
+
+    if (conn->owner && !conn->closed && (res >= 0 || res == -EINTR ||
+                                         res == -ECONNABORTED ||
+                                         res == -EMFILE || res == -ENFILE))
+        uring_queue_accept(conn);
+
+    uring_release(conn);
+}
+
+/* split received data into packets.  this is only called by the completion
+ * thread, with the connection marked busy, so its owner can only be changed
+ * by dispatching a SYN.
+ */
+static void uring_input(uring_conn_t *conn, const char *buf, size_t len)
+{
+    assert(conn && buf);
+
+    while (len > 0 && conn->owner)
+    {
+        uint16_t packet_len;
+        size_t frame_len, n;
+
+        /* a packet entirely within the buffer is passed on from there */
+        if (conn->frame_len == 0 && len >= URING_FRAME_HEADER_LEN)
+        {
+            memcpy(&packet_len, buf, sizeof(packet_len));
+            frame_len = URING_FRAME_HEADER_LEN + ntohs(packet_len);
+            if (len >= frame_len)
+            {
+                uring_deliver(conn, buf + URING_FRAME_HEADER_LEN,
+                              frame_len - URING_FRAME_HEADER_LEN);
+                buf += frame_len;
+                len -= frame_len;
+                continue;
+            }
+        }
+
+        /* otherwise, put it together */
+        if (conn->frame_len < URING_FRAME_HEADER_LEN)
+        {
+            frame_len = URING_FRAME_HEADER_LEN;
+        }
+        else
+        {
+            memcpy(&packet_len, conn->frame, sizeof(packet_len));
+            frame_len = URING_FRAME_HEADER_LEN + ntohs(packet_len);
+        }
+
+        n = MIN(frame_len - conn->frame_len, len);
+        memcpy(conn->frame + conn->frame_len, buf, n);
+        conn->frame_len += n;
+        buf += n;
+        len -= n;
+
+        if (conn->frame_len == URING_FRAME_HEADER_LEN)
+        {
+            memcpy(&packet_len, conn->frame, sizeof(packet_len));
+            frame_len = URING_FRAME_HEADER_LEN + ntohs(packet_len);
+        }
+
+        if (conn->frame_len == frame_len)
+        {
+            uring_deliver(conn, conn->frame + URING_FRAME_HEADER_LEN,
+                          frame_len - URING_FRAME_HEADER_LEN);
+            conn->frame_len = 0;
+        }
+    }
+}
+
+/* pass a packet on to the connection's owner */
+static void uring_deliver(uring_conn_t *conn, const char *packet, size_t len)
+{
+    mysock_context_t *owner = conn->owner;
+
+    assert(owner);
+
+    if (len == 0)
+        return;
+    len = MIN(len, MAX_IP_PAYLOAD_LEN);   /* discard the rest, as in TCP */
+
+    if (owner->listening)
+    {
+        network_context_socket_uring_t *uring_ctx =
+            (network_context_socket_uring_t *) owner->network_state.impl_data;
+
+        /* demultiplex and dispatch it; if it's a SYN, the connection goes
+         * to the new mysocket (see _network_update_passive_state())
+         */
+        assert(uring_ctx && !uring_ctx->new_conn);
+        uring_ctx->new_conn = conn;
+        _mysock_enqueue_connection(owner, packet, len,
+                                   &conn->peer_addr, conn->peer_addr_len,
+                                   NULL);
+        uring_ctx->new_conn = NULL;
+
+        if (conn->owner == owner &&
+            len >= sizeof(struct tcphdr) &&
+            (((const struct tcphdr *) packet)->th_flags & TH_SYN))
+        {
+            /* the SYN was dropped, as the listen queue is full.  leave the
+             * connection with the listening mysocket, still receiving, so
+             * that the SYN the peer resends is dispatched in its turn, as
+             * network_io_tcp.c does; the connection is dropped if the peer
+             * gives up and closes it, or the listening mysocket is closed
+             */
+            DEBUG_LOG(("parking socket %d until its SYN is resent\n",
+                       conn->fd));
+        }
+        else if (conn->owner == owner)
+        {
+            /* this wasn't a SYN */
+            PTHREAD_CALL(pthread_mutex_lock(&ring.lock));
+            conn->owner = NULL;
+            conn->closed = TRUE;
+            uring_shutdown(conn);
+            PTHREAD_CALL(pthread_mutex_unlock(&ring.lock));
+        }
+    }
+    else
+    {
+        /* enqueue the packet directly for this context */
+        _mysock_enqueue_buffer(owner, &owner->network_recv_queue,
+                               packet, len);
+    }
+}
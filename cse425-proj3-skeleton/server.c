@@ -26,12 +26,31 @@
 
 
 
-static char usage[] = "usage: %s \n";
+static char usage[] =
+    "usage: %s [-F <block>] [-l] [-E] [-e <rate>,<mark>[,<limit>]]\n"
+    "          [-i <impairment>=<value>[,...]] [-t <trace>]\n"
+    "impairments: delay=<ms> jitter=<ms> loss=<%%> burst=<%%> burstlen=<n>\n"
+    "             dup=<%%> reorder=<%%> seed=<n>\n";
+
+/* -i suboptions, in the order of impairment_names */
+enum
+{
+    IMPAIR_DELAY, IMPAIR_JITTER, IMPAIR_LOSS, IMPAIR_BURST, IMPAIR_BURSTLEN,
+    IMPAIR_DUP, IMPAIR_REORDER, IMPAIR_SEED
+};
+
+static char *const impairment_names[] =
+{
+    (char *) "delay", (char *) "jitter", (char *) "loss", (char *) "burst",
+    (char *) "burstlen", (char *) "dup", (char *) "reorder", (char *) "seed",
+    NULL
+};
 
 static void do_connection(mysocket_t bindsd);
 static int get_nvt_line(int sd, char *);
 static int process_line(int sd, char *);
 static int local_name(mysocket_t sd, char *name);
+static int parse_impairments(char *spec, mysock_emulation_t *link);
 
 /**********************************************************************/
 int
@@ -40,14 +59,49 @@ main(int argc, char *argv[])
     struct sockaddr_in sin;
     mysocket_t bindsd;
     int len, opt, errflg = 0;
+    int fec_block = 0;
+    int congestion = MYSOCK_CC_RENO;
+    int ecn = 0;
+    mysock_emulation_t link;
     char localname[256];
 
 
     /* Parse the command line */
-    while ((opt = getopt(argc, argv, "")) != EOF)
+    memset(&link, 0, sizeof(link));
+    while ((opt = getopt(argc, argv, "F:lEe:i:t:")) != EOF)
     {
         switch (opt)
         {
+        case 'F':
+            fec_block = atoi(optarg);
+            break;
+        case 'l':
+            /* serve files as low priority (background) transfers */
+            congestion = MYSOCK_CC_LEDBAT;
+            break;
+        case 'E':
+            ecn = 1;
+            break;
+        case 'e':
+            /* send through an emulated bottleneck of the given rate
+             * (bytes/s), which marks ECN-capable packets once the given
+             * number of bytes are queued, and drops others past the limit
+             */
+            if (sscanf(optarg, "%lu,%lu,%lu", &link.rate,
+                       &link.ecn_threshold, &link.queue_limit) < 2)
+                ++errflg;
+            break;
+        case 'i':
+            /* lose, delay, reorder or duplicate packets on the way */
+            if (parse_impairments(optarg, &link) < 0)
+                ++errflg;
+            break;
+        case 't':
+            /* send at the times the given (downlink) trace has the link
+             * delivering packets, rather than at a fixed rate
+             */
+            link.trace = optarg;
+            break;
         case '?':
             ++errflg;
             break;
@@ -79,6 +133,36 @@ main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    if (fec_block > 0 &&
+        mysetsockopt(bindsd, MYSO_FEC_BLOCK, &fec_block, sizeof(fec_block)) < 0)
+    {
+        perror("mysetsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    if (congestion != MYSOCK_CC_RENO &&
+        mysetsockopt(bindsd, MYSO_CONGESTION,
+                     &congestion, sizeof(congestion)) < 0)
+    {
+        perror("mysetsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    if (ecn && mysetsockopt(bindsd, MYSO_ECN, &ecn, sizeof(ecn)) < 0)
+    {
+        perror("mysetsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((link.rate > 0 || link.delay > 0 || link.jitter > 0 ||
+         link.loss > 0 || link.burst_loss > 0 || link.duplicate > 0 ||
+         link.reorder > 0 || link.trace) &&
+        mysetsockopt(bindsd, MYSO_EMULATION, &link, sizeof(link)) < 0)
+    {
+        perror("mysetsockopt");
+        exit(EXIT_FAILURE);
+    }
+
     if (mylisten(bindsd, 5) < 0)
     {
         perror("mylisten");
@@ -303,3 +387,59 @@ static int local_name(mysocket_t sd, char *name)
     return 0;
 }
 
+
+
+/* parse_impairments()
+ *
+ * Parses a comma-separated list of impairments (as in the usage message)
+ * for the link emulated in front of the server's outgoing packets.  Times
+ * are given in milliseconds, and probabilities in percent.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+
+static int parse_impairments(char *spec, mysock_emulation_t *link)
+{
+    char *value;
+    double v;
+
+    assert(spec && link);
+
+    while (*spec)
+    {
+        int which = getsubopt(&spec, impairment_names, &value);
+
+        if (which < 0 || !value || (v = atof(value)) < 0)
+            return -1;
+
+        switch (which)
+        {
+        case IMPAIR_DELAY:
+            link->delay = (unsigned long) (v * 1000);
+            break;
+        case IMPAIR_JITTER:
+            link->jitter = (unsigned long) (v * 1000);
+            break;
+        case IMPAIR_LOSS:
+            link->loss = (unsigned long) (v * 10000);
+            break;
+        case IMPAIR_BURST:
+            link->burst_loss = (unsigned long) (v * 10000);
+            break;
+        case IMPAIR_BURSTLEN:
+            link->burst_len = (unsigned long) v;
+            break;
+        case IMPAIR_DUP:
+            link->duplicate = (unsigned long) (v * 10000);
+            break;
+        case IMPAIR_REORDER:
+            link->reorder = (unsigned long) (v * 10000);
+            break;
+        case IMPAIR_SEED:
+            link->seed = (unsigned int) v;
+            break;
+        }
+    }
+
+    return 0;
+}
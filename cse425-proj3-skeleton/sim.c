@@ -0,0 +1,445 @@
+/*
+ * sim.c
+ *
+ * This file contains the simulator. It runs any number of clients and a
+ * server in one process, on a virtual clock (see mysock_sim.h). Each
+ * client connects to the server, which sends it the given number of
+ * bytes; the client acknowledges them with a byte of its own, and both
+ * close the connection. The time each transfer took, in simulated time,
+ * is reported with the server's sending counters for it, and the client's
+ * receiving ones (segments rebuilt from FEC parity).
+ *
+ * A run gives the same results every time, and takes as long as the
+ * packets do to process rather than as long as the transfers would, so
+ * parameters can be compared cheaply. The server's link (-e, -i, -t) is
+ * emulated as it is by the server itself; the clients' link has the same
+ * delay and jitter, so the round trip time is twice the delay.
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <assert.h>
+
+#include "mysock.h"
+#include "mysock_sim.h"
+
+
+static char usage[] =
+    "usage: %s [-n <connections>] [-s <bytes>] [-F <block>] [-l] [-E]\n"
+    "          [-e <rate>,<mark>[,<limit>]] [-i <impairment>=<value>[,...]]\n"
+    "          [-t <trace>]\n"
+    "impairments: delay=<ms> jitter=<ms> loss=<%%> burst=<%%> burstlen=<n>\n"
+    "             dup=<%%> reorder=<%%> seed=<n>\n";
+
+/* -i suboptions, in the order of impairment_names */
+enum
+{
+    IMPAIR_DELAY, IMPAIR_JITTER, IMPAIR_LOSS, IMPAIR_BURST, IMPAIR_BURSTLEN,
+    IMPAIR_DUP, IMPAIR_REORDER, IMPAIR_SEED
+};
+
+static char *const impairment_names[] =
+{
+    (char *) "delay", (char *) "jitter", (char *) "loss", (char *) "burst",
+    (char *) "burstlen", (char *) "dup", (char *) "reorder", (char *) "seed",
+    NULL
+};
+
+/* a transfer, as the client sees it */
+typedef struct
+{
+    unsigned short  port;       /* the client's */
+    size_t          received;
+    bool_t          corrupt;    /* TRUE if anything received was wrong */
+    struct timespec start;      /* when it connected... */
+    struct timespec finish;     /* ...and when it had everything */
+    mysock_stats_t  stats;      /* the client's */
+} transfer_t;
+
+/* a transfer, as the server sees it */
+typedef struct
+{
+    mysocket_t      sd;
+    unsigned short  port;       /* the client's */
+    mysock_stats_t  stats;
+} sender_t;
+
+static size_t              transfer_size = 1024 * 1024;
+static int                 num_transfers = 1;
+static mysocket_t          listen_sd;
+static struct sockaddr_in  server_addr;
+static int                 fec_block;
+static int                 ecn;
+static mysock_emulation_t  client_link;
+static transfer_t         *transfers;
+static sender_t           *senders;
+
+static void serve(void *arg);
+static void send_file(void *arg);
+static void receive_file(void *arg);
+static char pattern(size_t offset);
+static double seconds(const struct timespec *from, const struct timespec *to);
+static int parse_impairments(char *spec, mysock_emulation_t *link);
+
+/**********************************************************************/
+int
+main(int argc, char *argv[])
+{
+    struct sockaddr_in sin;
+    socklen_t len;
+    int k, opt, errflg = 0;
+    int congestion = MYSOCK_CC_RENO;
+    mysock_emulation_t link;
+    struct timespec start, end;
+    size_t total = 0;
+
+
+    /* Parse the command line */
+    memset(&link, 0, sizeof(link));
+    while ((opt = getopt(argc, argv, "n:s:F:lEe:i:t:")) != EOF)
+    {
+        switch (opt)
+        {
+        case 'n':
+            num_transfers = atoi(optarg);
+            break;
+        case 's':
+            transfer_size = strtoul(optarg, NULL, 0);
+            break;
+        case 'F':
+            fec_block = atoi(optarg);
+            break;
+        case 'l':
+            congestion = MYSOCK_CC_LEDBAT;
+            break;
+        case 'E':
+            ecn = 1;
+            break;
+        case 'e':
+            if (sscanf(optarg, "%lu,%lu,%lu", &link.rate,
+                       &link.ecn_threshold, &link.queue_limit) < 2)
+                ++errflg;
+            break;
+        case 'i':
+            if (parse_impairments(optarg, &link) < 0)
+                ++errflg;
+            break;
+        case 't':
+            link.trace = optarg;
+            break;
+        case '?':
+            ++errflg;
+            break;
+        }
+    }
+
+    /* each transfer takes a mysocket at either end, and the server
+     * listens on another
+     */
+    if (errflg || optind != argc || num_transfers < 1 ||
+        num_transfers > (MAX_NUM_CONNECTIONS - 1) / 2)
+    {
+        fprintf(stderr, usage, argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    client_link.delay  = link.delay;
+    client_link.jitter = link.jitter;
+    client_link.seed   = link.seed;
+
+    /* the server listens on any available port; connections it accepts
+     * have the listening mysocket's options
+     */
+    if ((listen_sd = mysocket()) < 0)
+    {
+        perror("mysocket");
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_ANY);
+    sin.sin_port = htons(0);
+
+    if (mybind(listen_sd, (struct sockaddr *) &sin, sizeof(sin)) < 0)
+    {
+        perror("mybind");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((fec_block > 0 &&
+         mysetsockopt(listen_sd, MYSO_FEC_BLOCK,
+                      &fec_block, sizeof(fec_block)) < 0) ||
+        (congestion != MYSOCK_CC_RENO &&
+         mysetsockopt(listen_sd, MYSO_CONGESTION,
+                      &congestion, sizeof(congestion)) < 0) ||
+        (ecn && mysetsockopt(listen_sd, MYSO_ECN, &ecn, sizeof(ecn)) < 0) ||
+        mysetsockopt(listen_sd, MYSO_EMULATION, &link, sizeof(link)) < 0)
+    {
+        perror("mysetsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    if (mylisten(listen_sd, num_transfers) < 0)
+    {
+        perror("mylisten");
+        exit(EXIT_FAILURE);
+    }
+
+    len = sizeof(server_addr);
+    if (mygetsockname(listen_sd, (struct sockaddr *) &server_addr, &len) < 0)
+    {
+        perror("mygetsockname");
+        exit(EXIT_FAILURE);
+    }
+    server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    transfers = (transfer_t *) calloc(num_transfers, sizeof(transfer_t));
+    senders = (sender_t *) calloc(num_transfers, sizeof(sender_t));
+    assert(transfers && senders);
+
+    mysim_gettime(&start);
+    mysim_spawn(serve, NULL);
+    for (k = 0; k < num_transfers; ++k)
+        mysim_spawn(receive_file, &transfers[k]);
+
+    if (mysim_run() < 0)
+    {
+        perror("mysim_run");
+        exit(EXIT_FAILURE);
+    }
+    mysim_gettime(&end);
+
+    if (myclose(listen_sd) < 0)
+        perror("myclose (listen_sd)");
+
+    for (k = 0; k < num_transfers; ++k)
+    {
+        const transfer_t *t = &transfers[k];
+        const mysock_stats_t *sent = NULL;
+        double elapsed = seconds(&t->start, &t->finish);
+        char rate[32];
+        int j;
+
+        for (j = 0; j < num_transfers; ++j)
+        {
+            if (senders[j].port == t->port)
+                sent = &senders[j].stats;
+        }
+        assert(sent);
+
+        /* with no delay or rate limit, no simulated time need pass */
+        if (elapsed > 0)
+            sprintf(rate, "%.1f kB/s", t->received / elapsed / 1000);
+        else
+            strcpy(rate, "no time passed");
+
+        printf("%d: %lu bytes%s in %.6f s (%s), %lu retransmits, "
+               "%lu timeouts (%lu spurious), %lu FEC recovered, "
+               "%lu ECN reductions\n",
+               k, (unsigned long) t->received,
+               t->corrupt ? " (corrupt)" : "", elapsed,
+               rate,
+               sent->retransmits, sent->timeouts, sent->spurious_timeouts,
+               t->stats.fec_recovered, sent->ecn_reductions);
+        total += t->received;
+    }
+
+    printf("%d transfers, %lu bytes in %.6f s of simulated time\n",
+           num_transfers, (unsigned long) total, seconds(&start, &end));
+    return 0;
+}
+
+/* accept the clients' connections, and send each its file */
+static void serve(void *arg)
+{
+    struct sockaddr_in sin;
+    int k, len;
+
+    for (k = 0; k < num_transfers; ++k)
+    {
+        len = sizeof(sin);
+        if ((senders[k].sd = myaccept(listen_sd, (struct sockaddr *) &sin,
+                                      &len)) < 0)
+        {
+            perror("myaccept");
+            exit(EXIT_FAILURE);
+        }
+
+        senders[k].port = ntohs(sin.sin_port);
+        mysim_spawn(send_file, &senders[k]);
+    }
+}
+
+/* send a file, and wait for the client to say it has it all */
+static void send_file(void *arg)
+{
+    sender_t *s = (sender_t *) arg;
+    char buf[4096];
+    size_t offset, k;
+    socklen_t stats_len = sizeof(s->stats);
+
+    for (offset = 0; offset < transfer_size; offset += k)
+    {
+        for (k = 0; k < sizeof(buf) && offset + k < transfer_size; ++k)
+            buf[k] = pattern(offset + k);
+
+        if (mywrite(s->sd, buf, k) < 0)
+        {
+            perror("mywrite");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (myread(s->sd, buf, 1) < 0)
+        perror("myread");
+
+    if (mygetsockopt(s->sd, MYSO_STATS, &s->stats, &stats_len) < 0)
+        perror("mygetsockopt");
+
+    if (myclose(s->sd) < 0)
+        perror("myclose");
+}
+
+/* fetch a file from the server */
+static void receive_file(void *arg)
+{
+    transfer_t *t = (transfer_t *) arg;
+    struct sockaddr_in sin;
+    socklen_t sin_len = sizeof(sin);
+    socklen_t stats_len = sizeof(t->stats);
+    char buf[4096];
+    mysocket_t sd;
+    int len, k;
+
+    if ((sd = mysocket()) < 0)
+    {
+        perror("mysocket");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((fec_block > 0 &&
+         mysetsockopt(sd, MYSO_FEC_BLOCK, &fec_block, sizeof(fec_block)) < 0) ||
+        (ecn && mysetsockopt(sd, MYSO_ECN, &ecn, sizeof(ecn)) < 0) ||
+        mysetsockopt(sd, MYSO_EMULATION,
+                     &client_link, sizeof(client_link)) < 0)
+    {
+        perror("mysetsockopt");
+        exit(EXIT_FAILURE);
+    }
+
+    mysim_gettime(&t->start);
+    if (myconnect(sd, (struct sockaddr *) &server_addr,
+                  sizeof(server_addr)) < 0)
+    {
+        perror("myconnect");
+        exit(EXIT_FAILURE);
+    }
+
+    if (mygetsockname(sd, (struct sockaddr *) &sin, &sin_len) < 0)
+    {
+        perror("mygetsockname");
+        exit(EXIT_FAILURE);
+    }
+    t->port = ntohs(sin.sin_port);
+
+    while (t->received < transfer_size &&
+           (len = myread(sd, buf, sizeof(buf))) > 0)
+    {
+        for (k = 0; k < len; ++k)
+        {
+            if (buf[k] != pattern(t->received + k))
+                t->corrupt = TRUE;
+        }
+        t->received += len;
+    }
+    mysim_gettime(&t->finish);
+
+    /* let the server know we're done, and wait for it to close */
+    if (mywrite(sd, "", 1) < 0)
+        perror("mywrite");
+    while (myread(sd, buf, sizeof(buf)) > 0)
+        ;
+
+    if (mygetsockopt(sd, MYSO_STATS, &t->stats, &stats_len) < 0)
+        perror("mygetsockopt");
+
+    if (myclose(sd) < 0)
+        perror("myclose");
+}
+
+/* the byte at the given offset into each file */
+static char pattern(size_t offset)
+{
+    return (char) (offset % 251);
+}
+
+static double seconds(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) +
+           (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/**********************************************************************/
+/* parse_impairments()
+ *
+ * Parses a comma-separated list of impairments (as in the usage message)
+ * for the link emulated in front of the server's outgoing packets.  Times
+ * are given in milliseconds, and probabilities in percent.
+ *
+ * Returns 0 on success and -1 on failure.
+ */
+
+static int parse_impairments(char *spec, mysock_emulation_t *link)
+{
+    char *value;
+    double v;
+
+    assert(spec && link);
+
+    while (*spec)
+    {
+        int which = getsubopt(&spec, impairment_names, &value);
+
+        if (which < 0 || !value || (v = atof(value)) < 0)
+            return -1;
+
+        switch (which)
+        {
+        case IMPAIR_DELAY:
+            link->delay = (unsigned long) (v * 1000);
+            break;
+        case IMPAIR_JITTER:
+            link->jitter = (unsigned long) (v * 1000);
+            break;
+        case IMPAIR_LOSS:
+            link->loss = (unsigned long) (v * 10000);
+            break;
+        case IMPAIR_BURST:
+            link->burst_loss = (unsigned long) (v * 10000);
+            break;
+        case IMPAIR_BURSTLEN:
+            link->burst_len = (unsigned long) v;
+            break;
+        case IMPAIR_DUP:
+            link->duplicate = (unsigned long) (v * 10000);
+            break;
+        case IMPAIR_REORDER:
+            link->reorder = (unsigned long) (v * 10000);
+            break;
+        case IMPAIR_SEED:
+            link->seed = (unsigned int) v;
+            break;
+        }
+    }
+
+    return 0;
+}
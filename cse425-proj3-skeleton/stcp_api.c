@@ -2,6 +2,7 @@
 
 #include <pthread.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
@@ -16,6 +17,8 @@
 #include "transport.h"
 
 
+static void _stcp_init_header_template(mysock_context_t *ctx);
+
 /* called by the transport layer thread to unblock the calling application,
  * e.g. when the connection is complete, or when an error is detected while
  * attempting to make the connection.  before calling this, the STCP layer may
@@ -66,6 +69,9 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
     unsigned int rc = 0;
     mysock_context_t *ctx = _mysock_get_context(sd);
 
+    /* whatever was sent for the last event goes out before waiting */
+    _network_send_flush(sd);
+
     PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
     for (;;)
     {
@@ -91,6 +97,15 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
 
         if (abstime)
         {
+            struct timespec now;
+
+            /* the time may already be up by the engine's clock, which
+             * needn't be the system's
+             */
+            (void) _mysock_engine_gettime(&now);
+            if (!_mysock_timespec_before(&now, abstime))
+                goto done;
+
             /* wait with timeout */
             switch (pthread_cond_timedwait(&ctx->data_ready_cond,
                                            &ctx->data_ready_lock,
@@ -126,6 +141,13 @@ done:
     return rc;
 }
 
+/* the time by the clock stcp_wait_for_event() measures abstime against */
+void stcp_get_time(struct timespec *now)
+{
+    assert(now);
+    (void) _mysock_engine_gettime(now);
+}
+
 /* allow STCP implementation to establish a context for a given mysocket
  * descriptor.  this context should contain any information that needs to be
  * tracked for the given mysocket, e.g. sequence numbers, retransmission
@@ -144,6 +166,36 @@ void *stcp_get_context(mysocket_t sd)
     return ctx->stcp_state;
 }
 
+int stcp_get_option(mysocket_t sd, mysock_option_t option)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    switch (option)
+    {
+    case MYSO_FEC_BLOCK:
+        return ctx->options.fec_block;
+
+    case MYSO_CONGESTION:
+        return ctx->options.congestion;
+
+    case MYSO_ECN:
+        return ctx->options.ecn;
+
+    default:
+        assert(0);
+        return 0;
+    }
+}
+
+mysock_stats_t *stcp_get_stats(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    return &ctx->stats;
+}
+
 /* stcp_network_recv
  *
  * Receive a datagram from the peer.  The call blocks until data is
@@ -176,58 +228,219 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len)
  * src_len      The length in bytes of the buffer
  *
  * This function takes data in multiple segments and sends them as a single
- * TCP packet. The buffer and length parameters may be repeated an arbitrary
- * number of times; a NULL pointer signifies the end of buffer/length pairs.
- * For example:
+ * TCP packet. The buffer and length parameters may be repeated up to
+ * STCP_MAX_IOV times; a NULL pointer signifies the end of buffer/length
+ * pairs. For example:
  *
  * stcp_network_send(mysd, buf1, len1, buf2, len2, NULL);
  *
+ * The segments aren't copied into one packet; see stcp_network_sendv().
+ *
  * Returns the number of bytes transferred on success, or -1 on failure.
  *
  */
 ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...)
 {
-    mysock_context_t *ctx = _mysock_get_context(sd);
-    char              packet[MAX_IP_PAYLOAD_LEN];
-    size_t            packet_len;
-    const void       *next_buf;
-    va_list           argptr;
-    struct tcphdr    *header;
+    struct iovec iov[STCP_MAX_IOV];
+    const void  *next_buf;
+    va_list      argptr;
+    int          iovcnt;
 
-    assert(ctx && src);
+    assert(src);
 
-    assert(src_len <= sizeof(packet));
-    memcpy(packet, src, src_len);
-    packet_len = src_len;
+    iov[0].iov_base = (void *) src;
+    iov[0].iov_len  = src_len;
+    iovcnt = 1;
 
     va_start(argptr, src_len);
     while ((next_buf = va_arg(argptr, const void *)))
     {
-        size_t next_len = va_arg(argptr, size_t);
-
-        assert(packet_len + next_len <= sizeof(packet));
-        memcpy(packet + packet_len, next_buf, next_len);
-        packet_len += next_len;
+        assert(iovcnt < STCP_MAX_IOV);
+        iov[iovcnt].iov_base = (void *) next_buf;
+        iov[iovcnt].iov_len  = va_arg(argptr, size_t);
+        ++iovcnt;
     }
     va_end(argptr);
 
+    return stcp_network_sendv(sd, iov, iovcnt);
+}
+
+/* stcp_network_sendv()
+ *
+ * Send a packet given as an array of buffers to the peer.
+ *
+ * sd           Mysocket descriptor
+ * iov          The buffers; the first starts with the TCP header
+ * iovcnt       The number of buffers
+ *
+ * The buffers are handed to the network layer where they lie, and the
+ * checksum is computed over them there.  Only the fixed TCP header is
+ * copied, so the fields that aren't handled by students can be filled in.
+ *
+ * Returns the number of bytes transferred on success, or -1 on failure.
+ */
+ssize_t stcp_network_sendv(mysocket_t sd, const struct iovec *iov, int iovcnt)
+{
+    return stcp_network_send_held(sd, iov, iovcnt, NULL);
+}
+
+/* stcp_network_send_held()
+ *
+ * Send a packet given as an array of buffers to the peer, the last of
+ * which lies in buf.
+ *
+ * sd           Mysocket descriptor
+ * iov          The buffers; the first starts with the TCP header
+ * iovcnt       The number of buffers
+ * buf          The block the last buffer lies in, or NULL if the network
+ *              layer mustn't refer to any of them once this returns
+ *
+ * Returns the number of bytes transferred on success, or -1 on failure.
+ */
+ssize_t stcp_network_send_held(mysocket_t sd, const struct iovec *iov,
+                               int iovcnt, void *buf)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    struct tcphdr     header;
+    struct iovec      packet[1 + STCP_MAX_IOV];
+    size_t            packet_len;
+    int               k, n;
+
+    assert(ctx && iov);
+    assert(iovcnt > 0 && iovcnt <= STCP_MAX_IOV);
+    assert(1 + STCP_MAX_IOV <= MAX_PACKET_IOV);
+
     /* fill in fields in the TCP header that aren't handled by students */
-    assert(packet_len >= sizeof(struct tcphdr));
-    header = (struct tcphdr *) packet;
+    assert(iov[0].iov_len >= sizeof(header));
+    memcpy(&header, iov[0].iov_base, sizeof(header));
 
-    header->th_sport = _network_get_port(&ctx->network_state);
-    /* N.B. assert(header->th_sport > 0) fires in the UDP SYN-ACK case */
+    if (ctx->hdr_template_valid)
+    {
+        /* ports are already known; avoid looking up the local port again */
+        header.th_sport = ctx->hdr_template.th_sport;
+        header.th_dport = ctx->hdr_template.th_dport;
+    }
+    else
+    {
+        header.th_sport = _network_get_port(&ctx->network_state);
+        /* N.B. assert(header.th_sport > 0) fires in the UDP SYN-ACK case */
+
+        assert(ctx->network_state.peer_addr.sa_family == AF_INET);
+        header.th_dport =
+            ((struct sockaddr_in *) &ctx->network_state.peer_addr)->sin_port;
+        assert(header.th_dport > 0);
+    }
+
+    header.th_sum = 0; /* set below */
+    header.th_urp = 0; /* ignored */
+
+    /* the rest of the first buffer (i.e. any options), and the others, are
+     * sent from where they are
+     */
+    packet[0].iov_base = &header;
+    packet[0].iov_len  = sizeof(header);
+    packet_len = sizeof(header);
+    n = 1;
+
+    for (k = 0; k < iovcnt; ++k)
+    {
+        size_t skip = (k == 0) ? sizeof(header) : 0;
+
+        if (iov[k].iov_len > skip)
+        {
+            packet[n].iov_base = (char *) iov[k].iov_base + skip;
+            packet[n].iov_len  = iov[k].iov_len - skip;
+            packet_len += packet[n].iov_len;
+            ++n;
+        }
+    }
+    assert(packet_len <= MAX_IP_PAYLOAD_LEN);
+
+    _mysock_set_checksumv(ctx, packet, n);
+    return _network_sendv(sd, packet, n, buf);
+}
+
+/* free a block passed to stcp_network_send_held().  the network layer
+ * keeps it until it's done with it.
+ */
+void stcp_network_free(mysocket_t sd, void *buf)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+
+    assert(ctx);
+    _network_free_buffer(&ctx->network_state, buf);
+}
+
+/* stcp_network_send_header()
+ *
+ * Send a header-only segment (e.g. a pure ACK) to the peer.  seq, ack and
+ * win are given in host byte order.
+ *
+ * Rather than building the header from scratch and checksumming it, this
+ * copies a prebuilt per-connection header, fills in the fields that
+ * differ from segment to segment, and adjusts the template's checksum for
+ * just those words (RFC 1624).
+ *
+ * Returns the number of bytes transferred on success, or -1 on failure.
+ */
+ssize_t stcp_network_send_header(mysocket_t sd, uint32_t seq, uint32_t ack,
+                                 uint8_t flags, uint16_t win)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    struct tcphdr     header;
+    uint16_t          sum;
+    unsigned int      k;
+
+    assert(ctx);
+
+    if (!ctx->hdr_template_valid)
+        _stcp_init_header_template(ctx);
+
+    header = ctx->hdr_template;
+    header.th_seq   = htonl(seq);
+    header.th_ack   = htonl(ack);
+    header.th_flags = flags;
+    header.th_win   = htons(win);
+
+    /* th_seq through th_win are zero in the template, so only the words
+     * that are now non-zero need to be folded into its checksum.
+     */
+    sum = ctx->hdr_template.th_sum;
+    for (k = offsetof(struct tcphdr, th_seq) / sizeof(uint16_t);
+         k < offsetof(struct tcphdr, th_sum) / sizeof(uint16_t); ++k)
+    {
+        uint16_t old_word = ((const uint16_t *) &ctx->hdr_template)[k];
+        uint16_t new_word = ((const uint16_t *) &header)[k];
+
+        if (new_word != old_word)
+            sum = _mysock_checksum_adjust(sum, old_word, new_word);
+    }
+    header.th_sum = sum;
+
+    return _network_send(sd, &header, sizeof(header));
+}
+
+/* build the header template used by stcp_network_send_header().  the peer
+ * address must be known by this point, as the checksum covers it.
+ */
+static void _stcp_init_header_template(mysock_context_t *ctx)
+{
+    struct tcphdr *header;
 
+    assert(ctx && !ctx->hdr_template_valid);
     assert(ctx->network_state.peer_addr.sa_family == AF_INET);
+
+    header = &ctx->hdr_template;
+    memset(header, 0, sizeof(*header));
+
+    header->th_sport = _network_get_port(&ctx->network_state);
     header->th_dport =
         ((struct sockaddr_in *) &ctx->network_state.peer_addr)->sin_port;
     assert(header->th_dport > 0);
+    header->th_off = sizeof(struct tcphdr) / sizeof(uint32_t);
 
-    header->th_sum = 0; /* set below */
-    header->th_urp = 0; /* ignored */
-
-    _mysock_set_checksum(ctx, packet, packet_len);
-    return _network_send(sd, packet, packet_len);
+    _mysock_set_checksum(ctx, header, sizeof(*header));
+    ctx->hdr_template_valid = TRUE;
 }
 
 /* receive data from the application (sent to us using mywrite()).
@@ -246,6 +459,19 @@ size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len)
                                   dst, max_len, TRUE);
 }
 
+bool_t stcp_app_pending(mysocket_t sd)
+{
+    mysock_context_t *ctx = _mysock_get_context(sd);
+    bool_t pending;
+
+    assert(ctx);
+
+    PTHREAD_CALL(pthread_mutex_lock(&ctx->data_ready_lock));
+    pending = (ctx->app_recv_queue.head != NULL);
+    PTHREAD_CALL(pthread_mutex_unlock(&ctx->data_ready_lock));
+    return pending;
+}
+
 /* pass data up to the application for consumption by myread() */
 void stcp_app_send(mysocket_t sd, const void *src, size_t src_len)
 {
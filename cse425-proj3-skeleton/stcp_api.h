@@ -7,6 +7,7 @@
 #define __STCP_API_H__
 
 #include <time.h>   /* timespec */
+#include <sys/uio.h>    /* iovec */
 #include "mysock.h" /* mysocket_t */
 
 
@@ -61,6 +62,14 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
                                  unsigned int           wait_flags,
                                  const struct timespec *abstime);
 
+/* the current time, by the clock that stcp_wait_for_event() measures
+ * abstime against.  this is the system clock, unless the connection is
+ * being simulated (see mysock_engine_sim.c), in which case it's a virtual
+ * one; timers and timestamps should be based on this rather than on the
+ * system clock itself.
+ */
+void stcp_get_time(struct timespec *now);
+
 /* allow STCP implementation to establish a context for a given mysocket
  * descriptor.  this context should contain any information that needs to be
  * tracked for the given mysocket, e.g. sequence numbers, retransmission
@@ -71,6 +80,16 @@ unsigned int stcp_wait_for_event(mysocket_t             sd,
 void stcp_set_context(mysocket_t sd, const void *stcp_state);
 void *stcp_get_context(mysocket_t my_sd);
 
+/* return the value of an integer mysocket option (MYSO_* in mysock.h), as
+ * set by the application with mysetsockopt().
+ */
+int stcp_get_option(mysocket_t sd, mysock_option_t option);
+
+/* counters reported to the application by mygetsockopt(MYSO_STATS).  the
+ * transport layer updates these directly through the returned pointer.
+ */
+mysock_stats_t *stcp_get_stats(mysocket_t sd);
+
 /* Receive a datagram from the peer.
  *
  * sd       Mysocket descriptor.
@@ -88,9 +107,9 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len);
  * src_len      The length in bytes of the buffer
  *
  * This function takes data in multiple segments and sends them as a single
- * datagram. The buffer and length parameters may be repeated an arbitrary
- * number of times; a NULL pointer signifies the end of buffer/length pairs.
- * For example:
+ * datagram. The buffer and length parameters may be repeated up to
+ * STCP_MAX_IOV times; a NULL pointer signifies the end of buffer/length
+ * pairs. For example:
  *
  * stcp_network_send(mysd, buf1, len1, buf2, len2, NULL);
  *
@@ -98,9 +117,70 @@ ssize_t stcp_network_recv(mysocket_t sd, void *dst, size_t max_len);
  */
 ssize_t stcp_network_send(mysocket_t sd, const void *src, size_t src_len, ...);
 
+#define STCP_MAX_IOV 8
+
+/* Send a datagram given as an array of buffers to the peer.
+ *
+ * sd           Mysocket descriptor
+ * iov          The buffers, the first of which must start with the whole
+ *              STCP header
+ * iovcnt       The number of buffers (at most STCP_MAX_IOV)
+ *
+ * This is the same as stcp_network_send(), but the buffers are never copied
+ * into one packet along the way; they're passed down to the network as they
+ * are.  Only the fixed header is copied, to fill in the fields STCP doesn't
+ * handle itself.
+ *
+ * Returns the number of bytes transferred on success, or -1 on failure.
+ */
+ssize_t stcp_network_sendv(mysocket_t sd, const struct iovec *iov, int iovcnt);
+
+/* Send a datagram whose last buffer lies in a block the network may hold on
+ * to.
+ *
+ * sd           Mysocket descriptor
+ * iov, iovcnt  As for stcp_network_sendv()
+ * buf          The block (from malloc()) that the last buffer lies in
+ *
+ * This is the same as stcp_network_sendv(), except that the network may go
+ * on using the last buffer after this returns, rather than copy it (e.g.
+ * to send it with MSG_ZEROCOPY).  buf mustn't be changed once it's been
+ * sent, and is given back with stcp_network_free() rather than free().
+ *
+ * Returns the number of bytes transferred on success, or -1 on failure.
+ */
+ssize_t stcp_network_send_held(mysocket_t sd, const struct iovec *iov,
+                               int iovcnt, void *buf);
+
+/* Free a block passed to stcp_network_send_held(), once the network is done
+ * with it (which may be after this returns).
+ */
+void stcp_network_free(mysocket_t sd, void *buf);
+
+/* Send a header-only segment (e.g. a pure ACK) to the peer.
+ *
+ * sd           Mysocket descriptor
+ * seq, ack     Sequence and acknowledgement numbers (host byte order)
+ * flags        TH_* flags for the segment
+ * win          Advertised window (host byte order)
+ *
+ * This is equivalent to filling in an STCPHeader with th_off = 5 and passing
+ * it to stcp_network_send(), but is cheaper, as only the fields given here
+ * are filled in and checksummed on each call.
+ *
+ * Returns the number of bytes transferred on success, or -1 on failure.
+ */
+ssize_t stcp_network_send_header(mysocket_t sd, uint32_t seq, uint32_t ack,
+                                 uint8_t flags, uint16_t win);
+
 /* receive data from the application (sent to us using mywrite()) */
 size_t stcp_app_recv(mysocket_t sd, void *dst, size_t max_len);
 
+/* returns TRUE if the application has written data that stcp_app_recv()
+ * hasn't taken yet
+ */
+bool_t stcp_app_pending(mysocket_t sd);
+
 /* pass data up to the application for consumption by myread() */
 void stcp_app_send(mysocket_t sd, const void *src, size_t src_len);
 
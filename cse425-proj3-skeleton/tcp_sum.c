@@ -1,6 +1,7 @@
 /* TCP checksum support--this is not used directly by students */
 
 #include <stddef.h>
+#include <string.h>
 #include <assert.h>
 #include <netinet/in.h>
 #include "mysock_impl.h"
@@ -8,6 +9,10 @@
 #include "tcp_sum.h"
 
 
+static uint32_t _tcp_pseudo_header_sum(uint32_t src_addr, uint32_t dst_addr,
+                                       size_t len);
+
+
 /* computes checksum for TCP segment, based on description in RFCs 793 and
  * 1071, and Berkeley in_cksum().
  */
@@ -16,31 +21,25 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
                               const void *packet,
                               size_t len /*host byte order*/)
 {
-    struct
-    {
-        uint32_t src_addr;
-        uint32_t dst_addr;
-        uint8_t  zero;
-        uint8_t  protocol;
-        uint16_t len;
-    } __attribute__ ((packed)) pseudo_header =
-    {
-        src_addr, dst_addr, 0, IPPROTO_TCP, htons(len)
-    };
+    return _mysock_checksum_fold(
+        _mysock_tcp_partial_sum(src_addr, dst_addr, packet, len));
+}
 
+/* returns the unfolded one's complement sum of the pseudo header and the
+ * given TCP segment (skipping th_sum), i.e. the checksum before folding and
+ * inversion.  partial sums may be added together before folding.
+ */
+uint32_t _mysock_tcp_partial_sum(uint32_t src_addr /*network byte order*/,
+                                 uint32_t dst_addr /*network byte order*/,
+                                 const void *packet,
+                                 size_t len /*host byte order*/)
+{
     unsigned int k;
-    int32_t sum = 0;
+    int32_t sum;
 
     assert(packet && len >= sizeof(struct tcphdr));
-    assert(sizeof(pseudo_header) == 12);
-
 
-    assert(src_addr > 0);
-    assert(dst_addr > 0);
-
-    /* process 96-bit pseudo header */
-    for (k = 0; k < sizeof(pseudo_header) / sizeof(uint16_t); ++k)
-        sum += ((uint16_t *) &pseudo_header)[k];
+    sum = _tcp_pseudo_header_sum(src_addr, dst_addr, len);
 
     /* process TCP header and payload */
     assert(((long)packet & 2) == 0);
@@ -59,13 +58,116 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
         sum += tmp;
     }
 
-    /* fold 32-bit sum to 16 bits */
+    return (uint32_t) sum;
+}
+
+/* the same, for a segment given as iovcnt pieces of any length and
+ * alignment.  the first piece must hold the whole TCP header, with th_sum
+ * zeroed, as it isn't skipped here.  the pieces are summed separately; a
+ * piece that starts at an odd offset into the segment has its sum's bytes
+ * swapped before it's added in (RFC 1071, section 2(B)).
+ */
+uint32_t _mysock_tcp_partial_sumv(uint32_t src_addr /*network byte order*/,
+                                  uint32_t dst_addr /*network byte order*/,
+                                  const struct iovec *iov, int iovcnt)
+{
+    uint32_t sum = 0;
+    size_t len = 0, k;
+    int j;
+
+    assert(iov && iovcnt > 0);
+    assert(iov[0].iov_len >= sizeof(struct tcphdr));
+    assert(((const struct tcphdr *) iov[0].iov_base)->th_sum == 0);
+
+    for (j = 0; j < iovcnt; ++j)
+    {
+        const uint8_t *piece = (const uint8_t *) iov[j].iov_base;
+        size_t piece_len = iov[j].iov_len;
+        uint32_t piece_sum = 0;
+        uint16_t word;
+
+        for (k = 0; k + 1 < piece_len; k += 2)
+        {
+            memcpy(&word, piece + k, sizeof(word));
+            piece_sum += word;
+        }
+        if (piece_len & 1)
+        {
+            word = 0;
+            *(uint8_t *) &word = piece[piece_len - 1];
+            piece_sum += word;
+        }
+
+        if (len & 1)
+        {
+            piece_sum = (piece_sum >> 16) + (piece_sum & 0xffff);
+            piece_sum += (piece_sum >> 16);
+            piece_sum = ((piece_sum & 0xff) << 8) | ((piece_sum >> 8) & 0xff);
+        }
+
+        sum += piece_sum;
+        len += piece_len;
+    }
+    assert(len <= 0xffff);
+
+    return sum + _tcp_pseudo_header_sum(src_addr, dst_addr, len);
+}
+
+/* sum of the 96-bit pseudo header for a segment of len bytes */
+static uint32_t _tcp_pseudo_header_sum(uint32_t src_addr /*network byte order*/,
+                                       uint32_t dst_addr /*network byte order*/,
+                                       size_t len /*host byte order*/)
+{
+    struct
+    {
+        uint32_t src_addr;
+        uint32_t dst_addr;
+        uint8_t  zero;
+        uint8_t  protocol;
+        uint16_t len;
+    } __attribute__ ((packed)) pseudo_header =
+    {
+        src_addr, dst_addr, 0, IPPROTO_TCP, htons(len)
+    };
+
+    unsigned int k;
+    uint32_t sum = 0;
+
+    assert(sizeof(pseudo_header) == 12);
+
+    assert(src_addr > 0);
+    assert(dst_addr > 0);
+
+    for (k = 0; k < sizeof(pseudo_header) / sizeof(uint16_t); ++k)
+        sum += ((uint16_t *) &pseudo_header)[k];
+
+    return sum;
+}
+
+/* fold a 32-bit partial sum to 16 bits, and return its complement */
+uint16_t _mysock_checksum_fold(uint32_t sum)
+{
     sum = (sum >> 16) + (sum & 0xffff);
     sum += (sum >> 16);
 
     return (uint16_t) ~sum;
 }
 
+/* incrementally update checksum hc when a 16-bit word of the segment changes
+ * from old_word to new_word, without revisiting the rest of the segment.
+ * this is eqn. 3 of RFC 1624 (HC' = ~(~HC + ~m + m')); words are taken as
+ * they appear in the packet, so no byte order conversion is needed.
+ */
+uint16_t _mysock_checksum_adjust(uint16_t hc, uint16_t old_word,
+                                 uint16_t new_word)
+{
+    uint32_t sum = (uint16_t) ~hc;
+
+    sum += (uint16_t) ~old_word;
+    sum += new_word;
+    return _mysock_checksum_fold(sum);
+}
+
 /* update checksum in the given STCP segment */
 void _mysock_set_checksum(const mysock_context_t *ctx,
                           void *packet, size_t len)
@@ -83,6 +185,26 @@ void _mysock_set_checksum(const mysock_context_t *ctx,
         packet, len);
 }
 
+/* update checksum in the given STCP segment, given in pieces.  th_sum, in
+ * the first piece, is written there.
+ */
+void _mysock_set_checksumv(const mysock_context_t *ctx,
+                           const struct iovec *iov, int iovcnt)
+{
+    assert(ctx && iov && iovcnt > 0);
+    assert(iov[0].iov_len >= sizeof(struct tcphdr));
+
+    assert(ctx->network_state.peer_addr.sa_family == AF_INET);
+
+    ((struct tcphdr *) iov[0].iov_base)->th_sum = _mysock_checksum_fold(
+        _mysock_tcp_partial_sumv(
+            _network_get_local_addr((network_context_t *)
+                                    &ctx->network_state), /*src*/
+            ((struct sockaddr_in *) &ctx->network_state.peer_addr)-> /*dst*/
+                sin_addr.s_addr,
+            iov, iovcnt));
+}
+
 /* returns TRUE if checksum is correct, FALSE otherwise */
 bool_t _mysock_verify_checksum(const mysock_context_t *ctx,
                                const void *packet, size_t len)
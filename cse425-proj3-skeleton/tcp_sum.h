@@ -3,6 +3,7 @@
 #ifndef __TCP_CHECKSUM_H__
 #define __TCP_CHECKSUM_H__
 
+#include <sys/uio.h>
 #include "mysock.h"
 
 struct mysock_context;
@@ -12,9 +13,26 @@ uint16_t _mysock_tcp_checksum(uint32_t src_addr /*network byte order*/,
                               const void *packet,
                               size_t len /*host byte order*/);
 
+uint32_t _mysock_tcp_partial_sum(uint32_t src_addr /*network byte order*/,
+                                 uint32_t dst_addr /*network byte order*/,
+                                 const void *packet,
+                                 size_t len /*host byte order*/);
+
+uint32_t _mysock_tcp_partial_sumv(uint32_t src_addr /*network byte order*/,
+                                  uint32_t dst_addr /*network byte order*/,
+                                  const struct iovec *iov, int iovcnt);
+
+uint16_t _mysock_checksum_fold(uint32_t sum);
+
+uint16_t _mysock_checksum_adjust(uint16_t hc, uint16_t old_word,
+                                 uint16_t new_word);
+
 void _mysock_set_checksum(const struct mysock_context *ctx,
                           void *packet, size_t len);
 
+void _mysock_set_checksumv(const struct mysock_context *ctx,
+                           const struct iovec *iov, int iovcnt);
+
 bool_t _mysock_verify_checksum(const mysock_context_t *ctx,
                                const void *packet, size_t len);
 
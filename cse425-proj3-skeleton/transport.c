@@ -24,10 +24,128 @@
 #define RECEIVER_WINDOW 3072
 #define SENDER_WINDOW 3072
 
-enum { SYN_SENT, SYN_RECEIVED, CSTATE_ESTABLISHED, FIN_WAIT_1, FIN_WAIT_2, TIME_WAIT, CLOSE_WAIT, LAST_ACK, CLOSED };    /* you should have more states */
+/* forward error correction (see fec_add_segment() and fec_try_recover()) */
+#define FEC_MAX_BLOCK   32  /* maximum data segments per parity segment */
+#define FEC_MAX_PENDING 4   /* parity segments held while data is missing */
 
-/* this structure is global to a mysocket descriptor */
+/* STCP options; the FEC options use the experimental kinds of RFC 4727 */
+#define TCPOPT_EOL          0
+#define TCPOPT_NOP          1
+#define TCPOPT_FEC          253 /* SYN: kind, len, FEC block size (16 bits) */
+#define TCPOPT_FEC_PARITY   254 /* parity: kind, len, # of data segments (16
+                                 * bits), bytes covered (32 bits)
+                                 */
+#define TCPOPT_TIMESTAMP    8   /* RFC 7323: kind, len, TSval, TSecr */
+#define TCPOLEN_FEC         4
+#define TCPOLEN_FEC_PARITY  8
+#define TCPOLEN_TIMESTAMP   10
+#define TCPOLEN_TSTAMP_APPA (TCPOLEN_TIMESTAMP + 2) /* with two NOPs first */
+
+/* largest STCP header, including options */
+#define MAX_HEADER_LEN      60
+
+/* congestion control (RFC 5681); windows are in bytes */
+#define INITIAL_CWND    MIN(4 * STCP_MSS, MAX(2 * STCP_MSS, 4380))
+#define TCP_MAXWIN      65535
+
+/* retransmission timer (RFC 6298), in microseconds.  the minimum is that of
+ * most real stacks rather than the RFC's one second, which is far longer
+ * than any path this runs over.
+ */
+#define RTO_INITIAL     1000000
+#define RTO_MIN         200000
+#define RTO_MAX         60000000
+#define MAX_RETRANSMITS 8   /* give up after this many timeouts in a row */
+#define LAST_ACK_RETRANSMITS 3  /* ...or this many, for our FIN in LAST_ACK */
+
+/* duplicate ACKs taken to mean a segment was lost (RFC 5681) */
+#define DUPACK_THRESHOLD 3
+
+/* LEDBAT (RFC 6817).  delays are in microseconds */
+#define LEDBAT_TARGET           100000  /* queueing delay to aim for */
+#define LEDBAT_BASE_HISTORY     10      /* minutes of base delay history */
+#define LEDBAT_CURRENT_FILTER   4       /* samples for the current delay */
+#define LEDBAT_MIN_CWND         (2 * STCP_MSS)
+
+/* optional parts of the transport, each of which is used on a connection
+ * only if the application asks for it there (and, for ECN and FEC, the peer
+ * agrees).  these tests decide what's offered in the handshake; after it,
+ * the connection is handled by the instantiation of the transport for just
+ * the policies it uses (see choose_engine()).  defining STCP_NO_LEDBAT,
+ * STCP_NO_ECN or STCP_NO_FEC builds the transport without the corresponding
+ * one, and without the instantiations that use it.
+ */
+#ifdef STCP_NO_LEDBAT
+#define USE_LEDBAT(ctx) FALSE
+#else
+#define USE_LEDBAT(ctx) ((ctx)->cc == MYSOCK_CC_LEDBAT)
+#endif
+
+#ifdef STCP_NO_ECN
+#define USE_ECN(ctx)    FALSE
+#else
+#define USE_ECN(ctx)    ((ctx)->ecn)
+#endif
+
+#ifdef STCP_NO_FEC
+#define USE_FEC(ctx)    FALSE
+#else
+#define USE_FEC(ctx)    ((ctx)->fec_block > 0)
+#endif
+
+/* sequence number comparisons, modulo 2^32 */
+#define SEQ_LT(a,b)     ((int32_t) ((a) - (b)) < 0)
+#define SEQ_LEQ(a,b)    ((int32_t) ((a) - (b)) <= 0)
+#define SEQ_GT(a,b)     ((int32_t) ((a) - (b)) > 0)
+#define SEQ_GEQ(a,b)    ((int32_t) ((a) - (b)) >= 0)
+
+enum { LISTEN, SYN_SENT, SYN_RECEIVED, CSTATE_ESTABLISHED, FIN_WAIT_1, FIN_WAIT_2, CLOSING, TIME_WAIT, CLOSE_WAIT, LAST_ACK, CLOSED };    /* you should have more states */
+
+/* TRUE once the handshake is over */
+#define CONNECTION_SYNCHRONISED(ctx) \
+    ((ctx)->connection_state >= CSTATE_ESTABLISHED)
+
+/* F-RTO (RFC 5682) progress after a retransmission timeout */
+enum { FRTO_NONE, FRTO_RETRANSMITTED, FRTO_NEW_DATA };
+
+/* a data segment held by the receiver */
+typedef struct segment
+{
+    tcp_seq         seq;
+    size_t          len;
+    struct segment *next;
+    char            data[STCP_MSS];
+} segment_t;
+
+/* a segment queued for the peer, kept until it's acknowledged */
+typedef struct send_segment
+{
+    tcp_seq              seq;
+    size_t               len;       /* bytes of data */
+    uint8_t              flags;     /* TH_FIN, if this is our FIN */
+    int                  xmits;     /* times sent so far */
+    struct timespec      sent_at;   /* time of the last of those */
+    struct send_segment *next;
+    char                 data[STCP_MSS];
+} send_segment_t;
+
+/* sequence space taken up by a queued segment */
+#define SEG_SEQ_LEN(s)  ((s)->len + (((s)->flags & TH_FIN) ? 1 : 0))
+
+/* a parity segment received from the peer, covering num_segs data segments
+ * that occupy [seq, seq + len) in the sequence space
+ */
 typedef struct
+{
+    tcp_seq seq;
+    size_t  len;
+    int     num_segs;
+    size_t  parity_len;
+    char    parity[STCP_MSS];
+} fec_parity_t;
+
+/* this structure is global to a mysocket descriptor */
+typedef struct context
 {
     bool_t done;    /* TRUE once connection is closed */
 
@@ -39,284 +157,562 @@ typedef struct
     tcp_seq current_sequence_num;
     tcp_seq fin_ack_sequence_num;
 
+    /* header reused for every outgoing data segment; only th_seq, th_ack
+     * (and the timestamp, if there is one) change
+     */
+    struct
+    {
+        STCPHeader hdr;
+        uint8_t    ts_opt[TCPOLEN_TSTAMP_APPA];
+    } __attribute__ ((packed)) data_hdr;
+
+    /* timestamps (RFC 7323) are sent on data segments when using LEDBAT,
+     * and echoed in the ACKs for them.  ts_recent is the TSval of the last
+     * segment received, which the next ACK should echo.
+     */
+    uint32_t ts_recent;
+    bool_t   ts_recent_valid;
+
+    /* send side.  everything from ack_num (the oldest unacknowledged
+     * sequence number) up to current_sequence_num is held in send_queue,
+     * in order, until it's acknowledged.  snd_nxt is the next sequence
+     * number to send; it only lags current_sequence_num while going back
+     * to resend segments after a timeout.
+     */
+    send_segment_t *send_queue;
+    send_segment_t *send_queue_tail;
+    tcp_seq         snd_nxt;
+
+    /* congestion control (RFC 5681).  recover is current_sequence_num as
+     * of the last time loss was detected; ACKs for data sent before then
+     * don't start another round of recovery (RFC 6582).
+     */
+    int     cwnd;
+    int     ssthresh;
+    tcp_seq recover;
+
+    /* fast retransmit and recovery (NewReno, RFC 6582).  during recovery,
+     * proportional rate reduction (RFC 6937) sets the window on each ACK,
+     * so that the amount sent tracks the amount the peer receives, and
+     * in_flight comes down to ssthresh gradually rather than all at once.
+     */
+    int    dupacks;         /* duplicate ACKs since the last new ACK */
+    bool_t in_recovery;
+    int    recover_fs;      /* bytes in flight when recovery began */
+    int    prr_delivered;   /* bytes the peer has received since then */
+    int    prr_out;         /* bytes sent since then */
+
+    /* congestion control algorithm, MYSOCK_CC_* */
+    int cc;
+
+    /* the instantiation of the transport that handles the connection once
+     * the handshake is over (see choose_engine()), and its handle_segment()
+     */
+    void (*engine)(mysocket_t sd, struct context *ctx, unsigned int event);
+    void (*engine_segment)(mysocket_t sd, struct context *ctx,
+                           char *segment, int pkt_size);
+
+    /* explicit congestion notification, if both ends agreed to it in the
+     * handshake.  we set ECT on our data segments, and echo CE on the
+     * peer's back in the ACK for each (ce_received is TRUE if the next
+     * ACK should).  marks on our own data are handled as DCTCP does
+     * (RFC 8257): dctcp_alpha tracks the fraction of data that's marked,
+     * in 1/1024ths, and is updated after each window of data (ending at
+     * dctcp_window_end).  a mark cuts the window in proportion, at most
+     * once a window (until ecn_recover is acknowledged).
+     */
+    bool_t  ecn;
+    bool_t  ce_received;
+    int     dctcp_alpha;
+    int     dctcp_acked;
+    int     dctcp_marked;
+    tcp_seq dctcp_window_end;
+    tcp_seq ecn_recover;
+
+    /* ...LEDBAT's one-way delay measurements: the lowest seen in each of
+     * the last few minutes (the most recent being ledbat_base[0]), and the
+     * last few samples.  only differences between these matter, so it
+     * doesn't matter that the two ends' clocks aren't in sync.
+     */
+    uint32_t ledbat_base[LEDBAT_BASE_HISTORY];
+    time_t   ledbat_base_minute;
+    uint32_t ledbat_current[LEDBAT_CURRENT_FILTER];
+    int      ledbat_num_samples;
+
+    /* retransmission timer (RFC 6298); times are in microseconds */
+    long            srtt;
+    long            rttvar;
+    long            rto;            /* before backing off */
+    int             rto_backoff;    /* timeouts since the last new ACK */
+    bool_t          rto_running;
+    struct timespec rto_deadline;
+
+    /* spurious timeout detection (F-RTO, RFC 5682).  a timeout reduces
+     * the window at once, as usual, but resends only the first
+     * unacknowledged segment.  if the ACKs that follow show the original
+     * transmissions got through after all, the window is put back the way
+     * it was before the timeout, instead of going back to resend the rest.
+     */
+    int     frto_state;
+    tcp_seq frto_rexmit_end;    /* end of the segment resent at the timeout */
+    int     prior_cwnd;
+    int     prior_ssthresh;
+
+    /* receive side reassembly.  rcv_nxt is the next sequence number to be
+     * passed up to the application; anything received beyond it waits in
+     * ooo_queue (sorted by sequence number) until the gap is filled.
+     */
+    tcp_seq    rcv_nxt;
+    segment_t *ooo_queue;
+    bool_t     fin_received;
+    tcp_seq    fin_seq;
+
+    /* forward error correction.  fec_block is the number of data segments
+     * covered by each parity segment, as agreed in the handshake, or 0 if
+     * FEC isn't in use.
+     */
+    int     fec_block;
+
+    /* ...sender: the block being built, and its running XOR */
+    tcp_seq fec_send_seq;
+    size_t  fec_send_len;
+    int     fec_send_segs;
+    size_t  fec_send_parity_len;
+    char    fec_send_parity[STCP_MSS];
+
+    /* ...receiver: the last fec_block segments passed up to the
+     * application (a ring indexed by fec_history_next), and parity
+     * segments that may yet be needed to fill a gap
+     */
+    segment_t    fec_history[FEC_MAX_BLOCK];
+    int          fec_history_next;
+    fec_parity_t fec_pending[FEC_MAX_PENDING];
+    int          fec_num_pending;
+
+    mysock_stats_t *stats;
+
     /* any other connection-wide global variables go here */
 } context_t;
 
 
 static void generate_initial_seq_num(context_t *ctx);
-static void control_loop(mysocket_t sd, context_t *ctx);
+static void transport_free(mysocket_t sd, context_t *ctx);
+static void handshake_segment(mysocket_t sd, context_t *ctx);
+static void handshake_timeout(mysocket_t sd, context_t *ctx);
+static void connection_established(mysocket_t sd, context_t *ctx);
+static int app_window(context_t *ctx);
+static ssize_t send_syn(mysocket_t sd, context_t *ctx,
+                        uint8_t flags, tcp_seq ack);
+static const uint8_t *find_option(const tcphdr *hdr, size_t len,
+                                  uint8_t kind, uint8_t opt_len);
+static void queue_segment(context_t *ctx, const char *data, size_t len,
+                          uint8_t flags);
+static int send_window(context_t *ctx);
+static void rtt_sample(context_t *ctx, long rtt);
+static void rto_recovery(context_t *ctx, int cwnd);
+static void prr_update(context_t *ctx, int delivered);
+static void reno_update(context_t *ctx, int acked);
+static void ledbat_delay_sample(context_t *ctx, uint32_t delay);
+static void ledbat_update(context_t *ctx, int acked, int flight);
+static void dctcp_update(context_t *ctx, int acked, bool_t ece);
+static ssize_t send_ack(mysocket_t sd, context_t *ctx);
+static uint32_t timestamp_now(void);
+static void start_timer(context_t *ctx);
+static void set_timer(context_t *ctx, long usec);
+static void time_wait(context_t *ctx);
+static long time_since(const struct timespec *then);
+static void fec_add_segment(mysocket_t sd, context_t *ctx,
+                            const char *data, size_t len);
+static void fec_send_parity(mysocket_t sd, context_t *ctx);
+static void fec_parity_received(context_t *ctx, tcp_seq seq,
+                                const uint8_t *opt,
+                                const char *parity, size_t parity_len);
+static void fec_save_delivered(context_t *ctx, const segment_t *seg);
+static size_t fec_rebuild(context_t *ctx, char *rebuilt);
+static size_t fec_try_recover(context_t *ctx, fec_parity_t *p,
+                              char *rebuilt);
 void our_dprintf(const char *format,...);
 
+
+/* once the handshake is over, a connection is handled by an instantiation
+ * of the templates below for the policies it uses.  each policy is a class
+ * of static member functions, called at fixed points on the per-segment
+ * paths, that work on the connection's context_t:
+ *   - congestion control: how the window changes as data is acknowledged
+ *   - acknowledgement: when received data is acknowledged
+ *   - recovery: what's done, beyond retransmission, to recover lost data
+ *   - pacing: when queued segments may be sent
+ * a policy that's not in use costs nothing on those paths, since its
+ * functions are empty (or constant) in the instantiations without it.
+ * choose_engine() picks the instantiation for each connection.
+ */
+
+/* congestion control.  uses_timestamps is TRUE if our data segments carry
+ * timestamps, so that the peer's ACKs give one-way delay samples.
+ */
+struct reno_cc
+{
+    enum { uses_timestamps = FALSE };
+
+    static void delay_sample(context_t *ctx, uint32_t delay) { }
+
+    static void window_update(context_t *ctx, int acked, int flight)
+    {
+        reno_update(ctx, acked);
+    }
+
+    static void ecn_echo(context_t *ctx, int acked, bool_t ece) { }
+};
+
+struct ledbat_cc : reno_cc
+{
+    enum { uses_timestamps = TRUE };
+
+    static void delay_sample(context_t *ctx, uint32_t delay)
+    {
+        ledbat_delay_sample(ctx, delay);
+    }
+
+    /* Reno's until there's a delay sample to go by */
+    static void window_update(context_t *ctx, int acked, int flight)
+    {
+        if (ctx->ledbat_num_samples > 0)
+            ledbat_update(ctx, acked, flight);
+        else
+            reno_update(ctx, acked);
+    }
+};
+
+/* ...either of those, responding to congestion marks as DCTCP does */
+template <class CC>
+struct dctcp_cc : CC
+{
+    static void ecn_echo(context_t *ctx, int acked, bool_t ece)
+    {
+        dctcp_update(ctx, acked, ece);
+    }
+};
+
+/* acknowledgement: every segment that needs it is acknowledged at once */
+struct immediate_ack
+{
+    static void data_received(mysocket_t sd, context_t *ctx)
+    {
+        send_ack(sd, ctx);
+    }
+};
+
+/* recovery: retransmission alone */
+struct arq_recovery
+{
+    static void data_sent(mysocket_t sd, context_t *ctx,
+                          const send_segment_t *seg) { }
+    static void app_idle(mysocket_t sd, context_t *ctx) { }
+    static void flush(mysocket_t sd, context_t *ctx) { }
+    static void parity_received(context_t *ctx, tcp_seq seq,
+                                const uint8_t *opt,
+                                const char *parity, size_t parity_len) { }
+    static void data_delivered(context_t *ctx, const segment_t *seg) { }
+    static size_t rebuild(context_t *ctx, char *rebuilt) { return 0; }
+};
+
+/* ...and forward error correction: a parity segment after each block of
+ * fec_block data segments, from which the receiver can rebuild any one
+ * segment of the block that's lost
+ */
+struct fec_recovery
+{
+    /* parity covers data as it's first sent, so it never goes out ahead of
+     * the data it covers
+     */
+    static void data_sent(mysocket_t sd, context_t *ctx,
+                          const send_segment_t *seg)
+    {
+        if (seg->len > 0)
+            fec_add_segment(sd, ctx, seg->data, seg->len);
+    }
+
+    /* if the application has nothing more queued for now, don't leave the
+     * tail of its data unprotected until it writes more
+     */
+    static void app_idle(mysocket_t sd, context_t *ctx)
+    {
+        if (ctx->fec_send_segs > 0 &&
+            ctx->snd_nxt == ctx->current_sequence_num &&
+            !stcp_app_pending(sd))
+            fec_send_parity(sd, ctx);
+    }
+
+    /* send the parity for the block being built, without waiting for the
+     * rest of it
+     */
+    static void flush(mysocket_t sd, context_t *ctx)
+    {
+        if (ctx->fec_send_segs > 0)
+            fec_send_parity(sd, ctx);
+    }
+
+    static void parity_received(context_t *ctx, tcp_seq seq,
+                                const uint8_t *opt,
+                                const char *parity, size_t parity_len)
+    {
+        fec_parity_received(ctx, seq, opt, parity, parity_len);
+    }
+
+    static void data_delivered(context_t *ctx, const segment_t *seg)
+    {
+        fec_save_delivered(ctx, seg);
+    }
+
+    static size_t rebuild(context_t *ctx, char *rebuilt)
+    {
+        return fec_rebuild(ctx, rebuilt);
+    }
+};
+
+/* pacing: segments are sent as soon as the window allows */
+struct window_pacer
+{
+    /* always allow one segment in flight, however small the window */
+    static bool_t may_send(context_t *ctx, const send_segment_t *seg)
+    {
+        return ctx->snd_nxt == ctx->ack_num ||
+               send_window(ctx) >= (int) SEG_SEQ_LEN(seg);
+    }
+};
+
+/* a set of policies, one of each kind */
+template <class CC, class Ack, class Recovery, class Pacer>
+struct transport_policy
+{
+    typedef CC       cc;
+    typedef Ack      ack;
+    typedef Recovery recovery;
+    typedef Pacer    pacer;
+};
+
+static void choose_engine(context_t *ctx);
+template <class P> static void set_engine(context_t *ctx);
+template <class P> static void connection_event(mysocket_t sd,
+                                                context_t *ctx,
+                                                unsigned int event);
+template <class P> static void handle_segment(mysocket_t sd, context_t *ctx,
+                                              char *segment, int pkt_size);
+template <class P> static void receive_data(mysocket_t sd, context_t *ctx,
+                                            tcp_seq seq, const char *data,
+                                            size_t len);
+template <class P> static void deliver_in_order(mysocket_t sd,
+                                                context_t *ctx);
+template <class P> static void send_segments(mysocket_t sd, context_t *ctx);
+template <class P> static void transmit_segment(mysocket_t sd,
+                                                context_t *ctx,
+                                                send_segment_t *seg);
+template <class P> static void ack_received(mysocket_t sd, context_t *ctx,
+                                            tcp_seq ack);
+template <class P> static void dup_ack_received(mysocket_t sd,
+                                                context_t *ctx);
+template <class P> static void fast_retransmit(mysocket_t sd,
+                                               context_t *ctx);
+template <class P> static void retransmit_timeout(mysocket_t sd,
+                                                  context_t *ctx);
+
 /* initialise the transport layer, and start the main loop, handling
  * any data from the peer or the application.  this function should not
  * return until the connection is closed.
  */
 void transport_init(mysocket_t sd, bool_t is_active)
+{
+    const struct timespec *abstime;
+    unsigned int flags;
+
+    transport_start(sd, is_active);
+    do
+    {
+        flags = transport_wait_flags(sd, &abstime);
+    } while (transport_event(sd, stcp_wait_for_event(sd, flags, abstime)));
+}
+
+/* set up the transport layer for a new connection, and send our SYN if
+ * we're the active side.  the rest of the handshake, and the connection
+ * itself, are driven by transport_event().
+ */
+void transport_start(mysocket_t sd, bool_t is_active)
 {
     context_t *ctx;
-    tcphdr *tcp_hdr;
-    int send_pkt_size, recv_pkt_size;
 
     ctx = (context_t *) calloc(1, sizeof(context_t));
-    tcp_hdr = (tcphdr *) calloc(1, sizeof(tcphdr));
-    
     assert(ctx);
-    assert(tcp_hdr);
 
     generate_initial_seq_num(ctx);
 
-    /* XXX: you should send a SYN packet here if is_active, or wait for one
-     * to arrive if !is_active.  after the handshake completes, unblock the
-     * application with stcp_unblock_application(sd).  you may also use
-     * this to communicate an error condition back to the application, e.g.
-     * if connection fails; to do so, just set errno appropriately (e.g. to
-     * ECONNREFUSED, etc.) before calling the function.
-     */
+    ctx->stats = stcp_get_stats(sd);
 
-    if(is_active)
+    /* options that aren't built in are never used, or offered to the peer */
+    ctx->cc = stcp_get_option(sd, MYSO_CONGESTION);
+    if (!USE_LEDBAT(ctx))
+        ctx->cc = MYSOCK_CC_RENO;
+    ctx->fec_block = MIN(stcp_get_option(sd, MYSO_FEC_BLOCK), FEC_MAX_BLOCK);
+    if (!USE_FEC(ctx))
+        ctx->fec_block = 0;
+    ctx->ecn = stcp_get_option(sd, MYSO_ECN) != 0;
+    if (!USE_ECN(ctx))
+        ctx->ecn = FALSE;
+
+    ctx->data_hdr.hdr.th_off = 5;
+    ctx->data_hdr.hdr.th_flags = TH_ACK;
+    ctx->data_hdr.hdr.th_win = htons(RECEIVER_WINDOW);
+    if (USE_LEDBAT(ctx))
+    {
+        ctx->data_hdr.hdr.th_off = sizeof(ctx->data_hdr) / sizeof(uint32_t);
+        ctx->data_hdr.ts_opt[0] = TCPOPT_NOP;
+        ctx->data_hdr.ts_opt[1] = TCPOPT_NOP;
+        ctx->data_hdr.ts_opt[2] = TCPOPT_TIMESTAMP;
+        ctx->data_hdr.ts_opt[3] = TCPOLEN_TIMESTAMP;
+    }
+
+    if (is_active)
     {
         /*--- SYN Packet ---*/
-        tcp_hdr->th_seq = htonl(ctx->initial_sequence_num);
-        tcp_hdr->th_off = 5;
-        tcp_hdr->th_flags |= TH_SYN;
-        tcp_hdr->th_win = htons(RECEIVER_WINDOW);
+        send_syn(sd, ctx, TH_SYN, 0);
         ctx->current_sequence_num++;
-        send_pkt_size = stcp_network_send(sd, tcp_hdr, sizeof(tcphdr), NULL);
-
-        /*--- Receive SYN-ACK Packet ---*/
-        bzero((tcphdr *)tcp_hdr, sizeof(tcphdr));
-        recv_pkt_size = stcp_network_recv(sd, tcp_hdr, sizeof(tcphdr));
-        if ((tcp_hdr->th_flags & TH_ACK) && (tcp_hdr->th_flags & TH_SYN) && (ntohl(tcp_hdr->th_ack) == ctx->current_sequence_num))
-        {
-            ctx->opp_sequence_num = ntohl(tcp_hdr->th_seq);
-            ctx->opp_window_size = ntohs(tcp_hdr->th_win);
-        }
-        else
-        {
-            errno = ECONNREFUSED;
-        }
         ctx->connection_state = SYN_SENT;
-
-        /*--- ACK Packet ---*/
-        bzero((tcphdr *)tcp_hdr, sizeof(tcphdr));
-        tcp_hdr->th_seq = htonl(ctx->current_sequence_num);
-        tcp_hdr->th_ack = htonl(ctx->opp_sequence_num + 1);
-        tcp_hdr->th_off = 5;
-        tcp_hdr->th_flags |= TH_ACK;
-        tcp_hdr->th_win = htons(RECEIVER_WINDOW);
-        ctx->current_sequence_num++;
-        send_pkt_size = stcp_network_send(sd, tcp_hdr, sizeof(tcphdr), NULL);
-
+        ctx->rto = RTO_INITIAL;
+        start_timer(ctx);
     }
     else
     {
-        /*--- Receive SYN Packet ---*/
-        recv_pkt_size = stcp_network_recv(sd, tcp_hdr, sizeof(tcphdr));
-        if (tcp_hdr->th_flags & TH_SYN)
-        {
-            ctx->opp_sequence_num = ntohl(tcp_hdr->th_seq);
-            ctx->opp_window_size = ntohs(tcp_hdr->th_win);
-        }
-        else
-        {
-            errno = ECONNREFUSED;
-        }
-        ctx->connection_state = SYN_RECEIVED;
-
-        /*--- SYN-ACK Packet ---*/
-        bzero((tcphdr *)tcp_hdr, sizeof(tcphdr));
-        tcp_hdr->th_seq = htonl(ctx->current_sequence_num);
-        tcp_hdr->th_ack = htonl(ctx->opp_sequence_num + 1);
-        tcp_hdr->th_off = 5;
-        tcp_hdr->th_flags |= TH_SYN;
-        tcp_hdr->th_flags |= TH_ACK;
-        tcp_hdr->th_win = htons(RECEIVER_WINDOW);
-        ctx->current_sequence_num++;
-        send_pkt_size = stcp_network_send(sd, tcp_hdr, sizeof(tcphdr), NULL);
-
-        /*--- Receive ACK Packet ---*/
-        bzero((tcphdr *)tcp_hdr, sizeof(tcphdr));
-        recv_pkt_size = stcp_network_recv(sd, tcp_hdr, sizeof(tcphdr));
-        if ((tcp_hdr->th_flags & TH_ACK) && (tcp_hdr->th_ack == ctx->current_sequence_num))
-        {
-            ctx->opp_sequence_num = ntohl(tcp_hdr->th_seq);
-            ctx->opp_window_size = ntohs(tcp_hdr->th_win);
-        }
-
+        /* the peer's SYN is already waiting for us */
+        ctx->connection_state = LISTEN;
     }
 
-    ctx->connection_state = CSTATE_ESTABLISHED;
-    stcp_unblock_application(sd);
-    
-    control_loop(sd, ctx);
-
-    /* do any cleanup here */
-    free(ctx);
+    stcp_set_context(sd, ctx);
 }
 
-
-/* generate random initial sequence number for an STCP connection */
-static void generate_initial_seq_num(context_t *ctx)
+/* the events (see stcp_wait_for_event()) that transport_event() should be
+ * called with next.  *abstime is set to the time by which it should be
+ * called regardless, with TIMEOUT if nothing else has happened, or to
+ * NULL if there's no such time.
+ */
+unsigned int transport_wait_flags(mysocket_t sd,
+                                  const struct timespec **abstime)
 {
-    assert(ctx);
+    context_t *ctx = (context_t *) stcp_get_context(sd);
+    unsigned int flags = ANY_EVENT;
 
-#ifdef FIXED_INITNUM
-    /* please don't change this! */
-    ctx->initial_sequence_num = 1;
-#else
-    /* you have to fill this up */
-    srand(time(NULL));
-    int r = rand() % 256;
-    ctx->initial_sequence_num = r;
-    ctx->current_sequence_num = ctx->initial_sequence_num;
-#endif
-}
+    assert(ctx && abstime);
+    *abstime = ctx->rto_running ? &ctx->rto_deadline : NULL;
 
+    if (!CONNECTION_SYNCHRONISED(ctx))
+        return NETWORK_DATA;
+
+    /* only take more from the application once everything queued has
+     * gone out, and then no more than can be sent straight away
+     */
+    if (app_window(ctx) <= 0)
+        flags &= ~APP_DATA;
+    return flags;
+}
 
-/* control_loop() is the main STCP loop; it repeatedly waits for one of the
- * following to happen:
+/* handle events, as returned by stcp_wait_for_event() for the flags given
+ * by transport_wait_flags().  returns FALSE once the connection is over,
+ * at which point the transport layer's state for it has been freed.
+ *
+ * each call handles a single segment from the peer and a single read
+ * from the application, so this is called repeatedly while events are
+ * pending.  this is where the work of the main STCP loop is done:
  *   - incoming data from the peer
  *   - new data from the application (via mywrite())
  *   - the socket to be closed (via myclose())
  *   - a timeout
  */
-static void control_loop(mysocket_t sd, context_t *ctx)
+bool_t transport_event(mysocket_t sd, unsigned int event)
 {
+    context_t *ctx = (context_t *) stcp_get_context(sd);
+
     assert(ctx);
     assert(!ctx->done);
-    tcphdr *tcp_hdr;
-    char* payload;
-    char* payload1;
+
+    if (CONNECTION_SYNCHRONISED(ctx))
+    {
+        ctx->engine(sd, ctx, event);
+    }
+    else if (event == TIMEOUT)
+    {
+        if (ctx->rto_running && time_since(&ctx->rto_deadline) >= 0)
+            handshake_timeout(sd, ctx);
+    }
+    else if (event & NETWORK_DATA)
+    {
+        handshake_segment(sd, ctx);
+    }
+
+    if (ctx->done)
+    {
+        transport_free(sd, ctx);
+        stcp_set_context(sd, NULL);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+/* transport_event(), once the handshake is over */
+template <class P>
+static void connection_event(mysocket_t sd, context_t *ctx,
+                             unsigned int event)
+{
+    char payload[SENDER_WINDOW];
+    char segment[MAX_HEADER_LEN + STCP_MSS];
     int payload_size, pkt_size;
     int current_sender_window;
-    
-    tcp_hdr = (tcphdr *) calloc(1, sizeof(tcphdr));
-    
-    while (!ctx->done)
-    {
-        unsigned int event;
-        /* see stcp_api.h or stcp_api.c for details of this function */
-        /* XXX: you will need to change some of these arguments! */
-        event = stcp_wait_for_event(sd, ANY_EVENT, NULL);
-        // our_dprintf("event occured %d\n", event);
-        current_sender_window = SENDER_WINDOW - (ctx->current_sequence_num - ctx->ack_num);
-        // our_dprintf("event: %d", event);
-        /* check whether it was the network, app, or a close request */
-        
-        if (event & NETWORK_DATA)
-        {
-            payload1 = (char *) calloc(1, STCP_MSS+20);
-            bzero((char *)payload1, STCP_MSS+20);
-
-            pkt_size = stcp_network_recv(sd, payload1, STCP_MSS+20);
 
-            bzero((tcphdr *)tcp_hdr, sizeof(tcphdr));
-            tcp_hdr = (tcphdr *)payload1;
-            
-            if (tcp_hdr->th_flags & TH_ACK)
-            {
-                /*--- Setting Context ---*/
-                ctx->ack_num = ntohl(tcp_hdr->th_ack);
-                ctx->opp_window_size = ntohs(tcp_hdr->th_win);
-
-                if (ntohl(tcp_hdr->th_ack) == ctx->fin_ack_sequence_num)
-                {
-                    if (ctx->connection_state == FIN_WAIT_1)
-                    {
-                        ctx->connection_state = FIN_WAIT_2;
-                    }
-                }
-            }
-            else if (tcp_hdr->th_flags & TH_FIN)
+    if (event == TIMEOUT)
+    {
+        if (ctx->rto_running && time_since(&ctx->rto_deadline) >= 0)
+        {
+            if (ctx->connection_state == TIME_WAIT)
             {
-                stcp_fin_received(sd);
-                /*--- Setting Context ---*/
-                ctx->opp_sequence_num = ntohl(tcp_hdr->th_seq);
-                ctx->opp_window_size = ntohs(tcp_hdr->th_win);
-
-                /*--- Sending Payload to app layer if there is data ---*/
-                if (pkt_size > 20)
-                {
-                    payload1 = payload1+20;
-                    payload_size = pkt_size-20;
-                    stcp_app_send(sd, payload1, payload_size);
-                }
-
-                /*--- Sending Ack Packet ---*/
-                bzero((tcphdr *)tcp_hdr, sizeof(tcphdr));
-                tcp_hdr->th_ack = htonl(ctx->opp_sequence_num + 1);
-                tcp_hdr->th_off = 5;
-                tcp_hdr->th_flags |= TH_ACK;
-                tcp_hdr->th_win = htons(RECEIVER_WINDOW);
-                pkt_size = stcp_network_send(sd, tcp_hdr, sizeof(tcphdr), NULL);
-                if (ctx->connection_state == CSTATE_ESTABLISHED)
-                {
-                    ctx->connection_state = CLOSE_WAIT;
-                }
-                else if (ctx->connection_state == FIN_WAIT_2)
-                {
-                    ctx->connection_state = CLOSED;
-                    ctx->done = true;
-                }
-                
+                /* the peer hasn't resent its FIN, so it has our ACK */
+                ctx->connection_state = CLOSED;
+                ctx->done = TRUE;
             }
             else
             {
-                /*--- Setting Context ---*/
-                ctx->opp_sequence_num = ntohl(tcp_hdr->th_seq);
-                ctx->opp_window_size = ntohs(tcp_hdr->th_win);
-                /*--- Sending Payload to app layer ---*/
-                payload1 = payload1+20;
-                payload_size = pkt_size-20;
-                stcp_app_send(sd, payload1, payload_size);
-
-                /*--- Sending Ack Packet ---*/
-                bzero((tcphdr *)tcp_hdr, sizeof(tcphdr));
-                tcp_hdr->th_ack = htonl(ctx->opp_sequence_num + payload_size);
-                tcp_hdr->th_off = 5;
-                tcp_hdr->th_flags |= TH_ACK;
-                tcp_hdr->th_win = htons(RECEIVER_WINDOW);
-                pkt_size = stcp_network_send(sd, tcp_hdr, sizeof(tcphdr), NULL);
+                retransmit_timeout<P>(sd, ctx);
             }
         }
-        if ((event & APP_DATA) && (current_sender_window > 0))
+    }
+    else
+    {
+        if (event & NETWORK_DATA)
+        {
+            pkt_size = stcp_network_recv(sd, segment, sizeof(segment));
+            handle_segment<P>(sd, ctx, segment, pkt_size);
+        }
+        if ((event & APP_DATA) &&
+            (current_sender_window = app_window(ctx)) > 0)
         {
-            payload = (char *) calloc(1, SENDER_WINDOW);
-            bzero((char *)payload, SENDER_WINDOW);
-            
+            int offset = 0;
+
             payload_size = stcp_app_recv(sd, payload, current_sender_window);
-            
-            while (payload_size > 0)
+
+            while (offset < payload_size)
             {
-                bzero((tcphdr *)tcp_hdr, sizeof(tcphdr));
-                tcp_hdr->th_seq = htonl(ctx->current_sequence_num);
-                tcp_hdr->th_off = 5;
-                tcp_hdr->th_win = htons(RECEIVER_WINDOW);
-                if(payload_size > STCP_MSS)
-                {
-                    pkt_size = stcp_network_send(sd, tcp_hdr, sizeof(tcphdr), payload, STCP_MSS, NULL);
-                    pkt_size = STCP_MSS;
-                }
-                else
-                {
-                    pkt_size = stcp_network_send(sd, tcp_hdr, sizeof(tcphdr), payload, payload_size, NULL);
-                    pkt_size = pkt_size - sizeof(tcphdr);
-                }
-                ctx->current_sequence_num = ctx->current_sequence_num + pkt_size;
-                payload = payload + pkt_size;
-                payload_size = payload_size - pkt_size;
+                pkt_size = MIN(payload_size - offset, STCP_MSS);
+
+                queue_segment(ctx, payload + offset, pkt_size, 0);
+                offset += pkt_size;
             }
-        } 
+            send_segments<P>(sd, ctx);
+            P::recovery::app_idle(sd, ctx);
+        }
 
         if (event & APP_CLOSE_REQUESTED)
-        {   
-            bzero((tcphdr *)tcp_hdr, sizeof(tcphdr));
-            tcp_hdr->th_seq = htonl(ctx->current_sequence_num);
-            tcp_hdr->th_off = 5;
-            tcp_hdr->th_flags |= TH_FIN;
-            tcp_hdr->th_win = htons(RECEIVER_WINDOW);
-            ctx->current_sequence_num++;
-            pkt_size = stcp_network_send(sd, tcp_hdr, sizeof(tcphdr), NULL);
+        {
+            P::recovery::flush(sd, ctx);
+
+            /* the FIN is queued like data, so it's resent if it's lost */
+            queue_segment(ctx, NULL, 0, TH_FIN);
+            send_segments<P>(sd, ctx);
             if (ctx->connection_state == CSTATE_ESTABLISHED)
             {
                 ctx->connection_state = FIN_WAIT_1;
@@ -324,14 +720,1336 @@ static void control_loop(mysocket_t sd, context_t *ctx)
             else
             {
                 ctx->connection_state = LAST_ACK;
-                ctx->done = true;
-                ctx->connection_state = CLOSED;
             }
             ctx->fin_ack_sequence_num = ctx->current_sequence_num;
         }
+    }
 
-        /* etc. */
+    /* send anything queued that the window now allows */
+    if (!ctx->done)
+        send_segments<P>(sd, ctx);
+}
+
+/* hand the connection to the instantiation of the transport for policies P */
+template <class P>
+static void set_engine(context_t *ctx)
+{
+    ctx->engine = &connection_event<P>;
+    ctx->engine_segment = &handle_segment<P>;
+}
+
+/* the instantiation of connection_event() for the policies a connection
+ * uses, given the options it ended up with in the handshake.  only the
+ * common combinations are instantiated: each of the congestion control
+ * algorithms, with or without ECN and FEC.
+ */
+template <class CC>
+static void choose_recovery(context_t *ctx)
+{
+#ifndef STCP_NO_FEC
+    if (ctx->fec_block > 0)
+    {
+        set_engine<transport_policy<CC, immediate_ack, fec_recovery,
+                                    window_pacer> >(ctx);
+        return;
+    }
+#endif
+    set_engine<transport_policy<CC, immediate_ack, arq_recovery,
+                                window_pacer> >(ctx);
+}
+
+template <class CC>
+static void choose_ecn(context_t *ctx)
+{
+#ifndef STCP_NO_ECN
+    if (ctx->ecn)
+    {
+        choose_recovery<dctcp_cc<CC> >(ctx);
+        return;
+    }
+#endif
+    choose_recovery<CC>(ctx);
+}
+
+static void choose_engine(context_t *ctx)
+{
+#ifndef STCP_NO_LEDBAT
+    if (ctx->cc == MYSOCK_CC_LEDBAT)
+    {
+        choose_ecn<ledbat_cc>(ctx);
+        return;
+    }
+#endif
+    choose_ecn<reno_cc>(ctx);
+}
+
+/* free the transport layer's state for a connection */
+static void transport_free(mysocket_t sd, context_t *ctx)
+{
+    while (ctx->send_queue)
+    {
+        send_segment_t *next = ctx->send_queue->next;
+        stcp_network_free(sd, ctx->send_queue);
+        ctx->send_queue = next;
+    }
+    while (ctx->ooo_queue)
+    {
+        segment_t *next = ctx->ooo_queue->next;
+        free(ctx->ooo_queue);
+        ctx->ooo_queue = next;
     }
+    free(ctx);
+}
+
+/* handle a segment received during the three-way handshake.  if it
+ * doesn't follow on from what we've sent, the connection is refused.
+ */
+static void handshake_segment(mysocket_t sd, context_t *ctx)
+{
+    tcphdr *tcp_hdr;
+    char segment[MAX_HEADER_LEN + STCP_MSS];
+    const uint8_t *opt;
+    int recv_pkt_size;
+
+    tcp_hdr = (tcphdr *) segment;
+    bzero(segment, sizeof(segment));
+    recv_pkt_size = stcp_network_recv(sd, segment, sizeof(segment));
+
+    switch (ctx->connection_state)
+    {
+    case SYN_SENT:
+        /*--- Receive SYN-ACK Packet ---*/
+        if (!(tcp_hdr->th_flags & TH_ACK) || !(tcp_hdr->th_flags & TH_SYN) ||
+            ntohl(tcp_hdr->th_ack) != ctx->current_sequence_num)
+        {
+            errno = ECONNREFUSED;
+            ctx->done = TRUE;
+            break;
+        }
+
+        ctx->opp_sequence_num = ntohl(tcp_hdr->th_seq);
+        ctx->opp_window_size = ntohs(tcp_hdr->th_win);
+        ctx->ack_num = ntohl(tcp_hdr->th_ack);
+
+        /* the peer echoes the FEC option if it agrees to use FEC */
+        opt = find_option(tcp_hdr, recv_pkt_size, TCPOPT_FEC, TCPOLEN_FEC);
+        ctx->fec_block = opt ? MIN(ctx->fec_block,
+                                   ntohs(*(const uint16_t *) (opt + 2)))
+                             : 0;
+        ctx->ecn = USE_ECN(ctx) && (tcp_hdr->th_x2 & TH_X2_ECE);
+
+        /*--- ACK Packet ---*/
+        stcp_network_send_header(sd, ctx->current_sequence_num,
+                                 ctx->opp_sequence_num + 1,
+                                 TH_ACK, RECEIVER_WINDOW);
+        connection_established(sd, ctx);
+        break;
+
+    case LISTEN:
+        /*--- Receive SYN Packet ---*/
+        if (!(tcp_hdr->th_flags & TH_SYN))
+        {
+            errno = ECONNREFUSED;
+            ctx->done = TRUE;
+            break;
+        }
+
+        ctx->opp_sequence_num = ntohl(tcp_hdr->th_seq);
+        ctx->opp_window_size = ntohs(tcp_hdr->th_win);
+
+        opt = find_option(tcp_hdr, recv_pkt_size, TCPOPT_FEC, TCPOLEN_FEC);
+        ctx->fec_block = opt ? MIN(ctx->fec_block,
+                                   ntohs(*(const uint16_t *) (opt + 2)))
+                             : 0;
+        ctx->ecn = USE_ECN(ctx) && (tcp_hdr->th_x2 & TH_X2_ECE);
+
+        /*--- SYN-ACK Packet ---*/
+        send_syn(sd, ctx, TH_SYN | TH_ACK, ctx->opp_sequence_num + 1);
+        ctx->current_sequence_num++;
+        ctx->connection_state = SYN_RECEIVED;
+        ctx->rto = RTO_INITIAL;
+        start_timer(ctx);
+        break;
+
+    case SYN_RECEIVED:
+        /*--- Receive ACK Packet ---*/
+        /* if the peer's ACK of our SYN-ACK was lost, its first data
+         * segment (which acknowledges the SYN-ACK too) completes the
+         * handshake instead, and is then handled as any other would be
+         */
+        if ((tcp_hdr->th_flags & TH_ACK) &&
+            ntohl(tcp_hdr->th_ack) == ctx->current_sequence_num)
+        {
+            ctx->opp_window_size = ntohs(tcp_hdr->th_win);
+            ctx->ack_num = ntohl(tcp_hdr->th_ack);
+            connection_established(sd, ctx);
+            ctx->engine_segment(sd, ctx, segment, recv_pkt_size);
+        }
+        break;
+
+    default:
+        assert(0);
+        break;
+    }
+}
+
+/* nothing has come back during the handshake, so our SYN (or SYN-ACK),
+ * or the peer's reply to it, may have been lost on the way; send it again
+ */
+static void handshake_timeout(mysocket_t sd, context_t *ctx)
+{
+    ctx->rto_running = FALSE;
+    if (++ctx->rto_backoff > MAX_RETRANSMITS)
+    {
+        errno = ETIMEDOUT;
+        ctx->done = TRUE;
+        return;
+    }
+
+    ctx->stats->timeouts++;
+    if (ctx->connection_state == SYN_SENT)
+    {
+        send_syn(sd, ctx, TH_SYN, 0);
+    }
+    else
+    {
+        assert(ctx->connection_state == SYN_RECEIVED);
+        send_syn(sd, ctx, TH_SYN | TH_ACK, ctx->opp_sequence_num + 1);
+    }
+    start_timer(ctx);
+}
+
+/* the handshake is complete; set up for data transfer, and let the
+ * application know
+ */
+static void connection_established(mysocket_t sd, context_t *ctx)
+{
+    ctx->rcv_nxt = ctx->opp_sequence_num + 1;
+    ctx->snd_nxt = ctx->current_sequence_num;
+    ctx->cwnd = INITIAL_CWND;
+    ctx->ssthresh = TCP_MAXWIN;
+    ctx->recover = ctx->current_sequence_num;
+    ctx->rto = RTO_INITIAL;
+    ctx->rto_backoff = 0;
+    ctx->rto_running = FALSE;
+    ctx->fec_send_seq = ctx->current_sequence_num;
+    if (USE_ECN(ctx))
+    {
+        ctx->data_hdr.hdr.th_x2 = TH_X2_ECT;
+        ctx->dctcp_alpha = 1024;
+        ctx->dctcp_window_end = ctx->current_sequence_num;
+        ctx->ecn_recover = ctx->current_sequence_num;
+    }
+    choose_engine(ctx);
+
+    ctx->connection_state = CSTATE_ESTABLISHED;
+
+    /* whatever system calls were made on the way here, the connection
+     * succeeded
+     */
+    errno = 0;
+    stcp_unblock_application(sd);
+}
+
+/* bytes that may be taken from the application now (see
+ * transport_wait_flags())
+ */
+static int app_window(context_t *ctx)
+{
+    if (ctx->snd_nxt != ctx->current_sequence_num)
+        return 0;
+
+    return MIN(send_window(ctx),
+               SENDER_WINDOW - (int) (ctx->current_sequence_num -
+                                      ctx->ack_num));
+}
+
+
+/* generate random initial sequence number for an STCP connection */
+static void generate_initial_seq_num(context_t *ctx)
+{
+    assert(ctx);
+
+#ifdef FIXED_INITNUM
+    /* please don't change this! */
+    ctx->initial_sequence_num = 1;
+#else
+    /* you have to fill this up */
+    struct timespec now;
+    stcp_get_time(&now);
+    srand(now.tv_sec);
+    int r = rand() % 256;
+    ctx->initial_sequence_num = r;
+#endif
+    ctx->current_sequence_num = ctx->initial_sequence_num;
+}
+
+/* send a SYN or SYN-ACK, offering (or agreeing to) FEC and ECN if they're
+ * enabled
+ */
+static ssize_t send_syn(mysocket_t sd, context_t *ctx,
+                        uint8_t flags, tcp_seq ack)
+{
+    struct
+    {
+        STCPHeader hdr;
+        uint8_t    fec_opt[TCPOLEN_FEC];
+    } __attribute__ ((packed)) syn;
+    size_t syn_len = sizeof(syn.hdr);
+
+    if (!USE_FEC(ctx) && !USE_ECN(ctx))
+    {
+        return stcp_network_send_header(sd, ctx->initial_sequence_num, ack,
+                                         flags, RECEIVER_WINDOW);
+    }
+
+    memset(&syn, 0, sizeof(syn));
+    syn.hdr.th_seq   = htonl(ctx->initial_sequence_num);
+    syn.hdr.th_ack   = htonl(ack);
+    syn.hdr.th_x2    = USE_ECN(ctx) ? TH_X2_ECE : 0;
+    syn.hdr.th_flags = flags;
+    syn.hdr.th_win   = htons(RECEIVER_WINDOW);
+
+    if (USE_FEC(ctx))
+    {
+        syn.fec_opt[0] = TCPOPT_FEC;
+        syn.fec_opt[1] = TCPOLEN_FEC;
+        *(uint16_t *) &syn.fec_opt[2] = htons(ctx->fec_block);
+        syn_len = sizeof(syn);
+    }
+    syn.hdr.th_off = syn_len / sizeof(uint32_t);
+
+    return stcp_network_send(sd, &syn, syn_len, NULL);
+}
+
+/* return a pointer to the option of the given kind and length in the header
+ * of a received segment of len bytes, or NULL if it's not present.
+ */
+static const uint8_t *find_option(const tcphdr *hdr, size_t len,
+                                  uint8_t kind, uint8_t opt_len)
+{
+    const uint8_t *opt = (const uint8_t *) (hdr + 1);
+    const uint8_t *end = (const uint8_t *) hdr + TCP_DATA_START(hdr);
+
+    if (len < TCP_DATA_START(hdr))
+        return NULL;
+
+    while (opt < end && *opt != TCPOPT_EOL)
+    {
+        if (*opt == TCPOPT_NOP)
+        {
+            ++opt;
+            continue;
+        }
+
+        if (opt + 1 >= end || opt[1] < 2 || opt + opt[1] > end)
+            break;  /* malformed */
+
+        if (opt[0] == kind && opt[1] == opt_len)
+            return opt;
+        opt += opt[1];
+    }
+
+    return NULL;
+}
+
+
+/* add a segment to the end of the send queue.  it's sent by
+ * send_segments() once the window allows.
+ */
+static void queue_segment(context_t *ctx, const char *data, size_t len,
+                          uint8_t flags)
+{
+    send_segment_t *seg;
+
+    assert(len <= STCP_MSS);
+
+    seg = (send_segment_t *) calloc(1, sizeof(send_segment_t));
+    assert(seg);
+    seg->seq   = ctx->current_sequence_num;
+    seg->len   = len;
+    seg->flags = flags;
+    if (len > 0)
+        memcpy(seg->data, data, len);
+
+    if (ctx->send_queue_tail)
+        ctx->send_queue_tail->next = seg;
+    else
+        ctx->send_queue = seg;
+    ctx->send_queue_tail = seg;
+
+    ctx->current_sequence_num += SEG_SEQ_LEN(seg);
+}
+
+/* send queued segments from snd_nxt on, for as long as the window allows */
+template <class P>
+static void send_segments(mysocket_t sd, context_t *ctx)
+{
+    send_segment_t *seg;
+
+    for (seg = ctx->send_queue; seg && SEQ_LT(seg->seq, ctx->snd_nxt);
+         seg = seg->next)
+        ;
+
+    for (; seg && P::pacer::may_send(ctx, seg); seg = seg->next)
+    {
+        transmit_segment<P>(sd, ctx, seg);
+        ctx->snd_nxt = seg->seq + SEG_SEQ_LEN(seg);
+    }
+}
+
+/* send (or resend) a queued segment */
+template <class P>
+static void transmit_segment(mysocket_t sd, context_t *ctx,
+                             send_segment_t *seg)
+{
+    if (seg->flags & TH_FIN)
+    {
+        stcp_network_send_header(sd, seg->seq, ctx->rcv_nxt,
+                                 TH_FIN | TH_ACK, RECEIVER_WINDOW);
+    }
+    else
+    {
+        struct iovec iov[2];
+
+        ctx->data_hdr.hdr.th_seq = htonl(seg->seq);
+        ctx->data_hdr.hdr.th_ack = htonl(ctx->rcv_nxt);
+        if (P::cc::uses_timestamps)
+            *(uint32_t *) &ctx->data_hdr.ts_opt[4] = htonl(timestamp_now());
+
+        /* the segment isn't changed once it's queued, so the network layer
+         * may send its data from where it is (see stcp_network_free())
+         */
+        iov[0].iov_base = &ctx->data_hdr;
+        iov[0].iov_len  = TCP_DATA_START(&ctx->data_hdr.hdr);
+        iov[1].iov_base = seg->data;
+        iov[1].iov_len  = seg->len;
+        stcp_network_send_held(sd, iov, 2, seg);
+    }
+
+    if (seg->xmits++ > 0)
+        ctx->stats->retransmits++;
+    else
+        P::recovery::data_sent(sd, ctx, seg);
+    if (ctx->in_recovery)
+        ctx->prr_out += SEG_SEQ_LEN(seg);
+    stcp_get_time(&seg->sent_at);
+
+    if (!ctx->rto_running)
+        start_timer(ctx);
+}
+
+/* bytes that may be sent beyond snd_nxt, given the congestion window and
+ * the peer's advertised window
+ */
+static int send_window(context_t *ctx)
+{
+    return MIN(ctx->cwnd, ctx->opp_window_size) -
+           (int) (ctx->snd_nxt - ctx->ack_num);
+}
+
+/* handle an ACK that acknowledges new data, up to (but not including) ack */
+template <class P>
+static void ack_received(mysocket_t sd, context_t *ctx, tcp_seq ack)
+{
+    send_segment_t *seg;
+    int acked = ack - ctx->ack_num;
+    int flight = ctx->snd_nxt - ctx->ack_num;
+    long rtt = -1;
+    bool_t karn = FALSE;
+
+    assert(SEQ_GT(ack, ctx->ack_num));
+
+    /* forget everything the peer now has.  per Karn's algorithm, there's
+     * no RTT sample if any of it had to be resent; that makes it ambiguous,
+     * and the ACK for the rest was held up by the gap anyway.
+     */
+    while ((seg = ctx->send_queue) &&
+           SEQ_LEQ(seg->seq + SEG_SEQ_LEN(seg), ack))
+    {
+        if (seg->xmits > 1)
+            karn = TRUE;
+        rtt = time_since(&seg->sent_at);
+
+        if (!(ctx->send_queue = seg->next))
+            ctx->send_queue_tail = NULL;
+        stcp_network_free(sd, seg);
+    }
+
+    ctx->ack_num = ack;
+    if (SEQ_LT(ctx->snd_nxt, ack))
+        ctx->snd_nxt = ack;
+    ctx->rto_backoff = 0;
+    ctx->dupacks = 0;
+
+    if (rtt >= 0 && !karn)
+        rtt_sample(ctx, rtt);
+
+    if (ctx->send_queue)
+        start_timer(ctx);
+    else
+        ctx->rto_running = FALSE;
+
+    if (ctx->in_recovery)
+    {
+        if (SEQ_GEQ(ack, ctx->recover))
+        {
+            /* everything outstanding when the loss was detected is in */
+            ctx->in_recovery = FALSE;
+            ctx->cwnd = ctx->ssthresh;
+        }
+        else
+        {
+            /* a partial ACK; the segment it stops at was lost too */
+            transmit_segment<P>(sd, ctx, ctx->send_queue);
+            prr_update(ctx, acked);
+        }
+        return;
+    }
+
+    switch (ctx->frto_state)
+    {
+    case FRTO_RETRANSMITTED:
+        if (SEQ_LT(ack, ctx->frto_rexmit_end) ||
+            SEQ_GEQ(ack, ctx->recover))
+        {
+            /* nothing to tell us whether the originals got through */
+            rto_recovery(ctx, ctx->cwnd);
+        }
+        else
+        {
+            /* the resent segment is in.  send two new segments, and see
+             * whether the next ACK is for data sent before the timeout.
+             */
+            ctx->cwnd = (int) (ctx->snd_nxt - ctx->ack_num) + 2 * STCP_MSS;
+            ctx->frto_state = FRTO_NEW_DATA;
+        }
+        break;
+
+    case FRTO_NEW_DATA:
+        /* it is, so that data wasn't lost after all; put things back the
+         * way they were before the timeout
+         */
+        ctx->stats->spurious_timeouts++;
+        ctx->cwnd = ctx->prior_cwnd;
+        ctx->ssthresh = ctx->prior_ssthresh;
+        ctx->frto_state = FRTO_NONE;
+        break;
+
+    default:
+        P::cc::window_update(ctx, acked, flight);
+        ctx->cwnd = MIN(ctx->cwnd, TCP_MAXWIN);
+        break;
+    }
+}
+
+/* open the window after acked bytes were acknowledged (RFC 5681) */
+static void reno_update(context_t *ctx, int acked)
+{
+    if (ctx->cwnd < ctx->ssthresh)
+        ctx->cwnd += MIN(acked, STCP_MSS);  /* slow start */
+    else
+        ctx->cwnd += MAX(1, STCP_MSS * STCP_MSS / ctx->cwnd);
+}
+
+/* handle a duplicate ACK, i.e. one that doesn't acknowledge anything new,
+ * while we have data outstanding
+ */
+template <class P>
+static void dup_ack_received(mysocket_t sd, context_t *ctx)
+{
+    /* the peer is missing something.  if that's in the block being built,
+     * the rest of the block may never be sent (the window can't open until
+     * the gap is filled), so send the parity now rather than at its end.
+     */
+    P::recovery::flush(sd, ctx);
+
+    /* after a timeout, this means the peer is still missing data from
+     * before it, so the timeout was genuine
+     */
+    if (ctx->frto_state == FRTO_RETRANSMITTED)
+    {
+        rto_recovery(ctx, ctx->cwnd);
+    }
+    else if (ctx->frto_state == FRTO_NEW_DATA)
+    {
+        rto_recovery(ctx, 3 * STCP_MSS);
+    }
+    else if (ctx->in_recovery)
+    {
+        /* another segment has left the network */
+        ctx->dupacks++;
+        prr_update(ctx, STCP_MSS);
+    }
+    else if (++ctx->dupacks == DUPACK_THRESHOLD &&
+             SEQ_GEQ(ctx->ack_num, ctx->recover) &&
+             ctx->snd_nxt == ctx->current_sequence_num)
+    {
+        fast_retransmit<P>(sd, ctx);
+    }
+}
+
+/* resend the segment the peer is missing, without waiting for the
+ * retransmission timer, and start fast recovery
+ */
+template <class P>
+static void fast_retransmit(mysocket_t sd, context_t *ctx)
+{
+    int flight = ctx->snd_nxt - ctx->ack_num;
+
+    ctx->in_recovery   = TRUE;
+    ctx->recover       = ctx->current_sequence_num;
+    ctx->ssthresh      = MAX(flight / 2, 2 * STCP_MSS);
+    ctx->recover_fs    = flight;
+    ctx->prr_delivered = 0;
+    ctx->prr_out       = 0;
+
+    transmit_segment<P>(sd, ctx, ctx->send_queue);
+    prr_update(ctx, STCP_MSS);
+}
+
+/* set the window for the next transmissions during fast recovery, given
+ * that the last ACK showed delivered more bytes had reached the peer.
+ * while more than ssthresh is in flight, sending is cut back in proportion
+ * to what's delivered; below it, sending may slow start back up to
+ * ssthresh, but no faster than the ACKs coming in.
+ */
+static void prr_update(context_t *ctx, int delivered)
+{
+    int flight = ctx->snd_nxt - ctx->ack_num;
+    int pipe = MAX(flight - ctx->dupacks * STCP_MSS, 0);
+    int sndcnt;
+
+    assert(ctx->in_recovery && ctx->recover_fs > 0);
+
+    ctx->prr_delivered += delivered;
+    if (pipe > ctx->ssthresh)
+    {
+        sndcnt = (int) (((long) ctx->prr_delivered * ctx->ssthresh +
+                         ctx->recover_fs - 1) / ctx->recover_fs) -
+                 ctx->prr_out;
+    }
+    else
+    {
+        sndcnt = MIN(ctx->ssthresh - pipe,
+                     MAX(ctx->prr_delivered - ctx->prr_out, delivered) +
+                     STCP_MSS);
+    }
+
+    /* send_window() counts everything unacknowledged as in flight, even
+     * what the duplicate ACKs show has arrived, so open the window by
+     * sndcnt beyond that
+     */
+    ctx->cwnd = flight + MAX(sndcnt, 0);
+}
+
+/* account for acked bytes acknowledged with (if ece) or without a
+ * congestion mark, and cut the window if need be (DCTCP)
+ */
+static void dctcp_update(context_t *ctx, int acked, bool_t ece)
+{
+    ctx->dctcp_acked += acked;
+    if (ece)
+        ctx->dctcp_marked += acked;
+
+    if (SEQ_GEQ(ctx->ack_num, ctx->dctcp_window_end))
+    {
+        /* a window's worth is in; fold the fraction of it that was marked
+         * into alpha, with a gain of 1/16
+         */
+        ctx->dctcp_alpha += (int) (((long) ctx->dctcp_marked << 6) /
+                                   MAX(ctx->dctcp_acked, 1)) -
+                            (ctx->dctcp_alpha >> 4);
+        ctx->dctcp_alpha = MIN(MAX(ctx->dctcp_alpha, 0), 1024);
+        ctx->dctcp_acked = ctx->dctcp_marked = 0;
+        ctx->dctcp_window_end = ctx->snd_nxt;
+    }
+
+    if (ece && !ctx->in_recovery && SEQ_GEQ(ctx->ack_num, ctx->ecn_recover))
+    {
+        ctx->cwnd -= (int) (((long) ctx->cwnd * ctx->dctcp_alpha) >> 11);
+        ctx->cwnd = MAX(ctx->cwnd, 2 * STCP_MSS);
+        ctx->ssthresh = ctx->cwnd;
+        ctx->ecn_recover = ctx->snd_nxt;
+        ctx->stats->ecn_reductions++;
+    }
+}
+
+/* record a one-way delay measurement, for LEDBAT */
+static void ledbat_delay_sample(context_t *ctx, uint32_t delay)
+{
+    struct timespec now;
+    time_t minute;
+    int k;
+
+    stcp_get_time(&now);
+    minute = now.tv_sec / 60;
+
+    if (ctx->ledbat_num_samples == 0)
+    {
+        for (k = 0; k < LEDBAT_BASE_HISTORY; ++k)
+            ctx->ledbat_base[k] = delay;
+        ctx->ledbat_base_minute = minute;
+    }
+    else if (minute != ctx->ledbat_base_minute)
+    {
+        /* start a new minute; the oldest falls out of the history */
+        memmove(&ctx->ledbat_base[1], &ctx->ledbat_base[0],
+                (LEDBAT_BASE_HISTORY - 1) * sizeof(uint32_t));
+        ctx->ledbat_base[0] = delay;
+        ctx->ledbat_base_minute = minute;
+    }
+    else
+    {
+        ctx->ledbat_base[0] = MIN(ctx->ledbat_base[0], delay);
+    }
+
+    ctx->ledbat_current[ctx->ledbat_num_samples % LEDBAT_CURRENT_FILTER] =
+        delay;
+    ctx->ledbat_num_samples++;
+}
+
+/* grow or shrink the window after acked bytes were acknowledged, in
+ * proportion to how far the queueing delay (the current delay, less the
+ * lowest seen recently) is from LEDBAT_TARGET.  with no queue, this grows
+ * the window no faster than congestion avoidance does.
+ */
+static void ledbat_update(context_t *ctx, int acked, int flight)
+{
+    uint32_t base = ctx->ledbat_base[0], current = ctx->ledbat_current[0];
+    long queueing, off_target;
+    int k;
+
+    for (k = 1; k < LEDBAT_BASE_HISTORY; ++k)
+        base = MIN(base, ctx->ledbat_base[k]);
+    for (k = 1; k < MIN(ctx->ledbat_num_samples, LEDBAT_CURRENT_FILTER); ++k)
+        current = MIN(current, ctx->ledbat_current[k]);
+
+    queueing = (long) (current - base);
+    off_target = LEDBAT_TARGET - queueing;
+
+    ctx->cwnd += (int) (off_target * acked * STCP_MSS /
+                        ((long) LEDBAT_TARGET * ctx->cwnd));
+
+    /* don't grow the window beyond what's actually being used */
+    ctx->cwnd = MIN(ctx->cwnd, flight + STCP_MSS);
+    ctx->cwnd = MAX(ctx->cwnd, LEDBAT_MIN_CWND);
+}
+
+/* update the retransmission timeout with a new RTT measurement (RFC 6298) */
+static void rtt_sample(context_t *ctx, long rtt)
+{
+    if (ctx->srtt == 0)
+    {
+        ctx->srtt   = MAX(rtt, 1);
+        ctx->rttvar = rtt / 2;
+    }
+    else
+    {
+        ctx->rttvar = (3 * ctx->rttvar + labs(ctx->srtt - rtt)) / 4;
+        ctx->srtt   = MAX((7 * ctx->srtt + rtt) / 8, 1);
+    }
+
+    ctx->rto = MIN(MAX(ctx->srtt + 4 * ctx->rttvar, RTO_MIN), RTO_MAX);
+}
+
+/* the retransmission timer has gone off; resend the oldest unacknowledged
+ * segment, and collapse the congestion window
+ */
+template <class P>
+static void retransmit_timeout(mysocket_t sd, context_t *ctx)
+{
+    int flight = ctx->current_sequence_num - ctx->ack_num;
+
+    ctx->rto_running = FALSE;
+    if (!ctx->send_queue)
+        return;
+
+    if (++ctx->rto_backoff > MAX_RETRANSMITS)
+    {
+        /* the peer has gone away */
+        errno = ETIMEDOUT;
+        ctx->done = TRUE;
+        return;
+    }
+
+    /* all that's left is our FIN, and the peer has closed too.  it most
+     * likely has the FIN, and has since left TIME_WAIT, so that its ACK is
+     * all that was lost; don't wait out the full backoff for it
+     */
+    if (ctx->connection_state == LAST_ACK &&
+        (ctx->send_queue->flags & TH_FIN) &&
+        ctx->rto_backoff > LAST_ACK_RETRANSMITS)
+    {
+        ctx->connection_state = CLOSED;
+        ctx->done = TRUE;
+        return;
+    }
+
+    ctx->stats->timeouts++;
+    ctx->in_recovery = FALSE;
+    ctx->dupacks = 0;
+    ctx->recover = ctx->current_sequence_num;
+
+    if (ctx->rto_backoff == 1)
+    {
+        /* the first timeout for this data; keep what we need to undo it,
+         * and try F-RTO
+         */
+        ctx->prior_cwnd     = ctx->cwnd;
+        ctx->prior_ssthresh = ctx->ssthresh;
+        ctx->ssthresh       = MAX(flight / 2, 2 * STCP_MSS);
+        ctx->frto_state     = FRTO_RETRANSMITTED;
+    }
+    else
+    {
+        ctx->frto_state = FRTO_NONE;
+    }
+    ctx->cwnd = STCP_MSS;
+
+    transmit_segment<P>(sd, ctx, ctx->send_queue);
+    ctx->frto_rexmit_end = ctx->send_queue->seq +
+                           SEG_SEQ_LEN(ctx->send_queue);
+
+    if (ctx->frto_state == FRTO_NONE)
+        rto_recovery(ctx, ctx->cwnd);
+}
+
+/* conventional recovery from a timeout: go back and resend everything after
+ * the segment resent when the timer went off, slow starting from cwnd
+ */
+static void rto_recovery(context_t *ctx, int cwnd)
+{
+    ctx->frto_state = FRTO_NONE;
+    ctx->cwnd = cwnd;
+    ctx->snd_nxt = SEQ_GT(ctx->frto_rexmit_end, ctx->ack_num)
+        ? ctx->frto_rexmit_end : ctx->ack_num;
+}
+
+/* (re)start the retransmission timer, backing off exponentially for each
+ * timeout since the last new ACK
+ */
+static void start_timer(context_t *ctx)
+{
+    set_timer(ctx, MIN(ctx->rto << ctx->rto_backoff, RTO_MAX));
+}
+
+/* both FINs have been acknowledged, but our ACK of the peer's may yet be
+ * lost, in which case the peer resends its FIN until it gives up.  so
+ * rather than forget the connection at once, wait long enough to see the
+ * FIN again, and acknowledge it if it is: twice our retransmission timeout,
+ * doubled for each time it's been resent, as the peer backs off.  this is
+ * much less than the two maximum segment lifetimes real stacks wait, since
+ * myclose() blocks until it's over; if the peer's timeout is longer still,
+ * it gives up on the ACK soon enough (see LAST_ACK_RETRANSMITS).
+ */
+static void time_wait(context_t *ctx)
+{
+    long wait = (2 * ctx->rto) << ctx->rto_backoff;
+
+    ctx->connection_state = TIME_WAIT;
+    set_timer(ctx, MIN(wait, RTO_MAX));
+}
+
+/* run the timer for another usec microseconds */
+static void set_timer(context_t *ctx, long usec)
+{
+    stcp_get_time(&ctx->rto_deadline);
+    ctx->rto_deadline.tv_sec  += usec / 1000000;
+    ctx->rto_deadline.tv_nsec += (usec % 1000000) * 1000;
+    if (ctx->rto_deadline.tv_nsec >= 1000000000)
+    {
+        ctx->rto_deadline.tv_sec++;
+        ctx->rto_deadline.tv_nsec -= 1000000000;
+    }
+    ctx->rto_running = TRUE;
+}
+
+/* microseconds elapsed since then (negative if it's still to come) */
+static long time_since(const struct timespec *then)
+{
+    struct timespec now;
+
+    stcp_get_time(&now);
+    return (now.tv_sec - then->tv_sec) * 1000000L +
+           (now.tv_nsec - then->tv_nsec) / 1000;
+}
+
+
+/* process a segment of pkt_size bytes received from the peer */
+template <class P>
+static void handle_segment(mysocket_t sd, context_t *ctx,
+                           char *segment, int pkt_size)
+{
+    tcphdr *tcp_hdr = (tcphdr *) segment;
+    const uint8_t *opt, *ts;
+    int payload_size, data_offset;
+    tcp_seq seq, old_rcv_nxt = ctx->rcv_nxt;
+    char rebuilt[STCP_MSS];
+    size_t rebuilt_len;
+
+    if (pkt_size < (int) sizeof(tcphdr) ||
+        pkt_size < (int) TCP_DATA_START(tcp_hdr))
+        return; /* runt, or the network layer hit an error */
+
+    seq = ntohl(tcp_hdr->th_seq);
+    data_offset = TCP_DATA_START(tcp_hdr);
+    payload_size = pkt_size - data_offset;
+    ts = find_option(tcp_hdr, pkt_size, TCPOPT_TIMESTAMP, TCPOLEN_TIMESTAMP);
+
+    if (tcp_hdr->th_flags & TH_SYN)
+    {
+        /* the peer resent its SYN-ACK, so our ACK of it was lost; ACK it
+         * again, or the peer never finishes the handshake
+         */
+        if ((tcp_hdr->th_flags & TH_ACK) && seq == ctx->opp_sequence_num)
+        {
+            stcp_network_send_header(sd, ctx->current_sequence_num,
+                                     ctx->opp_sequence_num + 1,
+                                     TH_ACK, RECEIVER_WINDOW);
+        }
+        return;
+    }
+
+    if (tcp_hdr->th_flags & TH_ACK)
+    {
+        tcp_seq ack = ntohl(tcp_hdr->th_ack);
+
+        /*--- Setting Context ---*/
+        ctx->opp_window_size = ntohs(tcp_hdr->th_win);
+        if (P::cc::uses_timestamps && ts && payload_size == 0)
+        {
+            /* the peer's TSval is when it sent this ACK, and so (near
+             * enough) when it received the segment whose TSval it echoes.
+             * its data segments carry a TSval, but echo nothing.
+             */
+            P::cc::delay_sample(ctx,
+                                ntohl(*(const uint32_t *) (ts + 2)) -
+                                ntohl(*(const uint32_t *) (ts + 6)));
+        }
+        if (SEQ_GT(ack, ctx->ack_num) &&
+            SEQ_LEQ(ack, ctx->current_sequence_num))
+        {
+            int acked = ack - ctx->ack_num;
+
+            ack_received<P>(sd, ctx, ack);
+            P::cc::ecn_echo(ctx, acked, tcp_hdr->th_x2 & TH_X2_ECE);
+        }
+        else if (ack == ctx->ack_num && ctx->send_queue &&
+                 payload_size == 0 && !(tcp_hdr->th_flags & TH_FIN))
+        {
+            dup_ack_received<P>(sd, ctx);
+        }
+
+        if (ack == ctx->fin_ack_sequence_num)
+        {
+            if (ctx->connection_state == FIN_WAIT_1)
+            {
+                ctx->connection_state = FIN_WAIT_2;
+            }
+            else if (ctx->connection_state == CLOSING)
+            {
+                time_wait(ctx);
+            }
+            else if (ctx->connection_state == LAST_ACK)
+            {
+                ctx->connection_state = CLOSED;
+                ctx->done = true;
+            }
+        }
+    }
+
+    if ((opt = find_option(tcp_hdr, pkt_size, TCPOPT_FEC_PARITY,
+                           TCPOLEN_FEC_PARITY)) != NULL)
+    {
+        /*--- Parity segment; not part of the sequence space ---*/
+        P::recovery::parity_received(ctx, seq, opt, segment + data_offset,
+                                     payload_size);
+    }
+    else if (payload_size > 0)
+    {
+        /*--- Sending Payload to app layer, once it's in order ---*/
+        if (ctx->ooo_queue && SEQ_LEQ(seq, ctx->rcv_nxt) &&
+            SEQ_GT(seq + payload_size, ctx->rcv_nxt))
+        {
+            /* this fills a gap that the peer had to resend */
+            ctx->stats->fec_retransmitted++;
+        }
+        if (ts)
+        {
+            ctx->ts_recent = ntohl(*(const uint32_t *) (ts + 2));
+            ctx->ts_recent_valid = TRUE;
+        }
+        if (tcp_hdr->th_x2 & TH_X2_CE)
+        {
+            ctx->ce_received = TRUE;
+            ctx->stats->ecn_marks_received++;
+        }
+        receive_data<P>(sd, ctx, seq, segment + data_offset, payload_size);
+    }
+
+    /* fill whatever gap that lets us rebuild */
+    while ((rebuilt_len = P::recovery::rebuild(ctx, rebuilt)) > 0)
+        receive_data<P>(sd, ctx, ctx->rcv_nxt, rebuilt, rebuilt_len);
+
+    if ((tcp_hdr->th_flags & TH_FIN) &&
+        ctx->connection_state == TIME_WAIT)
+    {
+        /* our ACK of the FIN was lost; it's acknowledged again below */
+        ++ctx->rto_backoff;
+        time_wait(ctx);
+    }
+
+    if ((tcp_hdr->th_flags & TH_FIN) && !ctx->fin_received)
+    {
+        ctx->fin_received = TRUE;
+        ctx->fin_seq = seq + payload_size;
+    }
+
+    if (ctx->fin_received && ctx->rcv_nxt == ctx->fin_seq)
+    {
+        /* everything up to the FIN has been passed up */
+        stcp_fin_received(sd);
+        ctx->rcv_nxt++;
+        ctx->opp_sequence_num = ctx->fin_seq;
+
+        if (ctx->connection_state == CSTATE_ESTABLISHED)
+        {
+            ctx->connection_state = CLOSE_WAIT;
+        }
+        else if (ctx->connection_state == FIN_WAIT_1)
+        {
+            ctx->connection_state = CLOSING;
+        }
+        else if (ctx->connection_state == FIN_WAIT_2)
+        {
+            time_wait(ctx);
+        }
+    }
+
+    /* acknowledge data and FINs, and any gap filled from parity */
+    if ((payload_size > 0 && !opt) || (tcp_hdr->th_flags & TH_FIN) ||
+        ctx->rcv_nxt != old_rcv_nxt)
+    {
+        /*--- Sending Ack Packet ---*/
+        P::ack::data_received(sd, ctx);
+    }
+}
+
+/* acknowledge everything received so far, echoing the timestamp and any
+ * congestion mark on the segment just received
+ */
+static ssize_t send_ack(mysocket_t sd, context_t *ctx)
+{
+    struct
+    {
+        STCPHeader hdr;
+        uint8_t    ts_opt[TCPOLEN_TSTAMP_APPA];
+    } __attribute__ ((packed)) ack;
+    size_t ack_len = sizeof(ack.hdr);
+
+    if (!ctx->ts_recent_valid && !ctx->ce_received)
+    {
+        return stcp_network_send_header(sd, ctx->current_sequence_num,
+                                         ctx->rcv_nxt, TH_ACK,
+                                         RECEIVER_WINDOW);
+    }
+
+    memset(&ack, 0, sizeof(ack));
+    ack.hdr.th_seq   = htonl(ctx->current_sequence_num);
+    ack.hdr.th_ack   = htonl(ctx->rcv_nxt);
+    ack.hdr.th_x2    = ctx->ce_received ? TH_X2_ECE : 0;
+    ack.hdr.th_flags = TH_ACK;
+    ack.hdr.th_win   = htons(RECEIVER_WINDOW);
+
+    if (ctx->ts_recent_valid)
+    {
+        ack.ts_opt[0] = TCPOPT_NOP;
+        ack.ts_opt[1] = TCPOPT_NOP;
+        ack.ts_opt[2] = TCPOPT_TIMESTAMP;
+        ack.ts_opt[3] = TCPOLEN_TIMESTAMP;
+        *(uint32_t *) &ack.ts_opt[4] = htonl(timestamp_now());
+        *(uint32_t *) &ack.ts_opt[8] = htonl(ctx->ts_recent);
+        ack_len = sizeof(ack);
+    }
+    ack.hdr.th_off = ack_len / sizeof(uint32_t);
+
+    ctx->ts_recent_valid = FALSE;
+    ctx->ce_received = FALSE;
+    return stcp_network_send(sd, &ack, ack_len, NULL);
+}
+
+/* the current time, as a 32-bit timestamp in microseconds */
+static uint32_t timestamp_now(void)
+{
+    struct timespec now;
+
+    stcp_get_time(&now);
+    return (uint32_t) (now.tv_sec * 1000000 + now.tv_nsec / 1000);
+}
+
+
+/* accept a data segment from the peer.  in-order data is passed straight up
+ * to the application, along with anything queued behind it; data beyond a
+ * gap is queued until the gap is filled (by the peer, or by FEC).
+ */
+template <class P>
+static void receive_data(mysocket_t sd, context_t *ctx, tcp_seq seq,
+                         const char *data, size_t len)
+{
+    segment_t **pos, *seg;
+
+    assert(ctx && data);
+    assert(len > 0 && len <= STCP_MSS);
+
+    /* trim anything we've already received */
+    if (SEQ_LEQ(seq + len, ctx->rcv_nxt))
+        return;
+    if (SEQ_LT(seq, ctx->rcv_nxt))
+    {
+        data += ctx->rcv_nxt - seq;
+        len  -= ctx->rcv_nxt - seq;
+        seq   = ctx->rcv_nxt;
+    }
+
+    if (SEQ_GEQ(seq, ctx->rcv_nxt + RECEIVER_WINDOW))
+        return; /* beyond the window */
+
+    /* insert into the reassembly queue, dropping duplicates */
+    for (pos = &ctx->ooo_queue; *pos && SEQ_LT((*pos)->seq, seq);
+         pos = &(*pos)->next)
+        ;
+    if (*pos && (*pos)->seq == seq)
+        return;
+
+    seg = (segment_t *) malloc(sizeof(segment_t));
+    assert(seg);
+    seg->seq = seq;
+    seg->len = len;
+    memcpy(seg->data, data, len);
+    seg->next = *pos;
+    *pos = seg;
+
+    deliver_in_order<P>(sd, ctx);
+}
+
+/* pass everything at the head of the reassembly queue up to the
+ * application, until the next gap.
+ */
+template <class P>
+static void deliver_in_order(mysocket_t sd, context_t *ctx)
+{
+    segment_t *seg;
+
+    while ((seg = ctx->ooo_queue) && SEQ_LEQ(seg->seq, ctx->rcv_nxt))
+    {
+        ctx->ooo_queue = seg->next;
+
+        if (SEQ_GT(seg->seq + seg->len, ctx->rcv_nxt))
+        {
+            size_t skip = ctx->rcv_nxt - seg->seq;
+
+            stcp_app_send(sd, seg->data + skip, seg->len - skip);
+            ctx->rcv_nxt = seg->seq + seg->len;
+            P::recovery::data_delivered(ctx, seg);
+        }
+
+        free(seg);
+    }
+}
+
+/* fold a newly sent data segment into the parity for the current block,
+ * and send the parity once the block is complete.
+ */
+static void fec_add_segment(mysocket_t sd, context_t *ctx,
+                            const char *data, size_t len)
+{
+    size_t k;
+
+    assert(ctx->fec_block > 0);
+
+    for (k = 0; k < len; ++k)
+        ctx->fec_send_parity[k] ^= data[k];
+
+    ctx->fec_send_parity_len = MAX(ctx->fec_send_parity_len, len);
+    ctx->fec_send_len += len;
+    if (++ctx->fec_send_segs >= ctx->fec_block)
+        fec_send_parity(sd, ctx);
+}
+
+/* send the parity segment for the current block, and start a new block */
+static void fec_send_parity(mysocket_t sd, context_t *ctx)
+{
+    struct
+    {
+        STCPHeader hdr;
+        uint8_t    parity_opt[TCPOLEN_FEC_PARITY];
+    } __attribute__ ((packed)) header;
+
+    assert(ctx->fec_send_segs > 0);
+
+    memset(&header, 0, sizeof(header));
+    header.hdr.th_seq = htonl(ctx->fec_send_seq);
+    header.hdr.th_off = sizeof(header) / sizeof(uint32_t);
+    header.hdr.th_win = htons(RECEIVER_WINDOW);
+
+    header.parity_opt[0] = TCPOPT_FEC_PARITY;
+    header.parity_opt[1] = TCPOLEN_FEC_PARITY;
+    *(uint16_t *) &header.parity_opt[2] = htons(ctx->fec_send_segs);
+    *(uint32_t *) &header.parity_opt[4] = htonl(ctx->fec_send_len);
+
+    stcp_network_send(sd, &header, sizeof(header),
+                      ctx->fec_send_parity, ctx->fec_send_parity_len, NULL);
+    ctx->stats->fec_parity_sent++;
+
+    ctx->fec_send_seq += ctx->fec_send_len;
+    ctx->fec_send_len = 0;
+    ctx->fec_send_segs = 0;
+    memset(ctx->fec_send_parity, 0, ctx->fec_send_parity_len);
+    ctx->fec_send_parity_len = 0;
+}
+
+/* keep data that's been passed up to the application, in case a parity
+ * segment needs it to rebuild a later segment of the same block
+ */
+static void fec_save_delivered(context_t *ctx, const segment_t *seg)
+{
+    segment_t *h = &ctx->fec_history[ctx->fec_history_next];
+
+    h->seq = seg->seq;
+    h->len = seg->len;
+    memcpy(h->data, seg->data, seg->len);
+    ctx->fec_history_next = (ctx->fec_history_next + 1) % ctx->fec_block;
+}
+
+/* handle a parity segment from the peer.  it's kept (for fec_rebuild()) if
+ * the data it covers is still incomplete, and dropped otherwise.
+ */
+static void fec_parity_received(context_t *ctx, tcp_seq seq,
+                                const uint8_t *opt,
+                                const char *parity, size_t parity_len)
+{
+    fec_parity_t *p;
+    int k;
+
+    /* forget parity for blocks that have since been received in full */
+    for (k = 0; k < ctx->fec_num_pending; )
+    {
+        p = &ctx->fec_pending[k];
+        if (SEQ_LEQ(p->seq + p->len, ctx->rcv_nxt))
+            *p = ctx->fec_pending[--ctx->fec_num_pending];
+        else
+            ++k;
+    }
+
+    if (parity_len == 0 || parity_len > STCP_MSS)
+        return;
+
+    if (ctx->fec_num_pending == FEC_MAX_PENDING)
+    {
+        /* make room by dropping the oldest */
+        memmove(&ctx->fec_pending[0], &ctx->fec_pending[1],
+                (FEC_MAX_PENDING - 1) * sizeof(fec_parity_t));
+        --ctx->fec_num_pending;
+    }
+
+    p = &ctx->fec_pending[ctx->fec_num_pending];
+    p->seq        = seq;
+    p->num_segs   = ntohs(*(const uint16_t *) (opt + 2));
+    p->len        = ntohl(*(const uint32_t *) (opt + 4));
+    p->parity_len = parity_len;
+
+    if (SEQ_LEQ(p->seq + p->len, ctx->rcv_nxt) ||
+        p->num_segs < 1 || p->num_segs > ctx->fec_block)
+        return; /* nothing missing, or not something we can use */
+
+    memcpy(p->parity, parity, parity_len);
+    ++ctx->fec_num_pending;
+}
+
+/* rebuild the missing data at rcv_nxt into rebuilt, if any of the parity
+ * segments held allows it.  returns the number of bytes rebuilt, or 0 if
+ * there's no gap that can be filled.
+ */
+static size_t fec_rebuild(context_t *ctx, char *rebuilt)
+{
+    size_t len;
+    int k;
+
+    for (k = 0; k < ctx->fec_num_pending; ++k)
+    {
+        if ((len = fec_try_recover(ctx, &ctx->fec_pending[k], rebuilt)) > 0)
+            return len;
+    }
+    return 0;
+}
+
+/* try to rebuild the missing segment at rcv_nxt into rebuilt, using parity
+ * segment p.  this works if the gap lies in the block covered by p, and
+ * every other segment of that block is either queued for reassembly or
+ * among those most recently passed up to the application.  returns the
+ * length of the gap if it can be filled, at which point p is no longer
+ * held, or 0 otherwise.
+ */
+static size_t fec_try_recover(context_t *ctx, fec_parity_t *p, char *rebuilt)
+{
+    tcp_seq block_end = p->seq + p->len, next_seq;
+    size_t gap_len, covered = 0, j;
+    int num_segs = 0, k;
+    segment_t *seg;
+
+    if (SEQ_LT(ctx->rcv_nxt, p->seq) || SEQ_GEQ(ctx->rcv_nxt, block_end))
+        return 0;
+
+    /* the gap runs from rcv_nxt to the next queued segment, or to the end
+     * of the block
+     */
+    next_seq = (ctx->ooo_queue && SEQ_LT(ctx->ooo_queue->seq, block_end))
+        ? ctx->ooo_queue->seq : block_end;
+    gap_len = next_seq - ctx->rcv_nxt;
+    if (gap_len == 0 || gap_len > p->parity_len)
+        return 0;
+
+    memcpy(rebuilt, p->parity, p->parity_len);
+
+    /* XOR out the part of the block already passed up... */
+    for (k = 0; k < ctx->fec_block; ++k)
+    {
+        seg = &ctx->fec_history[k];
+        if (seg->len == 0 || SEQ_LT(seg->seq, p->seq) ||
+            SEQ_GEQ(seg->seq, ctx->rcv_nxt))
+            continue;
+
+        for (j = 0; j < seg->len; ++j)
+            rebuilt[j] ^= seg->data[j];
+        covered += seg->len;
+        ++num_segs;
+    }
+
+    if (covered != (size_t) (ctx->rcv_nxt - p->seq))
+        return 0;   /* some of it has already left the history */
+
+    /* ...and the part queued after the gap */
+    for (seg = ctx->ooo_queue; seg && SEQ_LT(seg->seq, block_end);
+         seg = seg->next)
+    {
+        if (seg->seq != next_seq || SEQ_GT(seg->seq + seg->len, block_end))
+            return 0;   /* another gap, or an odd overlap */
+
+        for (j = 0; j < seg->len; ++j)
+            rebuilt[j] ^= seg->data[j];
+        covered += seg->len;
+        next_seq += seg->len;
+        ++num_segs;
+    }
+
+    if (covered + gap_len != p->len || num_segs != p->num_segs - 1)
+        return 0;   /* more than one segment is missing */
+
+    ctx->stats->fec_recovered++;
+    *p = ctx->fec_pending[--ctx->fec_num_pending];
+
+    return gap_len;
 }
 
 
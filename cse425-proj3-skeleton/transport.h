@@ -46,11 +46,11 @@ typedef struct tcphdr
     tcp_seq  th_seq;    /* sequence number */
     tcp_seq  th_ack;    /* acknowledgement number */
 #if __BYTE_ORDER == __LITTLE_ENDIAN
-    uint8_t  th_x2:4;   /* unused */
+    uint8_t  th_x2:4;   /* ECN (TH_X2_*) */
     uint8_t  th_off:4;  /* data offset */
 #elif __BYTE_ORDER == __BIG_ENDIAN
     uint8_t  th_off:4;  /* data offset */
-    uint8_t  th_x2:4;   /* unused */
+    uint8_t  th_x2:4;   /* ECN (TH_X2_*) */
 #else
 #error __BYTE_ORDER must be defined as __LITTLE_ENDIAN or __BIG_ENDIAN!
 #endif
@@ -61,6 +61,10 @@ typedef struct tcphdr
 #define TH_PUSH 0x08    /* ...or this */
 #define TH_ACK  0x10
 #define TH_URG  0x20    /* ...or this */
+/* th_x2 bits, used for explicit congestion notification */
+#define TH_X2_ECT   0x1 /* data: sender is ECN capable */
+#define TH_X2_CE    0x2 /* data: congestion experienced (set by the network) */
+#define TH_X2_ECE   0x4 /* SYN: ECN wanted; ACK: data acked had CE set */
     uint16_t th_win;    /* window */
     uint16_t th_sum;    /* checksum */
     uint16_t th_urp;    /* urgent pointer (unused in STCP) */
@@ -118,4 +122,11 @@ typedef struct tcphdr
 
 extern void transport_init(mysocket_t sd, bool_t is_active);
 
+/* the same, driven by the caller rather than blocking; see transport.c */
+struct timespec;
+extern void transport_start(mysocket_t sd, bool_t is_active);
+extern unsigned int transport_wait_flags(mysocket_t sd,
+                                         const struct timespec **abstime);
+extern bool_t transport_event(mysocket_t sd, unsigned int event);
+
 #endif  /* __TRANSPORT_H__ */